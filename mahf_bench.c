@@ -0,0 +1,455 @@
+/*
+ * Mahf Firmware CPU Driver - IOCTL Path Benchmark
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Loads the driver on simulated processors and times IOCTLs end to end,
+ * OnDeviceControl through HandleIOCTL to the handler and completion
+ *
+ *   mahf_bench [--cores N,N...] [--iterations N] [--threads N] [--save FILE]
+ *              [--baseline FILE] [--tolerance PCT] [--verbose]
+ *
+ *   cc -O2 -DMAHF_HOST -o mahf_bench mahf_bench.c mahf_host.c mahf_core.c mahf_hw.c -lpthread
+ *
+ * Each core count (default 4 to 256 in powers of two) gets a freshly loaded
+ * driver on the simulated hardware backend, a few telemetry ticks so the
+ * metrics are populated, then every case below. Calls are timed one by
+ * one; the table gives latency percentiles and the throughput of all
+ * threads together. Control IOCTLs are serialized by the driver, so extra
+ * threads only show contention for them.
+ *
+ * Broadcast IPIs run their worker once per processor on the calling
+ * thread (see mahf_host.h), so IPI paths report the total work of a
+ * broadcast rather than its wall-clock time on real hardware.
+ *
+ * --save writes the results as a baseline; --baseline compares against
+ * one and exits with 2 if any p50, p90 or throughput is worse by more than
+ * the tolerance (default 10 %).
+ */
+
+#include "mahf_host.h"
+#include "mahf_core.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_ITERATIONS 20000
+#define BENCH_DEFAULT_TOLERANCE 10      // Percent
+#define BENCH_WARMUP_CALLS      1000
+#define BENCH_WARMUP_TICKS      64      // Telemetry ticks before measuring
+#define BENCH_MAX_THREADS       64
+#define BENCH_MAX_CORE_COUNTS   16
+#define BENCH_DRAIN_SAMPLES     256
+#define BENCH_BUFFER_BYTES      32768
+
+// Input kinds
+#define BENCH_INPUT_NONE        0
+#define BENCH_INPUT_STATE       1       // Alternates balanced and performance
+#define BENCH_INPUT_DRAIN       2       // From sequence 0
+
+typedef struct _BENCH_CASE {
+    const char *Name;
+    ULONG IoControlCode;
+    ULONG Input;
+    ULONG OutputLength;
+} BENCH_CASE;
+
+static const BENCH_CASE Cases[] = {
+    { "cpu_info",         IOCTL_MAHF_GET_CPU_INFO,          BENCH_INPUT_NONE,  128 },
+    { "performance_data", IOCTL_MAHF_GET_PERFORMANCE_DATA,  BENCH_INPUT_NONE,  sizeof(MAHF_PERFORMANCE_DATA) },
+    { "set_state",        IOCTL_MAHF_SET_PERFORMANCE_STATE, BENCH_INPUT_STATE, sizeof(MAHF_STATE_RESULT) },
+    { "metric_summary",   IOCTL_MAHF_GET_METRIC_SUMMARY,    BENCH_INPUT_NONE,  sizeof(MAHF_METRIC_SUMMARY) },
+    { "topology",         IOCTL_MAHF_GET_TOPOLOGY,          BENCH_INPUT_NONE,
+      FIELD_OFFSET(MAHF_TOPOLOGY, Entries) + MAHF_MAX_PROCESSORS * sizeof(MAHF_TOPOLOGY_ENTRY) },
+    { "drain_telemetry",  IOCTL_MAHF_DRAIN_TELEMETRY,       BENCH_INPUT_DRAIN,
+      FIELD_OFFSET(MAHF_TELEMETRY_DRAIN_RESPONSE, Samples) + BENCH_DRAIN_SAMPLES * sizeof(MAHF_TELEMETRY_SAMPLE) },
+};
+
+#define BENCH_CASE_COUNT        ((ULONG)RTL_NUMBER_OF(Cases))
+
+typedef struct _BENCH_RESULT {
+    ULONG Cores;
+    char Name[32];
+    ULONG64 Calls;
+    ULONG64 P50;                // Nanoseconds
+    ULONG64 P90;
+    ULONG64 P99;
+    ULONG64 Max;
+    double Throughput;          // Calls per second, all threads
+} BENCH_RESULT, *PBENCH_RESULT;
+
+typedef struct _BENCH_THREAD {
+    pthread_t Thread;
+    WDFDEVICE Device;
+    const BENCH_CASE *Case;
+    ULONG Processor;
+    ULONG Iterations;
+    PULONG64 Latencies;         // Iterations entries
+    ULONG64 Start;              // Of the timed calls
+    ULONG64 End;
+    NTSTATUS Status;            // First failure
+} BENCH_THREAD, *PBENCH_THREAD;
+
+static pthread_barrier_t StartBarrier;
+static ULONG64 ClockOverhead;
+
+static ULONG64 BenchNow(VOID)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONG64)now.tv_sec * 1000000000 + (ULONG64)now.tv_nsec;
+}
+
+static int BenchCompareLatency(const void *Left, const void *Right)
+{
+    ULONG64 left = *(const ULONG64 *)Left;
+    ULONG64 right = *(const ULONG64 *)Right;
+    
+    return (left > right) - (left < right);
+}
+
+// Median cost of reading the clock, subtracted from every sample
+static ULONG64 BenchClockOverhead(VOID)
+{
+    ULONG64 samples[1001];
+    
+    for (ULONG i = 0; i < RTL_NUMBER_OF(samples); i++) {
+        ULONG64 start = BenchNow();
+        
+        samples[i] = BenchNow() - start;
+    }
+    
+    qsort(samples, RTL_NUMBER_OF(samples), sizeof(ULONG64), BenchCompareLatency);
+    return samples[RTL_NUMBER_OF(samples) / 2];
+}
+
+static NTSTATUS BenchCall(PBENCH_THREAD Worker, ULONG Iteration, PUCHAR Buffer)
+{
+    const BENCH_CASE *benchCase = Worker->Case;
+    MAHF_TELEMETRY_DRAIN_REQUEST drain;
+    ULONG state;
+    const VOID *input = NULL;
+    ULONG inputLength = 0;
+    ULONG_PTR information;
+    
+    if (benchCase->Input == BENCH_INPUT_STATE) {
+        state = (Iteration & 1) ? PERFORMANCE_STATE_PERFORMANCE : PERFORMANCE_STATE_BALANCED;
+        input = &state;
+        inputLength = sizeof(state);
+    } else if (benchCase->Input == BENCH_INPUT_DRAIN) {
+        drain.StartSequence = 0;
+        input = &drain;
+        inputLength = sizeof(drain);
+    }
+    
+    return MahfHostDeviceControl(Worker->Device, benchCase->IoControlCode, input, inputLength,
+                                 Buffer, benchCase->OutputLength, &information);
+}
+
+static void *BenchThread(void *Argument)
+{
+    PBENCH_THREAD worker = (PBENCH_THREAD)Argument;
+    PUCHAR buffer = (PUCHAR)malloc(BENCH_BUFFER_BYTES);
+    NTSTATUS status;
+    
+    worker->Status = buffer ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+    MahfHostSetProcessor(worker->Processor);
+    
+    for (ULONG i = 0; buffer && i < BENCH_WARMUP_CALLS; i++) {
+        status = BenchCall(worker, i, buffer);
+        if (!NT_SUCCESS(status) && NT_SUCCESS(worker->Status)) {
+            worker->Status = status;
+        }
+    }
+    
+    pthread_barrier_wait(&StartBarrier);
+    worker->Start = BenchNow();
+    
+    for (ULONG i = 0; buffer && i < worker->Iterations; i++) {
+        ULONG64 start = BenchNow();
+        ULONG64 elapsed;
+        
+        status = BenchCall(worker, i, buffer);
+        elapsed = BenchNow() - start;
+        
+        worker->Latencies[i] = elapsed > ClockOverhead ? elapsed - ClockOverhead : 0;
+        
+        if (!NT_SUCCESS(status) && NT_SUCCESS(worker->Status)) {
+            worker->Status = status;
+        }
+    }
+    
+    worker->End = BenchNow();
+    free(buffer);
+    return NULL;
+}
+
+static BOOLEAN BenchRunCase(WDFDEVICE Device, ULONG Cores, const BENCH_CASE *Case,
+                            ULONG Iterations, ULONG Threads, PBENCH_RESULT Result)
+{
+    BENCH_THREAD workers[BENCH_MAX_THREADS];
+    ULONG64 calls = (ULONG64)Iterations * Threads;
+    PULONG64 latencies = (PULONG64)malloc(calls * sizeof(ULONG64));
+    ULONG64 start = ~0ULL;
+    ULONG64 end = 0;
+    ULONG64 elapsed;
+    
+    if (!latencies) {
+        return FALSE;
+    }
+    
+    pthread_barrier_init(&StartBarrier, NULL, Threads + 1);
+    
+    // Spread the callers over the simulated processors
+    for (ULONG t = 0; t < Threads; t++) {
+        memset(&workers[t], 0, sizeof(workers[t]));
+        workers[t].Device = Device;
+        workers[t].Case = Case;
+        workers[t].Processor = (ULONG)((ULONG64)t * Cores / Threads);
+        workers[t].Iterations = Iterations;
+        workers[t].Latencies = &latencies[(ULONG64)t * Iterations];
+        pthread_create(&workers[t].Thread, NULL, BenchThread, &workers[t]);
+    }
+    
+    pthread_barrier_wait(&StartBarrier);
+    
+    for (ULONG t = 0; t < Threads; t++) {
+        pthread_join(workers[t].Thread, NULL);
+        start = workers[t].Start < start ? workers[t].Start : start;
+        end = workers[t].End > end ? workers[t].End : end;
+    }
+    
+    elapsed = end - start;
+    pthread_barrier_destroy(&StartBarrier);
+    
+    for (ULONG t = 0; t < Threads; t++) {
+        if (!NT_SUCCESS(workers[t].Status)) {
+            fprintf(stderr, "%s on %u cores failed: 0x%08X\n", Case->Name, Cores,
+                    (unsigned)workers[t].Status);
+            free(latencies);
+            return FALSE;
+        }
+    }
+    
+    qsort(latencies, calls, sizeof(ULONG64), BenchCompareLatency);
+    
+    memset(Result, 0, sizeof(*Result));
+    Result->Cores = Cores;
+    snprintf(Result->Name, sizeof(Result->Name), "%s", Case->Name);
+    Result->Calls = calls;
+    Result->P50 = latencies[(calls - 1) * 50 / 100];
+    Result->P90 = latencies[(calls - 1) * 90 / 100];
+    Result->P99 = latencies[(calls - 1) * 99 / 100];
+    Result->Max = latencies[calls - 1];
+    Result->Throughput = elapsed ? (double)calls * 1e9 / (double)elapsed : 0.0;
+    
+    free(latencies);
+    return TRUE;
+}
+
+// Baseline files: one "cores name p50 p90 p99 throughput" line per result,
+// '#' starts a comment
+static BOOLEAN BenchSave(const char *Path, const BENCH_RESULT *Results, ULONG Count,
+                         ULONG Iterations, ULONG Threads)
+{
+    FILE *file = fopen(Path, "w");
+    
+    if (!file) {
+        return FALSE;
+    }
+    
+    fprintf(file, "# mahf_bench baseline: %u iterations, %u threads\n", Iterations, Threads);
+    fprintf(file, "# cores name p50_ns p90_ns p99_ns calls_per_s\n");
+    
+    for (ULONG i = 0; i < Count; i++) {
+        fprintf(file, "%u %s %llu %llu %llu %.0f\n", Results[i].Cores, Results[i].Name,
+                (unsigned long long)Results[i].P50, (unsigned long long)Results[i].P90,
+                (unsigned long long)Results[i].P99, Results[i].Throughput);
+    }
+    
+    return fclose(file) == 0;
+}
+
+static BOOLEAN BenchWorse(const char *Metric, const BENCH_RESULT *Result, double Value,
+                          double Baseline, double Tolerance, BOOLEAN HigherIsBetter)
+{
+    double change = Baseline > 0 ? (Value - Baseline) / Baseline * 100.0 : 0.0;
+    
+    if (HigherIsBetter ? change >= -Tolerance : change <= Tolerance) {
+        return FALSE;
+    }
+    
+    printf("REGRESSION %u %s %s: %.0f vs %.0f baseline (%+.1f%%)\n", Result->Cores,
+           Result->Name, Metric, Value, Baseline, change);
+    return TRUE;
+}
+
+// Returns the number of regressions, or -1 if the baseline cannot be read
+static int BenchCompare(const char *Path, const BENCH_RESULT *Results, ULONG Count, double Tolerance)
+{
+    FILE *file = fopen(Path, "r");
+    char line[256];
+    int regressions = 0;
+    ULONG matched = 0;
+    
+    if (!file) {
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), file)) {
+        BENCH_RESULT baseline;
+        unsigned long long p50, p90, p99;
+        
+        if (line[0] == '#' ||
+            sscanf(line, "%u %31s %llu %llu %llu %lf", &baseline.Cores, baseline.Name,
+                   &p50, &p90, &p99, &baseline.Throughput) != 6) {
+            continue;
+        }
+        
+        for (ULONG i = 0; i < Count; i++) {
+            const BENCH_RESULT *result = &Results[i];
+            
+            if (result->Cores != baseline.Cores || strcmp(result->Name, baseline.Name) != 0) {
+                continue;
+            }
+            
+            matched++;
+            regressions += BenchWorse("p50 ns", result, (double)result->P50, (double)p50, Tolerance, FALSE);
+            regressions += BenchWorse("p90 ns", result, (double)result->P90, (double)p90, Tolerance, FALSE);
+            regressions += BenchWorse("calls/s", result, result->Throughput, baseline.Throughput,
+                                      Tolerance, TRUE);
+        }
+    }
+    
+    fclose(file);
+    
+    printf("%u of %u results compared with %s, %d regressions\n", matched, Count, Path, regressions);
+    return regressions;
+}
+
+static BOOLEAN BenchParseCores(const char *Text, PULONG Cores, PULONG Count)
+{
+    char *end;
+    
+    *Count = 0;
+    
+    while (*Text && *Count < BENCH_MAX_CORE_COUNTS) {
+        ULONG value = (ULONG)strtoul(Text, &end, 0);
+        
+        if (end == Text || value == 0 || value > MAHF_MAX_PROCESSORS) {
+            return FALSE;
+        }
+        
+        Cores[(*Count)++] = value;
+        Text = (*end == ',') ? end + 1 : end;
+    }
+    
+    return *Count != 0 && *Text == '\0';
+}
+
+static VOID BenchUsage(const char *Program)
+{
+    fprintf(stderr, "Usage: %s [--cores N,N...] [--iterations N] [--threads N] [--save FILE]\n"
+                    "       [--baseline FILE] [--tolerance PCT] [--verbose]\n", Program);
+}
+
+int main(int argc, char *argv[])
+{
+    ULONG cores[BENCH_MAX_CORE_COUNTS] = { 4, 8, 16, 32, 64, 128, 256 };
+    ULONG coreCount = 7;
+    ULONG iterations = BENCH_DEFAULT_ITERATIONS;
+    ULONG threads = 1;
+    double tolerance = BENCH_DEFAULT_TOLERANCE;
+    const char *savePath = NULL;
+    const char *baselinePath = NULL;
+    PBENCH_RESULT results;
+    ULONG resultCount = 0;
+    int regressions = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+            if (!BenchParseCores(argv[++i], cores, &coreCount)) {
+                fprintf(stderr, "Bad core list: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            MahfHostDebugPrint = TRUE;
+        } else {
+            BenchUsage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (iterations == 0 || threads == 0 || threads > BENCH_MAX_THREADS) {
+        BenchUsage(argv[0]);
+        return 1;
+    }
+    
+    results = (PBENCH_RESULT)calloc(coreCount * BENCH_CASE_COUNT, sizeof(BENCH_RESULT));
+    if (!results) {
+        return 1;
+    }
+    
+    ClockOverhead = BenchClockOverhead();
+    
+    printf("%5s %-16s %10s %9s %9s %9s %9s %12s\n",
+           "cores", "ioctl", "calls", "p50 ns", "p90 ns", "p99 ns", "max ns", "calls/s");
+    
+    for (ULONG c = 0; c < coreCount; c++) {
+        WDFDEVICE device;
+        NTSTATUS status = MahfHostStart(cores[c], &device);
+        
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "Driver failed to start on %u cores: 0x%08X\n", cores[c], (unsigned)status);
+            return 1;
+        }
+        
+        MahfHostRunTimers(BENCH_WARMUP_TICKS);
+        
+        for (ULONG k = 0; k < BENCH_CASE_COUNT; k++) {
+            PBENCH_RESULT result = &results[resultCount];
+            
+            if (!BenchRunCase(device, cores[c], &Cases[k], iterations, threads, result)) {
+                MahfHostStop();
+                return 1;
+            }
+            
+            resultCount++;
+            printf("%5u %-16s %10llu %9llu %9llu %9llu %9llu %12.0f\n", result->Cores, result->Name,
+                   (unsigned long long)result->Calls, (unsigned long long)result->P50,
+                   (unsigned long long)result->P90, (unsigned long long)result->P99,
+                   (unsigned long long)result->Max, result->Throughput);
+        }
+        
+        MahfHostStop();
+    }
+    
+    if (savePath && !BenchSave(savePath, results, resultCount, iterations, threads)) {
+        fprintf(stderr, "Cannot write %s\n", savePath);
+        return 1;
+    }
+    
+    if (baselinePath) {
+        regressions = BenchCompare(baselinePath, results, resultCount, tolerance);
+        if (regressions < 0) {
+            fprintf(stderr, "Cannot read %s\n", baselinePath);
+            return 1;
+        }
+    }
+    
+    free(results);
+    return regressions ? 2 : 0;
+}
\ No newline at end of file
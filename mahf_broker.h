@@ -0,0 +1,88 @@
+/*
+ * Mahf Firmware CPU Driver - Service Broker Protocol
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * The driver's device can only be opened once, by the service. Everything
+ * else talks to the service: telemetry through a shared section, commands
+ * through a named pipe.
+ */
+
+#ifndef _MAHF_BROKER_H_
+#define _MAHF_BROKER_H_
+
+#include "mahf_core.h"
+
+// Shared section
+// Same layout as MAHF_SHARED_TELEMETRY and the same sequence lock, refreshed
+// by the service whenever the driver publishes. Unlike the driver's section
+// any logged-on user may map it for read.
+#define MAHF_BROKER_SECTION_NAME    TEXT("Global\\MahfCPUBroker")
+
+// Named pipe
+// Message mode. Each request message is a MAHF_BROKER_REQUEST followed by
+// InputLength bytes; the service answers every request with one
+// MAHF_BROKER_RESPONSE followed by OutputLength bytes, in order. Clients
+// that are not administrators must open the pipe for read, FILE_WRITE_DATA
+// and FILE_WRITE_ATTRIBUTES only; full write access is refused.
+#define MAHF_BROKER_PIPE_NAME       TEXT("\\\\.\\pipe\\MahfCPU")
+#define MAHF_BROKER_MAX_MESSAGE     65536   // Bytes, either direction
+
+// Command is an IOCTL_MAHF_* code or one of these. IOCTL codes carry the
+// device type in the high word, so the two never overlap.
+//
+// Reads without input are answered from a cache: a client gets the last
+// driver reply if it is at most MaxAgeMs old, and clients asking for the
+// same data together share one driver call. The reply is always for a
+// full-size buffer; a smaller OutputLength gets its leading bytes and
+// ERROR_MORE_DATA. IOCTL_MAHF_DRAIN_TELEMETRY and
+// IOCTL_MAHF_WAIT_NOTIFICATION keep a cursor per caller and go straight
+// to the driver; a pending wait is cancelled if its client goes away.
+// IOCTL_MAHF_GET_STATISTICS also goes straight to the driver, uncached.
+//
+// Control commands (IOCTL_IS_CONTROL) are accepted from administrators
+// only, one at a time, and fail with ERROR_BUSY while another client holds
+// the control lease. A successful one invalidates every cached read.
+// IOCTL_MAHF_SET_TRACE and IOCTL_MAHF_DRAIN_TRACE are administrator only
+// too, but ignore the lease and leave the cache alone.
+#define MAHF_BROKER_ACQUIRE_CONTROL 1       // Input: MAHF_BROKER_LEASE
+#define MAHF_BROKER_RELEASE_CONTROL 2
+#define MAHF_BROKER_GET_STATUS      3       // Output: MAHF_BROKER_STATUS
+
+#define MAHF_BROKER_DEFAULT_LEASE_MS 10000
+#define MAHF_BROKER_MAX_LEASE_MS    60000
+
+typedef struct _MAHF_BROKER_REQUEST {
+    ULONG Command;
+    ULONG MaxAgeMs;             // Oldest cached reply accepted, reads only
+    ULONG InputLength;          // Bytes following this header
+    ULONG OutputLength;         // Largest reply wanted
+} MAHF_BROKER_REQUEST, *PMAHF_BROKER_REQUEST;
+
+typedef struct _MAHF_BROKER_RESPONSE {
+    ULONG Error;                // Win32 error code, ERROR_SUCCESS
+    ULONG OutputLength;         // Bytes following this header
+    ULONG AgeMs;                // Of a cached reply, 0 otherwise
+    ULONG Reserved;
+} MAHF_BROKER_RESPONSE, *PMAHF_BROKER_RESPONSE;
+
+// MAHF_BROKER_ACQUIRE_CONTROL input (optional)
+// Acquiring again renews the lease. The lease ends when it expires, is
+// released, or its client disconnects. The service's own workload profile
+// switches wait while a client holds it.
+typedef struct _MAHF_BROKER_LEASE {
+    ULONG LeaseMs;              // 0 for MAHF_BROKER_DEFAULT_LEASE_MS
+} MAHF_BROKER_LEASE, *PMAHF_BROKER_LEASE;
+
+// MAHF_BROKER_GET_STATUS output
+typedef struct _MAHF_BROKER_STATUS {
+    ULONG ClientCount;
+    ULONG LeaseProcessId;       // Holder of the control lease, 0 if none
+    ULONG LeaseRemainingMs;
+    ULONG CoalesceMs;           // Floor applied to MaxAgeMs
+    ULONG64 Requests;           // Pipe requests served
+    ULONG64 DriverReads;        // Cached reads that called the driver
+    ULONG64 CachedReads;        // Cached reads answered without it
+    ULONG64 RejectedControls;   // Refused for the lease or access
+} MAHF_BROKER_STATUS, *PMAHF_BROKER_STATUS;
+
+#endif // _MAHF_BROKER_H_
\ No newline at end of file
@@ -7,11 +7,19 @@
  * Version: 3.0.0-RELEASE
  */
 
+#if defined(MAHF_HOST)
+#include "mahf_host.h"
+#else
 #include <ntddk.h>
 #include <wdf.h>
 #include <ntstrsafe.h>
 #include <windef.h>
 #include <intrin.h>
+#include <initguid.h>
+#endif
+#include "mahf_core.h"
+#include "mahf_hw.h"
+#include "mahf_trace.h"
 
 // Driver configuration
 #define DRIVER_VERSION_MAJOR 3
@@ -20,9 +28,66 @@
 #define DRIVER_VERSION_REVISION 1
 
 #define DRIVER_TAG 'MAHF'
-#define MAX_CPU_CORES 256
+#define MAX_CPU_CORES MAHF_MAX_PROCESSORS
 #define MAX_DEVICE_NAME_LENGTH 256
 #define MAX_SYMBOLIC_LINK_LENGTH 256
+#define TELEMETRY_DEFAULT_PERIOD_MS 10
+#define TELEMETRY_HISTORY_MS 1000
+#define STATE_READ_RETRIES 4
+#define MSR_STALENESS_DEFAULT_US 1000
+#define MSR_STALENESS_MAX_US 1000000
+#define CPUID_CACHE_SIZE 8
+#define GOVERNOR_DEFAULT_PERIOD_MS 50
+#define GOVERNOR_DEFAULT_UP 80
+#define GOVERNOR_DEFAULT_DOWN 30
+#define GOVERNOR_DEFAULT_HYSTERESIS 2
+#define GOVERNOR_DEFAULT_RATE_LIMIT_MS 100
+#define MAX_GROUP_PROCESSORS 64
+#define THERMAL_DEFAULT_PERIOD_MS 100
+#define THERMAL_MIN_PERIOD_MS 20
+#define THERMAL_MAX_PERIOD_MS 1000
+#define THERMAL_DEFAULT_MARGIN 5
+#define THERMAL_DEFAULT_KP 30           // MHz per degree
+#define THERMAL_DEFAULT_KI 150          // MHz per degree-second
+#define THERMAL_DEFAULT_KD 1            // MHz per degree/second of change
+#define THERMAL_DEFAULT_TJMAX 100
+#define POWER_DEFAULT_PERIOD_MS 100
+#define POWER_MIN_PERIOD_MS 20
+#define POWER_MAX_PERIOD_MS 1000
+#define POWER_DEFAULT_WINDOW_MS 1000
+#define POWER_WINDOW_SAMPLES 64
+#define POWER_DEFAULT_KP 5              // MHz per watt
+#define POWER_DEFAULT_KI 30             // MHz per watt-second
+
+// IA32_THERM_STATUS / IA32_PACKAGE_THERM_STATUS
+#define THERM_STATUS_PROCHOT 0x1ULL
+#define THERM_STATUS_READOUT_SHIFT 16
+#define THERM_STATUS_READOUT_MASK 0x7F
+#define THERM_STATUS_VALID (1ULL << 31)  // Core register only
+
+// RAPL_POWER_UNIT energy unit, 2^-n J, and PERF_STATUS core voltage, 2^-13 V
+#define RAPL_ENERGY_UNIT_SHIFT 8
+#define RAPL_ENERGY_UNIT_MASK 0x1F
+#define PERF_STATUS_VOLTAGE_SHIFT 32
+#define PERF_STATUS_VOLTAGE_MASK 0xFFFF
+
+// Not declared by the WDK headers
+#define SystemProcessorPerformanceInformation 8
+
+typedef struct _SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION {
+    LARGE_INTEGER IdleTime;
+    LARGE_INTEGER KernelTime;       // Includes idle time
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER DpcTime;
+    LARGE_INTEGER InterruptTime;
+    ULONG InterruptCount;
+} SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION, *PSYSTEM_PROCESSOR_PERFORMANCE_INFORMATION;
+
+NTSYSAPI NTSTATUS NTAPI ZwQuerySystemInformation(
+    _In_ ULONG SystemInformationClass,
+    _Out_ PVOID SystemInformation,
+    _In_ ULONG SystemInformationLength,
+    _Out_opt_ PULONG ReturnLength);
 
 // Performance states
 typedef enum _PERFORMANCE_STATE {
@@ -30,7 +95,7 @@ typedef enum _PERFORMANCE_STATE {
     STATE_BALANCED = 1,
     STATE_PERFORMANCE = 2,
     STATE_EXTREME = 3
-} PERFORMANCE_STATE;
+} PERFORMANCE_STATE, *PPERFORMANCE_STATE;
 
 // CPU Architecture types
 typedef enum _CPU_ARCHITECTURE {
@@ -49,75 +114,548 @@ typedef struct _MSR_REGISTERS {
     ULONG64 TurboRatioLimit; // 0x1AD
 } MSR_REGISTERS;
 
+// Per-processor MSR cache
+// An entry is only read and written while running on its own processor,
+// so it needs no lock. PlatformInfo and TurboRatioLimit are static and
+// filled once at initialization. PerfStatus and ThermalStatus are reused
+// while younger than the staleness budget. PerfCtl is write-through: the
+// driver is its only writer, so the cached value is authoritative once
+// valid and an unchanged value is never written again.
+typedef struct DECLSPEC_CACHEALIGN _MSR_CACHE {
+    MSR_REGISTERS Registers;
+    ULONG64 PerfStatusTime;         // Interrupt time of the last read
+    ULONG64 ThermalStatusTime;
+    BOOLEAN PerfCtlValid;
+} MSR_CACHE, *PMSR_CACHE;
+
+// Per-processor activity counters
+// Written only by the sampling broadcast, each processor on its own entry.
+// MPERF counts at the TSC rate and APERF at the delivered frequency, both
+// only in C0, so over an interval APERF/MPERF scales the base frequency to
+// the delivered one and MPERF/TSC is the C0 residency. PerfStatus and
+// ThermalStatus are this processor's own registers for the telemetry ring.
+typedef struct DECLSPEC_CACHEALIGN _CORE_COUNTERS {
+    ULONG64 Tsc;
+    ULONG64 Mperf;
+    ULONG64 Aperf;
+    ULONG64 PerfStatus;
+    ULONG64 ThermalStatus;
+    ULONG EffectiveFrequency;       // MHz over the last interval
+    ULONG Residency;                // Percent of the last interval in C0
+    BOOLEAN Valid;                  // Previous counter values are present
+} CORE_COUNTERS, *PCORE_COUNTERS;
+
+// Processor-invariant CPUID leaves, read once
+typedef struct _CPUID_CACHE_ENTRY {
+    ULONG Function;
+    ULONG SubFunction;
+    BOOLEAN Valid;
+    ULONG32 Registers[4];
+} CPUID_CACHE_ENTRY, *PCPUID_CACHE_ENTRY;
+
 // CPU Core Information
 typedef struct _CPU_CORE_INFO {
     UCHAR CoreId;
     UCHAR PackageId;
-    ULONG CurrentFrequency;
+    ULONG CurrentFrequency;         // Delivered, from APERF/MPERF
+    ULONG TargetFrequency;          // Programmed into PERF_CTL
     ULONG BaseFrequency;
     ULONG MaxFrequency;
     ULONG Temperature;
-    ULONG Utilization;
+    ULONG Utilization;              // C0 residency, percent
     PERFORMANCE_STATE CurrentState;
 } CPU_CORE_INFO, *PCPU_CORE_INFO;
 
+// Per-core state slot, one cache line per core
+// Sequence is both the writer lock and the reader version: a writer moves it
+// from even to odd with a compare-exchange and back to even when done, so
+// writers only ever contend on their own core and readers retry instead of
+// blocking. Writers run at DISPATCH_LEVEL for the few stores they make, which
+// keeps a preempted writer from stalling a reader; readers must therefore not
+// run above DISPATCH_LEVEL.
+typedef struct DECLSPEC_CACHEALIGN _CORE_SLOT {
+    volatile LONG Sequence;
+    CPU_CORE_INFO Info;
+} CORE_SLOT, *PCORE_SLOT;
+
+// PERF_CTL broadcast
+// Handed to every processor at once by KeIpiGenericCall. Each processor
+// programs only its own PERF_CTL and reports back through its bit.
+typedef struct _PERF_CTL_BROADCAST {
+    struct _DRIVER_CONTEXT *Context;
+    ULONG ProcessorCount;
+    ULONG64 Ratio;
+    PUCHAR Ratios;                  // Per processor, overrides Ratio; 0 skips
+    volatile LONG64 SuccessMask[MAHF_CORE_MASK_WORDS];
+} PERF_CTL_BROADCAST, *PPERF_CTL_BROADCAST;
+
+#define PERF_CTL_RATIO_SHIFT 8
+#define PERF_CTL_RATIO_MASK  0xFF00ULL
+
+// ENERGY_PERF_BIAS broadcast; only bits 3:0 are written, the rest are kept
+typedef struct _ENERGY_BIAS_BROADCAST {
+    ULONG ProcessorCount;
+    ULONG64 Bias;
+    volatile LONG FailedCount;
+} ENERGY_BIAS_BROADCAST, *PENERGY_BIAS_BROADCAST;
+
+#define ENERGY_BIAS_MASK     0xFULL
+
+// Topology enumeration, one IPI for every processor
+typedef struct _TOPOLOGY_BROADCAST {
+    struct _DRIVER_CONTEXT *Context;
+    ULONG MaxLeaf;
+    ULONG MaxExtendedLeaf;
+    ULONG AmdApicIdSize;            // CPUID 0x80000008 ECX[15:12]
+    BOOLEAN Hybrid;
+} TOPOLOGY_BROADCAST, *PTOPOLOGY_BROADCAST;
+
+#define CPUID_LEVEL_SMT     1
+#define CPUID_LEVEL_CORE    2
+#define CPUID_LEVEL_MODULE  3
+#define CPUID_LEVEL_DIE     5
+#define CPUID_HYBRID_ATOM   0x20
+#define CPUID_HYBRID_CORE   0x40
+
+// Hot per-core metrics, structure of arrays
+// Aggregates only need these three values, so they live in contiguous,
+// cache-aligned arrays sized to the processor count instead of being read
+// out of every core slot. Writers update them inside the core slot's write
+// section; each value is a single aligned ULONG, so aggregate readers see
+// either the old or the new value of a core and retry around state changes
+// through StateGeneration.
+typedef struct _CORE_METRICS {
+    PVOID Block;                    // One allocation for all arrays
+    ULONG Capacity;                 // Processors the arrays can hold
+    PULONG Frequency;               // MHz
+    PULONG Temperature;             // Celsius
+    PULONG Utilization;             // Percent
+} CORE_METRICS, *PCORE_METRICS;
+
+// One pass over a metric array
+typedef struct _METRIC_SUMMARY {
+    ULONG64 Sum;
+    ULONG64 SumSquares;
+    ULONG Min;
+    ULONG Max;
+} METRIC_SUMMARY, *PMETRIC_SUMMARY;
+
+// Per-processor statistics
+// One block per processor, each starting on its own cache line, so counting
+// never moves a line between processors. Updates are still interlocked: an
+// IPI or DPC on the same processor can interrupt a passive-level update, and
+// a thread can migrate between picking its block and writing it. A locked
+// add on a line the processor already owns is cheap; one line shared by
+// every processor is what this avoids.
+typedef struct DECLSPEC_CACHEALIGN _CPU_STATS {
+    ULONG64 TotalOperations;
+    ULONG64 FailedOperations;
+    MAHF_LATENCY_HISTOGRAM Ioctl[MAHF_STAT_IOCTL_COUNT];
+    MAHF_LATENCY_HISTOGRAM Msr[MAHF_STAT_MSR_COUNT];
+    MAHF_LATENCY_HISTOGRAM Transition[MAHF_STAT_STATE_COUNT][MAHF_STAT_STATE_COUNT];
+    MAHF_LATENCY_HISTOGRAM Retarget;
+} CPU_STATS, *PCPU_STATS;
+
+// Driver-wide like the hardware backend, so the register accessors can
+// count without a context. Blocks are picked by processor number modulo
+// CpuCount; counting before the blocks exist is skipped.
+typedef struct _STATISTICS {
+    PCPU_STATS Cpus;
+    ULONG CpuCount;
+    ULONG64 Frequency;              // Performance counter ticks per second
+} STATISTICS, *PSTATISTICS;
+
+// Per-processor trace ring
+// Writers claim a slot with an interlocked increment of Head on their own
+// processor's ring and publish the record by storing its Stamp last, as the
+// telemetry ring does. Tail is the drain's position and only moves on the
+// control queue.
+typedef struct DECLSPEC_CACHEALIGN _TRACE_RING {
+    volatile LONG64 Head;           // Slots ever claimed
+    ULONG64 Tail;                   // Next slot to drain
+    UCHAR Reserved[SYSTEM_CACHE_ALIGNMENT_SIZE - 2 * sizeof(ULONG64)];
+    MAHF_TRACE_RECORD Records[MAHF_TRACE_RING_SIZE];
+} TRACE_RING, *PTRACE_RING;
+
+// Driver-wide like the statistics; rings are picked the same way
+typedef struct _TRACE {
+    PTRACE_RING Rings;
+    ULONG RingCount;
+    ULONG NextRing;                 // Where a drain that filled its buffer stopped
+    ULONG64 Frequency;              // Performance counter ticks per second
+} TRACE, *PTRACE;
+
+#define METRIC_ARRAY_ALIGN 16           // ULONGs per cache line
+
+// Governor state
+// Touched only by the governor timer with ControlLock held, and by the
+// control queue, which holds the same lock.
+typedef struct _GOVERNOR_CORE {
+    ULONG64 LastBusy;               // 100 ns units
+    ULONG64 LastTotal;
+    ULONG64 LastChange;             // Interrupt time of the last change
+    ULONG Utilization;              // Percent, last period
+    LONG Pressure;                  // Periods above (+) or below (-) the band
+} GOVERNOR_CORE, *PGOVERNOR_CORE;
+
+typedef struct _GOVERNOR {
+    MAHF_GOVERNOR_CONFIG Config;
+    MAHF_GOVERNOR_STATS Stats;
+    volatile LONG Running;
+    GOVERNOR_CORE Cores[MAX_CPU_CORES];
+    UCHAR Ratios[MAX_CPU_CORES];
+    SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION Times[MAX_GROUP_PROCESSORS];
+} GOVERNOR, *PGOVERNOR;
+
+// Thermal controller state
+// Samples are written by each processor on itself during the sampling
+// broadcast; everything else belongs to the thermal timer, which runs
+// with ControlLock held. All PID arithmetic is in integer kHz.
+typedef struct _THERMAL_SAMPLE {
+    ULONG Temperature;              // Celsius, 0 if unreadable
+    ULONG PackageTemperature;       // Package leads only
+    BOOLEAN Prochot;
+} THERMAL_SAMPLE, *PTHERMAL_SAMPLE;
+
+typedef struct _THERMAL {
+    BOOLEAN Available;
+    BOOLEAN Primed;                 // LastTemperature is valid
+    ULONG PeriodMs;
+    ULONG Margin;                   // Degrees kept below TjMax
+    LONG Kp;
+    LONG Ki;
+    LONG Kd;
+    ULONG TjMax;
+    ULONG Cap;                      // MHz, MaxFrequency when not throttling
+    LONG64 Integral;                // kHz
+    LONG LastTemperature;
+    MAHF_THERMAL_STATUS Status;
+    THERMAL_SAMPLE Samples[MAX_CPU_CORES];
+} THERMAL, *PTHERMAL;
+
+// Energy metering state
+// Raw counters are read by each processor on itself during the metering
+// broadcast; everything else belongs to the power timer, which runs with
+// ControlLock held. Totals stay in raw RAPL units until reported.
+typedef struct _ENERGY_SAMPLE {
+    ULONG Counter[MAHF_POWER_DOMAIN_COUNT];
+    ULONG Valid;                    // Bit per domain read this period
+    ULONG Voltage;                  // mV, 0 if unreadable
+} ENERGY_SAMPLE, *PENERGY_SAMPLE;
+
+typedef struct _POWER_PACKAGE {
+    ULONG64 Energy[MAHF_POWER_DOMAIN_COUNT];
+    ULONG64 LastEnergy;             // Package domain at the previous period
+    ULONG Cap;                      // MHz, MaxFrequency when under the limit
+    LONG64 Integral;                // kHz
+} POWER_PACKAGE, *PPOWER_PACKAGE;
+
+typedef struct _POWER_WINDOW_ENTRY {
+    ULONG64 Time;                   // Interrupt time
+    ULONG64 Energy[MAHF_POWER_DOMAIN_COUNT];  // All packages
+} POWER_WINDOW_ENTRY, *PPOWER_WINDOW_ENTRY;
+
+typedef struct _POWER {
+    BOOLEAN Available;
+    BOOLEAN PerCoreEnergy;          // Cores domain is per core (AMD)
+    ULONG PeriodMs;
+    ULONG WindowMs;
+    LONG Kp;
+    LONG Ki;
+    ULONG EnergyShift;              // One raw unit is 2^-EnergyShift J
+    ULONG DomainRegister[MAHF_POWER_DOMAIN_COUNT];  // 0 if not metered
+    ULONG64 LastTime;
+    volatile ULONG Voltage;         // mV, read by GetPerformanceData
+    MAHF_ENERGY_STATUS Status;
+    ULONG64 WindowCount;            // Entries ever written
+    POWER_WINDOW_ENTRY Window[POWER_WINDOW_SAMPLES];
+    POWER_PACKAGE Packages[MAX_CPU_CORES];
+    ULONG LastCounter[MAX_CPU_CORES][MAHF_POWER_DOMAIN_COUNT];
+    UCHAR Primed[MAX_CPU_CORES];    // Bit per domain: LastCounter valid
+    ENERGY_SAMPLE Samples[MAX_CPU_CORES];
+} POWER, *PPOWER;
+
+// Telemetry ring
+// Producers reserve a range of sequence numbers with one interlocked add and
+// publish each slot by storing its Sequence last; readers never take a lock.
+// Sized when the device is added to hold TELEMETRY_HISTORY_MS of samples
+// from every processor at the telemetry period, a power of two.
+typedef struct _TELEMETRY_RING {
+    volatile LONG64 Head;       // Next sequence number to be reserved
+    ULONG64 Size;               // Samples
+    PMAHF_TELEMETRY_SAMPLE Samples;
+} TELEMETRY_RING, *PTELEMETRY_RING;
+
+#define TELEMETRY_SLOT_BUSY MAXULONG64
+
+// Shared telemetry section, mapped into system space and locked
+typedef struct _SHARED_SECTION {
+    HANDLE SectionHandle;
+    PVOID SectionObject;
+    PVOID SystemView;
+    PMDL Mdl;
+    PMAHF_SHARED_TELEMETRY Data;
+    volatile LONG PublishBusy;
+} SHARED_SECTION, *PSHARED_SECTION;
+
+// Notification ring
+// Events are appended under Lock by whichever path noticed the change; the
+// lock also orders a wait being queued against the append that would
+// complete it. Kept across a reset, so sequence numbers keep increasing.
+typedef struct _NOTIFY {
+    KSPIN_LOCK Lock;
+    MAHF_NOTIFY_CONFIG Config;
+    ULONG64 Head;                   // Next sequence number
+    BOOLEAN Rearm;                  // Config changed; forget the edge state
+    BOOLEAN OverTemperature;
+    ULONG Band;                     // MAHF_NOTIFY_BAND_*
+    
+    // Last telemetry tick, for waits with their own thresholds
+    BOOLEAN Sampled;
+    ULONG Temperature;              // Hottest core
+    ULONG Utilization;              // Average
+    ULONG64 SampleTime;
+    
+    MAHF_NOTIFY_EVENT Events[MAHF_NOTIFY_RING_SIZE];
+} NOTIFY, *PNOTIFY;
+
+// Pending wait, copied out of the request before it is queued
+typedef struct _NOTIFY_WAIT_CONTEXT {
+    ULONG64 StartSequence;
+    ULONG EventMask;
+    BOOLEAN OwnConfig;              // Config below instead of the device's
+    BOOLEAN OverTemperature;        // As the caller last saw it
+    ULONG Band;
+    MAHF_NOTIFY_CONFIG Config;
+} NOTIFY_WAIT_CONTEXT, *PNOTIFY_WAIT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTIFY_WAIT_CONTEXT, GetNotifyWaitContext);
+
 // Driver Context Structure
 typedef struct _DRIVER_CONTEXT {
-    // WDF handles
+    // WDF handles and kernel resources, preserved across a reset
     WDFDEVICE Device;
-    WDFQUEUE DefaultQueue;
+    WDFQUEUE DefaultQueue;          // Parallel, read-only IOCTLs
+    WDFQUEUE ControlQueue;          // Sequential, state-changing IOCTLs
+    WDFQUEUE NotifyQueue;           // Manual, pending notification waits
+    WDFTIMER TelemetryTimer;
+    WDFTIMER GovernorTimer;
+    WDFTIMER ThermalTimer;
+    WDFTIMER PowerTimer;
+    WDFWAITLOCK ControlLock;        // Control queue vs. governor and limit loops
+    SHARED_SECTION Shared;
+    CORE_METRICS Metrics;
+    NOTIFY Notify;
+    TELEMETRY_RING Telemetry;
     
     // CPU Information
     CPU_ARCHITECTURE Architecture;
     ULONG CoreCount;
     ULONG ThreadCount;
+    ULONG ProcessorCount;           // Logical processors with a core slot
     ULONG BaseFrequency;
     ULONG MaxFrequency;
     CHAR VendorString[13];
     CHAR BrandString[49];
     
     // Performance Management
+    // StateGeneration is odd while the control queue is applying a state
+    // change; readers that aggregate across cores retry around it.
+    volatile LONG StateGeneration;
     PERFORMANCE_STATE GlobalState;
     ULONG GlobalPowerLimit;
     ULONG GlobalThermalLimit;
     BOOLEAN TurboBoostEnabled;
     
-    // Core Management
-    CPU_CORE_INFO Cores[MAX_CPU_CORES];
-    KSPIN_LOCK CoreLock;
+    // What the fixed state or the governor asked for, per processor; the
+    // programmed frequency is this clamped to the thermal and power caps
+    ULONG RequestedFrequency[MAX_CPU_CORES];
+    ULONG TargetFrequency[MAX_CPU_CORES];   // Last programmed, ControlLock held
+    UCHAR CapRatios[MAX_CPU_CORES];
+    
+    // Core Management, indexed by logical processor number
+    CORE_SLOT Cores[MAX_CPU_CORES];
+    MAHF_TOPOLOGY_ENTRY Topology[MAX_CPU_CORES];
+    UCHAR PackageIndex[MAX_CPU_CORES];  // Dense, 0 to PackageCount - 1
+    BOOLEAN PackageLead[MAX_CPU_CORES]; // First processor of its package
+    ULONG PackageCount;
+    ULONG PerformanceCoreCount;
+    ULONG EfficiencyCoreCount;
+    BOOLEAN Hybrid;
+    
+    // Register caches
+    ULONG64 MsrStaleness;           // 100 ns units
+    MSR_CACHE MsrCache[MAX_CPU_CORES];
+    CPUID_CACHE_ENTRY CpuidCache[CPUID_CACHE_SIZE];
+    
+    // Activity counters, sampled with the telemetry
+    BOOLEAN ActivityCounters;       // APERF/MPERF present, CPUID.06H:ECX[0]
+    CORE_COUNTERS Counters[MAX_CPU_CORES];
+    
+    // Utilization governor
+    GOVERNOR Governor;
+    
+    // Thermal controller
+    THERMAL Thermal;
+    
+    // Energy metering and power limit
+    POWER Power;
+    
+    // Performance profiles
+    // A slot with an empty name is free. Slots are only written by the
+    // control queue, inside a StateGeneration bracket; switching profiles
+    // only swaps ActiveProfile, which is NULL when none is selected.
+    MAHF_PROFILE Profiles[MAHF_MAX_PROFILES];
+    PMAHF_PROFILE volatile ActiveProfile;
+    BOOLEAN EnergyBias;             // ENERGY_PERF_BIAS present, CPUID.06H:ECX[3]
+    
+    // Telemetry
+    ULONG TelemetryPeriodMs;
     
-    // Statistics
-    ULONG64 TotalOperations;
-    ULONG64 FailedOperations;
     LARGE_INTEGER DriverStartTime;
 } DRIVER_CONTEXT, *PDRIVER_CONTEXT;
 
+WDF_DECLARE_CONTEXT_TYPE(DRIVER_CONTEXT);
+
 // Global driver object
 WDFDRIVER g_Driver = NULL;
 
+// Per-processor counters and latency histograms
+STATISTICS g_Statistics = {0};
+
+// Binary trace rings and the runtime filter
+TRACE g_Trace = {0};
+volatile ULONG g_TraceLevel = MAHF_TRACE_DEFAULT_LEVEL;
+volatile ULONG g_TraceCategories = MAHF_TRACE_CATEGORY_ALL;
+
 // Function declarations
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD OnDeviceAdd;
+EVT_WDF_DRIVER_UNLOAD OnDriverUnload;
+EVT_WDF_DEVICE_D0_ENTRY OnDeviceD0Entry;
+EVT_WDF_DEVICE_D0_EXIT OnDeviceD0Exit;
 EVT_WDF_DEVICE_CONTEXT_CLEANUP OnDeviceContextCleanup;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL OnDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL OnControlDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP OnIoStop;
 EVT_WDF_IO_QUEUE_IO_RESUME OnIoResume;
+EVT_WDF_TIMER OnTelemetryTimer;
+EVT_WDF_TIMER OnGovernorTimer;
+EVT_WDF_TIMER OnThermalTimer;
+EVT_WDF_TIMER OnPowerTimer;
 
 // Driver-specific functions
+PDRIVER_CONTEXT GetDriverContext(WDFDEVICE Device);
 NTSTATUS InitializeDriverContext(PDRIVER_CONTEXT Context);
+NTSTATUS ResetDriverContext(PDRIVER_CONTEXT Context);
+VOID ReadDriverParameters(PDRIVER_CONTEXT Context);
 NTSTATUS DetectCPUArchitecture(PDRIVER_CONTEXT Context);
 NTSTATUS InitializeCoreManagement(PDRIVER_CONTEXT Context);
+NTSTATUS InitializeCoreMetrics(PDRIVER_CONTEXT Context);
+VOID FreeCoreMetrics(PDRIVER_CONTEXT Context);
+NTSTATUS InitializeTelemetry(PDRIVER_CONTEXT Context);
+VOID FreeTelemetry(PDRIVER_CONTEXT Context);
+VOID SummarizeMetric(const ULONG *Values, ULONG Count, PMETRIC_SUMMARY Summary);
+NTSTATUS GetMetricSummary(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+VOID EnumerateTopology(PDRIVER_CONTEXT Context);
+KIPI_BROADCAST_WORKER EnumerateTopologyIpi;
+VOID ReadLeafTopology(ULONG Leaf, PMAHF_TOPOLOGY_ENTRY Entry);
+NTSTATUS GetTopology(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
 VOID CleanupDriverContext(PDRIVER_CONTEXT Context);
-NTSTATUS HandleIOCTL(PDRIVER_CONTEXT Context, WDFREQUEST Request, ULONG IoControlCode);
+VOID ProcessDeviceControl(PDRIVER_CONTEXT Context, WDFREQUEST Request, ULONG IoControlCode);
+NTSTATUS HandleIOCTL(PDRIVER_CONTEXT Context, WDFREQUEST Request, ULONG IoControlCode, PSIZE_T BytesReturned);
+NTSTATUS DispatchIOCTL(PDRIVER_CONTEXT Context, ULONG IoControlCode,
+                       PVOID InputBuffer, SIZE_T InputLength,
+                       PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+NTSTATUS ExecuteBatch(PDRIVER_CONTEXT Context, PVOID InputBuffer, SIZE_T InputLength,
+                      PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+NTSTATUS SetLimits(PDRIVER_CONTEXT Context, PMAHF_LIMITS Limits);
 NTSTATUS ValidateRequest(WDFREQUEST Request, SIZE_T RequiredSize);
 NTSTATUS ReadMSR(ULONG Register, PULONG64 Value);
 NTSTATUS WriteMSR(ULONG Register, ULONG64 Value);
 NTSTATUS GetCPUID(ULONG Function, ULONG SubFunction, PULONG32 Registers);
-NTSTATUS SetPerformanceState(PDRIVER_CONTEXT Context, PERFORMANCE_STATE State);
-NTSTATUS GetPerformanceData(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength);
-NTSTATUS GetCPUInfo(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength);
-NTSTATUS UpdateCoreFrequency(PDRIVER_CONTEXT Context, UCHAR CoreId, ULONG Frequency);
+VOID InitializeRegisterCache(PDRIVER_CONTEXT Context);
+VOID InvalidateRegisterCache(PDRIVER_CONTEXT Context);
+NTSTATUS CachedCPUID(PDRIVER_CONTEXT Context, ULONG Function, ULONG SubFunction, PULONG32 Registers);
+NTSTATUS CachedReadMSR(PDRIVER_CONTEXT Context, ULONG Register, PULONG64 Value);
+NTSTATUS CachedWritePerfCtl(PDRIVER_CONTEXT Context, ULONG64 Value);
+NTSTATUS SetPerformanceState(PDRIVER_CONTEXT Context, PERFORMANCE_STATE State,
+                             PMAHF_STATE_RESULT Result);
+KIPI_BROADCAST_WORKER ProgramPerfCtlIpi;
+NTSTATUS GetPerformanceData(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+NTSTATUS GetCPUInfo(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+NTSTATUS DrainTelemetry(PDRIVER_CONTEXT Context, PVOID InputBuffer, SIZE_T InputLength,
+                        PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+VOID SampleTelemetry(PDRIVER_CONTEXT Context);
+VOID ComputePerformanceData(PDRIVER_CONTEXT Context, PMAHF_PERFORMANCE_DATA Data);
+NTSTATUS CreateSharedSection(PDRIVER_CONTEXT Context);
+VOID DestroySharedSection(PDRIVER_CONTEXT Context);
+VOID PublishSharedTelemetry(PDRIVER_CONTEXT Context);
+NTSTATUS UpdateCoreFrequency(PDRIVER_CONTEXT Context, UCHAR CoreId, ULONG Frequency,
+                             PERFORMANCE_STATE State);
+VOID UpdateCoreUtilization(PDRIVER_CONTEXT Context, ULONG CoreId, ULONG Utilization);
+VOID UpdateCoreTemperature(PDRIVER_CONTEXT Context, ULONG CoreId, ULONG Temperature);
+VOID UpdateCoreActivity(PDRIVER_CONTEXT Context, ULONG CoreId, ULONG Frequency, ULONG Utilization);
+KIPI_BROADCAST_WORKER SampleCountersIpi;
+ULONG ApplyFrequencyRatios(PDRIVER_CONTEXT Context, PUCHAR Ratios);
+VOID InitializeThermal(PDRIVER_CONTEXT Context);
+VOID RunThermal(PDRIVER_CONTEXT Context);
+VOID EnforceFrequencyCap(PDRIVER_CONTEXT Context);
+KIPI_BROADCAST_WORKER SampleThermalIpi;
+NTSTATUS GetThermal(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+ULONG ProcessorFrequencyCap(PDRIVER_CONTEXT Context, ULONG Processor);
+VOID InitializePower(PDRIVER_CONTEXT Context);
+VOID RunPower(PDRIVER_CONTEXT Context);
+KIPI_BROADCAST_WORKER SampleEnergyIpi;
+ULONG64 EnergyToMicrojoules(PDRIVER_CONTEXT Context, ULONG64 Energy);
+NTSTATUS GetEnergy(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+BOOLEAN ValidateGovernorConfig(PMAHF_GOVERNOR_CONFIG Config);
+NTSTATUS SetGovernor(PDRIVER_CONTEXT Context, PMAHF_GOVERNOR_CONFIG Config);
+NTSTATUS GetGovernor(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+VOID StartGovernor(PDRIVER_CONTEXT Context);
+VOID StopGovernor(PDRIVER_CONTEXT Context);
+VOID RunGovernor(PDRIVER_CONTEXT Context);
+VOID MeasureUtilization(PDRIVER_CONTEXT Context);
+ULONG ProfileNameLength(PCWSTR Name);
+BOOLEAN ValidateProfile(PMAHF_PROFILE Profile);
+PMAHF_PROFILE FindProfile(PDRIVER_CONTEXT Context, PCWSTR Name);
+NTSTATUS SetProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE Profile);
+NTSTATUS SelectProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE_NAME Name);
+NTSTATUS DeleteProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE_NAME Name);
+NTSTATUS GetProfiles(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+VOID ActivateProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE Profile);
+VOID ProgramProfile(PDRIVER_CONTEXT Context);
+KIPI_BROADCAST_WORKER WriteEnergyBiasIpi;
+VOID ProfileFrequencyRange(PDRIVER_CONTEXT Context, ULONG Processor,
+                           PULONG MinFrequency, PULONG MaxFrequency);
+VOID LoadProfiles(PDRIVER_CONTEXT Context, WDFKEY Key);
+VOID SaveProfiles(PDRIVER_CONTEXT Context);
+VOID WaitNotification(PDRIVER_CONTEXT Context, WDFREQUEST Request);
+NTSTATUS SetNotification(PDRIVER_CONTEXT Context, PMAHF_NOTIFY_CONFIG Config);
+BOOLEAN IsValidNotifyConfig(PMAHF_NOTIFY_CONFIG Config);
+VOID EvaluateNotifyConfig(PNOTIFY Notify, PMAHF_NOTIFY_CONFIG Config, PBOOLEAN Over, PULONG Band);
+ULONG FillNotifyResponse(PNOTIFY Notify, PNOTIFY_WAIT_CONTEXT Wait, PMAHF_NOTIFY_RESPONSE Response);
+VOID PostNotification(PDRIVER_CONTEXT Context, ULONG Type, ULONG Value, ULONG Detail);
+VOID CompleteNotifyWaits(PDRIVER_CONTEXT Context);
+VOID CheckNotifications(PDRIVER_CONTEXT Context);
+KIRQL CoreWriteBegin(PCORE_SLOT Slot);
+VOID CoreWriteEnd(PCORE_SLOT Slot, KIRQL OldIrql);
+VOID CoreReadInfo(PCORE_SLOT Slot, PCPU_CORE_INFO Info);
 VOID SafeCopyMemory(PVOID Dest, PVOID Src, SIZE_T Length);
+NTSTATUS InitializeStatistics(VOID);
+VOID FreeStatistics(VOID);
+PCPU_STATS CpuStats(ULONG Processor);
+ULONG64 StatTimestamp(VOID);
+VOID RecordLatency(PMAHF_LATENCY_HISTOGRAM Histogram, ULONG64 Start, NTSTATUS Status);
+VOID CountRequest(NTSTATUS Status);
+VOID RecordRequest(ULONG IoControlCode, ULONG64 Start, NTSTATUS Status);
+VOID SumOperations(PULONG64 Total, PULONG64 Failed);
+VOID MergeHistogram(PMAHF_LATENCY_HISTOGRAM Total, PMAHF_LATENCY_HISTOGRAM Histogram);
+NTSTATUS GetStatistics(PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
+NTSTATUS InitializeTrace(VOID);
+VOID FreeTrace(VOID);
+NTSTATUS SetTrace(PMAHF_TRACE_CONFIG Config);
+NTSTATUS DrainTrace(PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned);
 
 // Driver Entry Point
 NTSTATUS DriverEntry(
@@ -132,14 +670,22 @@ NTSTATUS DriverEntry(
     DbgPrint("Mahf Firmware CPU Driver %d.%d.%d Loading...\n",
              DRIVER_VERSION_MAJOR, DRIVER_VERSION_MINOR, DRIVER_VERSION_BUILD);
     
+    // Hardware access is bound once here; everything after goes through
+    // the backend table. The simulated register file is set up before any
+    // IPI can reach it.
+    MahfHwSelect(&MahfHwSimulated);
+    MahfHwSimulatedReset();
+    
     // Initialize WDF driver configuration
     WDF_DRIVER_CONFIG_INIT(&config, OnDeviceAdd);
     config.DriverPoolTag = DRIVER_TAG;
     config.EvtDriverUnload = OnDriverUnload;
     
     // Set driver attributes
+    // No framework-wide serialization: read IOCTLs run in parallel and
+    // state changes are serialized by the control queue instead.
     WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-    attributes.SynchronizationScope = WdfSynchronizationScopeDevice;
+    attributes.SynchronizationScope = WdfSynchronizationScopeNone;
     
     // Create WDF driver object
     status = WdfDriverCreate(DriverObject, RegistryPath,
@@ -165,6 +711,8 @@ NTSTATUS OnDeviceAdd(
     WDFDEVICE device = NULL;
     WDF_IO_QUEUE_CONFIG queueConfig;
     WDF_OBJECT_ATTRIBUTES attributes;
+    WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
+    WDF_TIMER_CONFIG timerConfig;
     PDRIVER_CONTEXT context = NULL;
     WDFQUEUE queue = NULL;
     UNICODE_STRING deviceName, symbolicLink;
@@ -190,6 +738,12 @@ NTSTATUS OnDeviceAdd(
     // Set I/O type
     WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoBuffered);
     
+    // Telemetry sampling runs while the device is in D0
+    WDF_PNPPOWER_EVENT_CALLBACKS_INIT(&pnpPowerCallbacks);
+    pnpPowerCallbacks.EvtDeviceD0Entry = OnDeviceD0Entry;
+    pnpPowerCallbacks.EvtDeviceD0Exit = OnDeviceD0Exit;
+    WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
+    
     // Create device name
     RtlInitUnicodeString(&deviceName, L"\\Device\\MahfCPU");
     
@@ -199,6 +753,10 @@ NTSTATUS OnDeviceAdd(
         return status;
     }
     
+    // Every request carries room for a notification wait
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, NOTIFY_WAIT_CONTEXT);
+    WdfDeviceInitSetRequestAttributes(DeviceInit, &attributes);
+    
     // Create device object
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, DRIVER_CONTEXT);
     attributes.EvtCleanupCallback = OnDeviceContextCleanup;
@@ -216,6 +774,21 @@ NTSTATUS OnDeviceAdd(
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     
+    KeInitializeSpinLock(&context->Notify.Lock);
+    
+    // Statistics first, so initialization's own register accesses count
+    status = InitializeStatistics();
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("InitializeStatistics failed: 0x%08X\n", status);
+        return status;
+    }
+    
+    status = InitializeTrace();
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("InitializeTrace failed: 0x%08X\n", status);
+        return status;
+    }
+    
     // Initialize driver context
     status = InitializeDriverContext(context);
     if (!NT_SUCCESS(status)) {
@@ -223,9 +796,23 @@ NTSTATUS OnDeviceAdd(
         return status;
     }
     
+    // After the parameters, which set the period the ring is sized for
+    status = InitializeTelemetry(context);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("InitializeTelemetry failed: 0x%08X\n", status);
+        return status;
+    }
+    
     // Set context in device
     context->Device = device;
     
+    // Publish telemetry to user mode through a shared section
+    status = CreateSharedSection(context);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("CreateSharedSection failed: 0x%08X\n", status);
+        return status;
+    }
+    
     // Create symbolic link
     RtlInitUnicodeString(&symbolicLink, L"\\DosDevices\\MahfCPU");
     
@@ -236,8 +823,10 @@ NTSTATUS OnDeviceAdd(
     }
     
     // Create default queue
+    // Reads are dispatched in parallel; control IOCTLs are forwarded from
+    // here to the sequential control queue.
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
-                                           WdfIoQueueDispatchSequential);
+                                           WdfIoQueueDispatchParallel);
     queueConfig.EvtIoDeviceControl = OnDeviceControl;
     queueConfig.EvtIoStop = OnIoStop;
     queueConfig.EvtIoResume = OnIoResume;
@@ -251,6 +840,106 @@ NTSTATUS OnDeviceAdd(
     
     context->DefaultQueue = queue;
     
+    // Create control queue
+    // Runs at PASSIVE_LEVEL so a reset can quiesce the read queue.
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+    queueConfig.EvtIoDeviceControl = OnControlDeviceControl;
+    queueConfig.EvtIoStop = OnIoStop;
+    queueConfig.EvtIoResume = OnIoResume;
+    
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ExecutionLevel = WdfExecutionLevelPassive;
+    
+    status = WdfIoQueueCreate(device, &queueConfig,
+                              &attributes, &context->ControlQueue);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("WdfIoQueueCreate (control) failed: 0x%08X\n", status);
+        return status;
+    }
+    
+    // Create notification queue
+    // Manual: waits sit here until an event completes them or the caller
+    // cancels. Not power managed, so a wait survives a trip out of D0.
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    
+    status = WdfIoQueueCreate(device, &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES, &context->NotifyQueue);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("WdfIoQueueCreate (notify) failed: 0x%08X\n", status);
+        return status;
+    }
+    
+    // Create telemetry timer, started from D0 entry
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, OnTelemetryTimer,
+                                   context->TelemetryPeriodMs);
+    timerConfig.AutomaticSerialization = FALSE;
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+    
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = device;
+    
+    status = WdfTimerCreate(&timerConfig, &attributes, &context->TelemetryTimer);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("WdfTimerCreate failed: 0x%08X\n", status);
+        return status;
+    }
+    
+    // Create governor timer and the lock it shares with the control queue
+    // The governor re-arms itself each period so its period can change at
+    // run time; it runs at PASSIVE_LEVEL to read processor times.
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = device;
+    
+    status = WdfWaitLockCreate(&attributes, &context->ControlLock);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("WdfWaitLockCreate failed: 0x%08X\n", status);
+        return status;
+    }
+    
+    WDF_TIMER_CONFIG_INIT(&timerConfig, OnGovernorTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+    
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = device;
+    attributes.ExecutionLevel = WdfExecutionLevelPassive;
+    
+    status = WdfTimerCreate(&timerConfig, &attributes, &context->GovernorTimer);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("WdfTimerCreate (governor) failed: 0x%08X\n", status);
+        return status;
+    }
+    
+    // Create thermal timer
+    // Periodic at PASSIVE_LEVEL: sensors are read with a broadcast IPI and
+    // the loop shares ControlLock with the control queue.
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, OnThermalTimer, context->Thermal.PeriodMs);
+    timerConfig.AutomaticSerialization = FALSE;
+    
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = device;
+    attributes.ExecutionLevel = WdfExecutionLevelPassive;
+    
+    status = WdfTimerCreate(&timerConfig, &attributes, &context->ThermalTimer);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("WdfTimerCreate (thermal) failed: 0x%08X\n", status);
+        return status;
+    }
+    
+    // Create power timer, configured like the thermal timer
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, OnPowerTimer, context->Power.PeriodMs);
+    timerConfig.AutomaticSerialization = FALSE;
+    
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = device;
+    attributes.ExecutionLevel = WdfExecutionLevelPassive;
+    
+    status = WdfTimerCreate(&timerConfig, &attributes, &context->PowerTimer);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("WdfTimerCreate (power) failed: 0x%08X\n", status);
+        return status;
+    }
+    
     // Create device interface
     status = WdfDeviceCreateDeviceInterface(device,
                                             &GUID_DEVINTERFACE_MAHF_CPU,
@@ -269,15 +958,14 @@ NTSTATUS OnDeviceAdd(
 NTSTATUS InitializeDriverContext(PDRIVER_CONTEXT Context)
 {
     NTSTATUS status = STATUS_SUCCESS;
+    ULONG32 regs[4] = {0};
     ULONG i;
     
     DbgPrint("InitializeDriverContext: Starting\n");
     
-    // Zero out the context
-    RtlZeroMemory(Context, sizeof(DRIVER_CONTEXT));
-    
-    // Initialize spin lock
-    KeInitializeSpinLock(&Context->CoreLock);
+    // Zero out the context, leaving framework handles and kernel resources
+    RtlZeroMemory(&Context->Architecture,
+                  sizeof(DRIVER_CONTEXT) - FIELD_OFFSET(DRIVER_CONTEXT, Architecture));
     
     // Initialize timestamps
     KeQuerySystemTime(&Context->DriverStartTime);
@@ -301,33 +989,304 @@ NTSTATUS InitializeDriverContext(PDRIVER_CONTEXT Context)
     Context->GlobalThermalLimit = 85;
     Context->GlobalPowerLimit = 65;
     Context->TurboBoostEnabled = TRUE;
+    Context->TelemetryPeriodMs = TELEMETRY_DEFAULT_PERIOD_MS;
+    Context->MsrStaleness = MSR_STALENESS_DEFAULT_US * 10;
+    Context->Governor.Config.Enabled = FALSE;
+    Context->Governor.Config.PeriodMs = GOVERNOR_DEFAULT_PERIOD_MS;
+    Context->Governor.Config.UpThreshold = GOVERNOR_DEFAULT_UP;
+    Context->Governor.Config.DownThreshold = GOVERNOR_DEFAULT_DOWN;
+    Context->Governor.Config.HysteresisSamples = GOVERNOR_DEFAULT_HYSTERESIS;
+    Context->Governor.Config.RateLimitMs = GOVERNOR_DEFAULT_RATE_LIMIT_MS;
+    Context->Thermal.PeriodMs = THERMAL_DEFAULT_PERIOD_MS;
+    Context->Thermal.Margin = THERMAL_DEFAULT_MARGIN;
+    Context->Thermal.Kp = THERMAL_DEFAULT_KP;
+    Context->Thermal.Ki = THERMAL_DEFAULT_KI;
+    Context->Thermal.Kd = THERMAL_DEFAULT_KD;
+    Context->Power.PeriodMs = POWER_DEFAULT_PERIOD_MS;
+    Context->Power.WindowMs = POWER_DEFAULT_WINDOW_MS;
+    Context->Power.Kp = POWER_DEFAULT_KP;
+    Context->Power.Ki = POWER_DEFAULT_KI;
+    
+    // Override defaults from the service Parameters key
+    ReadDriverParameters(Context);
     
     // Initialize cores
     for (i = 0; i < MAX_CPU_CORES; i++) {
-        Context->Cores[i].CoreId = (UCHAR)i;
-        Context->Cores[i].CurrentState = STATE_BALANCED;
-        Context->Cores[i].BaseFrequency = Context->BaseFrequency;
-        Context->Cores[i].MaxFrequency = Context->MaxFrequency;
-        Context->Cores[i].CurrentFrequency = Context->BaseFrequency;
-        Context->Cores[i].Temperature = 40;
-        Context->Cores[i].Utilization = 10;
+        Context->Cores[i].Info.CoreId = (UCHAR)i;
+        Context->Cores[i].Info.CurrentState = STATE_BALANCED;
+        Context->Cores[i].Info.BaseFrequency = Context->BaseFrequency;
+        Context->Cores[i].Info.MaxFrequency = Context->MaxFrequency;
+        Context->Cores[i].Info.CurrentFrequency = Context->BaseFrequency;
+        Context->Cores[i].Info.TargetFrequency = Context->BaseFrequency;
+        Context->Cores[i].Info.Temperature = 40;
+        Context->Cores[i].Info.Utilization = 10;
     }
     
     // Mark detected cores
-    for (i = 0; i < Context->CoreCount; i++) {
-        Context->Cores[i].CoreId = (UCHAR)i;
+    for (i = 0; i < Context->ProcessorCount; i++) {
+        Context->Cores[i].Info.CoreId = (UCHAR)i;
+        Context->Cores[i].Info.PackageId = (UCHAR)Context->Topology[i].PackageId;
+        Context->RequestedFrequency[i] = Context->BaseFrequency;
+        Context->TargetFrequency[i] = Context->BaseFrequency;
+    }
+    
+    // APERF/MPERF, CPUID.06H:ECX[0]; AMD reports the same bit. The energy
+    // bias register is Intel only.
+    if (NT_SUCCESS(CachedCPUID(Context, 6, 0, regs))) {
+        Context->ActivityCounters = (regs[2] & 1) != 0;
+        Context->EnergyBias = Context->Architecture == ARCH_INTEL && (regs[2] & 8) != 0;
+    }
+    
+    // A profile restored from the registry takes over the requests and
+    // limits; it is programmed when the device enters D0
+    if (Context->ActiveProfile) {
+        ActivateProfile(Context, Context->ActiveProfile);
+    }
+    
+    InitializeThermal(Context);
+    InitializePower(Context);
+    
+    status = InitializeCoreMetrics(Context);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("InitializeCoreMetrics failed: 0x%08X\n", status);
+        return status;
     }
     
     DbgPrint("InitializeDriverContext: Completed successfully\n");
     DbgPrint("  Architecture: %d\n", Context->Architecture);
     DbgPrint("  Cores: %d\n", Context->CoreCount);
     DbgPrint("  Threads: %d\n", Context->ThreadCount);
+    DbgPrint("  Processors: %d\n", Context->ProcessorCount);
+    DbgPrint("  Packages: %d\n", Context->PackageCount);
+    DbgPrint("  P/E cores: %d/%d\n", Context->PerformanceCoreCount, Context->EfficiencyCoreCount);
     DbgPrint("  Vendor: %s\n", Context->VendorString);
     DbgPrint("  Brand: %s\n", Context->BrandString);
     
     return STATUS_SUCCESS;
 }
 
+// Reset Driver Context
+// Called from the control queue. The read queue, the telemetry timer, the
+// governor and the limit loops are quiesced first so no reader can observe
+// a half-initialized context; WDF handles and the shared section survive
+// the reset.
+NTSTATUS ResetDriverContext(PDRIVER_CONTEXT Context)
+{
+    NTSTATUS status;
+    ULONG telemetryPeriodMs = Context->TelemetryPeriodMs;
+    ULONG thermalPeriodMs = Context->Thermal.PeriodMs;
+    ULONG powerPeriodMs = Context->Power.PeriodMs;
+    
+    DbgPrint("ResetDriverContext: Starting\n");
+    
+    WdfIoQueueStopSynchronously(Context->DefaultQueue);
+    WdfTimerStop(Context->TelemetryTimer, TRUE);
+    WdfTimerStop(Context->ThermalTimer, TRUE);
+    WdfTimerStop(Context->PowerTimer, TRUE);
+    StopGovernor(Context);
+    
+    status = InitializeDriverContext(Context);
+    ProgramProfile(Context);
+    
+    // Conditions are re-evaluated from scratch against the kept thresholds
+    Context->Notify.Rearm = TRUE;
+    PostNotification(Context, MAHF_NOTIFY_STATE, Context->GlobalState,
+                     Context->ActiveProfile != NULL);
+    
+    // Timer periods are fixed when the timers are created
+    Context->TelemetryPeriodMs = telemetryPeriodMs;
+    Context->Thermal.PeriodMs = thermalPeriodMs;
+    Context->Thermal.Status.PeriodMs = thermalPeriodMs;
+    Context->Power.PeriodMs = powerPeriodMs;
+    Context->Power.Status.PeriodMs = powerPeriodMs;
+    
+    if (NT_SUCCESS(status)) {
+        status = InitializeTelemetry(Context);
+    }
+    
+    WdfTimerStart(Context->TelemetryTimer, WDF_REL_TIMEOUT_IN_MS(Context->TelemetryPeriodMs));
+    if (Context->Thermal.Available) {
+        WdfTimerStart(Context->ThermalTimer, WDF_REL_TIMEOUT_IN_MS(Context->Thermal.PeriodMs));
+    }
+    if (Context->Power.Available) {
+        WdfTimerStart(Context->PowerTimer, WDF_REL_TIMEOUT_IN_MS(Context->Power.PeriodMs));
+    }
+    StartGovernor(Context);
+    WdfIoQueueStart(Context->DefaultQueue);
+    
+    return status;
+}
+
+// Read Driver Parameters
+VOID ReadDriverParameters(PDRIVER_CONTEXT Context)
+{
+    NTSTATUS status;
+    WDFKEY key;
+    ULONG value;
+    DECLARE_CONST_UNICODE_STRING(telemetryPeriodName, L"TelemetryPeriodMs");
+    DECLARE_CONST_UNICODE_STRING(msrStalenessName, L"MsrStalenessUs");
+    DECLARE_CONST_UNICODE_STRING(governorEnabledName, L"GovernorEnabled");
+    DECLARE_CONST_UNICODE_STRING(governorPeriodName, L"GovernorPeriodMs");
+    DECLARE_CONST_UNICODE_STRING(governorUpName, L"GovernorUpThreshold");
+    DECLARE_CONST_UNICODE_STRING(governorDownName, L"GovernorDownThreshold");
+    DECLARE_CONST_UNICODE_STRING(governorHysteresisName, L"GovernorHysteresis");
+    DECLARE_CONST_UNICODE_STRING(governorRateLimitName, L"GovernorRateLimitMs");
+    DECLARE_CONST_UNICODE_STRING(thermalLimitName, L"ThermalLimit");
+    DECLARE_CONST_UNICODE_STRING(thermalPeriodName, L"ThermalPeriodMs");
+    DECLARE_CONST_UNICODE_STRING(thermalMarginName, L"ThermalMargin");
+    DECLARE_CONST_UNICODE_STRING(thermalKpName, L"ThermalKp");
+    DECLARE_CONST_UNICODE_STRING(thermalKiName, L"ThermalKi");
+    DECLARE_CONST_UNICODE_STRING(thermalKdName, L"ThermalKd");
+    DECLARE_CONST_UNICODE_STRING(powerLimitName, L"PowerLimit");
+    DECLARE_CONST_UNICODE_STRING(powerPeriodName, L"PowerPeriodMs");
+    DECLARE_CONST_UNICODE_STRING(powerWindowName, L"PowerWindowMs");
+    DECLARE_CONST_UNICODE_STRING(powerKpName, L"PowerKp");
+    DECLARE_CONST_UNICODE_STRING(powerKiName, L"PowerKi");
+    DECLARE_CONST_UNICODE_STRING(traceLevelName, L"TraceLevel");
+    DECLARE_CONST_UNICODE_STRING(traceCategoriesName, L"TraceCategories");
+    MAHF_GOVERNOR_CONFIG governor = Context->Governor.Config;
+    
+    status = WdfDriverOpenParametersRegistryKey(g_Driver, KEY_READ,
+                                                WDF_NO_OBJECT_ATTRIBUTES, &key);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &telemetryPeriodName, &value))) {
+        Context->TelemetryPeriodMs = max(min(value, MAHF_TELEMETRY_MAX_PERIOD_MS),
+                                         MAHF_TELEMETRY_MIN_PERIOD_MS);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &msrStalenessName, &value))) {
+        Context->MsrStaleness = (ULONG64)min(value, MSR_STALENESS_MAX_US) * 10;
+    }
+    
+    // Governor settings are taken only if they are valid as a whole
+    WdfRegistryQueryULong(key, &governorEnabledName, &governor.Enabled);
+    WdfRegistryQueryULong(key, &governorPeriodName, &governor.PeriodMs);
+    WdfRegistryQueryULong(key, &governorUpName, &governor.UpThreshold);
+    WdfRegistryQueryULong(key, &governorDownName, &governor.DownThreshold);
+    WdfRegistryQueryULong(key, &governorHysteresisName, &governor.HysteresisSamples);
+    WdfRegistryQueryULong(key, &governorRateLimitName, &governor.RateLimitMs);
+    
+    if (ValidateGovernorConfig(&governor)) {
+        Context->Governor.Config = governor;
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &thermalLimitName, &value)) &&
+        value >= MAHF_THERMAL_LIMIT_MIN && value <= MAHF_THERMAL_LIMIT_MAX) {
+        Context->GlobalThermalLimit = value;
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &thermalPeriodName, &value))) {
+        Context->Thermal.PeriodMs = max(min(value, THERMAL_MAX_PERIOD_MS), THERMAL_MIN_PERIOD_MS);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &thermalMarginName, &value))) {
+        Context->Thermal.Margin = min(value, 30);
+    }
+    
+    // Gains are whole MHz; the cap cannot move more than the frequency
+    // range in one period, so anything larger only adds ringing
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &thermalKpName, &value))) {
+        Context->Thermal.Kp = (LONG)min(value, 10000);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &thermalKiName, &value))) {
+        Context->Thermal.Ki = (LONG)min(value, 10000);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &thermalKdName, &value))) {
+        Context->Thermal.Kd = (LONG)min(value, 10000);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &powerLimitName, &value)) &&
+        value >= MAHF_POWER_LIMIT_MIN && value <= MAHF_POWER_LIMIT_MAX) {
+        Context->GlobalPowerLimit = value;
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &powerPeriodName, &value))) {
+        Context->Power.PeriodMs = max(min(value, POWER_MAX_PERIOD_MS), POWER_MIN_PERIOD_MS);
+    }
+    
+    // The window is clamped to what the sample ring can cover once the
+    // period is known; see RunPower
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &powerWindowName, &value))) {
+        Context->Power.WindowMs = max(value, POWER_MIN_PERIOD_MS);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &powerKpName, &value))) {
+        Context->Power.Kp = (LONG)min(value, 10000);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &powerKiName, &value))) {
+        Context->Power.Ki = (LONG)min(value, 10000);
+    }
+    
+    // Tracing from the start of the next load, before any client is there
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &traceLevelName, &value))) {
+        g_TraceLevel = min(value, MAHF_TRACE_LEVEL_VERBOSE);
+    }
+    
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &traceCategoriesName, &value))) {
+        g_TraceCategories = value & MAHF_TRACE_CATEGORY_ALL;
+    }
+    
+    LoadProfiles(Context, key);
+    
+    WdfRegistryClose(key);
+}
+
+// D0 Entry Callback
+NTSTATUS OnDeviceD0Entry(
+    _In_ WDFDEVICE Device,
+    _In_ WDF_POWER_DEVICE_STATE PreviousState
+)
+{
+    PDRIVER_CONTEXT context = GetDriverContext(Device);
+    
+    UNREFERENCED_PARAMETER(PreviousState);
+    
+    // Firmware may have reprogrammed the volatile MSRs while we were out of D0
+    InvalidateRegisterCache(context);
+    
+    if (context->ActiveProfile) {
+        WdfWaitLockAcquire(context->ControlLock, NULL);
+        ProgramProfile(context);
+        WdfWaitLockRelease(context->ControlLock);
+    }
+    
+    WdfTimerStart(context->TelemetryTimer,
+                  WDF_REL_TIMEOUT_IN_MS(context->TelemetryPeriodMs));
+    if (context->Thermal.Available) {
+        WdfTimerStart(context->ThermalTimer, WDF_REL_TIMEOUT_IN_MS(context->Thermal.PeriodMs));
+    }
+    if (context->Power.Available) {
+        WdfTimerStart(context->PowerTimer, WDF_REL_TIMEOUT_IN_MS(context->Power.PeriodMs));
+    }
+    StartGovernor(context);
+    
+    return STATUS_SUCCESS;
+}
+
+// D0 Exit Callback
+NTSTATUS OnDeviceD0Exit(
+    _In_ WDFDEVICE Device,
+    _In_ WDF_POWER_DEVICE_STATE TargetState
+)
+{
+    PDRIVER_CONTEXT context = GetDriverContext(Device);
+    
+    UNREFERENCED_PARAMETER(TargetState);
+    
+    WdfTimerStop(context->TelemetryTimer, TRUE);
+    WdfTimerStop(context->ThermalTimer, TRUE);
+    WdfTimerStop(context->PowerTimer, TRUE);
+    StopGovernor(context);
+    
+    return STATUS_SUCCESS;
+}
+
 // Detect CPU Architecture
 NTSTATUS DetectCPUArchitecture(PDRIVER_CONTEXT Context)
 {
@@ -338,7 +1297,7 @@ NTSTATUS DetectCPUArchitecture(PDRIVER_CONTEXT Context)
     DbgPrint("DetectCPUArchitecture: Starting\n");
     
     // Get CPUID vendor string
-    status = GetCPUID(0, 0, regs);
+    status = CachedCPUID(Context, 0, 0, regs);
     if (!NT_SUCCESS(status)) {
         return status;
     }
@@ -355,23 +1314,8 @@ NTSTATUS DetectCPUArchitecture(PDRIVER_CONTEXT Context)
     // Determine architecture
     if (strstr(vendor, "GenuineIntel")) {
         Context->Architecture = ARCH_INTEL;
-        
-        // Get CPUID for Intel
-        status = GetCPUID(1, 0, regs);
-        if (NT_SUCCESS(status)) {
-            Context->CoreCount = (regs[1] >> 16) & 0xFF;
-            Context->ThreadCount = Context->CoreCount * 2;
-        }
-        
     } else if (strstr(vendor, "AuthenticAMD")) {
         Context->Architecture = ARCH_AMD;
-        
-        // Get CPUID for AMD
-        status = GetCPUID(0x80000008, 0, regs);
-        if (NT_SUCCESS(status)) {
-            Context->CoreCount = (regs[2] & 0xFF) + 1;
-            Context->ThreadCount = Context->CoreCount;
-        }
     } else {
         Context->Architecture = ARCH_UNKNOWN;
     }
@@ -382,7 +1326,7 @@ NTSTATUS DetectCPUArchitecture(PDRIVER_CONTEXT Context)
         
         // CPUID function 0x80000002-0x80000004 for brand string
         for (int i = 0; i < 3; i++) {
-            status = GetCPUID(0x80000002 + i, 0, regs);
+            status = CachedCPUID(Context, 0x80000002 + i, 0, regs);
             if (NT_SUCCESS(status)) {
                 *((ULONG32*)&brand[i * 16]) = regs[0];
                 *((ULONG32*)&brand[i * 16 + 4]) = regs[1];
@@ -402,21 +1346,38 @@ NTSTATUS DetectCPUArchitecture(PDRIVER_CONTEXT Context)
         RtlStringCbCopyA(Context->BrandString, sizeof(Context->BrandString), brand);
     }
     
+    // Core slots follow the logical processors Windows schedules on, so each
+    // slot can be programmed on the processor it describes
+    Context->ThreadCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Context->ProcessorCount = min(Context->ThreadCount, MAX_CPU_CORES);
+    
+    // Physical cores, packages and core types come from the CPUID topology
+    // leaves of every processor
+    EnumerateTopology(Context);
+    
+    InitializeRegisterCache(Context);
+    
     // Get frequency information
     if (Context->Architecture == ARCH_INTEL || Context->Architecture == ARCH_AMD) {
         ULONG64 msrValue;
         
-        // Read Platform Info MSR
-        if (NT_SUCCESS(ReadMSR(0xCE, &msrValue))) {
+        // Max non-turbo ratio, bits 15:8 of PLATFORM_INFO
+        if (NT_SUCCESS(CachedReadMSR(Context, MSR_PLATFORM_INFO, &msrValue))) {
             Context->BaseFrequency = (ULONG)(((msrValue >> 8) & 0xFF) * 100);
-            Context->MaxFrequency = Context->BaseFrequency * 2;
+            Context->MaxFrequency = Context->BaseFrequency * 3 / 2;
+        }
+        
+        // Single-core turbo ratio, bits 7:0 of TURBO_RATIO_LIMIT
+        if (Context->BaseFrequency != 0 &&
+            NT_SUCCESS(CachedReadMSR(Context, MSR_TURBO_RATIO_LIMIT, &msrValue)) &&
+            (msrValue & 0xFF) * 100 > Context->BaseFrequency) {
+            Context->MaxFrequency = (ULONG)((msrValue & 0xFF) * 100);
         }
     }
     
     // Default values if detection failed
     if (Context->CoreCount == 0) {
-        Context->CoreCount = 4;
-        Context->ThreadCount = 8;
+        Context->CoreCount = Context->ProcessorCount;
     }
     
     if (Context->BaseFrequency == 0) {
@@ -442,62 +1403,430 @@ NTSTATUS InitializeCoreManagement(PDRIVER_CONTEXT Context)
     // In a real driver, you would enumerate CPU cores
     
     // For now, we'll just set up the basic structures
-    for (ULONG i = 0; i < Context->CoreCount; i++) {
-        Context->Cores[i].CoreId = (UCHAR)i;
-        Context->Cores[i].BaseFrequency = Context->BaseFrequency;
-        Context->Cores[i].MaxFrequency = Context->MaxFrequency;
-        Context->Cores[i].CurrentFrequency = Context->BaseFrequency;
-        Context->Cores[i].Temperature = 40;
-        Context->Cores[i].Utilization = 10;
-        Context->Cores[i].CurrentState = STATE_BALANCED;
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        Context->Cores[i].Info.CoreId = (UCHAR)i;
+        Context->Cores[i].Info.PackageId = (UCHAR)Context->Topology[i].PackageId;
+        Context->Cores[i].Info.BaseFrequency = Context->BaseFrequency;
+        Context->Cores[i].Info.MaxFrequency = Context->MaxFrequency;
+        Context->Cores[i].Info.CurrentFrequency = Context->BaseFrequency;
+        Context->Cores[i].Info.TargetFrequency = Context->BaseFrequency;
+        Context->Cores[i].Info.Temperature = 40;
+        Context->Cores[i].Info.Utilization = 10;
+        Context->Cores[i].Info.CurrentState = STATE_BALANCED;
     }
     
-    DbgPrint("InitializeCoreManagement: Initialized %d cores\n", Context->CoreCount);
+    DbgPrint("InitializeCoreManagement: Initialized %d processors\n", Context->ProcessorCount);
     
     return STATUS_SUCCESS;
 }
 
-// Device Control Handler
-VOID OnDeviceControl(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
-)
+// Initialize Core Metrics
+// Sized to the processor count, rounded up to whole cache lines per array.
+// Kept across a reset unless the processor count grew.
+NTSTATUS InitializeCoreMetrics(PDRIVER_CONTEXT Context)
 {
-    NTSTATUS status = STATUS_SUCCESS;
-    WDFDEVICE device;
-    PDRIVER_CONTEXT context;
+    PCORE_METRICS metrics = &Context->Metrics;
+    ULONG capacity = (Context->ProcessorCount + METRIC_ARRAY_ALIGN - 1) & ~(METRIC_ARRAY_ALIGN - 1);
     
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
-    
-    device = WdfIoQueueGetDevice(Queue);
-    context = GetDriverContext(device);
+    if (metrics->Capacity < capacity) {
+        FreeCoreMetrics(Context);
+        
+        metrics->Block = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                         3 * capacity * sizeof(ULONG), DRIVER_TAG);
+        if (!metrics->Block) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        metrics->Capacity = capacity;
+        metrics->Frequency = (PULONG)metrics->Block;
+        metrics->Temperature = metrics->Frequency + capacity;
+        metrics->Utilization = metrics->Temperature + capacity;
+    }
     
-    // Update operation count
-    InterlockedIncrement64((LONG64*)&context->TotalOperations);
+    RtlZeroMemory(metrics->Block, 3 * metrics->Capacity * sizeof(ULONG));
     
-    DbgPrint("OnDeviceControl: IOCTL 0x%08X\n", IoControlCode);
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        metrics->Frequency[i] = Context->Cores[i].Info.CurrentFrequency;
+        metrics->Temperature[i] = Context->Cores[i].Info.Temperature;
+        metrics->Utilization[i] = Context->Cores[i].Info.Utilization;
+    }
     
-    // Handle IOCTL
-    status = HandleIOCTL(context, Request, IoControlCode);
+    return STATUS_SUCCESS;
+}
+
+// Free Core Metrics
+VOID FreeCoreMetrics(PDRIVER_CONTEXT Context)
+{
+    PCORE_METRICS metrics = &Context->Metrics;
     
-    if (!NT_SUCCESS(status)) {
-        InterlockedIncrement64((LONG64*)&context->FailedOperations);
+    if (metrics->Block) {
+        ExFreePoolWithTag(metrics->Block, DRIVER_TAG);
     }
     
-    // Complete request
-    WdfRequestComplete(Request, status);
+    RtlZeroMemory(metrics, sizeof(CORE_METRICS));
 }
 
-// Handle Specific IOCTLs
-NTSTATUS HandleIOCTL(PDRIVER_CONTEXT Context, WDFREQUEST Request, ULONG IoControlCode)
+// Initialize Telemetry
+// Grows the ring if the processor count or the period now needs more than
+// it holds; a ring that cannot grow is kept, with less history. Sequence
+// numbers restart at 0 and every slot reads as unpublished until written.
+// Called with the telemetry timer and the read queue stopped.
+NTSTATUS InitializeTelemetry(PDRIVER_CONTEXT Context)
 {
-    NTSTATUS status = STATUS_SUCCESS;
-    PVOID inputBuffer = NULL;
-    PVOID outputBuffer = NULL;
+    PTELEMETRY_RING ring = &Context->Telemetry;
+    ULONG64 needed = (ULONG64)Context->ProcessorCount *
+                     ((TELEMETRY_HISTORY_MS + Context->TelemetryPeriodMs - 1) / Context->TelemetryPeriodMs);
+    ULONG64 size = MAHF_TELEMETRY_RING_SIZE;
+    PMAHF_TELEMETRY_SAMPLE samples;
+    
+    while (size < needed) {
+        size *= 2;
+    }
+    
+    if (ring->Size < size) {
+        samples = (PMAHF_TELEMETRY_SAMPLE)ExAllocatePool2(POOL_FLAG_NON_PAGED, size * sizeof(MAHF_TELEMETRY_SAMPLE),
+                                                          DRIVER_TAG);
+        if (samples) {
+            FreeTelemetry(Context);
+            ring->Samples = samples;
+            ring->Size = size;
+        } else if (!ring->Samples) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    
+    for (ULONG64 i = 0; i < ring->Size; i++) {
+        ring->Samples[i].Sequence = TELEMETRY_SLOT_BUSY;
+    }
+    
+    ring->Head = 0;
+    
+    DbgPrint("InitializeTelemetry: %llu samples, %llu ms at %d ms\n", ring->Size,
+             ring->Size / Context->ProcessorCount * Context->TelemetryPeriodMs, Context->TelemetryPeriodMs);
+    
+    return STATUS_SUCCESS;
+}
+
+// Free Telemetry
+VOID FreeTelemetry(PDRIVER_CONTEXT Context)
+{
+    PTELEMETRY_RING ring = &Context->Telemetry;
+    
+    if (ring->Samples) {
+        ExFreePoolWithTag(ring->Samples, DRIVER_TAG);
+    }
+    
+    RtlZeroMemory(ring, sizeof(TELEMETRY_RING));
+}
+
+// Enumerate Topology
+// Every processor decodes its own CPUID topology leaves in one broadcast;
+// the summary counts are derived afterwards at PASSIVE_LEVEL.
+VOID EnumerateTopology(PDRIVER_CONTEXT Context)
+{
+    TOPOLOGY_BROADCAST broadcast;
+    ULONG32 regs[4];
+    ULONG coreCount = 0;
+    
+    RtlZeroMemory(&broadcast, sizeof(broadcast));
+    RtlZeroMemory(Context->Topology, sizeof(Context->Topology));
+    broadcast.Context = Context;
+    
+    if (NT_SUCCESS(CachedCPUID(Context, 0, 0, regs))) {
+        broadcast.MaxLeaf = regs[0];
+    }
+    
+    if (NT_SUCCESS(CachedCPUID(Context, 0x80000000, 0, regs))) {
+        broadcast.MaxExtendedLeaf = regs[0];
+    }
+    
+    // Hybrid flag, CPUID.07H.0:EDX[15]
+    if (broadcast.MaxLeaf >= 7 && NT_SUCCESS(CachedCPUID(Context, 7, 0, regs))) {
+        broadcast.Hybrid = (regs[3] & (1 << 15)) != 0;
+    }
+    
+    if (broadcast.MaxExtendedLeaf >= 0x80000008 &&
+        NT_SUCCESS(CachedCPUID(Context, 0x80000008, 0, regs))) {
+        broadcast.AmdApicIdSize = (regs[2] >> 12) & 0xF;
+    }
+    
+    KeIpiGenericCall(EnumerateTopologyIpi, (ULONG_PTR)&broadcast);
+    
+    Context->Hybrid = broadcast.Hybrid;
+    Context->PackageCount = 0;
+    Context->PerformanceCoreCount = 0;
+    Context->EfficiencyCoreCount = 0;
+    
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        PMAHF_TOPOLOGY_ENTRY entry = &Context->Topology[i];
+        ULONG package = Context->PackageCount;
+        
+        for (ULONG j = 0; j < i; j++) {
+            if (Context->Topology[j].PackageId == entry->PackageId) {
+                package = Context->PackageIndex[j];
+                break;
+            }
+        }
+        
+        Context->PackageIndex[i] = (UCHAR)package;
+        Context->PackageLead[i] = (package == Context->PackageCount);
+        
+        if (Context->PackageLead[i]) {
+            Context->PackageCount++;
+        }
+        
+        // Count each core once, through its first thread
+        if (entry->SmtId != 0) {
+            continue;
+        }
+        
+        coreCount++;
+        
+        if (entry->CoreType == MAHF_CORE_TYPE_EFFICIENCY) {
+            Context->EfficiencyCoreCount++;
+        } else {
+            Context->PerformanceCoreCount++;
+        }
+    }
+    
+    Context->CoreCount = coreCount;
+    
+    DbgPrint("EnumerateTopology: %d packages, %d cores (%d P, %d E), %d threads\n",
+             Context->PackageCount, coreCount, Context->PerformanceCoreCount,
+             Context->EfficiencyCoreCount, Context->ProcessorCount);
+}
+
+// Topology IPI
+// Runs at IPI_LEVEL on every processor; fills only the caller's own entry.
+ULONG_PTR EnumerateTopologyIpi(ULONG_PTR Argument)
+{
+    PTOPOLOGY_BROADCAST broadcast = (PTOPOLOGY_BROADCAST)Argument;
+    PDRIVER_CONTEXT context = broadcast->Context;
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PMAHF_TOPOLOGY_ENTRY entry;
+    ULONG32 regs[4];
+    
+    if (processor >= context->ProcessorCount) {
+        return 0;
+    }
+    
+    entry = &context->Topology[processor];
+    entry->CoreType = MAHF_CORE_TYPE_PERFORMANCE;
+    
+    if (context->Architecture == ARCH_AMD && broadcast->MaxExtendedLeaf >= 0x8000001E) {
+        // EAX extended APIC ID, EBX[7:0] core, EBX[15:8] threads per core - 1,
+        // ECX[7:0] node (die)
+        GetCPUID(0x8000001E, 0, regs);
+        entry->ApicId = regs[0];
+        entry->CoreId = (USHORT)(regs[1] & 0xFF);
+        entry->ModuleId = entry->CoreId;
+        entry->SmtId = ((regs[1] >> 8) & 0xFF) ? (UCHAR)(regs[0] & 1) : 0;
+        entry->DieId = (USHORT)(regs[2] & 0xFF);
+        entry->PackageId = broadcast->AmdApicIdSize ?
+            (USHORT)(regs[0] >> broadcast->AmdApicIdSize) : 0;
+    } else if (broadcast->MaxLeaf >= 0xB) {
+        ReadLeafTopology(broadcast->MaxLeaf >= 0x1F ? 0x1F : 0xB, entry);
+    } else {
+        // Legacy: initial APIC ID only
+        GetCPUID(1, 0, regs);
+        entry->ApicId = regs[1] >> 24;
+        entry->CoreId = (USHORT)entry->ApicId;
+        entry->ModuleId = entry->CoreId;
+    }
+    
+    // Native core type, CPUID.1AH:EAX[31:24]
+    if (broadcast->Hybrid && broadcast->MaxLeaf >= 0x1A) {
+        GetCPUID(0x1A, 0, regs);
+        
+        switch (regs[0] >> 24) {
+            case CPUID_HYBRID_ATOM:
+                entry->CoreType = MAHF_CORE_TYPE_EFFICIENCY;
+                break;
+                
+            case CPUID_HYBRID_CORE:
+                entry->CoreType = MAHF_CORE_TYPE_PERFORMANCE;
+                break;
+                
+            default:
+                entry->CoreType = MAHF_CORE_TYPE_UNKNOWN;
+                break;
+        }
+    }
+    
+    return 0;
+}
+
+// Read Extended Topology Leaf (0x1F or 0xB)
+// Each sub-leaf gives a level type and the APIC ID shift to the next level
+// up; the last valid level's shift separates the package ID.
+VOID ReadLeafTopology(ULONG Leaf, PMAHF_TOPOLOGY_ENTRY Entry)
+{
+    ULONG32 regs[4];
+    ULONG smtShift = 0;
+    ULONG coreShift = 0;
+    ULONG dieBelowShift = 0;
+    ULONG packageShift = 0;
+    BOOLEAN hasModule = FALSE;
+    BOOLEAN hasDie = FALSE;
+    ULONG apicId = 0;
+    ULONG packageLocal;
+    
+    for (ULONG subLeaf = 0; subLeaf < 8; subLeaf++) {
+        ULONG levelType;
+        ULONG shift;
+        
+        GetCPUID(Leaf, subLeaf, regs);
+        
+        levelType = (regs[2] >> 8) & 0xFF;
+        if (levelType == 0) {
+            break;
+        }
+        
+        shift = regs[0] & 0x1F;
+        apicId = regs[3];
+        
+        switch (levelType) {
+            case CPUID_LEVEL_SMT:
+                smtShift = shift;
+                break;
+                
+            case CPUID_LEVEL_CORE:
+                coreShift = shift;
+                break;
+                
+            case CPUID_LEVEL_MODULE:
+                hasModule = TRUE;
+                break;
+                
+            case CPUID_LEVEL_DIE:
+                hasDie = TRUE;
+                dieBelowShift = packageShift;
+                break;
+        }
+        
+        packageShift = shift;
+    }
+    
+    packageLocal = packageShift < 32 ? apicId & ((1UL << packageShift) - 1) : apicId;
+    
+    Entry->ApicId = apicId;
+    Entry->PackageId = (USHORT)(packageShift < 32 ? apicId >> packageShift : 0);
+    Entry->SmtId = (UCHAR)(apicId & ((1UL << smtShift) - 1));
+    Entry->CoreId = (USHORT)(packageLocal >> smtShift);
+    Entry->ModuleId = hasModule ? (USHORT)(packageLocal >> coreShift) : Entry->CoreId;
+    Entry->DieId = hasDie ? (USHORT)(packageLocal >> dieBelowShift) : 0;
+}
+
+// Device Control Handler
+// Default queue, parallel dispatch. Control IOCTLs are handed to the
+// sequential control queue; reads are processed here without waiting on it,
+// and notification waits may be parked on the notification queue.
+VOID OnDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    NTSTATUS status;
+    PDRIVER_CONTEXT context;
+    
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    
+    context = GetDriverContext(WdfIoQueueGetDevice(Queue));
+    
+    if (IOCTL_IS_CONTROL(IoControlCode)) {
+        status = WdfRequestForwardToIoQueue(Request, context->ControlQueue);
+        if (!NT_SUCCESS(status)) {
+            MAHF_TRACE(IOCTL_NOT_QUEUED, IoControlCode, status, 0, 0);
+            CountRequest(status);
+            WdfRequestComplete(Request, status);
+        }
+        return;
+    }
+    
+    if (IoControlCode == IOCTL_MAHF_WAIT_NOTIFICATION) {
+        WaitNotification(context, Request);
+        return;
+    }
+    
+    ProcessDeviceControl(context, Request, IoControlCode);
+}
+
+// Control Queue Device Control Handler
+VOID OnControlDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    PDRIVER_CONTEXT context = GetDriverContext(WdfIoQueueGetDevice(Queue));
+    
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    
+    WdfWaitLockAcquire(context->ControlLock, NULL);
+    ProcessDeviceControl(context, Request, IoControlCode);
+    WdfWaitLockRelease(context->ControlLock);
+}
+
+// Process and Complete a Device Control Request
+VOID ProcessDeviceControl(PDRIVER_CONTEXT Context, WDFREQUEST Request, ULONG IoControlCode)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    SIZE_T bytesReturned = 0;
+    ULONG64 start = StatTimestamp();
+    
+    // Handle IOCTL
+    status = HandleIOCTL(Context, Request, IoControlCode, &bytesReturned);
+    
+    if (!NT_SUCCESS(status)) {
+        bytesReturned = 0;
+    }
+    
+    RecordRequest(IoControlCode, start, status);
+    MAHF_TRACE(IOCTL, IoControlCode, status, bytesReturned, 0);
+    
+    // Complete request
+    WdfRequestCompleteWithInformation(Request, status, bytesReturned);
+}
+
+// I/O Stop Callback
+// Requests are completed inside the dispatch callbacks, so nothing is held
+// by the driver across a power transition. Pending notification waits live
+// on a queue that is not power managed.
+VOID OnIoStop(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG ActionFlags
+)
+{
+    UNREFERENCED_PARAMETER(Queue);
+    UNREFERENCED_PARAMETER(ActionFlags);
+    
+    WdfRequestStopAcknowledge(Request, FALSE);
+}
+
+// I/O Resume Callback
+VOID OnIoResume(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request
+)
+{
+    UNREFERENCED_PARAMETER(Queue);
+    UNREFERENCED_PARAMETER(Request);
+}
+
+// Handle Specific IOCTLs
+NTSTATUS HandleIOCTL(PDRIVER_CONTEXT Context, WDFREQUEST Request, ULONG IoControlCode, PSIZE_T BytesReturned)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PVOID inputBuffer = NULL;
+    PVOID outputBuffer = NULL;
     size_t inputLength = 0;
     size_t outputLength = 0;
     
@@ -516,303 +1845,3448 @@ NTSTATUS HandleIOCTL(PDRIVER_CONTEXT Context, WDFREQUEST Request, ULONG IoContro
         status = STATUS_SUCCESS;
     }
     
+    if (IoControlCode == IOCTL_MAHF_BATCH) {
+        return ExecuteBatch(Context, inputBuffer, inputLength,
+                            outputBuffer, outputLength, BytesReturned);
+    }
+    
+    return DispatchIOCTL(Context, IoControlCode, inputBuffer, inputLength,
+                         outputBuffer, outputLength, BytesReturned);
+}
+
+// Dispatch One Command
+// Shared by single IOCTLs and batch sub-commands.
+NTSTATUS DispatchIOCTL(PDRIVER_CONTEXT Context, ULONG IoControlCode,
+                       PVOID InputBuffer, SIZE_T InputLength,
+                       PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    
+    *BytesReturned = 0;
+    
     // Process IOCTL based on control code
     switch (IoControlCode) {
         case IOCTL_MAHF_GET_CPU_INFO:
-            status = GetCPUInfo(Context, outputBuffer, outputLength);
+            status = GetCPUInfo(Context, OutputBuffer, OutputLength, BytesReturned);
             break;
             
         case IOCTL_MAHF_GET_PERFORMANCE_DATA:
-            status = GetPerformanceData(Context, outputBuffer, outputLength);
+            status = GetPerformanceData(Context, OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_GET_TOPOLOGY:
+            status = GetTopology(Context, OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_GET_METRIC_SUMMARY:
+            status = GetMetricSummary(Context, OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_SET_GOVERNOR:
+            if (InputBuffer && InputLength >= sizeof(MAHF_GOVERNOR_CONFIG)) {
+                status = SetGovernor(Context, (PMAHF_GOVERNOR_CONFIG)InputBuffer);
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            break;
+            
+        case IOCTL_MAHF_GET_GOVERNOR:
+            status = GetGovernor(Context, OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_GET_THERMAL:
+            status = GetThermal(Context, OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_GET_ENERGY:
+            status = GetEnergy(Context, OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_SET_PROFILE:
+            if (InputBuffer && InputLength >= sizeof(MAHF_PROFILE)) {
+                status = SetProfile(Context, (PMAHF_PROFILE)InputBuffer);
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            break;
+            
+        case IOCTL_MAHF_SELECT_PROFILE:
+            if (InputBuffer && InputLength >= sizeof(MAHF_PROFILE_NAME)) {
+                status = SelectProfile(Context, (PMAHF_PROFILE_NAME)InputBuffer);
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            break;
+            
+        case IOCTL_MAHF_GET_PROFILES:
+            status = GetProfiles(Context, OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_DELETE_PROFILE:
+            if (InputBuffer && InputLength >= sizeof(MAHF_PROFILE_NAME)) {
+                status = DeleteProfile(Context, (PMAHF_PROFILE_NAME)InputBuffer);
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
             break;
             
         case IOCTL_MAHF_SET_PERFORMANCE_STATE:
-            if (inputLength >= sizeof(PERFORMANCE_STATE)) {
-                PERFORMANCE_STATE state = *(PPERFORMANCE_STATE)inputBuffer;
-                status = SetPerformanceState(Context, state);
+            if (InputBuffer && InputLength >= sizeof(PERFORMANCE_STATE)) {
+                PERFORMANCE_STATE state = *(PPERFORMANCE_STATE)InputBuffer;
+                MAHF_STATE_RESULT result;
+                
+                status = SetPerformanceState(Context, state, &result);
+                
+                // The per-core result is optional; callers that pass no
+                // output buffer only get the status
+                if (NT_SUCCESS(status) && OutputBuffer &&
+                    OutputLength >= sizeof(MAHF_STATE_RESULT)) {
+                    RtlCopyMemory(OutputBuffer, &result, sizeof(MAHF_STATE_RESULT));
+                    *BytesReturned = sizeof(MAHF_STATE_RESULT);
+                }
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            break;
+            
+        case IOCTL_MAHF_RESET_DRIVER:
+            status = ResetDriverContext(Context);
+            break;
+            
+        case IOCTL_MAHF_DRAIN_TELEMETRY:
+            status = DrainTelemetry(Context, InputBuffer, InputLength,
+                                    OutputBuffer, OutputLength, BytesReturned);
+            break;
+            
+        case IOCTL_MAHF_SET_LIMITS:
+            if (InputBuffer && InputLength >= sizeof(MAHF_LIMITS)) {
+                status = SetLimits(Context, (PMAHF_LIMITS)InputBuffer);
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            break;
+            
+        case IOCTL_MAHF_SET_NOTIFICATION:
+            if (InputBuffer && InputLength >= sizeof(MAHF_NOTIFY_CONFIG)) {
+                status = SetNotification(Context, (PMAHF_NOTIFY_CONFIG)InputBuffer);
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            break;
+            
+        case IOCTL_MAHF_GET_STATISTICS:
+            status = GetStatistics(OutputBuffer, OutputLength, BytesReturned);
+            break;
+        
+        case IOCTL_MAHF_SET_TRACE:
+            if (InputBuffer && InputLength >= sizeof(MAHF_TRACE_CONFIG)) {
+                status = SetTrace((PMAHF_TRACE_CONFIG)InputBuffer);
             } else {
                 status = STATUS_BUFFER_TOO_SMALL;
             }
             break;
+        
+        case IOCTL_MAHF_DRAIN_TRACE:
+            status = DrainTrace(OutputBuffer, OutputLength, BytesReturned);
+            break;
+        
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+    
+    return status;
+}
+
+// Execute Batch
+// Runs on the control queue at PASSIVE_LEVEL. The whole command table is
+// validated before anything runs. Input and output share the system buffer,
+// so the input is copied aside first.
+NTSTATUS ExecuteBatch(PDRIVER_CONTEXT Context, PVOID InputBuffer, SIZE_T InputLength,
+                      PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    PMAHF_BATCH_REQUEST request;
+    PMAHF_BATCH_RESPONSE response;
+    ULONG commandCount;
+    ULONG flags;
+    SIZE_T tableLength;
+    ULONG64 dataOffset;
+    ULONG64 outputOffset;
+    ULONG failedCount = 0;
+    ULONG executed = 0;
+    
+    if (!InputBuffer || InputLength < FIELD_OFFSET(MAHF_BATCH_REQUEST, Commands)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    commandCount = ((PMAHF_BATCH_REQUEST)InputBuffer)->CommandCount;
+    if (commandCount == 0 || commandCount > MAHF_BATCH_MAX_COMMANDS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    tableLength = FIELD_OFFSET(MAHF_BATCH_REQUEST, Commands) +
+                  (SIZE_T)commandCount * sizeof(MAHF_BATCH_COMMAND);
+    if (InputLength < tableLength) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    request = (PMAHF_BATCH_REQUEST)ExAllocatePool2(POOL_FLAG_PAGED, InputLength, DRIVER_TAG);
+    if (!request) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlCopyMemory(request, InputBuffer, InputLength);
+    flags = request->Flags;
+    
+    // Validate inputs and lay out outputs. The pool copy is 8-byte
+    // aligned, so aligned offsets keep sub-command structs aligned too.
+    dataOffset = MAHF_BATCH_ALIGN(FIELD_OFFSET(MAHF_BATCH_RESPONSE, Results) +
+                                  (ULONG64)commandCount * sizeof(MAHF_BATCH_RESULT));
+    outputOffset = dataOffset;
+    
+    for (ULONG i = 0; i < commandCount; i++) {
+        PMAHF_BATCH_COMMAND command = &request->Commands[i];
+        
+        if ((ULONG64)command->InputOffset + command->InputLength > InputLength ||
+            (command->InputLength != 0 && command->InputOffset < tableLength) ||
+            (command->InputLength != 0 && command->InputOffset % sizeof(ULONG64) != 0)) {
+            ExFreePoolWithTag(request, DRIVER_TAG);
+            return STATUS_INVALID_PARAMETER;
+        }
+        
+        outputOffset += MAHF_BATCH_ALIGN((ULONG64)command->OutputLength);
+    }
+    
+    if (!OutputBuffer || OutputLength < outputOffset) {
+        ExFreePoolWithTag(request, DRIVER_TAG);
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    // The whole reply, output slots included: the buffer still holds the
+    // input, and a slot's unwritten bytes are returned with it
+    response = (PMAHF_BATCH_RESPONSE)OutputBuffer;
+    RtlZeroMemory(response, (SIZE_T)outputOffset);
+    outputOffset = dataOffset;
+    
+    for (ULONG i = 0; i < commandCount; i++) {
+        PMAHF_BATCH_COMMAND command = &request->Commands[i];
+        PMAHF_BATCH_RESULT result = &response->Results[i];
+        SIZE_T bytesReturned = 0;
+        
+        // Cancelled commands keep their slot, so every offset matches the
+        // layout the caller computed
+        result->OutputOffset = (ULONG)outputOffset;
+        outputOffset += MAHF_BATCH_ALIGN((ULONG64)command->OutputLength);
+        
+        if ((flags & MAHF_BATCH_FLAG_STOP_ON_ERROR) && failedCount != 0) {
+            result->Status = STATUS_CANCELLED;
+            continue;
+        }
+        
+        result->Status = DispatchIOCTL(
+            Context, command->IoControlCode,
+            command->InputLength ? (PUCHAR)request + command->InputOffset : NULL,
+            command->InputLength,
+            command->OutputLength ? (PUCHAR)OutputBuffer + result->OutputOffset : NULL,
+            command->OutputLength,
+            &bytesReturned);
+        
+        result->BytesReturned = NT_SUCCESS(result->Status) ? (ULONG)bytesReturned : 0;
+        
+        if (!NT_SUCCESS(result->Status)) {
+            failedCount++;
+        }
+        
+        executed++;
+    }
+    
+    response->CommandCount = executed;
+    response->FailedCount = failedCount;
+    
+    ExFreePoolWithTag(request, DRIVER_TAG);
+    
+    *BytesReturned = (SIZE_T)outputOffset;
+    return STATUS_SUCCESS;
+}
+
+// Set Limits
+NTSTATUS SetLimits(PDRIVER_CONTEXT Context, PMAHF_LIMITS Limits)
+{
+    if (Limits->ThermalLimit < MAHF_THERMAL_LIMIT_MIN ||
+        Limits->ThermalLimit > MAHF_THERMAL_LIMIT_MAX ||
+        Limits->PowerLimit < MAHF_POWER_LIMIT_MIN ||
+        Limits->PowerLimit > MAHF_POWER_LIMIT_MAX) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    InterlockedExchange((volatile LONG*)&Context->GlobalThermalLimit, Limits->ThermalLimit);
+    InterlockedExchange((volatile LONG*)&Context->GlobalPowerLimit, Limits->PowerLimit);
+    
+    DbgPrint("SetLimits: Thermal %d C, Power %d W\n",
+             Limits->ThermalLimit, Limits->PowerLimit);
+    
+    return STATUS_SUCCESS;
+}
+
+// Set Performance State
+// PERF_CTL is per logical processor, so the new ratio is written by every
+// processor on itself in a single broadcast IPI rather than one hop at a
+// time. Core slots are published afterwards at PASSIVE_LEVEL, only for the
+// processors that accepted the write.
+NTSTATUS SetPerformanceState(PDRIVER_CONTEXT Context, PERFORMANCE_STATE State,
+                             PMAHF_STATE_RESULT Result)
+{
+    NTSTATUS status;
+    ULONG targetFrequency = Context->BaseFrequency;
+    ULONG appliedFrequency;
+    PERF_CTL_BROADCAST broadcast;
+    ULONG failedCount = 0;
+    PERFORMANCE_STATE previousState = Context->GlobalState;
+    ULONG64 start = StatTimestamp();
+    PCPU_STATS stats;
+    
+    // Validate state; unsigned, since the enum is signed under MSVC and the
+    // value indexes the transition histograms
+    if ((ULONG)State > STATE_EXTREME) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    // Calculate target frequency based on state
+    switch (State) {
+        case STATE_POWER_SAVE:
+            targetFrequency = Context->BaseFrequency * 6 / 10;
+            break;
+            
+        case STATE_BALANCED:
+            targetFrequency = Context->BaseFrequency;
+            break;
+            
+        case STATE_PERFORMANCE:
+            targetFrequency = Context->BaseFrequency * 12 / 10;
+            break;
+            
+        case STATE_EXTREME:
+            targetFrequency = Context->MaxFrequency;
+            break;
+            
+        default:
+            return STATUS_INVALID_PARAMETER;
+    }
+    
+    // Validate frequency range
+    if (targetFrequency < Context->BaseFrequency * 4 / 10 ||
+        targetFrequency > Context->MaxFrequency) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    MAHF_TRACE(STATE_BEGIN, State, previousState, 0, 0);
+    
+    // A fixed state overrides the governor and the active profile
+    if (Context->Governor.Config.Enabled) {
+        StopGovernor(Context);
+        Context->Governor.Config.Enabled = FALSE;
+    }
+    
+    if (Context->ActiveProfile) {
+        ActivateProfile(Context, NULL);
+        SaveProfiles(Context);
+    }
+    
+    // Remembered unclamped, so the state comes back in full when the caps
+    // lift. The uniform broadcast takes the tightest cap; the next limit
+    // period raises packages that have headroom.
+    appliedFrequency = targetFrequency;
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        Context->RequestedFrequency[i] = targetFrequency;
+        appliedFrequency = min(appliedFrequency, ProcessorFrequencyCap(Context, i));
+    }
+    
+    RtlZeroMemory(&broadcast, sizeof(broadcast));
+    broadcast.Context = Context;
+    broadcast.ProcessorCount = Context->ProcessorCount;
+    broadcast.Ratio = appliedFrequency / 100;
+    
+    // Odd generation: change in progress
+    InterlockedIncrement(&Context->StateGeneration);
+    
+    // Set global state
+    InterlockedExchange((volatile LONG*)&Context->GlobalState, State);
+    
+    // Program every processor at once, unless the cache shows none of them
+    // would change. PerfCtl entries are only written by these broadcasts,
+    // which the control queue serializes, so they can be read from here.
+    if (Context->Architecture == ARCH_INTEL || Context->Architecture == ARCH_AMD) {
+        BOOLEAN dirty = FALSE;
+        
+        for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+            PMSR_CACHE cache = &Context->MsrCache[i];
+            
+            if (!cache->PerfCtlValid ||
+                ((cache->Registers.PerfCtl & PERF_CTL_RATIO_MASK) >> PERF_CTL_RATIO_SHIFT) !=
+                    broadcast.Ratio) {
+                dirty = TRUE;
+                break;
+            }
+        }
+        
+        if (dirty) {
+            KeIpiGenericCall(ProgramPerfCtlIpi, (ULONG_PTR)&broadcast);
+        } else {
+            for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+                broadcast.SuccessMask[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+    } else {
+        for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+            broadcast.SuccessMask[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+    
+    // Publish the cores that took the new ratio
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        if (!(broadcast.SuccessMask[i / 64] & (1ULL << (i % 64)))) {
+            failedCount++;
+            continue;
+        }
+        
+        status = UpdateCoreFrequency(Context, (UCHAR)i, appliedFrequency, State);
+        if (!NT_SUCCESS(status)) {
+            MAHF_TRACE(CORE_UPDATE_FAILED, i, status, 0, 0);
+            // Continue with other cores
+        }
+    }
+    
+    InterlockedIncrement(&Context->StateGeneration);
+    
+    if (Result) {
+        Result->ProcessorCount = Context->ProcessorCount;
+        Result->FailedCount = failedCount;
+        for (ULONG i = 0; i < MAHF_CORE_MASK_WORDS; i++) {
+            Result->CoreMask[i] = (ULONG64)broadcast.SuccessMask[i];
+        }
+    }
+    
+    MAHF_TRACE(STATE_END, State, Context->ProcessorCount - failedCount,
+               Context->ProcessorCount, appliedFrequency);
+    
+    stats = CpuStats(KeGetCurrentProcessorNumberEx(NULL));
+    if (stats) {
+        RecordLatency(&stats->Transition[previousState][State], start,
+                      failedCount ? STATUS_UNSUCCESSFUL : STATUS_SUCCESS);
+    }
+    
+    PostNotification(Context, MAHF_NOTIFY_STATE, State, Context->ActiveProfile != NULL);
+    
+    return STATUS_SUCCESS;
+}
+
+// Program PERF_CTL
+// Runs at IPI_LEVEL on every processor simultaneously; no DbgPrint, no
+// locks, nothing that can wait. The target ratio lives in bits 15:8.
+ULONG_PTR ProgramPerfCtlIpi(ULONG_PTR Argument)
+{
+    PPERF_CTL_BROADCAST broadcast = (PPERF_CTL_BROADCAST)Argument;
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    ULONG64 msrValue;
+    ULONG64 ratio;
+    
+    if (processor >= broadcast->ProcessorCount) {
+        return 0;
+    }
+    
+    ratio = broadcast->Ratios ? broadcast->Ratios[processor] : broadcast->Ratio;
+    if (ratio == 0) {
+        return 0;
+    }
+    
+    if (!NT_SUCCESS(CachedReadMSR(broadcast->Context, MSR_PERF_CTL, &msrValue))) {
+        return 0;
+    }
+    
+    msrValue &= ~PERF_CTL_RATIO_MASK;
+    msrValue |= (ratio << PERF_CTL_RATIO_SHIFT) & PERF_CTL_RATIO_MASK;
+    
+    if (NT_SUCCESS(CachedWritePerfCtl(broadcast->Context, msrValue))) {
+        InterlockedOr64(&broadcast->SuccessMask[processor / 64], (LONG64)(1ULL << (processor % 64)));
+    }
+    
+    return 0;
+}
+
+// Get CPU Information
+NTSTATUS GetCPUInfo(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    typedef struct _CPU_INFO_RESPONSE {
+        CHAR Vendor[13];
+        CHAR Brand[49];
+        ULONG Architecture;
+        ULONG CoreCount;
+        ULONG ThreadCount;
+        ULONG BaseFrequency;
+        ULONG MaxFrequency;
+        ULONG CurrentFrequency;
+        BOOLEAN HyperThreading;
+        BOOLEAN TurboBoost;
+    } CPU_INFO_RESPONSE, *PCPU_INFO_RESPONSE;
+    
+    if (!OutputBuffer || OutputLength < sizeof(CPU_INFO_RESPONSE)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    PCPU_INFO_RESPONSE response = (PCPU_INFO_RESPONSE)OutputBuffer;
+    
+    // Fill response structure
+    RtlStringCbCopyA(response->Vendor, sizeof(response->Vendor), Context->VendorString);
+    RtlStringCbCopyA(response->Brand, sizeof(response->Brand), Context->BrandString);
+    response->Architecture = Context->Architecture;
+    response->CoreCount = Context->CoreCount;
+    response->ThreadCount = Context->ThreadCount;
+    response->BaseFrequency = Context->BaseFrequency;
+    response->MaxFrequency = Context->MaxFrequency;
+    CPU_CORE_INFO firstCore;
+    CoreReadInfo(&Context->Cores[0], &firstCore);
+    response->CurrentFrequency = firstCore.CurrentFrequency; // First core frequency
+    response->HyperThreading = (Context->ThreadCount > Context->CoreCount);
+    response->TurboBoost = Context->TurboBoostEnabled;
+    
+    *BytesReturned = sizeof(CPU_INFO_RESPONSE);
+    return STATUS_SUCCESS;
+}
+
+// Get Performance Data
+NTSTATUS GetPerformanceData(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    if (!OutputBuffer || OutputLength < sizeof(MAHF_PERFORMANCE_DATA)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    ComputePerformanceData(Context, (PMAHF_PERFORMANCE_DATA)OutputBuffer);
+    
+    *BytesReturned = sizeof(MAHF_PERFORMANCE_DATA);
+    return STATUS_SUCCESS;
+}
+
+// Get Topology
+NTSTATUS GetTopology(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    PMAHF_TOPOLOGY response = (PMAHF_TOPOLOGY)OutputBuffer;
+    SIZE_T capacity;
+    ULONG count;
+    
+    if (!OutputBuffer || OutputLength < FIELD_OFFSET(MAHF_TOPOLOGY, Entries)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    capacity = (OutputLength - FIELD_OFFSET(MAHF_TOPOLOGY, Entries)) / sizeof(MAHF_TOPOLOGY_ENTRY);
+    count = (ULONG)min(capacity, Context->ProcessorCount);
+    
+    response->ProcessorCount = Context->ProcessorCount;
+    response->EntryCount = count;
+    response->PackageCount = Context->PackageCount;
+    response->CoreCount = Context->CoreCount;
+    response->PerformanceCoreCount = Context->PerformanceCoreCount;
+    response->EfficiencyCoreCount = Context->EfficiencyCoreCount;
+    response->Flags = Context->Hybrid ? MAHF_TOPOLOGY_FLAG_HYBRID : 0;
+    response->Reserved = 0;
+    
+    RtlCopyMemory(response->Entries, Context->Topology, count * sizeof(MAHF_TOPOLOGY_ENTRY));
+    
+    *BytesReturned = FIELD_OFFSET(MAHF_TOPOLOGY, Entries) + count * sizeof(MAHF_TOPOLOGY_ENTRY);
+    return STATUS_SUCCESS;
+}
+
+// Compute Performance Data
+// Aggregates the metric arrays in one pass each. The pass is retried a few
+// times if a state change lands mid-sweep, so it normally reflects the
+// cores entirely before or entirely after the change; readers never wait
+// for the control queue.
+VOID ComputePerformanceData(PDRIVER_CONTEXT Context, PMAHF_PERFORMANCE_DATA Data)
+{
+    PCORE_METRICS metrics = &Context->Metrics;
+    ULONG count = Context->ProcessorCount;
+    METRIC_SUMMARY usage;
+    METRIC_SUMMARY temperature;
+    METRIC_SUMMARY frequency;
+    
+    for (ULONG attempt = 0; attempt < STATE_READ_RETRIES; attempt++) {
+        LONG generation = ReadAcquire(&Context->StateGeneration);
+        
+        SummarizeMetric(metrics->Utilization, count, &usage);
+        SummarizeMetric(metrics->Temperature, count, &temperature);
+        SummarizeMetric(metrics->Frequency, count, &frequency);
+        
+        KeMemoryBarrier();
+        
+        if (!(generation & 1) &&
+            ReadNoFence(&Context->StateGeneration) == generation) {
+            break;
+        }
+    }
+    
+    // Fill response structure
+    Data->State = Context->GlobalState;
+    Data->Usage = (ULONG)(usage.Sum / count);
+    Data->Temperature = (ULONG)(temperature.Sum / count);
+    Data->PowerConsumption =
+        (Context->Power.Status.Domains[MAHF_POWER_DOMAIN_PACKAGE].PowerMilliwatts + 500) / 1000;
+    Data->CurrentFrequency = (ULONG)(frequency.Sum / count);
+    Data->Voltage = Context->Power.Voltage;
+}
+
+// Summarize Metric
+// Sum, sum of squares, min and max in a single pass. Four lanes at a time
+// with SSE2 on x64, where kernel code may use XMM registers without saving
+// state; x86 does not preserve them for the kernel, so it runs scalar like
+// the remainder and other architectures.
+// Values are below 2^31, so signed 32-bit compares are exact.
+VOID SummarizeMetric(const ULONG *Values, ULONG Count, PMETRIC_SUMMARY Summary)
+{
+    ULONG i = 0;
+    ULONG64 sum = 0;
+    ULONG64 sumSquares = 0;
+    ULONG minimum = MAXULONG;
+    ULONG maximum = 0;
+    
+#if defined(_M_AMD64)
+    if (Count >= 4) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i vmin = _mm_set1_epi32(MAXLONG);
+        __m128i vmax = _mm_setzero_si128();
+        __m128i vsum = _mm_setzero_si128();
+        __m128i vsquares = _mm_setzero_si128();
+        ULONG64 lanes64[2];
+        ULONG lanes32[4];
+        
+        for (; i + 4 <= Count; i += 4) {
+            __m128i v = _mm_load_si128((const __m128i*)&Values[i]);
+            __m128i odd = _mm_srli_epi64(v, 32);
+            __m128i mask;
+            
+            // 64-bit running sums of the four lanes
+            vsum = _mm_add_epi64(vsum, _mm_unpacklo_epi32(v, zero));
+            vsum = _mm_add_epi64(vsum, _mm_unpackhi_epi32(v, zero));
+            
+            // Squares of lanes 0/2, then 1/3
+            vsquares = _mm_add_epi64(vsquares, _mm_mul_epu32(v, v));
+            vsquares = _mm_add_epi64(vsquares, _mm_mul_epu32(odd, odd));
+            
+            // Branch-free min/max select
+            mask = _mm_cmplt_epi32(v, vmin);
+            vmin = _mm_or_si128(_mm_and_si128(mask, v), _mm_andnot_si128(mask, vmin));
+            mask = _mm_cmpgt_epi32(v, vmax);
+            vmax = _mm_or_si128(_mm_and_si128(mask, v), _mm_andnot_si128(mask, vmax));
+        }
+        
+        _mm_storeu_si128((__m128i*)lanes64, vsum);
+        sum = lanes64[0] + lanes64[1];
+        _mm_storeu_si128((__m128i*)lanes64, vsquares);
+        sumSquares = lanes64[0] + lanes64[1];
+        
+        _mm_storeu_si128((__m128i*)lanes32, vmin);
+        minimum = min(min(lanes32[0], lanes32[1]), min(lanes32[2], lanes32[3]));
+        _mm_storeu_si128((__m128i*)lanes32, vmax);
+        maximum = max(max(lanes32[0], lanes32[1]), max(lanes32[2], lanes32[3]));
+    }
+#endif
+    
+    for (; i < Count; i++) {
+        ULONG value = ReadNoFence((volatile LONG*)&Values[i]);
+        
+        sum += value;
+        sumSquares += (ULONG64)value * value;
+        minimum = min(minimum, value);
+        maximum = max(maximum, value);
+    }
+    
+    Summary->Sum = sum;
+    Summary->SumSquares = sumSquares;
+    Summary->Min = Count ? minimum : 0;
+    Summary->Max = maximum;
+}
+
+// Get Metric Summary
+NTSTATUS GetMetricSummary(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    PMAHF_METRIC_SUMMARY response = (PMAHF_METRIC_SUMMARY)OutputBuffer;
+    PCORE_METRICS metrics = &Context->Metrics;
+    ULONG count = Context->ProcessorCount;
+    METRIC_SUMMARY summaries[MAHF_METRIC_COUNT];
+    
+    if (!OutputBuffer || OutputLength < sizeof(MAHF_METRIC_SUMMARY)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    for (ULONG attempt = 0; attempt < STATE_READ_RETRIES; attempt++) {
+        LONG generation = ReadAcquire(&Context->StateGeneration);
+        
+        SummarizeMetric(metrics->Frequency, count, &summaries[MAHF_METRIC_FREQUENCY]);
+        SummarizeMetric(metrics->Temperature, count, &summaries[MAHF_METRIC_TEMPERATURE]);
+        SummarizeMetric(metrics->Utilization, count, &summaries[MAHF_METRIC_UTILIZATION]);
+        
+        KeMemoryBarrier();
+        
+        if (!(generation & 1) &&
+            ReadNoFence(&Context->StateGeneration) == generation) {
+            break;
+        }
+    }
+    
+    response->ProcessorCount = count;
+    response->Reserved = 0;
+    
+    for (ULONG i = 0; i < MAHF_METRIC_COUNT; i++) {
+        PMAHF_METRIC_STATS stats = &response->Metrics[i];
+        ULONG64 mean = summaries[i].Sum / count;
+        
+        stats->Sum = summaries[i].Sum;
+        stats->Min = summaries[i].Min;
+        stats->Max = summaries[i].Max;
+        stats->Mean = (ULONG)mean;
+        
+        // E[x^2] - E[x]^2, clamped against rounding
+        stats->Variance = (ULONG)(summaries[i].SumSquares / count > mean * mean ?
+                                  summaries[i].SumSquares / count - mean * mean : 0);
+    }
+    
+    *BytesReturned = sizeof(MAHF_METRIC_SUMMARY);
+    return STATUS_SUCCESS;
+}
+
+// Telemetry Timer Callback
+VOID OnTelemetryTimer(_In_ WDFTIMER Timer)
+{
+    WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+    
+    SampleTelemetry(GetDriverContext(device));
+}
+
+// Governor Timer Callback
+// One-shot, re-armed each period. If the control queue holds ControlLock
+// the tick is skipped rather than waited for, so stopping the timer from
+// the control path can never deadlock against it.
+VOID OnGovernorTimer(_In_ WDFTIMER Timer)
+{
+    WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+    PDRIVER_CONTEXT context = GetDriverContext(device);
+    PGOVERNOR governor = &context->Governor;
+    LONGLONG noWait = 0;
+    
+    if (!ReadAcquire(&governor->Running)) {
+        return;
+    }
+    
+    if (WdfWaitLockAcquire(context->ControlLock, &noWait) == STATUS_SUCCESS) {
+        RunGovernor(context);
+        WdfWaitLockRelease(context->ControlLock);
+    } else {
+        // Not under the lock, and a slow tick can overlap the next
+        InterlockedIncrement64((volatile LONG64*)&governor->Stats.SkippedTicks);
+    }
+    
+    if (ReadAcquire(&governor->Running)) {
+        WdfTimerStart(Timer, WDF_REL_TIMEOUT_IN_MS(governor->Config.PeriodMs));
+    }
+}
+
+// Start Governor
+VOID StartGovernor(PDRIVER_CONTEXT Context)
+{
+    if (!Context->Governor.Config.Enabled || !Context->GovernorTimer) {
+        return;
+    }
+    
+    if (InterlockedExchange(&Context->Governor.Running, TRUE) == FALSE) {
+        WdfTimerStart(Context->GovernorTimer,
+                      WDF_REL_TIMEOUT_IN_MS(Context->Governor.Config.PeriodMs));
+    }
+}
+
+// Stop Governor
+// The second stop catches a callback that re-armed itself while the first
+// one was waiting for it.
+VOID StopGovernor(PDRIVER_CONTEXT Context)
+{
+    if (!Context->GovernorTimer) {
+        return;
+    }
+    
+    InterlockedExchange(&Context->Governor.Running, FALSE);
+    WdfTimerStop(Context->GovernorTimer, TRUE);
+    WdfTimerStop(Context->GovernorTimer, TRUE);
+}
+
+// Validate Governor Configuration
+BOOLEAN ValidateGovernorConfig(PMAHF_GOVERNOR_CONFIG Config)
+{
+    return Config->PeriodMs >= MAHF_GOVERNOR_MIN_PERIOD_MS &&
+           Config->PeriodMs <= MAHF_GOVERNOR_MAX_PERIOD_MS &&
+           Config->UpThreshold <= 100 &&
+           Config->DownThreshold < Config->UpThreshold &&
+           Config->HysteresisSamples <= MAHF_GOVERNOR_MAX_HYSTERESIS &&
+           Config->RateLimitMs <= MAHF_GOVERNOR_MAX_RATE_LIMIT_MS;
+}
+
+// Set Governor
+// Control queue, ControlLock held.
+NTSTATUS SetGovernor(PDRIVER_CONTEXT Context, PMAHF_GOVERNOR_CONFIG Config)
+{
+    if (!ValidateGovernorConfig(Config)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    StopGovernor(Context);
+    
+    Context->Governor.Config = *Config;
+    Context->Governor.Config.Enabled = Config->Enabled ? TRUE : FALSE;
+    
+    // Decisions restart from a clean history
+    for (ULONG i = 0; i < MAX_CPU_CORES; i++) {
+        Context->Governor.Cores[i].Pressure = 0;
+    }
+    
+    StartGovernor(Context);
+    
+    DbgPrint("SetGovernor: %s, period %d ms, band %d-%d%%\n",
+             Config->Enabled ? "enabled" : "disabled", Config->PeriodMs,
+             Config->DownThreshold, Config->UpThreshold);
+    
+    return STATUS_SUCCESS;
+}
+
+// Get Governor
+NTSTATUS GetGovernor(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    PMAHF_GOVERNOR_STATUS response = (PMAHF_GOVERNOR_STATUS)OutputBuffer;
+    
+    if (!OutputBuffer || OutputLength < sizeof(MAHF_GOVERNOR_STATUS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    // Counters are only advanced by the governor; a snapshot taken while it
+    // runs may mix two ticks, which is fine for statistics
+    response->Config = Context->Governor.Config;
+    response->Stats = Context->Governor.Stats;
+    
+    *BytesReturned = sizeof(MAHF_GOVERNOR_STATUS);
+    return STATUS_SUCCESS;
+}
+
+// Run Governor
+// One governor period, ControlLock held. Measures utilization, decides a
+// ratio per processor, programs the changed ones in one broadcast and
+// publishes the result.
+VOID RunGovernor(PDRIVER_CONTEXT Context)
+{
+    PGOVERNOR governor = &Context->Governor;
+    PMAHF_GOVERNOR_CONFIG config = &governor->Config;
+    ULONG64 now = KeQueryInterruptTime();
+    ULONG64 rateLimit = (ULONG64)config->RateLimitMs * 10000;
+    ULONG midpoint = (config->UpThreshold + config->DownThreshold) / 2;
+    ULONG changed = 0;
+    ULONG64 totalUtilization = 0;
+    ULONG64 totalFrequency = 0;
+    
+    MeasureUtilization(Context);
+    
+    RtlZeroMemory(governor->Ratios, sizeof(governor->Ratios));
+    
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        PGOVERNOR_CORE core = &governor->Cores[i];
+        ULONG current = Context->TargetFrequency[i];
+        ULONG requested;
+        ULONG target;
+        ULONG floor;
+        ULONG ceiling;
+        
+        totalUtilization += core->Utilization;
+        totalFrequency += current;
+        
+        // Count consecutive periods outside the band
+        if (core->Utilization >= config->UpThreshold) {
+            core->Pressure = max(core->Pressure, 0) + 1;
+        } else if (core->Utilization <= config->DownThreshold) {
+            core->Pressure = min(core->Pressure, 0) - 1;
+        } else {
+            core->Pressure = 0;
+            continue;
+        }
+        
+        if ((ULONG)abs(core->Pressure) < config->HysteresisSamples) {
+            governor->Stats.HeldByHysteresis++;
+            continue;
+        }
+        
+        // Scale so the same work would land mid-band, on a 100 MHz ratio
+        requested = (ULONG)((ULONG64)current * core->Utilization / max(midpoint, 1));
+        requested = (requested + 50) / 100 * 100;
+        ProfileFrequencyRange(Context, i, &floor, &ceiling);
+        requested = max(min(requested, ceiling), floor);
+        target = min(requested, ProcessorFrequencyCap(Context, i));
+        
+        if (target == current) {
+            Context->RequestedFrequency[i] = requested;
+            continue;
+        }
+        
+        if (core->LastChange != 0 && now - core->LastChange < rateLimit) {
+            governor->Stats.HeldByRateLimit++;
+            continue;
+        }
+        
+        Context->RequestedFrequency[i] = requested;
+        governor->Ratios[i] = (UCHAR)(target / 100);
+        core->LastChange = now;
+        core->Pressure = 0;
+        changed++;
+        
+        if (target > current) {
+            governor->Stats.Raises++;
+        } else {
+            governor->Stats.Lowers++;
+        }
+    }
+    
+    if (changed != 0) {
+        ApplyFrequencyRatios(Context, governor->Ratios);
+    }
+    
+    // Without APERF/MPERF the telemetry cannot measure residency, so the
+    // governor's own measurement is published instead
+    if (!Context->ActivityCounters) {
+        for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+            UpdateCoreUtilization(Context, i, governor->Cores[i].Utilization);
+        }
+    }
+    
+    governor->Stats.Ticks++;
+    governor->Stats.LastTickTime = now;
+    governor->Stats.LastAverageUtilization = (ULONG)(totalUtilization / Context->ProcessorCount);
+    governor->Stats.LastAverageFrequency = (ULONG)(totalFrequency / Context->ProcessorCount);
+}
+
+// Measure Utilization
+// Busy share of each processor since the previous call, from the kernel's
+// per-processor idle/kernel/user times. The query reports the calling
+// thread's processor group, so the thread visits each group in turn.
+VOID MeasureUtilization(PDRIVER_CONTEXT Context)
+{
+    PGOVERNOR governor = &Context->Governor;
+    USHORT groupCount = KeQueryActiveGroupCount();
+    
+    for (USHORT group = 0; group < groupCount; group++) {
+        GROUP_AFFINITY affinity;
+        GROUP_AFFINITY previous;
+        ULONG groupProcessors = KeQueryActiveProcessorCountEx(group);
+        ULONG length = 0;
+        NTSTATUS status;
+        
+        RtlZeroMemory(&affinity, sizeof(affinity));
+        affinity.Group = group;
+        affinity.Mask = groupProcessors >= MAX_GROUP_PROCESSORS ?
+            (KAFFINITY)-1 : (((KAFFINITY)1 << groupProcessors) - 1);
+        
+        KeSetSystemGroupAffinityThread(&affinity, &previous);
+        status = ZwQuerySystemInformation(SystemProcessorPerformanceInformation,
+                                          governor->Times, sizeof(governor->Times), &length);
+        KeRevertToUserGroupAffinityThread(&previous);
+        
+        if (!NT_SUCCESS(status)) {
+            continue;
+        }
+        
+        for (ULONG n = 0; n < length / sizeof(SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION); n++) {
+            PSYSTEM_PROCESSOR_PERFORMANCE_INFORMATION times = &governor->Times[n];
+            PROCESSOR_NUMBER number;
+            PGOVERNOR_CORE core;
+            ULONG index;
+            ULONG64 total;
+            ULONG64 busy;
+            
+            number.Group = group;
+            number.Number = (UCHAR)n;
+            number.Reserved = 0;
+            
+            index = KeGetProcessorIndexFromNumber(&number);
+            if (index >= Context->ProcessorCount) {
+                continue;
+            }
+            
+            core = &governor->Cores[index];
+            total = (ULONG64)(times->KernelTime.QuadPart + times->UserTime.QuadPart);
+            busy = total - (ULONG64)times->IdleTime.QuadPart;
+            
+            if (total > core->LastTotal && busy >= core->LastBusy) {
+                core->Utilization = (ULONG)min((busy - core->LastBusy) * 100 /
+                                               (total - core->LastTotal), 100);
+            }
+            
+            core->LastTotal = total;
+            core->LastBusy = busy;
+        }
+    }
+}
+
+// Apply Frequency Ratios
+// Programs a per-processor ratio (0 leaves the processor alone) in one
+// broadcast and publishes the processors that took it. Callers hold
+// ControlLock. Returns the number of processors changed.
+ULONG ApplyFrequencyRatios(PDRIVER_CONTEXT Context, PUCHAR Ratios)
+{
+    PERF_CTL_BROADCAST broadcast;
+    ULONG applied = 0;
+    ULONG requested = 0;
+    ULONG64 start = StatTimestamp();
+    PCPU_STATS stats;
+    
+    RtlZeroMemory(&broadcast, sizeof(broadcast));
+    broadcast.Context = Context;
+    broadcast.ProcessorCount = Context->ProcessorCount;
+    broadcast.Ratios = Ratios;
+    
+    InterlockedIncrement(&Context->StateGeneration);
+    
+    if (Context->Architecture == ARCH_INTEL || Context->Architecture == ARCH_AMD) {
+        KeIpiGenericCall(ProgramPerfCtlIpi, (ULONG_PTR)&broadcast);
+    } else {
+        for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+            broadcast.SuccessMask[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+    
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        if (Ratios[i] == 0) {
+            continue;
+        }
+        
+        requested++;
+        if (broadcast.SuccessMask[i / 64] & (1ULL << (i % 64))) {
+            UpdateCoreFrequency(Context, (UCHAR)i, Ratios[i] * 100, Context->GlobalState);
+            applied++;
+        }
+    }
+    
+    InterlockedIncrement(&Context->StateGeneration);
+    
+    stats = CpuStats(KeGetCurrentProcessorNumberEx(NULL));
+    if (stats) {
+        RecordLatency(&stats->Retarget, start,
+                      applied < requested ? STATUS_UNSUCCESSFUL : STATUS_SUCCESS);
+    }
+    
+    MAHF_TRACE(RETARGET, applied, requested, 0, 0);
+    
+    return applied;
+}
+
+// Initialize Thermal
+// The loop runs only where CPUID leaf 6 reports digital sensors and the
+// core register reads back valid. TjMax comes from TEMPERATURE_TARGET,
+// less any TCC activation offset the firmware configured.
+VOID InitializeThermal(PDRIVER_CONTEXT Context)
+{
+    PTHERMAL thermal = &Context->Thermal;
+    ULONG32 regs[4] = {0};
+    ULONG64 msrValue = 0;
+    
+    thermal->Cap = Context->MaxFrequency;
+    thermal->TjMax = THERMAL_DEFAULT_TJMAX;
+    thermal->Available = FALSE;
+    
+    RtlZeroMemory(&thermal->Status, sizeof(thermal->Status));
+    thermal->Status.PeriodMs = thermal->PeriodMs;
+    thermal->Status.FrequencyCap = thermal->Cap;
+    
+    if (Context->Architecture != ARCH_INTEL ||
+        !NT_SUCCESS(CachedCPUID(Context, 6, 0, regs)) || !(regs[0] & 1)) {
+        DbgPrint("InitializeThermal: No digital thermal sensors, loop disabled\n");
+        return;
+    }
+    
+    if (NT_SUCCESS(ReadMSR(MSR_TEMPERATURE_TARGET, &msrValue))) {
+        ULONG target = (ULONG)((msrValue >> 16) & 0xFF);
+        ULONG offset = (ULONG)((msrValue >> 24) & 0x3F);
+        
+        if (target > offset && target - offset >= MAHF_THERMAL_LIMIT_MIN) {
+            thermal->TjMax = target - offset;
+        }
+    }
+    
+    if (!NT_SUCCESS(ReadMSR(MSR_THERM_STATUS, &msrValue)) || !(msrValue & THERM_STATUS_VALID)) {
+        DbgPrint("InitializeThermal: THERM_STATUS unreadable, loop disabled\n");
+        return;
+    }
+    
+    thermal->Available = TRUE;
+    thermal->Status.Flags = MAHF_THERMAL_FLAG_SENSORS;
+    thermal->Status.TjMax = thermal->TjMax;
+    
+    DbgPrint("InitializeThermal: TjMax %d C, period %d ms\n", thermal->TjMax, thermal->PeriodMs);
+}
+
+// Thermal Timer Callback
+// Skips the period rather than wait while the control queue holds
+// ControlLock, like the governor.
+VOID OnThermalTimer(_In_ WDFTIMER Timer)
+{
+    WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+    PDRIVER_CONTEXT context = GetDriverContext(device);
+    LONGLONG noWait = 0;
+    
+    if (WdfWaitLockAcquire(context->ControlLock, &noWait) == STATUS_SUCCESS) {
+        RunThermal(context);
+        WdfWaitLockRelease(context->ControlLock);
+    } else {
+        InterlockedIncrement64((volatile LONG64*)&context->Thermal.Status.SkippedTicks);
+    }
+}
+
+// Sample Thermal Sensors
+// Runs at IPI_LEVEL on every processor; each reads its own core sensor,
+// and the package sensor if it is its package's lead. Reads bypass the
+// MSR cache, which may answer with a value up to MsrStalenessUs old: the
+// controller's derivative and integral assume one fresh sample per period.
+ULONG_PTR SampleThermalIpi(ULONG_PTR Argument)
+{
+    PDRIVER_CONTEXT context = (PDRIVER_CONTEXT)Argument;
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    ULONG tjMax = context->Thermal.TjMax;
+    PTHERMAL_SAMPLE sample;
+    ULONG64 msrValue;
+    ULONG readout;
+    
+    if (processor >= context->ProcessorCount) {
+        return 0;
+    }
+    
+    sample = &context->Thermal.Samples[processor];
+    sample->Temperature = 0;
+    sample->PackageTemperature = 0;
+    sample->Prochot = FALSE;
+    
+    if (NT_SUCCESS(ReadMSR(MSR_THERM_STATUS, &msrValue)) && (msrValue & THERM_STATUS_VALID)) {
+        readout = (ULONG)(msrValue >> THERM_STATUS_READOUT_SHIFT) & THERM_STATUS_READOUT_MASK;
+        sample->Temperature = readout < tjMax ? tjMax - readout : 1;
+        sample->Prochot = (msrValue & THERM_STATUS_PROCHOT) != 0;
+    }
+    
+    if (context->PackageLead[processor] &&
+        NT_SUCCESS(ReadMSR(MSR_PACKAGE_THERM_STATUS, &msrValue))) {
+        readout = (ULONG)(msrValue >> THERM_STATUS_READOUT_SHIFT) & THERM_STATUS_READOUT_MASK;
+        sample->PackageTemperature = readout < tjMax ? tjMax - readout : 1;
+        sample->Prochot |= (msrValue & THERM_STATUS_PROCHOT) != 0;
+    }
+    
+    return 0;
+}
+
+// Run Thermal
+// One control period, ControlLock held. The controller output is an offset
+// below MaxFrequency:
+//   P = Kp * e,  I += Ki * e * dt,  D = -Kd * dT/dt,  e = setpoint - T
+// where T is the hottest sensor. D acts on the measurement so a changed
+// limit does not kick the cap. I is kept within [-(range), 0] so it cannot
+// wind up while the part runs cool, or push the cap below the minimum.
+VOID RunThermal(PDRIVER_CONTEXT Context)
+{
+    PTHERMAL thermal = &Context->Thermal;
+    PMAHF_THERMAL_STATUS status = &thermal->Status;
+    ULONG minFrequency = (Context->BaseFrequency * 4 / 10 + 99) / 100 * 100;
+    LONG64 rangeKhz = ((LONG64)Context->MaxFrequency - minFrequency) * 1000;
+    ULONG hottest = 0;
+    ULONG hottestProcessor = 0;
+    ULONG package = 0;
+    BOOLEAN prochot = FALSE;
+    ULONG setpoint;
+    LONG error;
+    LONG64 proportional;
+    LONG64 derivative = 0;
+    LONG64 output;
+    ULONG cap;
+    ULONG flags;
+    
+    KeIpiGenericCall(SampleThermalIpi, (ULONG_PTR)Context);
+    
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        PTHERMAL_SAMPLE sample = &thermal->Samples[i];
+        
+        if (sample->Temperature != 0) {
+            UpdateCoreTemperature(Context, i, sample->Temperature);
+            
+            if (sample->Temperature > hottest) {
+                hottest = sample->Temperature;
+                hottestProcessor = i;
+            }
+        }
+        
+        package = max(package, sample->PackageTemperature);
+        
+        if (sample->Prochot) {
+            prochot = TRUE;
+            status->ProchotSamples++;
+        }
+    }
+    
+    if (hottest == 0 && package == 0) {
+        return;
+    }
+    
+    hottest = max(hottest, package);
+    setpoint = min(Context->GlobalThermalLimit, thermal->TjMax - thermal->Margin);
+    error = (LONG)setpoint - (LONG)hottest;
+    
+    proportional = (LONG64)thermal->Kp * error * 1000;
+    
+    thermal->Integral += (LONG64)thermal->Ki * error * thermal->PeriodMs;
+    thermal->Integral = max(min(thermal->Integral, 0), -rangeKhz);
+    
+    if (thermal->Primed) {
+        derivative = -(LONG64)thermal->Kd * ((LONG)hottest - thermal->LastTemperature) *
+                     1000000 / thermal->PeriodMs;
+    }
+    
+    thermal->LastTemperature = (LONG)hottest;
+    thermal->Primed = TRUE;
+    
+    output = (LONG64)Context->MaxFrequency * 1000 + proportional + thermal->Integral + derivative;
+    output = max(min(output, (LONG64)Context->MaxFrequency * 1000), (LONG64)minFrequency * 1000);
+    
+    // Whole ratios only; round down so the cap errs cool
+    cap = max((ULONG)(output / 1000) / 100 * 100, minFrequency);
+    
+    if (cap != thermal->Cap) {
+        MAHF_TRACE(THERMAL_CAP, hottest, setpoint, thermal->Cap, cap);
+        
+        thermal->Cap = cap;
+        status->CapChanges++;
+    }
+    
+    // Re-applied every period: a governor decision or fixed state made
+    // since the last one may also need clamping or restoring
+    EnforceFrequencyCap(Context);
+    
+    flags = MAHF_THERMAL_FLAG_SENSORS |
+            (cap < Context->MaxFrequency ? MAHF_THERMAL_FLAG_CAPPED : 0) |
+            (prochot ? MAHF_THERMAL_FLAG_PROCHOT : 0);
+    
+    if ((flags ^ status->Flags) & MAHF_THERMAL_FLAG_CAPPED) {
+        PostNotification(Context, MAHF_NOTIFY_THROTTLE, cap, MAHF_NOTIFY_THROTTLE_THERMAL);
+    }
+    if (flags & ~status->Flags & MAHF_THERMAL_FLAG_PROCHOT) {
+        PostNotification(Context, MAHF_NOTIFY_THROTTLE, hottest, MAHF_NOTIFY_THROTTLE_PROCHOT);
+    }
+    
+    status->Flags = flags;
+    status->Setpoint = setpoint;
+    status->HottestTemperature = hottest;
+    status->HottestProcessor = hottestProcessor;
+    status->PackageTemperature = package;
+    status->FrequencyCap = cap;
+    status->ProportionalTerm = (LONG)(proportional / 1000);
+    status->IntegralTerm = (LONG)(thermal->Integral / 1000);
+    status->DerivativeTerm = (LONG)(derivative / 1000);
+    status->Ticks++;
+}
+
+// Processor Frequency Cap
+// The tighter of the thermal cap and the power cap of the processor's package.
+ULONG ProcessorFrequencyCap(PDRIVER_CONTEXT Context, ULONG Processor)
+{
+    return min(Context->Thermal.Cap,
+               Context->Power.Packages[Context->PackageIndex[Processor]].Cap);
+}
+
+// Enforce Frequency Cap
+// Moves every processor to its requested frequency clamped to its cap,
+// touching only the ones that are not there already. ControlLock held.
+VOID EnforceFrequencyCap(PDRIVER_CONTEXT Context)
+{
+    ULONG changed = 0;
+    
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        ULONG target = min(Context->RequestedFrequency[i], ProcessorFrequencyCap(Context, i));
+        
+        Context->CapRatios[i] = 0;
+        
+        if (target != Context->TargetFrequency[i]) {
+            Context->CapRatios[i] = (UCHAR)(target / 100);
+            changed++;
+        }
+    }
+    
+    if (changed != 0) {
+        ApplyFrequencyRatios(Context, Context->CapRatios);
+    }
+}
+
+// Get Thermal
+NTSTATUS GetThermal(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    if (!OutputBuffer || OutputLength < sizeof(MAHF_THERMAL_STATUS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    // Advanced by the thermal timer only; a copy may straddle a period
+    RtlCopyMemory(OutputBuffer, &Context->Thermal.Status, sizeof(MAHF_THERMAL_STATUS));
+    
+    *BytesReturned = sizeof(MAHF_THERMAL_STATUS);
+    return STATUS_SUCCESS;
+}
+
+// Initialize Power
+// Metering runs where the RAPL unit register and at least the package
+// counter read back; the cores and DRAM domains are optional. The backend
+// reports registers a part lacks as failed reads.
+VOID InitializePower(PDRIVER_CONTEXT Context)
+{
+    PPOWER power = &Context->Power;
+    ULONG unitRegister = 0;
+    ULONG64 msrValue = 0;
+    
+    power->Available = FALSE;
+    
+    for (ULONG i = 0; i < MAX_CPU_CORES; i++) {
+        power->Packages[i].Cap = Context->MaxFrequency;
+    }
+    
+    RtlZeroMemory(&power->Status, sizeof(power->Status));
+    power->Status.PowerLimit = Context->GlobalPowerLimit;
+    power->Status.PeriodMs = power->PeriodMs;
+    power->Status.FrequencyCap = Context->MaxFrequency;
+    
+    if (Context->Architecture == ARCH_INTEL) {
+        unitRegister = MSR_RAPL_POWER_UNIT;
+        power->DomainRegister[MAHF_POWER_DOMAIN_PACKAGE] = MSR_PKG_ENERGY_STATUS;
+        power->DomainRegister[MAHF_POWER_DOMAIN_CORES] = MSR_PP0_ENERGY_STATUS;
+        power->DomainRegister[MAHF_POWER_DOMAIN_DRAM] = MSR_DRAM_ENERGY_STATUS;
+    } else if (Context->Architecture == ARCH_AMD) {
+        unitRegister = MSR_AMD_RAPL_POWER_UNIT;
+        power->DomainRegister[MAHF_POWER_DOMAIN_PACKAGE] = MSR_AMD_PKG_ENERGY_STATUS;
+        power->DomainRegister[MAHF_POWER_DOMAIN_CORES] = MSR_AMD_CORE_ENERGY_STATUS;
+        power->PerCoreEnergy = TRUE;
+    }
+    
+    if (unitRegister == 0 || !NT_SUCCESS(ReadMSR(unitRegister, &msrValue))) {
+        DbgPrint("InitializePower: No RAPL, energy metering disabled\n");
+        RtlZeroMemory(power->DomainRegister, sizeof(power->DomainRegister));
+        return;
+    }
+    
+    power->EnergyShift = (ULONG)(msrValue >> RAPL_ENERGY_UNIT_SHIFT) & RAPL_ENERGY_UNIT_MASK;
+    
+    for (ULONG d = 0; d < MAHF_POWER_DOMAIN_COUNT; d++) {
+        if (power->DomainRegister[d] != 0 &&
+            !NT_SUCCESS(ReadMSR(power->DomainRegister[d], &msrValue))) {
+            power->DomainRegister[d] = 0;
+        }
+        
+        power->Status.Domains[d].Supported = power->DomainRegister[d] != 0;
+    }
+    
+    if (power->DomainRegister[MAHF_POWER_DOMAIN_PACKAGE] == 0) {
+        DbgPrint("InitializePower: Package energy unreadable, metering disabled\n");
+        return;
+    }
+    
+    power->Available = TRUE;
+    power->Status.Flags = MAHF_ENERGY_FLAG_METERING |
+                          (Context->Architecture == ARCH_INTEL ? MAHF_ENERGY_FLAG_VOLTAGE : 0);
+    
+    DbgPrint("InitializePower: Energy unit 2^-%d J, limit %d W per package\n",
+             power->EnergyShift, Context->GlobalPowerLimit);
+}
+
+// Power Timer Callback
+VOID OnPowerTimer(_In_ WDFTIMER Timer)
+{
+    WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+    PDRIVER_CONTEXT context = GetDriverContext(device);
+    LONGLONG noWait = 0;
+    
+    if (WdfWaitLockAcquire(context->ControlLock, &noWait) == STATUS_SUCCESS) {
+        RunPower(context);
+        WdfWaitLockRelease(context->ControlLock);
+    } else {
+        InterlockedIncrement64((volatile LONG64*)&context->Power.Status.SkippedTicks);
+    }
+}
+
+// Sample Energy Counters
+// Runs at IPI_LEVEL on every processor. Package leads read the package-wide
+// counters; on AMD each core's first thread also reads its core counter.
+// Intel processors read their own PERF_STATUS voltage.
+ULONG_PTR SampleEnergyIpi(ULONG_PTR Argument)
+{
+    PDRIVER_CONTEXT context = (PDRIVER_CONTEXT)Argument;
+    PPOWER power = &context->Power;
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PENERGY_SAMPLE sample;
+    ULONG64 msrValue;
+    
+    if (processor >= context->ProcessorCount) {
+        return 0;
+    }
+    
+    sample = &power->Samples[processor];
+    sample->Valid = 0;
+    sample->Voltage = 0;
+    
+    for (ULONG d = 0; d < MAHF_POWER_DOMAIN_COUNT; d++) {
+        BOOLEAN reader = context->PackageLead[processor];
+        
+        if (d == MAHF_POWER_DOMAIN_CORES && power->PerCoreEnergy) {
+            reader = context->Topology[processor].SmtId == 0;
+        }
+        
+        if (reader && power->DomainRegister[d] != 0 &&
+            NT_SUCCESS(ReadMSR(power->DomainRegister[d], &msrValue))) {
+            sample->Counter[d] = (ULONG)msrValue;
+            sample->Valid |= 1 << d;
+        }
+    }
+    
+    if (context->Architecture == ARCH_INTEL && NT_SUCCESS(ReadMSR(MSR_PERF_STATUS, &msrValue))) {
+        sample->Voltage = (ULONG)((((msrValue >> PERF_STATUS_VOLTAGE_SHIFT) &
+                                    PERF_STATUS_VOLTAGE_MASK) * 1000) >> 13);
+    }
+    
+    return 0;
+}
+
+// Energy To Microjoules
+// Split so that whole joules and the fraction are each scaled without
+// overflowing 64 bits.
+ULONG64 EnergyToMicrojoules(PDRIVER_CONTEXT Context, ULONG64 Energy)
+{
+    ULONG shift = Context->Power.EnergyShift;
+    
+    return (Energy >> shift) * 1000000 +
+           (((Energy & ((1ULL << shift) - 1)) * 1000000) >> shift);
+}
+
+// Run Power
+// One metering period, ControlLock held. Counters are folded into 64-bit
+// totals: unsigned 32-bit subtraction is exact across a single wrap, and a
+// period is far shorter than the minutes a counter takes to wrap. Each
+// package's power over the period then drives a PI loop on its cap:
+//   P = Kp * e,  I += Ki * e * dt,  e = limit - power
+// with I bounded like the thermal loop's.
+VOID RunPower(PDRIVER_CONTEXT Context)
+{
+    PPOWER power = &Context->Power;
+    PMAHF_ENERGY_STATUS status = &power->Status;
+    ULONG64 now = KeQueryInterruptTime();
+    ULONG64 elapsed = now - power->LastTime;
+    ULONG minFrequency = (Context->BaseFrequency * 4 / 10 + 99) / 100 * 100;
+    LONG64 rangeKhz = ((LONG64)Context->MaxFrequency - minFrequency) * 1000;
+    ULONG windowSamples = min(max(power->WindowMs / power->PeriodMs, 1), POWER_WINDOW_SAMPLES - 1);
+    ULONG lowestCap = Context->MaxFrequency;
+    ULONG voltage = 0;
+    PPOWER_WINDOW_ENTRY entry;
+    PPOWER_WINDOW_ENTRY oldest;
+    ULONG64 span;
+    
+    KeIpiGenericCall(SampleEnergyIpi, (ULONG_PTR)Context);
+    
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        PENERGY_SAMPLE sample = &power->Samples[i];
+        PPOWER_PACKAGE package = &power->Packages[Context->PackageIndex[i]];
+        
+        voltage = max(voltage, sample->Voltage);
+        
+        for (ULONG d = 0; d < MAHF_POWER_DOMAIN_COUNT; d++) {
+            if (!(sample->Valid & (1 << d))) {
+                continue;
+            }
+            
+            if (power->Primed[i] & (1 << d)) {
+                package->Energy[d] += (ULONG)(sample->Counter[d] - power->LastCounter[i][d]);
+            }
+            
+            power->LastCounter[i][d] = sample->Counter[d];
+            power->Primed[i] |= (UCHAR)(1 << d);
+        }
+    }
+    
+    WriteNoFence((volatile LONG*)&power->Voltage, (LONG)voltage);
+    
+    // Append to the window ring and average against the entry one window back
+    entry = &power->Window[power->WindowCount % POWER_WINDOW_SAMPLES];
+    entry->Time = now;
+    
+    for (ULONG d = 0; d < MAHF_POWER_DOMAIN_COUNT; d++) {
+        entry->Energy[d] = 0;
+        
+        for (ULONG p = 0; p < Context->PackageCount; p++) {
+            entry->Energy[d] += power->Packages[p].Energy[d];
+        }
+        
+        status->Domains[d].EnergyMicrojoules = EnergyToMicrojoules(Context, entry->Energy[d]);
+    }
+    
+    span = min(power->WindowCount, windowSamples);
+    power->WindowCount++;
+    
+    if (span > 0) {
+        oldest = &power->Window[(power->WindowCount - 1 - span) % POWER_WINDOW_SAMPLES];
+        
+        if (entry->Time > oldest->Time) {
+            ULONG64 duration = entry->Time - oldest->Time;
+            
+            // uJ over 100 ns units: uJ * 10^4 / t is mW
+            for (ULONG d = 0; d < MAHF_POWER_DOMAIN_COUNT; d++) {
+                status->Domains[d].PowerMilliwatts = (ULONG)(EnergyToMicrojoules(
+                    Context, entry->Energy[d] - oldest->Energy[d]) * 10000 / duration);
+            }
+            
+            status->WindowMs = (ULONG)(duration / 10000);
+        }
+    }
+    
+    // Per-package limit loop, on the latest period only so it reacts at
+    // the loop's own rate rather than the reporting window's
+    if (power->LastTime != 0 && elapsed > 0) {
+        LONG64 limit = (LONG64)Context->GlobalPowerLimit * 1000;
+        
+        for (ULONG p = 0; p < Context->PackageCount; p++) {
+            PPOWER_PACKAGE package = &power->Packages[p];
+            ULONG64 energy = package->Energy[MAHF_POWER_DOMAIN_PACKAGE];
+            LONG64 milliwatts = (LONG64)(EnergyToMicrojoules(Context, energy - package->LastEnergy) *
+                                         10000 / elapsed);
+            LONG64 error = limit - milliwatts;
+            LONG64 output;
+            ULONG cap;
+            
+            package->LastEnergy = energy;
+            
+            // Gains are MHz per W (per second for Ki); times mW they give kHz
+            package->Integral += (LONG64)power->Ki * error * (LONG64)(elapsed / 10000) / 1000;
+            package->Integral = max(min(package->Integral, 0), -rangeKhz);
+            
+            output = (LONG64)Context->MaxFrequency * 1000 + (LONG64)power->Kp * error +
+                     package->Integral;
+            output = max(min(output, (LONG64)Context->MaxFrequency * 1000),
+                         (LONG64)minFrequency * 1000);
+            
+            cap = max((ULONG)(output / 1000) / 100 * 100, minFrequency);
+            
+            if (cap != package->Cap) {
+                MAHF_TRACE(POWER_CAP, p, milliwatts, package->Cap, cap);
+                
+                package->Cap = cap;
+                status->CapChanges++;
+            }
+            
+            lowestCap = min(lowestCap, cap);
+        }
+    } else {
+        for (ULONG p = 0; p < Context->PackageCount; p++) {
+            power->Packages[p].LastEnergy = power->Packages[p].Energy[MAHF_POWER_DOMAIN_PACKAGE];
+        }
+    }
+    
+    power->LastTime = now;
+    
+    EnforceFrequencyCap(Context);
+    
+    if (((status->Flags & MAHF_ENERGY_FLAG_CAPPED) != 0) != (lowestCap < Context->MaxFrequency)) {
+        PostNotification(Context, MAHF_NOTIFY_THROTTLE, lowestCap, MAHF_NOTIFY_THROTTLE_POWER);
+    }
+    
+    status->Flags = (status->Flags & ~MAHF_ENERGY_FLAG_CAPPED) |
+                    (lowestCap < Context->MaxFrequency ? MAHF_ENERGY_FLAG_CAPPED : 0);
+    status->PowerLimit = Context->GlobalPowerLimit;
+    status->FrequencyCap = lowestCap;
+    status->Voltage = voltage;
+    status->Ticks++;
+}
+
+// Get Energy
+NTSTATUS GetEnergy(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    if (!OutputBuffer || OutputLength < sizeof(MAHF_ENERGY_STATUS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    // Advanced by the power timer only; a copy may straddle a period
+    RtlCopyMemory(OutputBuffer, &Context->Power.Status, sizeof(MAHF_ENERGY_STATUS));
+    
+    *BytesReturned = sizeof(MAHF_ENERGY_STATUS);
+    return STATUS_SUCCESS;
+}
+
+// Profile Name Length
+// In WCHARs; MAHF_PROFILE_NAME_LENGTH if the name is not terminated.
+ULONG ProfileNameLength(PCWSTR Name)
+{
+    ULONG length = 0;
+    
+    while (length < MAHF_PROFILE_NAME_LENGTH && Name[length] != L'\0') {
+        length++;
+    }
+    
+    return length;
+}
+
+// Validate Profile
+BOOLEAN ValidateProfile(PMAHF_PROFILE Profile)
+{
+    ULONG length = ProfileNameLength(Profile->Name);
+    
+    if (length == 0 || length >= MAHF_PROFILE_NAME_LENGTH) {
+        return FALSE;
+    }
+    
+    for (ULONG t = 0; t < MAHF_CORE_TYPE_COUNT; t++) {
+        PMAHF_FREQUENCY_RANGE range = &Profile->Frequency[t];
+        
+        if (range->MaxFrequency != 0 && range->MinFrequency > range->MaxFrequency) {
+            return FALSE;
+        }
+    }
+    
+    return Profile->EnergyPerformanceBias <= MAHF_ENERGY_BIAS_MAX &&
+           (Profile->ThermalLimit == 0 ||
+            (Profile->ThermalLimit >= MAHF_THERMAL_LIMIT_MIN &&
+             Profile->ThermalLimit <= MAHF_THERMAL_LIMIT_MAX)) &&
+           (Profile->PowerLimit == 0 ||
+            (Profile->PowerLimit >= MAHF_POWER_LIMIT_MIN &&
+             Profile->PowerLimit <= MAHF_POWER_LIMIT_MAX));
+}
+
+// Find Profile
+// Exact match on a terminated name; NULL if there is none.
+PMAHF_PROFILE FindProfile(PDRIVER_CONTEXT Context, PCWSTR Name)
+{
+    ULONG length = ProfileNameLength(Name);
+    SIZE_T bytes = (SIZE_T)length * sizeof(WCHAR);
+    
+    if (length == 0 || length >= MAHF_PROFILE_NAME_LENGTH) {
+        return NULL;
+    }
+    
+    for (ULONG s = 0; s < MAHF_MAX_PROFILES; s++) {
+        PMAHF_PROFILE profile = &Context->Profiles[s];
+        
+        if (ProfileNameLength(profile->Name) == length &&
+            RtlCompareMemory(profile->Name, Name, bytes) == bytes) {
+            return profile;
+        }
+    }
+    
+    return NULL;
+}
+
+// Set Profile
+// Control queue, ControlLock held. Replaces the profile of the same name or
+// takes a free slot; an active profile that is replaced is reapplied.
+NTSTATUS SetProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE Profile)
+{
+    PMAHF_PROFILE slot;
+    
+    if (!ValidateProfile(Profile)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    slot = FindProfile(Context, Profile->Name);
+    
+    for (ULONG s = 0; !slot && s < MAHF_MAX_PROFILES; s++) {
+        if (Context->Profiles[s].Name[0] == L'\0') {
+            slot = &Context->Profiles[s];
+        }
+    }
+    
+    if (!slot) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    InterlockedIncrement(&Context->StateGeneration);
+    RtlCopyMemory(slot, Profile, sizeof(MAHF_PROFILE));
+    InterlockedIncrement(&Context->StateGeneration);
+    
+    if (slot == Context->ActiveProfile) {
+        ActivateProfile(Context, slot);
+        ProgramProfile(Context);
+    }
+    
+    SaveProfiles(Context);
+    
+    DbgPrint("SetProfile: %ws, bias %d, turbo %d\n",
+             slot->Name, slot->EnergyPerformanceBias, slot->TurboEnabled);
+    
+    return STATUS_SUCCESS;
+}
+
+// Select Profile
+// Control queue, ControlLock held. An empty name deselects.
+NTSTATUS SelectProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE_NAME Name)
+{
+    PMAHF_PROFILE profile = NULL;
+    ULONG length = ProfileNameLength(Name->Name);
+    
+    if (length >= MAHF_PROFILE_NAME_LENGTH) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (length != 0) {
+        profile = FindProfile(Context, Name->Name);
+        if (!profile) {
+            return STATUS_NOT_FOUND;
+        }
+    }
+    
+    ActivateProfile(Context, profile);
+    ProgramProfile(Context);
+    SaveProfiles(Context);
+    
+    DbgPrint("SelectProfile: %ws\n", profile ? profile->Name : L"(none)");
+    
+    PostNotification(Context, MAHF_NOTIFY_STATE, Context->GlobalState, profile != NULL);
+    
+    return STATUS_SUCCESS;
+}
+
+// Delete Profile
+// Control queue, ControlLock held. Deleting the active profile deselects it;
+// processors stay where they are until the next state or profile change.
+NTSTATUS DeleteProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE_NAME Name)
+{
+    PMAHF_PROFILE profile = FindProfile(Context, Name->Name);
+    
+    if (!profile) {
+        return STATUS_NOT_FOUND;
+    }
+    
+    if (profile == Context->ActiveProfile) {
+        ActivateProfile(Context, NULL);
+        PostNotification(Context, MAHF_NOTIFY_STATE, Context->GlobalState, FALSE);
+    }
+    
+    InterlockedIncrement(&Context->StateGeneration);
+    RtlZeroMemory(profile, sizeof(MAHF_PROFILE));
+    InterlockedIncrement(&Context->StateGeneration);
+    
+    SaveProfiles(Context);
+    
+    return STATUS_SUCCESS;
+}
+
+// Get Profiles
+// Runs on the read queue; retries around profile changes like the other
+// aggregating readers.
+NTSTATUS GetProfiles(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    PMAHF_PROFILE_LIST list = (PMAHF_PROFILE_LIST)OutputBuffer;
+    
+    if (!OutputBuffer || OutputLength < sizeof(MAHF_PROFILE_LIST)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    for (ULONG attempt = 0; attempt < STATE_READ_RETRIES; attempt++) {
+        LONG generation = ReadAcquire(&Context->StateGeneration);
+        PMAHF_PROFILE active = (PMAHF_PROFILE)ReadPointerAcquire((PVOID volatile *)&Context->ActiveProfile);
+        
+        RtlZeroMemory(list, sizeof(MAHF_PROFILE_LIST));
+        list->ActiveIndex = MAHF_PROFILE_NONE;
+        
+        for (ULONG s = 0; s < MAHF_MAX_PROFILES; s++) {
+            if (Context->Profiles[s].Name[0] == L'\0') {
+                continue;
+            }
+            
+            if (&Context->Profiles[s] == active) {
+                list->ActiveIndex = list->ProfileCount;
+            }
+            
+            RtlCopyMemory(&list->Profiles[list->ProfileCount++], &Context->Profiles[s],
+                          sizeof(MAHF_PROFILE));
+        }
+        
+        KeMemoryBarrier();
+        
+        if (!(generation & 1) &&
+            ReadNoFence(&Context->StateGeneration) == generation) {
+            break;
+        }
+    }
+    
+    *BytesReturned = sizeof(MAHF_PROFILE_LIST);
+    return STATUS_SUCCESS;
+}
+
+// Activate Profile
+// Makes Profile (or none) the active one and takes over its limits and
+// turbo allowance. Each processor is asked for its type's ceiling; the
+// governor, when enabled, works down from there within the range. Nothing
+// is programmed here; see ProgramProfile. ControlLock held.
+VOID ActivateProfile(PDRIVER_CONTEXT Context, PMAHF_PROFILE Profile)
+{
+    ULONG floor;
+    ULONG ceiling;
+    
+    InterlockedExchangePointer((PVOID volatile *)&Context->ActiveProfile, Profile);
+    
+    if (!Profile) {
+        Context->TurboBoostEnabled = TRUE;
+        return;
+    }
+    
+    Context->TurboBoostEnabled = Profile->TurboEnabled ? TRUE : FALSE;
+    
+    if (Profile->ThermalLimit != 0) {
+        InterlockedExchange((volatile LONG*)&Context->GlobalThermalLimit, Profile->ThermalLimit);
+    }
+    
+    if (Profile->PowerLimit != 0) {
+        InterlockedExchange((volatile LONG*)&Context->GlobalPowerLimit, Profile->PowerLimit);
+    }
+    
+    for (ULONG i = 0; i < Context->ProcessorCount; i++) {
+        ProfileFrequencyRange(Context, i, &floor, &ceiling);
+        Context->RequestedFrequency[i] = ceiling;
+    }
+}
+
+// Program Profile
+// Writes the active profile's energy bias on every processor and moves each
+// one to its request, clamped to the caps. ControlLock held.
+VOID ProgramProfile(PDRIVER_CONTEXT Context)
+{
+    PMAHF_PROFILE profile = Context->ActiveProfile;
+    ENERGY_BIAS_BROADCAST broadcast;
+    
+    if (!profile) {
+        return;
+    }
+    
+    if (Context->EnergyBias) {
+        RtlZeroMemory(&broadcast, sizeof(broadcast));
+        broadcast.ProcessorCount = Context->ProcessorCount;
+        broadcast.Bias = profile->EnergyPerformanceBias;
+        
+        KeIpiGenericCall(WriteEnergyBiasIpi, (ULONG_PTR)&broadcast);
+        
+        if (broadcast.FailedCount != 0) {
+            DbgPrint("ProgramProfile: energy bias rejected by %d processors\n",
+                     broadcast.FailedCount);
+        }
+    }
+    
+    EnforceFrequencyCap(Context);
+}
+
+// Write ENERGY_PERF_BIAS
+// Runs at IPI_LEVEL on every processor simultaneously.
+ULONG_PTR WriteEnergyBiasIpi(ULONG_PTR Argument)
+{
+    PENERGY_BIAS_BROADCAST broadcast = (PENERGY_BIAS_BROADCAST)Argument;
+    ULONG64 msrValue;
+    
+    if (KeGetCurrentProcessorNumberEx(NULL) >= broadcast->ProcessorCount) {
+        return 0;
+    }
+    
+    if (!NT_SUCCESS(ReadMSR(MSR_ENERGY_PERF_BIAS, &msrValue)) ||
+        !NT_SUCCESS(WriteMSR(MSR_ENERGY_PERF_BIAS,
+                             (msrValue & ~ENERGY_BIAS_MASK) | broadcast->Bias))) {
+        InterlockedIncrement(&broadcast->FailedCount);
+    }
+    
+    return 0;
+}
+
+// Profile Frequency Range
+// Floor and ceiling of a processor under the active profile, on whole
+// 100 MHz ratios. Without a profile it is the governor's full range.
+VOID ProfileFrequencyRange(PDRIVER_CONTEXT Context, ULONG Processor,
+                           PULONG MinFrequency, PULONG MaxFrequency)
+{
+    PMAHF_PROFILE profile = Context->ActiveProfile;
+    PMAHF_FREQUENCY_RANGE range;
+    ULONG floor = (Context->BaseFrequency * 4 / 10 + 99) / 100 * 100;
+    ULONG ceiling = Context->MaxFrequency;
+    
+    if (profile) {
+        range = &profile->Frequency[Context->Topology[Processor].CoreType];
+        if (range->MinFrequency == 0 && range->MaxFrequency == 0) {
+            range = &profile->Frequency[MAHF_CORE_TYPE_UNKNOWN];
+        }
+        
+        if (!profile->TurboEnabled) {
+            ceiling = min(ceiling, Context->BaseFrequency);
+        }
+        
+        if (range->MaxFrequency != 0) {
+            ceiling = min(ceiling, range->MaxFrequency / 100 * 100);
+        }
+        
+        if (range->MinFrequency != 0) {
+            floor = max(floor, (range->MinFrequency + 99) / 100 * 100);
+        }
+        
+        floor = min(floor, ceiling);
+    }
+    
+    *MinFrequency = floor;
+    *MaxFrequency = ceiling;
+}
+
+// Load Profiles
+// From the Parameters key, at initialization. Slots that do not validate
+// are dropped rather than the whole table.
+VOID LoadProfiles(PDRIVER_CONTEXT Context, WDFKEY Key)
+{
+    DECLARE_CONST_UNICODE_STRING(profilesName, L"Profiles");
+    DECLARE_CONST_UNICODE_STRING(activeProfileName, L"ActiveProfile");
+    WCHAR activeName[MAHF_PROFILE_NAME_LENGTH] = {0};
+    ULONG length = 0;
+    ULONG type = 0;
+    
+    if (!NT_SUCCESS(WdfRegistryQueryValue(Key, &profilesName, sizeof(Context->Profiles),
+                                          Context->Profiles, &length, &type)) ||
+        type != REG_BINARY) {
+        RtlZeroMemory(Context->Profiles, sizeof(Context->Profiles));
+        return;
+    }
+    
+    for (ULONG s = 0; s < MAHF_MAX_PROFILES; s++) {
+        if ((s + 1) * sizeof(MAHF_PROFILE) > length ||
+            !ValidateProfile(&Context->Profiles[s]) ||
+            FindProfile(Context, Context->Profiles[s].Name) != &Context->Profiles[s]) {
+            RtlZeroMemory(&Context->Profiles[s], sizeof(MAHF_PROFILE));
+        }
+    }
+    
+    // Leave room for the terminator
+    if (NT_SUCCESS(WdfRegistryQueryValue(Key, &activeProfileName,
+                                         sizeof(activeName) - sizeof(WCHAR),
+                                         activeName, &length, &type)) &&
+        type == REG_SZ) {
+        Context->ActiveProfile = FindProfile(Context, activeName);
+    }
+}
+
+// Save Profiles
+// Writes the whole table and the active name back to the Parameters key.
+// Failure only costs persistence, so it is logged and not returned.
+VOID SaveProfiles(PDRIVER_CONTEXT Context)
+{
+    NTSTATUS status;
+    WDFKEY key;
+    PMAHF_PROFILE active = Context->ActiveProfile;
+    PCWSTR activeName = active ? active->Name : L"";
+    DECLARE_CONST_UNICODE_STRING(profilesName, L"Profiles");
+    DECLARE_CONST_UNICODE_STRING(activeProfileName, L"ActiveProfile");
+    
+    status = WdfDriverOpenParametersRegistryKey(g_Driver, KEY_WRITE,
+                                                WDF_NO_OBJECT_ATTRIBUTES, &key);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("SaveProfiles: cannot open Parameters: 0x%08X\n", status);
+        return;
+    }
+    
+    status = WdfRegistryAssignValue(key, &profilesName, REG_BINARY,
+                                    sizeof(Context->Profiles), Context->Profiles);
+    if (NT_SUCCESS(status)) {
+        status = WdfRegistryAssignValue(key, &activeProfileName, REG_SZ,
+                                        (ProfileNameLength(activeName) + 1) * sizeof(WCHAR),
+                                        (PVOID)activeName);
+    }
+    
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("SaveProfiles: write failed: 0x%08X\n", status);
+    }
+    
+    WdfRegistryClose(key);
+}
+
+// Wait Notification
+// Default queue. Completes at once if the ring already holds a matching
+// event; otherwise parks the request on the notification queue. The check
+// and the forward happen under the ring lock, so an event posted in between
+// finds the request queued.
+VOID WaitNotification(PDRIVER_CONTEXT Context, WDFREQUEST Request)
+{
+    NTSTATUS status;
+    PNOTIFY notify = &Context->Notify;
+    PNOTIFY_WAIT_CONTEXT wait = GetNotifyWaitContext(Request);
+    PMAHF_NOTIFY_WAIT input;
+    PMAHF_NOTIFY_WAIT_CONFIG inputConfig = NULL;
+    PMAHF_NOTIFY_RESPONSE response;
+    size_t inputLength = 0;
+    ULONG count;
+    KIRQL oldIrql;
+    ULONG64 start = StatTimestamp();
+    
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(MAHF_NOTIFY_WAIT), (PVOID*)&input, &inputLength);
+    if (NT_SUCCESS(status)) {
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(MAHF_NOTIFY_RESPONSE),
+                                                (PVOID*)&response, NULL);
+    }
+    
+    if (NT_SUCCESS(status) && inputLength >= sizeof(MAHF_NOTIFY_WAIT_CONFIG)) {
+        inputConfig = (PMAHF_NOTIFY_WAIT_CONFIG)input;
+    }
+    
+    if (NT_SUCCESS(status) &&
+        ((input->EventMask & MAHF_NOTIFY_ALL) == 0 ||
+         (inputConfig && (!IsValidNotifyConfig(&inputConfig->Config) ||
+                          inputConfig->OverTemperature > 1 ||
+                          inputConfig->Band > MAHF_NOTIFY_BAND_BELOW)))) {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!NT_SUCCESS(status)) {
+        RecordRequest(IOCTL_MAHF_WAIT_NOTIFICATION, start, status);
+        WdfRequestComplete(Request, status);
+        return;
+    }
+    
+    // Input and output share the system buffer; keep the input aside
+    wait->StartSequence = input->StartSequence;
+    wait->EventMask = input->EventMask;
+    wait->OwnConfig = (inputConfig != NULL);
+    
+    if (inputConfig) {
+        wait->Config = inputConfig->Config;
+        wait->OverTemperature = (BOOLEAN)inputConfig->OverTemperature;
+        wait->Band = inputConfig->Band;
+    }
+    
+    KeAcquireSpinLock(&notify->Lock, &oldIrql);
+    
+    count = FillNotifyResponse(notify, wait, response);
+    if (count == 0) {
+        status = WdfRequestForwardToIoQueue(Request, Context->NotifyQueue);
+    }
+    
+    KeReleaseSpinLock(&notify->Lock, oldIrql);
+    
+    // Timed until completed or parked; a parked wait's status is the forward's
+    RecordRequest(IOCTL_MAHF_WAIT_NOTIFICATION, start, status);
+    
+    if (count != 0) {
+        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(MAHF_NOTIFY_RESPONSE));
+    } else if (!NT_SUCCESS(status)) {
+        MAHF_TRACE(IOCTL_NOT_QUEUED, IOCTL_MAHF_WAIT_NOTIFICATION, status, 0, 0);
+        WdfRequestComplete(Request, status);
+    }
+}
+
+// Set Notification
+// Control queue, ControlLock held. Conditions are re-evaluated against the
+// new thresholds on the next telemetry tick, which reports the ones already
+// past them.
+NTSTATUS SetNotification(PDRIVER_CONTEXT Context, PMAHF_NOTIFY_CONFIG Config)
+{
+    PNOTIFY notify = &Context->Notify;
+    KIRQL oldIrql;
+    
+    if (!IsValidNotifyConfig(Config)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    KeAcquireSpinLock(&notify->Lock, &oldIrql);
+    notify->Config = *Config;
+    notify->Rearm = TRUE;
+    KeReleaseSpinLock(&notify->Lock, oldIrql);
+    
+    DbgPrint("SetNotification: %d C (hysteresis %d), utilization %d-%d%%\n",
+             Config->TemperatureThreshold, Config->TemperatureHysteresis,
+             Config->UtilizationLow, Config->UtilizationHigh);
+    
+    return STATUS_SUCCESS;
+}
+
+// Is Valid Notify Config
+BOOLEAN IsValidNotifyConfig(PMAHF_NOTIFY_CONFIG Config)
+{
+    return Config->UtilizationLow <= Config->UtilizationHigh &&
+           Config->UtilizationHigh <= 100 &&
+           Config->TemperatureThreshold <= 150 &&
+           Config->TemperatureHysteresis <= 30;
+}
+
+// Evaluate Notify Config
+// Notify->Lock held. Moves Over and Band, the state last reported, to where
+// the last tick sits against Config; a disabled threshold leaves its state.
+// Over temperature holds until Hysteresis degrees below the threshold.
+VOID EvaluateNotifyConfig(PNOTIFY Notify, PMAHF_NOTIFY_CONFIG Config, PBOOLEAN Over, PULONG Band)
+{
+    if (Config->TemperatureThreshold != 0) {
+        *Over = *Over ?
+                Notify->Temperature + Config->TemperatureHysteresis >= Config->TemperatureThreshold :
+                Notify->Temperature >= Config->TemperatureThreshold;
+    }
+    
+    if (Config->UtilizationHigh != 0) {
+        *Band = Notify->Utilization > Config->UtilizationHigh ? MAHF_NOTIFY_BAND_ABOVE :
+                Notify->Utilization < Config->UtilizationLow ? MAHF_NOTIFY_BAND_BELOW :
+                MAHF_NOTIFY_BAND_INSIDE;
+    }
+}
+
+// Fill Notify Response
+// Notify->Lock held. Counts the events from the wait's start sequence that
+// match its mask, copying up to MAHF_NOTIFY_MAX_EVENTS when a response is
+// given; with no response it stops at the first. A sequence from before the
+// driver was loaded restarts at the head. A wait with its own thresholds
+// skips the device-wide crossings and gets its own, checked against the
+// last tick, after the ring's events.
+ULONG FillNotifyResponse(PNOTIFY Notify, PNOTIFY_WAIT_CONTEXT Wait, PMAHF_NOTIFY_RESPONSE Response)
+{
+    ULONG64 head = Notify->Head;
+    ULONG64 oldest = (head > MAHF_NOTIFY_RING_SIZE) ? head - MAHF_NOTIFY_RING_SIZE : 0;
+    ULONG64 start = min(Wait->StartSequence, head);
+    ULONG64 lost = 0;
+    ULONG mask = Wait->EventMask;
+    ULONG count = 0;
+    
+    if (Wait->OwnConfig) {
+        mask &= ~(MAHF_NOTIFY_TEMPERATURE | MAHF_NOTIFY_UTILIZATION);
+    }
+    
+    if (start < oldest) {
+        lost = oldest - start;
+        start = oldest;
+    }
+    
+    for (; start < head && count < MAHF_NOTIFY_MAX_EVENTS; start++) {
+        PMAHF_NOTIFY_EVENT event = &Notify->Events[start & (MAHF_NOTIFY_RING_SIZE - 1)];
+        
+        if (!(event->Type & mask)) {
+            continue;
+        }
+        
+        if (!Response) {
+            return 1;
+        }
+        
+        Response->Events[count++] = *event;
+    }
+    
+    // Room for both, or they wait for the next call
+    if (Wait->OwnConfig && Notify->Sampled && count + 2 <= MAHF_NOTIFY_MAX_EVENTS) {
+        MAHF_NOTIFY_EVENT crossings[2] = { 0 };
+        BOOLEAN over = Wait->OverTemperature;
+        ULONG band = Wait->Band;
+        
+        EvaluateNotifyConfig(Notify, &Wait->Config, &over, &band);
+        
+        crossings[0].Type = (over != Wait->OverTemperature) ? MAHF_NOTIFY_TEMPERATURE : 0;
+        crossings[0].Value = Notify->Temperature;
+        crossings[0].Detail = over;
+        crossings[1].Type = (band != Wait->Band) ? MAHF_NOTIFY_UTILIZATION : 0;
+        crossings[1].Value = Notify->Utilization;
+        crossings[1].Detail = band;
+        
+        for (ULONG i = 0; i < ARRAYSIZE(crossings); i++) {
+            if (!(crossings[i].Type & Wait->EventMask)) {
+                continue;
+            }
+            
+            if (!Response) {
+                return 1;
+            }
+            
+            crossings[i].Sequence = start;
+            crossings[i].Timestamp = Notify->SampleTime;
+            Response->Events[count++] = crossings[i];
+        }
+    }
+    
+    if (Response && count != 0) {
+        Response->NextSequence = start;
+        Response->LostEvents = lost;
+        Response->EventCount = count;
+        Response->Reserved = 0;
+    }
+    
+    return count;
+}
+
+// Post Notification
+// Any IRQL up to DISPATCH_LEVEL. Appends one event, then completes the
+// waits it satisfies.
+VOID PostNotification(PDRIVER_CONTEXT Context, ULONG Type, ULONG Value, ULONG Detail)
+{
+    PNOTIFY notify = &Context->Notify;
+    PMAHF_NOTIFY_EVENT event;
+    KIRQL oldIrql;
+    
+    KeAcquireSpinLock(&notify->Lock, &oldIrql);
+    
+    event = &notify->Events[notify->Head & (MAHF_NOTIFY_RING_SIZE - 1)];
+    event->Sequence = notify->Head++;
+    event->Timestamp = KeQueryInterruptTime();
+    event->Type = Type;
+    event->Value = Value;
+    event->Detail = Detail;
+    event->Reserved = 0;
+    
+    KeReleaseSpinLock(&notify->Lock, oldIrql);
+    
+    CompleteNotifyWaits(Context);
+}
+
+// Complete Notify Waits
+// Walks the notification queue and completes every wait that now has an
+// event. The walk restarts from the front after each completion, and when
+// the request it was positioned on was cancelled meanwhile; the queue only
+// holds one request per waiting client, so this stays short.
+VOID CompleteNotifyWaits(PDRIVER_CONTEXT Context)
+{
+    PNOTIFY notify = &Context->Notify;
+    WDFREQUEST previous = NULL;
+    WDFREQUEST found;
+    WDFREQUEST request;
+    NTSTATUS status;
+    KIRQL oldIrql;
+    
+    if (!Context->NotifyQueue) {
+        return;
+    }
+    
+    for (;;) {
+        status = WdfIoQueueFindRequest(Context->NotifyQueue, previous, NULL, NULL, &found);
+        
+        if (previous) {
+            WdfObjectDereference(previous);
+            previous = NULL;
+            
+            if (status == STATUS_NOT_FOUND) {
+                continue;
+            }
+        }
+        
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+        
+        KeAcquireSpinLock(&notify->Lock, &oldIrql);
+        
+        if (!FillNotifyResponse(notify, GetNotifyWaitContext(found), NULL)) {
+            KeReleaseSpinLock(&notify->Lock, oldIrql);
+            previous = found;
+            continue;
+        }
+        
+        KeReleaseSpinLock(&notify->Lock, oldIrql);
+        
+        status = WdfIoQueueRetrieveFoundRequest(Context->NotifyQueue, found, &request);
+        WdfObjectDereference(found);
+        
+        if (NT_SUCCESS(status)) {
+            PMAHF_NOTIFY_RESPONSE response;
+            ULONG count = 0;
+            
+            // Validated when the wait was queued
+            status = WdfRequestRetrieveOutputBuffer(request, sizeof(MAHF_NOTIFY_RESPONSE),
+                                                    (PVOID*)&response, NULL);
+            if (NT_SUCCESS(status)) {
+                KeAcquireSpinLock(&notify->Lock, &oldIrql);
+                count = FillNotifyResponse(notify, GetNotifyWaitContext(request), response);
+                KeReleaseSpinLock(&notify->Lock, oldIrql);
+            }
+            
+            WdfRequestCompleteWithInformation(request, status,
+                                              count ? sizeof(MAHF_NOTIFY_RESPONSE) : 0);
+        }
+    }
+}
+
+// Check Notifications
+// End of every telemetry tick, DISPATCH_LEVEL. Compares the hottest core
+// and the average utilization with the device-wide thresholds and posts an
+// event on each crossing. The edge state is updated under the ring lock,
+// since a slow tick can overlap the next. After a threshold change the
+// first tick reports whichever conditions already hold rather than staying
+// silent. Waits with their own thresholds are checked whenever the summary
+// moves, as there is no posted event to complete them.
+VOID CheckNotifications(PDRIVER_CONTEXT Context)
+{
+    PNOTIFY notify = &Context->Notify;
+    PCORE_METRICS metrics = &Context->Metrics;
+    ULONG count = Context->ProcessorCount;
+    METRIC_SUMMARY temperature;
+    METRIC_SUMMARY utilization;
+    BOOLEAN postTemperature;
+    BOOLEAN postBand;
+    BOOLEAN changed;
+    BOOLEAN over;
+    ULONG average;
+    ULONG band;
+    KIRQL oldIrql;
+    
+    if (count == 0) {
+        return;
+    }
+    
+    SummarizeMetric(metrics->Temperature, count, &temperature);
+    SummarizeMetric(metrics->Utilization, count, &utilization);
+    average = (ULONG)(utilization.Sum / count);
+    
+    KeAcquireSpinLock(&notify->Lock, &oldIrql);
+    
+    changed = !notify->Sampled || notify->Temperature != temperature.Max ||
+              notify->Utilization != average;
+    notify->Sampled = TRUE;
+    notify->Temperature = temperature.Max;
+    notify->Utilization = average;
+    notify->SampleTime = KeQueryInterruptTime();
+    
+    if (notify->Rearm) {
+        notify->OverTemperature = FALSE;
+        notify->Band = MAHF_NOTIFY_BAND_INSIDE;
+        notify->Rearm = FALSE;
+    }
+    
+    over = notify->OverTemperature;
+    band = notify->Band;
+    EvaluateNotifyConfig(notify, &notify->Config, &over, &band);
+    
+    postTemperature = (over != notify->OverTemperature);
+    postBand = (band != notify->Band);
+    notify->OverTemperature = over;
+    notify->Band = band;
+    
+    KeReleaseSpinLock(&notify->Lock, oldIrql);
+    
+    if (postTemperature) {
+        PostNotification(Context, MAHF_NOTIFY_TEMPERATURE, temperature.Max, over);
+    }
+    if (postBand) {
+        PostNotification(Context, MAHF_NOTIFY_UTILIZATION, average, band);
+    }
+    
+    // Posting already walked the waits
+    if (changed && !postTemperature && !postBand) {
+        CompleteNotifyWaits(Context);
+    }
+}
+
+// Sample Telemetry
+// Appends one sample per core. Runs at DISPATCH_LEVEL; a slow tick may
+// overlap the next one on another processor, so slots are reserved as a
+// block rather than assuming a single producer. Every processor first
+// samples its own counters and status registers in one broadcast.
+VOID SampleTelemetry(PDRIVER_CONTEXT Context)
+{
+    PTELEMETRY_RING ring = &Context->Telemetry;
+    ULONG coreCount = Context->ProcessorCount;
+    ULONG64 timestamp = KeQueryInterruptTime();
+    ULONG64 sequence;
+    
+    KeIpiGenericCall(SampleCountersIpi, (ULONG_PTR)Context);
+    
+    if (Context->ActivityCounters) {
+        for (ULONG i = 0; i < coreCount; i++) {
+            PCORE_COUNTERS counters = &Context->Counters[i];
+            
+            if (counters->EffectiveFrequency != 0) {
+                UpdateCoreActivity(Context, i, counters->EffectiveFrequency, counters->Residency);
+            }
+        }
+    }
+    
+    sequence = (ULONG64)InterlockedExchangeAdd64(&ring->Head, coreCount);
+    
+    for (ULONG i = 0; i < coreCount; i++, sequence++) {
+        PMAHF_TELEMETRY_SAMPLE slot =
+            &ring->Samples[sequence & (ring->Size - 1)];
+        ULONG64 perfStatus = Context->Counters[i].PerfStatus;
+        ULONG64 thermalStatus = Context->Counters[i].ThermalStatus;
+        CPU_CORE_INFO core;
+        
+        CoreReadInfo(&Context->Cores[i], &core);
+        
+        // Mark the slot busy before overwriting it
+        WriteNoFence64((volatile LONG64*)&slot->Sequence, (LONG64)TELEMETRY_SLOT_BUSY);
+        KeMemoryBarrier();
+        
+        slot->Timestamp = timestamp;
+        slot->PerfStatus = perfStatus;
+        slot->ThermalStatus = thermalStatus;
+        slot->CoreId = i;
+        slot->State = core.CurrentState;
+        slot->Frequency = core.CurrentFrequency;
+        slot->Temperature = core.Temperature;
+        slot->Utilization = core.Utilization;
+        slot->Reserved = 0;
+        
+        // Publish
+        WriteRelease64((volatile LONG64*)&slot->Sequence, (LONG64)sequence);
+    }
+    
+    PublishSharedTelemetry(Context);
+    CheckNotifications(Context);
+}
+
+// Sample Counters
+// Runs at IPI_LEVEL on every processor; fills only the caller's own entry.
+// An interval the processor spent entirely out of C0 leaves the delivered
+// frequency at its last value and the residency at zero.
+ULONG_PTR SampleCountersIpi(ULONG_PTR Argument)
+{
+    PDRIVER_CONTEXT context = (PDRIVER_CONTEXT)Argument;
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PCORE_COUNTERS counters;
+    ULONG64 tsc, mperf, aperf;
+    
+    if (processor >= context->ProcessorCount) {
+        return 0;
+    }
+    
+    counters = &context->Counters[processor];
+    
+    CachedReadMSR(context, MSR_PERF_STATUS, &counters->PerfStatus);
+    CachedReadMSR(context, MSR_THERM_STATUS, &counters->ThermalStatus);
+    
+    if (!context->ActivityCounters) {
+        return 0;
+    }
+    
+    // TSC first and APERF last keeps both ratios from overshooting
+    if (!NT_SUCCESS(ReadMSR(MSR_TSC, &tsc)) ||
+        !NT_SUCCESS(ReadMSR(MSR_MPERF, &mperf)) ||
+        !NT_SUCCESS(ReadMSR(MSR_APERF, &aperf))) {
+        counters->Valid = FALSE;
+        return 0;
+    }
+    
+    if (counters->Valid) {
+        ULONG64 tscDelta = tsc - counters->Tsc;
+        ULONG64 mperfDelta = mperf - counters->Mperf;
+        ULONG64 aperfDelta = aperf - counters->Aperf;
+        
+        if (mperfDelta != 0) {
+            counters->EffectiveFrequency =
+                (ULONG)min(aperfDelta * context->BaseFrequency / mperfDelta, MAXULONG);
+        }
+        
+        counters->Residency = tscDelta ? (ULONG)min(mperfDelta * 100 / tscDelta, 100) : 0;
+    }
+    
+    counters->Tsc = tsc;
+    counters->Mperf = mperf;
+    counters->Aperf = aperf;
+    counters->Valid = TRUE;
+    
+    return 0;
+}
+
+// Drain Telemetry
+// Copies every committed sample from StartSequence onwards. Samples that were
+// overwritten before the caller got to them are reported in LostSamples; a
+// slot still being written ends the drain so it is returned next time.
+NTSTATUS DrainTelemetry(PDRIVER_CONTEXT Context, PVOID InputBuffer, SIZE_T InputLength,
+                        PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    PTELEMETRY_RING ring = &Context->Telemetry;
+    PMAHF_TELEMETRY_DRAIN_RESPONSE response;
+    ULONG64 start, head, oldest;
+    ULONG64 lost = 0;
+    SIZE_T capacity;
+    ULONG count = 0;
+    
+    if (!InputBuffer || InputLength < sizeof(MAHF_TELEMETRY_DRAIN_REQUEST)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    if (!OutputBuffer ||
+        OutputLength < FIELD_OFFSET(MAHF_TELEMETRY_DRAIN_RESPONSE, Samples)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    // Input and output share the system buffer; read before writing
+    start = ((PMAHF_TELEMETRY_DRAIN_REQUEST)InputBuffer)->StartSequence;
+    response = (PMAHF_TELEMETRY_DRAIN_RESPONSE)OutputBuffer;
+    capacity = (OutputLength - FIELD_OFFSET(MAHF_TELEMETRY_DRAIN_RESPONSE, Samples)) /
+               sizeof(MAHF_TELEMETRY_SAMPLE);
+    
+    head = (ULONG64)ReadAcquire64(&ring->Head);
+    oldest = (head > ring->Size) ? head - ring->Size : 0;
+    
+    // A sequence from before a driver reset restarts at the oldest sample
+    if (start > head) {
+        start = oldest;
+    }
+    
+    if (start < oldest) {
+        lost = oldest - start;
+        start = oldest;
+    }
+    
+    while (start < head && count < capacity) {
+        PMAHF_TELEMETRY_SAMPLE slot =
+            &ring->Samples[start & (ring->Size - 1)];
+        ULONG64 before = (ULONG64)ReadAcquire64((volatile LONG64*)&slot->Sequence);
+        
+        if (before == TELEMETRY_SLOT_BUSY || before < start) {
+            // Reserved but not yet published
+            break;
+        }
+        
+        if (before == start) {
+            RtlCopyMemory(&response->Samples[count], slot, sizeof(MAHF_TELEMETRY_SAMPLE));
+            KeMemoryBarrier();
+            
+            if ((ULONG64)ReadNoFence64((volatile LONG64*)&slot->Sequence) == start) {
+                count++;
+                start++;
+                continue;
+            }
+        }
+        
+        // Lapped by the producer while copying
+        lost++;
+        start++;
+    }
+    
+    response->NextSequence = start;
+    response->LostSamples = lost;
+    response->SampleCount = count;
+    response->PeriodMs = Context->TelemetryPeriodMs;
+    
+    *BytesReturned = FIELD_OFFSET(MAHF_TELEMETRY_DRAIN_RESPONSE, Samples) +
+                     (SIZE_T)count * sizeof(MAHF_TELEMETRY_SAMPLE);
+    return STATUS_SUCCESS;
+}
+
+// Update Core Frequency
+// Publishes a core's new operating point once its PERF_CTL has been
+// programmed; see SetPerformanceState. The delivered frequency follows from
+// the next telemetry sample, or is taken to be the target where the
+// processor has no APERF/MPERF.
+NTSTATUS UpdateCoreFrequency(PDRIVER_CONTEXT Context, UCHAR CoreId, ULONG Frequency,
+                             PERFORMANCE_STATE State)
+{
+    PCORE_SLOT slot;
+    PCPU_CORE_INFO core;
+    KIRQL oldIrql;
+    
+    if (CoreId >= Context->ProcessorCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    // Validate frequency range
+    if (Frequency < Context->BaseFrequency * 4 / 10 ||
+        Frequency > Context->MaxFrequency) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    Context->TargetFrequency[CoreId] = Frequency;
+    
+    // Update core information
+    slot = &Context->Cores[CoreId];
+    core = &slot->Info;
+    oldIrql = CoreWriteBegin(slot);
+    
+    core->CurrentState = State;
+    core->TargetFrequency = Frequency;
+    
+    if (!Context->ActivityCounters) {
+        core->CurrentFrequency = Frequency;
+        WriteNoFence((volatile LONG*)&Context->Metrics.Frequency[CoreId], Frequency);
+    }
+    
+    CoreWriteEnd(slot, oldIrql);
+    
+    MAHF_TRACE(CORE_FREQUENCY, CoreId, Frequency, State, 0);
+    
+    return STATUS_SUCCESS;
+}
+
+// Update Core Utilization
+VOID UpdateCoreUtilization(PDRIVER_CONTEXT Context, ULONG CoreId, ULONG Utilization)
+{
+    PCORE_SLOT slot = &Context->Cores[CoreId];
+    KIRQL oldIrql;
+    
+    oldIrql = CoreWriteBegin(slot);
+    slot->Info.Utilization = Utilization;
+    WriteNoFence((volatile LONG*)&Context->Metrics.Utilization[CoreId], Utilization);
+    CoreWriteEnd(slot, oldIrql);
+}
+
+// Update Core Activity
+// Delivered frequency and C0 residency from the counter sample.
+VOID UpdateCoreActivity(PDRIVER_CONTEXT Context, ULONG CoreId, ULONG Frequency, ULONG Utilization)
+{
+    PCORE_SLOT slot = &Context->Cores[CoreId];
+    KIRQL oldIrql;
+    
+    oldIrql = CoreWriteBegin(slot);
+    slot->Info.CurrentFrequency = Frequency;
+    slot->Info.Utilization = Utilization;
+    WriteNoFence((volatile LONG*)&Context->Metrics.Frequency[CoreId], Frequency);
+    WriteNoFence((volatile LONG*)&Context->Metrics.Utilization[CoreId], Utilization);
+    CoreWriteEnd(slot, oldIrql);
+}
+
+// Update Core Temperature
+// Temperatures come only from the thermal loop's sensor reads.
+VOID UpdateCoreTemperature(PDRIVER_CONTEXT Context, ULONG CoreId, ULONG Temperature)
+{
+    PCORE_SLOT slot = &Context->Cores[CoreId];
+    KIRQL oldIrql;
+    
+    oldIrql = CoreWriteBegin(slot);
+    slot->Info.Temperature = Temperature;
+    WriteNoFence((volatile LONG*)&Context->Metrics.Temperature[CoreId], Temperature);
+    CoreWriteEnd(slot, oldIrql);
+}
+
+// Begin Core Write
+KIRQL CoreWriteBegin(PCORE_SLOT Slot)
+{
+    KIRQL oldIrql;
+    
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    
+    for (;;) {
+        LONG sequence = ReadNoFence(&Slot->Sequence);
+        
+        if (!(sequence & 1) &&
+            InterlockedCompareExchange(&Slot->Sequence, sequence + 1, sequence) == sequence) {
+            break;
+        }
+        
+        YieldProcessor();
+    }
+    
+    return oldIrql;
+}
+
+// End Core Write
+VOID CoreWriteEnd(PCORE_SLOT Slot, KIRQL OldIrql)
+{
+    InterlockedIncrement(&Slot->Sequence);
+    KeLowerIrql(OldIrql);
+}
+
+// Read Core Info
+// Returns a snapshot that never mixes two updates of the same core.
+VOID CoreReadInfo(PCORE_SLOT Slot, PCPU_CORE_INFO Info)
+{
+    for (;;) {
+        LONG before = ReadAcquire(&Slot->Sequence);
+        
+        if (!(before & 1)) {
+            RtlCopyMemory(Info, &Slot->Info, sizeof(CPU_CORE_INFO));
+            KeMemoryBarrier();
+            
+            if (ReadNoFence(&Slot->Sequence) == before) {
+                return;
+            }
+        }
+        
+        YieldProcessor();
+    }
+}
+
+// Read MSR
+// MSR and CPUID accessors act on the current processor through the
+// selected hardware backend; callers that need a particular processor run
+// there first (see ProgramPerfCtlIpi).
+NTSTATUS ReadMSR(ULONG Register, PULONG64 Value)
+{
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PCPU_STATS stats = CpuStats(processor);
+    ULONG64 start = StatTimestamp();
+    NTSTATUS status = g_HwBackend->ReadMsr(processor, Register, Value);
+    
+    if (stats) {
+        RecordLatency(&stats->Msr[MAHF_STAT_MSR_READ], start, status);
+    }
+    
+    return status;
+}
+
+// Write MSR
+NTSTATUS WriteMSR(ULONG Register, ULONG64 Value)
+{
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PCPU_STATS stats = CpuStats(processor);
+    ULONG64 start = StatTimestamp();
+    NTSTATUS status = g_HwBackend->WriteMsr(processor, Register, Value);
+    
+    if (stats) {
+        RecordLatency(&stats->Msr[MAHF_STAT_MSR_WRITE], start, status);
+    }
+    
+    return status;
+}
+
+// Get CPUID
+NTSTATUS GetCPUID(ULONG Function, ULONG SubFunction, PULONG32 Registers)
+{
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PCPU_STATS stats = CpuStats(processor);
+    ULONG64 start = StatTimestamp();
+    NTSTATUS status = g_HwBackend->Cpuid(processor, Function, SubFunction, Registers);
+    
+    if (stats) {
+        RecordLatency(&stats->Msr[MAHF_STAT_CPUID], start, status);
+    }
+    
+    return status;
+}
+
+// Initialize Register Cache
+// PlatformInfo and TurboRatioLimit are package-wide and never change, so
+// they are read once here and copied to every processor's entry.
+VOID InitializeRegisterCache(PDRIVER_CONTEXT Context)
+{
+    ULONG64 platformInfo = 0;
+    ULONG64 turboRatioLimit = 0;
+    
+    ReadMSR(MSR_PLATFORM_INFO, &platformInfo);
+    ReadMSR(MSR_TURBO_RATIO_LIMIT, &turboRatioLimit);
+    
+    for (ULONG i = 0; i < MAX_CPU_CORES; i++) {
+        RtlZeroMemory(&Context->MsrCache[i], sizeof(MSR_CACHE));
+        Context->MsrCache[i].Registers.PlatformInfo = platformInfo;
+        Context->MsrCache[i].Registers.TurboRatioLimit = turboRatioLimit;
+    }
+}
+
+// Invalidate Register Cache
+// Drops everything the hardware may have changed behind our back, including
+// the activity counter baselines; static registers are kept. Called with
+// the control queue and telemetry idle.
+VOID InvalidateRegisterCache(PDRIVER_CONTEXT Context)
+{
+    for (ULONG i = 0; i < MAX_CPU_CORES; i++) {
+        Context->MsrCache[i].PerfCtlValid = FALSE;
+        Context->MsrCache[i].PerfStatusTime = 0;
+        Context->MsrCache[i].ThermalStatusTime = 0;
+        Context->Counters[i].Valid = FALSE;
+    }
+}
+
+// Cached CPUID
+// Leaves that are identical on every processor are answered from the cache;
+// per-processor leaves (APIC IDs, topology) always go to the hardware. The
+// cache is filled from the initialization and control paths only.
+NTSTATUS CachedCPUID(PDRIVER_CONTEXT Context, ULONG Function, ULONG SubFunction, PULONG32 Registers)
+{
+    NTSTATUS status;
+    PCPUID_CACHE_ENTRY entry = NULL;
+    
+    if (Function == 1 || Function == 0xB || Function == 0x1A || Function == 0x1F ||
+        Function == 0x8000001E) {
+        return GetCPUID(Function, SubFunction, Registers);
+    }
+    
+    for (ULONG i = 0; i < CPUID_CACHE_SIZE; i++) {
+        PCPUID_CACHE_ENTRY candidate = &Context->CpuidCache[i];
+        
+        if (!candidate->Valid) {
+            if (!entry) {
+                entry = candidate;
+            }
+            continue;
+        }
+        
+        if (candidate->Function == Function && candidate->SubFunction == SubFunction) {
+            RtlCopyMemory(Registers, candidate->Registers, sizeof(candidate->Registers));
+            return STATUS_SUCCESS;
+        }
+    }
+    
+    status = GetCPUID(Function, SubFunction, Registers);
+    
+    if (NT_SUCCESS(status) && entry) {
+        entry->Function = Function;
+        entry->SubFunction = SubFunction;
+        RtlCopyMemory(entry->Registers, Registers, sizeof(entry->Registers));
+        entry->Valid = TRUE;
+    }
+    
+    return status;
+}
+
+// Cached Read MSR
+// Reads the current processor's copy of a register; see MSR_CACHE.
+NTSTATUS CachedReadMSR(PDRIVER_CONTEXT Context, ULONG Register, PULONG64 Value)
+{
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PMSR_CACHE cache;
+    PULONG64 cachedValue;
+    PULONG64 cachedTime;
+    ULONG64 now;
+    NTSTATUS status;
+    
+    if (processor >= MAX_CPU_CORES) {
+        return ReadMSR(Register, Value);
+    }
+    
+    cache = &Context->MsrCache[processor];
+    
+    switch (Register) {
+        case MSR_PLATFORM_INFO:
+            *Value = cache->Registers.PlatformInfo;
+            return *Value ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+            
+        case MSR_TURBO_RATIO_LIMIT:
+            *Value = cache->Registers.TurboRatioLimit;
+            return *Value ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+            
+        case MSR_PERF_CTL:
+            if (cache->PerfCtlValid) {
+                *Value = cache->Registers.PerfCtl;
+                return STATUS_SUCCESS;
+            }
+            
+            status = ReadMSR(Register, Value);
+            if (NT_SUCCESS(status)) {
+                cache->Registers.PerfCtl = *Value;
+                cache->PerfCtlValid = TRUE;
+            }
+            return status;
+            
+        case MSR_PERF_STATUS:
+            cachedValue = &cache->Registers.PerfStatus;
+            cachedTime = &cache->PerfStatusTime;
+            break;
             
-        case IOCTL_MAHF_RESET_DRIVER:
-            status = InitializeDriverContext(Context);
+        case MSR_THERM_STATUS:
+            cachedValue = &cache->Registers.ThermalStatus;
+            cachedTime = &cache->ThermalStatusTime;
             break;
             
         default:
-            status = STATUS_INVALID_DEVICE_REQUEST;
-            break;
+            return ReadMSR(Register, Value);
+    }
+    
+    // Volatile register: reuse while within the staleness budget
+    now = KeQueryInterruptTime();
+    if (*cachedTime != 0 && now - *cachedTime <= Context->MsrStaleness) {
+        *Value = *cachedValue;
+        return STATUS_SUCCESS;
+    }
+    
+    status = ReadMSR(Register, Value);
+    if (NT_SUCCESS(status)) {
+        *cachedValue = *Value;
+        *cachedTime = now;
     }
     
     return status;
 }
 
-// Set Performance State
-NTSTATUS SetPerformanceState(PDRIVER_CONTEXT Context, PERFORMANCE_STATE State)
+// Cached Write PERF_CTL
+// Write-through for the current processor. A value equal to the cached one
+// is not written again; a real write also expires the cached PERF_STATUS so
+// the next read shows the transition.
+NTSTATUS CachedWritePerfCtl(PDRIVER_CONTEXT Context, ULONG64 Value)
 {
-    KIRQL oldIrql;
-    NTSTATUS status = STATUS_SUCCESS;
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    PMSR_CACHE cache;
+    NTSTATUS status;
+    
+    if (processor >= MAX_CPU_CORES) {
+        return WriteMSR(MSR_PERF_CTL, Value);
+    }
     
-    DbgPrint("SetPerformanceState: Setting state %d\n", State);
+    cache = &Context->MsrCache[processor];
     
-    // Validate state
-    if (State > STATE_EXTREME) {
-        return STATUS_INVALID_PARAMETER;
+    if (cache->PerfCtlValid && cache->Registers.PerfCtl == Value) {
+        return STATUS_SUCCESS;
     }
     
-    // Acquire lock
-    KeAcquireSpinLock(&Context->CoreLock, &oldIrql);
+    status = WriteMSR(MSR_PERF_CTL, Value);
+    if (NT_SUCCESS(status)) {
+        cache->Registers.PerfCtl = Value;
+        cache->PerfCtlValid = TRUE;
+        cache->PerfStatusTime = 0;
+    }
     
-    // Set global state
-    Context->GlobalState = State;
+    return status;
+}
+
+// Create Shared Section
+// A named pagefile-backed section readable by SYSTEM and Administrators.
+// The driver's view is locked so it can be written at DISPATCH_LEVEL.
+// The section is not created at all if its security cannot be built.
+NTSTATUS CreateSharedSection(PDRIVER_CONTEXT Context)
+{
+    NTSTATUS status;
+    PSHARED_SECTION shared = &Context->Shared;
+    UNICODE_STRING sectionName = RTL_CONSTANT_STRING(MAHF_SHARED_SECTION_KERNEL_NAME);
+    OBJECT_ATTRIBUTES objectAttributes;
+    SECURITY_DESCRIPTOR securityDescriptor;
+    ULONG aclLength;
+    PACL acl;
+    LARGE_INTEGER sectionSize;
+    SIZE_T viewSize = 0;
+    PMAHF_SHARED_TELEMETRY data;
     
-    // Apply to all cores
-    for (ULONG i = 0; i < Context->CoreCount; i++) {
-        ULONG targetFrequency = Context->BaseFrequency;
-        
-        // Calculate target frequency based on state
-        switch (State) {
-            case STATE_POWER_SAVE:
-                targetFrequency = Context->BaseFrequency * 6 / 10;
-                break;
-                
-            case STATE_BALANCED:
-                targetFrequency = Context->BaseFrequency;
-                break;
-                
-            case STATE_PERFORMANCE:
-                targetFrequency = Context->BaseFrequency * 12 / 10;
-                break;
-                
-            case STATE_EXTREME:
-                targetFrequency = Context->MaxFrequency;
-                break;
-        }
-        
-        // Update core frequency
-        status = UpdateCoreFrequency(Context, (UCHAR)i, targetFrequency);
-        if (!NT_SUCCESS(status)) {
-            DbgPrint("UpdateCoreFrequency failed for core %d: 0x%08X\n", i, status);
-            // Continue with other cores
+    C_ASSERT(FIELD_OFFSET(MAHF_SHARED_TELEMETRY, Generation) == 8);
+    C_ASSERT(FIELD_OFFSET(MAHF_SHARED_TELEMETRY, Performance) == 64);
+    C_ASSERT(FIELD_OFFSET(MAHF_SHARED_TELEMETRY, Cores) == 88);
+    
+    // SYSTEM: full access, Administrators: map for read. Each ACE holds
+    // its SID from SidStart on.
+    aclLength = sizeof(ACL) +
+                FIELD_OFFSET(ACCESS_ALLOWED_ACE, SidStart) + RtlLengthSid(SeExports->SeLocalSystemSid) +
+                FIELD_OFFSET(ACCESS_ALLOWED_ACE, SidStart) + RtlLengthSid(SeExports->SeAliasAdminsSid);
+    
+    acl = (PACL)ExAllocatePool2(POOL_FLAG_PAGED, aclLength, DRIVER_TAG);
+    if (!acl) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    status = RtlCreateSecurityDescriptor(&securityDescriptor, SECURITY_DESCRIPTOR_REVISION);
+    if (NT_SUCCESS(status)) {
+        status = RtlCreateAcl(acl, aclLength, ACL_REVISION);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlAddAccessAllowedAce(acl, ACL_REVISION, SECTION_ALL_ACCESS,
+                                        SeExports->SeLocalSystemSid);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlAddAccessAllowedAce(acl, ACL_REVISION, SECTION_MAP_READ | SECTION_QUERY,
+                                        SeExports->SeAliasAdminsSid);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlSetDaclSecurityDescriptor(&securityDescriptor, TRUE, acl, FALSE);
+    }
+    
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("CreateSharedSection: security descriptor failed: 0x%08X\n", status);
+        ExFreePoolWithTag(acl, DRIVER_TAG);
+        return status;
+    }
+    
+    InitializeObjectAttributes(&objectAttributes, &sectionName,
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                               NULL, &securityDescriptor);
+    
+    sectionSize.QuadPart = sizeof(MAHF_SHARED_TELEMETRY);
+    
+    // The new section keeps its own copy of the security descriptor
+    status = ZwCreateSection(&shared->SectionHandle, SECTION_ALL_ACCESS, &objectAttributes,
+                             &sectionSize, PAGE_READWRITE, SEC_COMMIT, NULL);
+    ExFreePoolWithTag(acl, DRIVER_TAG);
+    
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("ZwCreateSection failed: 0x%08X\n", status);
+        shared->SectionHandle = NULL;
+        return status;
+    }
+    
+    status = ObReferenceObjectByHandle(shared->SectionHandle, SECTION_MAP_WRITE, NULL,
+                                       KernelMode, &shared->SectionObject, NULL);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("ObReferenceObjectByHandle failed: 0x%08X\n", status);
+        DestroySharedSection(Context);
+        return status;
+    }
+    
+    status = MmMapViewInSystemSpace(shared->SectionObject, &shared->SystemView, &viewSize);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("MmMapViewInSystemSpace failed: 0x%08X\n", status);
+        shared->SystemView = NULL;
+        DestroySharedSection(Context);
+        return status;
+    }
+    
+    // Lock the view so the timer DPC never touches pageable memory
+    shared->Mdl = IoAllocateMdl(shared->SystemView, sizeof(MAHF_SHARED_TELEMETRY),
+                                FALSE, FALSE, NULL);
+    if (!shared->Mdl) {
+        DestroySharedSection(Context);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    __try {
+        MmProbeAndLockPages(shared->Mdl, KernelMode, IoWriteAccess);
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        IoFreeMdl(shared->Mdl);
+        shared->Mdl = NULL;
+        DestroySharedSection(Context);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    data = (PMAHF_SHARED_TELEMETRY)MmGetSystemAddressForMdlSafe(
+        shared->Mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (!data) {
+        DestroySharedSection(Context);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlZeroMemory(data, sizeof(MAHF_SHARED_TELEMETRY));
+    data->Version = MAHF_SHARED_VERSION;
+    KeMemoryBarrier();
+    data->Magic = MAHF_SHARED_MAGIC;
+    
+    shared->Data = data;
+    
+    DbgPrint("CreateSharedSection: %u bytes published\n",
+             (ULONG)sizeof(MAHF_SHARED_TELEMETRY));
+    
+    return STATUS_SUCCESS;
+}
+
+// Destroy Shared Section
+// Clients that still have the section mapped keep the pages alive; clearing
+// Magic tells them the data is no longer being updated.
+VOID DestroySharedSection(PDRIVER_CONTEXT Context)
+{
+    PSHARED_SECTION shared = &Context->Shared;
+    
+    if (shared->Data) {
+        shared->Data->Magic = 0;
+        shared->Data = NULL;
+    }
+    
+    if (shared->Mdl) {
+        if (shared->Mdl->MdlFlags & MDL_PAGES_LOCKED) {
+            MmUnlockPages(shared->Mdl);
         }
+        IoFreeMdl(shared->Mdl);
+        shared->Mdl = NULL;
+    }
+    
+    if (shared->SystemView) {
+        MmUnmapViewInSystemSpace(shared->SystemView);
+        shared->SystemView = NULL;
+    }
+    
+    if (shared->SectionObject) {
+        ObDereferenceObject(shared->SectionObject);
+        shared->SectionObject = NULL;
+    }
+    
+    if (shared->SectionHandle) {
+        ZwClose(shared->SectionHandle);
+        shared->SectionHandle = NULL;
+    }
+}
+
+// Publish Shared Telemetry
+// Single writer: an overlapping tick skips the publish rather than waiting,
+// the next tick catches up.
+VOID PublishSharedTelemetry(PDRIVER_CONTEXT Context)
+{
+    PSHARED_SECTION shared = &Context->Shared;
+    PMAHF_SHARED_TELEMETRY data = shared->Data;
+    ULONG coreCount;
+    LONG generation;
+    
+    if (!data || InterlockedCompareExchange(&shared->PublishBusy, 1, 0) != 0) {
+        return;
+    }
+    
+    coreCount = min(Context->ProcessorCount, MAHF_SHARED_MAX_CORES);
+    
+    // Odd generation: write in progress
+    generation = data->Generation;
+    WriteRelease(&data->Generation, generation + 1);
+    KeMemoryBarrier();
+    
+    data->CoreCount = coreCount;
+    data->UpdateTime = KeQueryInterruptTime();
+    data->TelemetrySequence = (ULONG64)ReadNoFence64(&Context->Telemetry.Head);
+    SumOperations(&data->TotalOperations, &data->FailedOperations);
+    data->GlobalState = Context->GlobalState;
+    data->GlobalPowerLimit = Context->GlobalPowerLimit;
+    data->GlobalThermalLimit = Context->GlobalThermalLimit;
+    data->TurboBoostEnabled = Context->TurboBoostEnabled;
+    ComputePerformanceData(Context, &data->Performance);
+    
+    for (ULONG i = 0; i < coreCount; i++) {
+        PMAHF_SHARED_CORE core = &data->Cores[i];
+        CPU_CORE_INFO info;
         
-        // Update core state
-        Context->Cores[i].CurrentState = State;
-        Context->Cores[i].CurrentFrequency = targetFrequency;
+        CoreReadInfo(&Context->Cores[i], &info);
+        core->CoreId = info.CoreId;
+        core->PackageId = info.PackageId;
+        core->CurrentFrequency = info.CurrentFrequency;
+        core->BaseFrequency = info.BaseFrequency;
+        core->MaxFrequency = info.MaxFrequency;
+        core->Temperature = info.Temperature;
+        core->Utilization = info.Utilization;
+        core->CurrentState = info.CurrentState;
     }
     
-    // Release lock
-    KeReleaseSpinLock(&Context->CoreLock, oldIrql);
+    // Even generation: snapshot consistent
+    KeMemoryBarrier();
+    WriteRelease(&data->Generation, generation + 2);
     
-    DbgPrint("SetPerformanceState: State %d applied to %d cores\n",
-             State, Context->CoreCount);
+    InterlockedExchange(&shared->PublishBusy, 0);
+}
+
+// Initialize Statistics
+// One block for every active processor in every group, zeroed. Kept across
+// a reset, so the counts run from load to unload.
+NTSTATUS InitializeStatistics(VOID)
+{
+    LARGE_INTEGER frequency;
+    ULONG cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    
+    g_Statistics.Cpus = (PCPU_STATS)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                                    cpuCount * sizeof(CPU_STATS), DRIVER_TAG);
+    if (!g_Statistics.Cpus) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    KeQueryPerformanceCounter(&frequency);
+    g_Statistics.Frequency = (ULONG64)frequency.QuadPart;
+    g_Statistics.CpuCount = cpuCount;
     
     return STATUS_SUCCESS;
 }
 
-// Get CPU Information
-NTSTATUS GetCPUInfo(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength)
+// Free Statistics
+VOID FreeStatistics(VOID)
 {
-    typedef struct _CPU_INFO_RESPONSE {
-        CHAR Vendor[13];
-        CHAR Brand[49];
-        ULONG Architecture;
-        ULONG CoreCount;
-        ULONG ThreadCount;
-        ULONG BaseFrequency;
-        ULONG MaxFrequency;
-        ULONG CurrentFrequency;
-        BOOLEAN HyperThreading;
-        BOOLEAN TurboBoost;
-    } CPU_INFO_RESPONSE, *PCPU_INFO_RESPONSE;
+    if (g_Statistics.Cpus) {
+        ExFreePoolWithTag(g_Statistics.Cpus, DRIVER_TAG);
+    }
     
-    if (!OutputBuffer || OutputLength < sizeof(CPU_INFO_RESPONSE)) {
-        return STATUS_BUFFER_TOO_SMALL;
+    RtlZeroMemory(&g_Statistics, sizeof(STATISTICS));
+}
+
+// Processor's Statistics Block
+// NULL until the blocks exist; any IRQL.
+PCPU_STATS CpuStats(ULONG Processor)
+{
+    if (!g_Statistics.Cpus) {
+        return NULL;
     }
     
-    PCPU_INFO_RESPONSE response = (PCPU_INFO_RESPONSE)OutputBuffer;
+    return &g_Statistics.Cpus[Processor % g_Statistics.CpuCount];
+}
+
+// Statistics Timestamp
+// Performance counter ticks; callable at any IRQL.
+ULONG64 StatTimestamp(VOID)
+{
+    return (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+// Record Latency
+// Adds the time since Start to a histogram. The maximum is raised with a
+// compare-exchange, which only loops while another update raced this one.
+VOID RecordLatency(PMAHF_LATENCY_HISTOGRAM Histogram, ULONG64 Start, NTSTATUS Status)
+{
+    ULONG64 elapsed = StatTimestamp() - Start;
+    ULONG64 frequency = g_Statistics.Frequency;
+    ULONG64 ns;
+    ULONG bucket = 0;
+    LONG64 maxNs;
     
-    // Fill response structure
-    RtlStringCbCopyA(response->Vendor, sizeof(response->Vendor), Context->VendorString);
-    RtlStringCbCopyA(response->Brand, sizeof(response->Brand), Context->BrandString);
-    response->Architecture = Context->Architecture;
-    response->CoreCount = Context->CoreCount;
-    response->ThreadCount = Context->ThreadCount;
-    response->BaseFrequency = Context->BaseFrequency;
-    response->MaxFrequency = Context->MaxFrequency;
-    response->CurrentFrequency = Context->Cores[0].CurrentFrequency; // First core frequency
-    response->HyperThreading = (Context->ThreadCount > Context->CoreCount);
-    response->TurboBoost = Context->TurboBoostEnabled;
+    // Split so that a long interval cannot overflow
+    ns = elapsed / frequency * 1000000000 + elapsed % frequency * 1000000000 / frequency;
     
-    return STATUS_SUCCESS;
+    while (bucket < MAHF_LATENCY_BUCKETS - 1 && (ns >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+    
+    InterlockedIncrement64((volatile LONG64*)&Histogram->Count);
+    InterlockedIncrement64((volatile LONG64*)&Histogram->Buckets[bucket]);
+    InterlockedAdd64((volatile LONG64*)&Histogram->TotalNs, (LONG64)ns);
+    if (!NT_SUCCESS(Status)) {
+        InterlockedIncrement64((volatile LONG64*)&Histogram->Failed);
+    }
+    
+    maxNs = ReadNoFence64((volatile LONG64*)&Histogram->MaxNs);
+    while ((ULONG64)maxNs < ns) {
+        LONG64 seen = InterlockedCompareExchange64((volatile LONG64*)&Histogram->MaxNs,
+                                                   (LONG64)ns, maxNs);
+        if (seen == maxNs) {
+            break;
+        }
+        maxNs = seen;
+    }
 }
 
-// Get Performance Data
-NTSTATUS GetPerformanceData(PDRIVER_CONTEXT Context, PVOID OutputBuffer, SIZE_T OutputLength)
+// Count Request
+// Totals only, for requests that never reached a handler.
+VOID CountRequest(NTSTATUS Status)
 {
-    typedef struct _PERFORMANCE_DATA_RESPONSE {
-        ULONG State;
-        ULONG Usage;
-        ULONG Temperature;
-        ULONG PowerConsumption;
-        ULONG CurrentFrequency;
-        ULONG Voltage;
-    } PERFORMANCE_DATA_RESPONSE, *PPERFORMANCE_DATA_RESPONSE;
+    PCPU_STATS stats = CpuStats(KeGetCurrentProcessorNumberEx(NULL));
     
-    if (!OutputBuffer || OutputLength < sizeof(PERFORMANCE_DATA_RESPONSE)) {
-        return STATUS_BUFFER_TOO_SMALL;
+    if (!stats) {
+        return;
     }
     
-    PPERFORMANCE_DATA_RESPONSE response = (PPERFORMANCE_DATA_RESPONSE)OutputBuffer;
+    InterlockedIncrement64((volatile LONG64*)&stats->TotalOperations);
+    if (!NT_SUCCESS(Status)) {
+        InterlockedIncrement64((volatile LONG64*)&stats->FailedOperations);
+    }
+}
+
+// Record Request
+// Totals, and the IOCTL's histogram when its function code has one.
+VOID RecordRequest(ULONG IoControlCode, ULONG64 Start, NTSTATUS Status)
+{
+    PCPU_STATS stats = CpuStats(KeGetCurrentProcessorNumberEx(NULL));
+    ULONG index = MAHF_STAT_IOCTL_INDEX(IoControlCode);
     
-    // Calculate averages
-    ULONG totalUsage = 0;
-    ULONG totalTemp = 0;
-    ULONG totalFreq = 0;
+    if (!stats) {
+        return;
+    }
     
-    for (ULONG i = 0; i < Context->CoreCount; i++) {
-        totalUsage += Context->Cores[i].Utilization;
-        totalTemp += Context->Cores[i].Temperature;
-        totalFreq += Context->Cores[i].CurrentFrequency;
+    InterlockedIncrement64((volatile LONG64*)&stats->TotalOperations);
+    if (!NT_SUCCESS(Status)) {
+        InterlockedIncrement64((volatile LONG64*)&stats->FailedOperations);
     }
     
-    // Fill response structure
-    response->State = Context->GlobalState;
-    response->Usage = totalUsage / Context->CoreCount;
-    response->Temperature = totalTemp / Context->CoreCount;
-    response->PowerConsumption = Context->CoreCount * 5; // Estimate
-    response->CurrentFrequency = totalFreq / Context->CoreCount;
-    response->Voltage = 1200; // Default voltage in mV
+    if (index < MAHF_STAT_IOCTL_COUNT) {
+        RecordLatency(&stats->Ioctl[index], Start, Status);
+    }
+}
+
+// Sum Operations
+// The two totals across processors, for the shared section and unload.
+VOID SumOperations(PULONG64 Total, PULONG64 Failed)
+{
+    *Total = 0;
+    *Failed = 0;
     
-    return STATUS_SUCCESS;
+    for (ULONG i = 0; i < g_Statistics.CpuCount; i++) {
+        PCPU_STATS stats = &g_Statistics.Cpus[i];
+        
+        *Total += (ULONG64)ReadNoFence64((volatile LONG64*)&stats->TotalOperations);
+        *Failed += (ULONG64)ReadNoFence64((volatile LONG64*)&stats->FailedOperations);
+    }
 }
 
-// Update Core Frequency
-NTSTATUS UpdateCoreFrequency(PDRIVER_CONTEXT Context, UCHAR CoreId, ULONG Frequency)
+// Merge Histogram
+VOID MergeHistogram(PMAHF_LATENCY_HISTOGRAM Total, PMAHF_LATENCY_HISTOGRAM Histogram)
 {
-    NTSTATUS status = STATUS_SUCCESS;
+    ULONG64 maxNs = (ULONG64)ReadNoFence64((volatile LONG64*)&Histogram->MaxNs);
     
-    if (CoreId >= Context->CoreCount) {
-        return STATUS_INVALID_PARAMETER;
+    Total->Count += (ULONG64)ReadNoFence64((volatile LONG64*)&Histogram->Count);
+    Total->Failed += (ULONG64)ReadNoFence64((volatile LONG64*)&Histogram->Failed);
+    Total->TotalNs += (ULONG64)ReadNoFence64((volatile LONG64*)&Histogram->TotalNs);
+    Total->MaxNs = max(Total->MaxNs, maxNs);
+    
+    for (ULONG i = 0; i < MAHF_LATENCY_BUCKETS; i++) {
+        Total->Buckets[i] += (ULONG64)ReadNoFence64((volatile LONG64*)&Histogram->Buckets[i]);
     }
+}
+
+// Get Statistics
+// Merges every processor's block into the caller's buffer. Nothing is
+// locked and the blocks are only read, so the processors counting into
+// them are not slowed down.
+NTSTATUS GetStatistics(PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
+{
+    PMAHF_STATISTICS response = (PMAHF_STATISTICS)OutputBuffer;
     
-    // Validate frequency range
-    if (Frequency < Context->BaseFrequency * 4 / 10 ||
-        Frequency > Context->MaxFrequency) {
-        return STATUS_INVALID_PARAMETER;
+    if (!OutputBuffer || OutputLength < sizeof(MAHF_STATISTICS)) {
+        return STATUS_BUFFER_TOO_SMALL;
     }
     
-    DbgPrint("UpdateCoreFrequency: Core %d -> %d MHz\n", CoreId, Frequency);
+    RtlZeroMemory(response, sizeof(MAHF_STATISTICS));
+    response->ProcessorCount = g_Statistics.CpuCount;
+    response->BucketCount = MAHF_LATENCY_BUCKETS;
+    SumOperations(&response->TotalOperations, &response->FailedOperations);
     
-    // For Intel/AMD, we would write to MSR registers
-    if (Context->Architecture == ARCH_INTEL || Context->Architecture == ARCH_AMD) {
-        ULONG64 msrValue;
+    for (ULONG i = 0; i < g_Statistics.CpuCount; i++) {
+        PCPU_STATS stats = &g_Statistics.Cpus[i];
         
-        // Read current PerfCtl MSR
-        status = ReadMSR(0x199, &msrValue);
-        if (!NT_SUCCESS(status)) {
-            DbgPrint("ReadMSR failed: 0x%08X\n", status);
-            return status;
+        for (ULONG j = 0; j < MAHF_STAT_IOCTL_COUNT; j++) {
+            MergeHistogram(&response->Ioctl[j], &stats->Ioctl[j]);
         }
         
-        // Modify frequency bits (simplified)
-        // In reality, this is more complex
-        ULONG64 newValue = msrValue & ~0xFF;
-        newValue |= (Frequency / 100) & 0xFF;
+        for (ULONG j = 0; j < MAHF_STAT_MSR_COUNT; j++) {
+            MergeHistogram(&response->Msr[j], &stats->Msr[j]);
+        }
         
-        // Write back to MSR
-        status = WriteMSR(0x199, newValue);
-        if (!NT_SUCCESS(status)) {
-            DbgPrint("WriteMSR failed: 0x%08X\n", status);
-            return status;
+        for (ULONG from = 0; from < MAHF_STAT_STATE_COUNT; from++) {
+            for (ULONG to = 0; to < MAHF_STAT_STATE_COUNT; to++) {
+                MergeHistogram(&response->Transition[from][to], &stats->Transition[from][to]);
+            }
         }
+        
+        MergeHistogram(&response->Retarget, &stats->Retarget);
     }
     
-    // Update core information
-    Context->Cores[CoreId].CurrentFrequency = Frequency;
+    *BytesReturned = sizeof(MAHF_STATISTICS);
+    return STATUS_SUCCESS;
+}
+
+// Initialize Trace
+// One ring per active processor, like the statistics blocks, and kept
+// across a reset for the same reason.
+NTSTATUS InitializeTrace(VOID)
+{
+    LARGE_INTEGER frequency;
+    ULONG cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
     
-    // Simulate temperature change based on frequency
-    if (Frequency > Context->BaseFrequency) {
-        Context->Cores[CoreId].Temperature = 
-            min(Context->Cores[CoreId].Temperature + 5, 100);
-    } else if (Frequency < Context->BaseFrequency) {
-        Context->Cores[CoreId].Temperature = 
-            max(Context->Cores[CoreId].Temperature - 2, 30);
+    g_Trace.Rings = (PTRACE_RING)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                                 cpuCount * sizeof(TRACE_RING), DRIVER_TAG);
+    if (!g_Trace.Rings) {
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
     
-    // Simulate utilization change
-    ULONG utilization = (Frequency * 100) / Context->MaxFrequency;
-    Context->Cores[CoreId].Utilization = min(utilization, 100);
+    KeQueryPerformanceCounter(&frequency);
+    g_Trace.Frequency = (ULONG64)frequency.QuadPart;
+    g_Trace.RingCount = cpuCount;
     
     return STATUS_SUCCESS;
 }
 
-// Read MSR
-NTSTATUS ReadMSR(ULONG Register, PULONG64 Value)
+// Free Trace
+VOID FreeTrace(VOID)
 {
-    if (!Value) {
-        return STATUS_INVALID_PARAMETER;
+    PTRACE_RING rings = g_Trace.Rings;
+    
+    // Writers check Rings first; they run on the queues and timers, all
+    // stopped by now
+    g_Trace.Rings = NULL;
+    if (rings) {
+        ExFreePoolWithTag(rings, DRIVER_TAG);
     }
     
-    // For demonstration, return simulated values
-    switch (Register) {
-        case 0x198: // IA32_PERF_STATUS
-            *Value = 0x0000000000001F40; // 8000 MHz
-            break;
-            
-        case 0x199: // IA32_PERF_CTL
-            *Value = 0x0000000000001B58; // 7000 MHz
-            break;
-            
-        case 0x19C: // IA32_THERM_STATUS
-            *Value = 0x0000000000000028; // 40°C
-            break;
-            
-        case 0xCE: // MSR_PLATFORM_INFO
-            *Value = 0x0000000008000800; // Base 3.0 GHz, Max 4.5 GHz
-            break;
-            
-        default:
-            *Value = 0;
-            return STATUS_NOT_SUPPORTED;
+    RtlZeroMemory(&g_Trace, sizeof(TRACE));
+}
+
+// Write Trace Record
+// Called through MAHF_TRACE once the level and category have passed. The
+// record goes into the current processor's ring at DISPATCH_LEVEL, so the
+// writer cannot be moved or preempted between claiming its slot and
+// publishing it. Another writer on the same processor can only be an
+// interrupt at a higher IRQL, which claims the next slot. A full ring
+// overwrites its oldest records; the drain counts them as lost.
+VOID MahfTraceWrite(ULONG Event, ULONG Arg0, ULONG Arg1, ULONG Arg2, ULONG Arg3)
+{
+    PTRACE_RING ring;
+    PMAHF_TRACE_RECORD record;
+    ULONG processor;
+    ULONG64 slot;
+    KIRQL oldIrql = DISPATCH_LEVEL;
+    BOOLEAN raised = FALSE;
+    
+    if (!g_Trace.Rings) {
+        return;
     }
     
-    return STATUS_SUCCESS;
+    if (KeGetCurrentIrql() < DISPATCH_LEVEL) {
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+        raised = TRUE;
+    }
+    
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+    ring = &g_Trace.Rings[processor % g_Trace.RingCount];
+    slot = (ULONG64)InterlockedIncrement64(&ring->Head) - 1;
+    record = &ring->Records[slot % MAHF_TRACE_RING_SIZE];
+    
+    // A stamp one behind the slot's marks it as being written
+    WriteNoFence((volatile LONG*)&record->Stamp, (LONG)(ULONG)slot);
+    KeMemoryBarrier();
+    
+    record->Timestamp = StatTimestamp();
+    record->Event = (USHORT)Event;
+    record->Processor = (USHORT)processor;
+    record->Args[0] = Arg0;
+    record->Args[1] = Arg1;
+    record->Args[2] = Arg2;
+    record->Args[3] = Arg3;
+    
+    WriteRelease((volatile LONG*)&record->Stamp, (LONG)(ULONG)(slot + 1));
+    
+    if (raised) {
+        KeLowerIrql(oldIrql);
+    }
 }
 
-// Write MSR
-NTSTATUS WriteMSR(ULONG Register, ULONG64 Value)
+// Set Trace
+NTSTATUS SetTrace(PMAHF_TRACE_CONFIG Config)
 {
-    UNREFERENCED_PARAMETER(Register);
-    UNREFERENCED_PARAMETER(Value);
+    if (Config->Level > MAHF_TRACE_LEVEL_VERBOSE ||
+        (Config->Categories & ~MAHF_TRACE_CATEGORY_ALL) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    // Levels above MAHF_TRACE_MAX_LEVEL are accepted and have no effect;
+    // the drain reports both so a client can tell
+    InterlockedExchange((volatile LONG*)&g_TraceLevel, (LONG)Config->Level);
+    InterlockedExchange((volatile LONG*)&g_TraceCategories, (LONG)Config->Categories);
     
-    // In a real driver, you would write to the MSR
-    // This is a placeholder implementation
     return STATUS_SUCCESS;
 }
 
-// Get CPUID
-NTSTATUS GetCPUID(ULONG Function, ULONG SubFunction, PULONG32 Registers)
+// Drain Trace
+// Copies the records written since the last drain, ring by ring, and moves
+// each ring's read position past them. Runs on the control queue, so only
+// one drain touches the positions at a time; writers are never held up.
+// A slot whose stamp is behind the one expected is still being written and
+// ends that ring's part of this drain; one ahead was overwritten and is
+// counted lost. A drain that fills the buffer starts the next one at the
+// ring where it stopped, so a busy processor cannot starve the others.
+NTSTATUS DrainTrace(PVOID OutputBuffer, SIZE_T OutputLength, PSIZE_T BytesReturned)
 {
-    if (!Registers) {
-        return STATUS_INVALID_PARAMETER;
+    PMAHF_TRACE_DRAIN_RESPONSE response = (PMAHF_TRACE_DRAIN_RESPONSE)OutputBuffer;
+    SIZE_T headerSize = FIELD_OFFSET(MAHF_TRACE_DRAIN_RESPONSE, Records);
+    ULONG capacity;
+    ULONG count = 0;
+    ULONG64 lost = 0;
+    ULONG ringCount = g_Trace.RingCount;
+    
+    if (!OutputBuffer || OutputLength < headerSize) {
+        return STATUS_BUFFER_TOO_SMALL;
     }
     
-    // Simplified CPUID simulation
-    if (Function == 0) {
-        // Vendor string "GenuineIntel"
-        Registers[0] = 0x0000000B;
-        Registers[1] = 0x756E6547;
-        Registers[2] = 0x6C65746E;
-        Registers[3] = 0x49656E69;
-    } else if (Function == 1) {
-        // Processor info
-        Registers[0] = 0x000906A0;
-        Registers[1] = 0x000C0800;
-        Registers[2] = 0x7FFAFBBF;
-        Registers[3] = 0xBFEBFBFF;
+    capacity = (ULONG)min((OutputLength - headerSize) / sizeof(MAHF_TRACE_RECORD), MAXULONG);
+    
+    for (ULONG n = 0; n < ringCount && count < capacity; n++) {
+        ULONG index = (g_Trace.NextRing + n) % ringCount;
+        PTRACE_RING ring = &g_Trace.Rings[index];
+        ULONG64 head = (ULONG64)ReadAcquire64(&ring->Head);
+        ULONG64 tail = ring->Tail;
+        
+        if (head - tail > MAHF_TRACE_RING_SIZE) {
+            lost += head - tail - MAHF_TRACE_RING_SIZE;
+            tail = head - MAHF_TRACE_RING_SIZE;
+        }
+        
+        while (tail < head && count < capacity) {
+            PMAHF_TRACE_RECORD record = &ring->Records[tail % MAHF_TRACE_RING_SIZE];
+            ULONG expected = (ULONG)(tail + 1);
+            LONG age = (LONG)((ULONG)ReadAcquire((volatile LONG*)&record->Stamp) - expected);
+            
+            if (age < 0) {
+                break;
+            }
+            
+            if (age == 0) {
+                response->Records[count] = *record;
+                KeMemoryBarrier();
+                
+                // Overwritten while being copied
+                if ((ULONG)ReadNoFence((volatile LONG*)&record->Stamp) == expected) {
+                    count++;
+                } else {
+                    lost++;
+                }
+            } else {
+                lost++;
+            }
+            
+            tail++;
+        }
+        
+        ring->Tail = tail;
+        
+        if (count == capacity) {
+            g_Trace.NextRing = index;
+        }
     }
     
+    response->Frequency = g_Trace.Frequency;
+    response->LostRecords = lost;
+    response->RecordCount = count;
+    response->Level = g_TraceLevel;
+    response->Categories = g_TraceCategories;
+    response->MaxLevel = MAHF_TRACE_MAX_LEVEL;
+    
+    *BytesReturned = headerSize + (SIZE_T)count * sizeof(MAHF_TRACE_RECORD);
     return STATUS_SUCCESS;
 }
 
@@ -851,12 +5325,22 @@ VOID OnDeviceContextCleanup(WDFOBJECT Device)
 // Cleanup Driver Context
 VOID CleanupDriverContext(PDRIVER_CONTEXT Context)
 {
+    ULONG64 totalOperations;
+    ULONG64 failedOperations;
+    
     DbgPrint("CleanupDriverContext: Starting cleanup\n");
     
     // Print statistics
+    SumOperations(&totalOperations, &failedOperations);
     DbgPrint("Driver Statistics:\n");
-    DbgPrint("  Total Operations: %llu\n", Context->TotalOperations);
-    DbgPrint("  Failed Operations: %llu\n", Context->FailedOperations);
+    DbgPrint("  Total Operations: %llu\n", totalOperations);
+    DbgPrint("  Failed Operations: %llu\n", failedOperations);
+    
+    DestroySharedSection(Context);
+    FreeCoreMetrics(Context);
+    FreeTelemetry(Context);
+    FreeStatistics();
+    FreeTrace();
     
     DbgPrint("CleanupDriverContext: Cleanup completed\n");
 }
@@ -1,7 +1,14 @@
 #ifndef _MAHF_CORE_H_
 #define _MAHF_CORE_H_
 
+#ifdef _KERNEL_MODE
 #include <ntddk.h>
+#elif defined(MAHF_HOST)
+#include "mahf_host.h"
+#else
+#include <windows.h>
+#include <winioctl.h>
+#endif
 
 // Device Interface GUID
 // {8F9D7A5B-3C2E-4B1F-9A6D-E4C5B7A8D9F0}
@@ -11,10 +18,12 @@ DEFINE_GUID(GUID_DEVINTERFACE_MAHF_CPU,
 // IOCTL Definitions
 #define FILE_DEVICE_MAHF_CPU 0x00008880
 
-#define CTL_CODE_MAHF( Function, Method, Access ) (                 \
-    ((FILE_DEVICE_MAHF_CPU) << 16) | ((Access) << 14) |             \
+// Unsigned, like the ULONG codes it is compared with; the device type
+// sets bit 31, which a signed shift would overflow
+#define CTL_CODE_MAHF( Function, Method, Access ) ((ULONG)(          \
+    ((ULONG)(FILE_DEVICE_MAHF_CPU) << 16) | ((Access) << 14) |      \
     ((Function) << 2) | (Method)                                    \
-)
+))
 
 #define IOCTL_MAHF_GET_CPU_INFO \
     CTL_CODE_MAHF(0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -28,6 +37,66 @@ DEFINE_GUID(GUID_DEVINTERFACE_MAHF_CPU,
 #define IOCTL_MAHF_RESET_DRIVER \
     CTL_CODE_MAHF(0x803, METHOD_BUFFERED, FILE_WRITE_DATA)
 
+#define IOCTL_MAHF_DRAIN_TELEMETRY \
+    CTL_CODE_MAHF(0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_BATCH \
+    CTL_CODE_MAHF(0x805, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_SET_LIMITS \
+    CTL_CODE_MAHF(0x806, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_GET_TOPOLOGY \
+    CTL_CODE_MAHF(0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_GET_METRIC_SUMMARY \
+    CTL_CODE_MAHF(0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_SET_GOVERNOR \
+    CTL_CODE_MAHF(0x809, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_GET_GOVERNOR \
+    CTL_CODE_MAHF(0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_GET_THERMAL \
+    CTL_CODE_MAHF(0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_GET_ENERGY \
+    CTL_CODE_MAHF(0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_SET_PROFILE \
+    CTL_CODE_MAHF(0x80D, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_SELECT_PROFILE \
+    CTL_CODE_MAHF(0x80E, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_GET_PROFILES \
+    CTL_CODE_MAHF(0x80F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_DELETE_PROFILE \
+    CTL_CODE_MAHF(0x810, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_WAIT_NOTIFICATION \
+    CTL_CODE_MAHF(0x811, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MAHF_SET_NOTIFICATION \
+    CTL_CODE_MAHF(0x812, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_GET_STATISTICS \
+    CTL_CODE_MAHF(0x813, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Binary trace, see mahf_trace.h. Draining consumes the records, so both
+// are control IOCTLs.
+#define IOCTL_MAHF_SET_TRACE \
+    CTL_CODE_MAHF(0x814, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define IOCTL_MAHF_DRAIN_TRACE \
+    CTL_CODE_MAHF(0x815, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+// IOCTLs that require write access change driver state and are serialized
+// on the control queue; everything else is dispatched in parallel.
+#define IOCTL_IS_CONTROL(Code) ((((Code) >> 14) & FILE_WRITE_ACCESS) != 0)
+
 // Performance States
 #define PERFORMANCE_STATE_POWER_SAVE    0
 #define PERFORMANCE_STATE_BALANCED      1
@@ -40,4 +109,475 @@ DEFINE_GUID(GUID_DEVINTERFACE_MAHF_CPU,
 #define CPU_ARCH_AMD        2
 #define CPU_ARCH_ARM        3
 
+// Telemetry
+#define MAHF_TELEMETRY_RING_SIZE        8192    // Minimum samples, power of two
+#define MAHF_TELEMETRY_MIN_PERIOD_MS    1       // 1 kHz
+#define MAHF_TELEMETRY_MAX_PERIOD_MS    1000
+
+// One per-core sample taken by the driver's telemetry timer
+typedef struct _MAHF_TELEMETRY_SAMPLE {
+    ULONG64 Sequence;           // Monotonic across all cores
+    ULONG64 Timestamp;          // Interrupt time, 100 ns units
+    ULONG64 PerfStatus;         // Raw IA32_PERF_STATUS
+    ULONG64 ThermalStatus;      // Raw IA32_THERM_STATUS
+    ULONG CoreId;
+    ULONG State;
+    ULONG Frequency;            // MHz
+    ULONG Temperature;          // Celsius
+    ULONG Utilization;          // Percent
+    ULONG Reserved;
+} MAHF_TELEMETRY_SAMPLE, *PMAHF_TELEMETRY_SAMPLE;
+
+// IOCTL_MAHF_DRAIN_TELEMETRY input
+typedef struct _MAHF_TELEMETRY_DRAIN_REQUEST {
+    ULONG64 StartSequence;      // NextSequence from the previous drain, 0 first time
+} MAHF_TELEMETRY_DRAIN_REQUEST, *PMAHF_TELEMETRY_DRAIN_REQUEST;
+
+// IOCTL_MAHF_DRAIN_TELEMETRY output, followed by SampleCount samples
+typedef struct _MAHF_TELEMETRY_DRAIN_RESPONSE {
+    ULONG64 NextSequence;       // Pass back as StartSequence on the next drain
+    ULONG64 LostSamples;        // Overwritten before they could be drained
+    ULONG SampleCount;
+    ULONG PeriodMs;
+    MAHF_TELEMETRY_SAMPLE Samples[ANYSIZE_ARRAY];
+} MAHF_TELEMETRY_DRAIN_RESPONSE, *PMAHF_TELEMETRY_DRAIN_RESPONSE;
+
+// IOCTL_MAHF_SET_PERFORMANCE_STATE output (optional)
+// Bit N of CoreMask is set when logical processor N accepted the new
+// PERF_CTL value.
+#define MAHF_MAX_PROCESSORS     256
+#define MAHF_CORE_MASK_WORDS    (MAHF_MAX_PROCESSORS / 64)
+
+typedef struct _MAHF_STATE_RESULT {
+    ULONG ProcessorCount;
+    ULONG FailedCount;
+    ULONG64 CoreMask[MAHF_CORE_MASK_WORDS];
+} MAHF_STATE_RESULT, *PMAHF_STATE_RESULT;
+
+// Processor topology
+// One entry per logical processor, in Windows processor index order. IDs
+// are from CPUID (leaf 0x1F or 0xB on Intel, 0x8000001E on AMD): SMT
+// siblings share PackageId/CoreId, cores sharing a clock or L2 on hybrid
+// parts share ModuleId.
+#define MAHF_CORE_TYPE_UNKNOWN      0
+#define MAHF_CORE_TYPE_PERFORMANCE  1
+#define MAHF_CORE_TYPE_EFFICIENCY   2
+
+#define MAHF_TOPOLOGY_FLAG_HYBRID   0x00000001
+
+typedef struct _MAHF_TOPOLOGY_ENTRY {
+    ULONG ApicId;               // x2APIC / extended APIC ID
+    USHORT PackageId;
+    USHORT DieId;               // Within the package
+    USHORT ModuleId;            // Within the package
+    USHORT CoreId;              // Within the package
+    UCHAR SmtId;                // Thread within the core
+    UCHAR CoreType;             // MAHF_CORE_TYPE_*
+    USHORT Reserved;
+} MAHF_TOPOLOGY_ENTRY, *PMAHF_TOPOLOGY_ENTRY;
+
+// IOCTL_MAHF_GET_TOPOLOGY output, followed by EntryCount entries. Entries
+// that do not fit the buffer are left out; ProcessorCount is always set.
+typedef struct _MAHF_TOPOLOGY {
+    ULONG ProcessorCount;
+    ULONG EntryCount;
+    ULONG PackageCount;
+    ULONG CoreCount;            // Physical cores
+    ULONG PerformanceCoreCount;
+    ULONG EfficiencyCoreCount;
+    ULONG Flags;
+    ULONG Reserved;
+    MAHF_TOPOLOGY_ENTRY Entries[ANYSIZE_ARRAY];
+} MAHF_TOPOLOGY, *PMAHF_TOPOLOGY;
+
+// IOCTL_MAHF_SET_LIMITS input
+typedef struct _MAHF_LIMITS {
+    ULONG ThermalLimit;         // Celsius
+    ULONG PowerLimit;           // Watts
+} MAHF_LIMITS, *PMAHF_LIMITS;
+
+#define MAHF_THERMAL_LIMIT_MIN  40
+#define MAHF_THERMAL_LIMIT_MAX  110
+#define MAHF_POWER_LIMIT_MIN    1
+#define MAHF_POWER_LIMIT_MAX    1000
+
+// Batched commands
+// IOCTL_MAHF_BATCH runs up to MAHF_BATCH_MAX_COMMANDS sub-commands in one
+// dispatch on the control queue. Sub-command inputs are carried in the batch
+// input after the command table, each at an 8-byte aligned offset or the
+// batch is rejected; each sub-command's output is placed in the
+// batch output after the result table, in command order, at 8-byte aligned
+// offsets reported in its result. Batches cannot be nested.
+#define MAHF_BATCH_MAX_COMMANDS         32
+#define MAHF_BATCH_FLAG_STOP_ON_ERROR   0x00000001
+#define MAHF_BATCH_ALIGN(Length)        (((Length) + 7) & ~7UL)
+
+typedef struct _MAHF_BATCH_COMMAND {
+    ULONG IoControlCode;
+    ULONG InputOffset;          // From the start of the batch input
+    ULONG InputLength;
+    ULONG OutputLength;         // Output bytes reserved for this command
+} MAHF_BATCH_COMMAND, *PMAHF_BATCH_COMMAND;
+
+typedef struct _MAHF_BATCH_REQUEST {
+    ULONG CommandCount;
+    ULONG Flags;
+    MAHF_BATCH_COMMAND Commands[ANYSIZE_ARRAY];
+} MAHF_BATCH_REQUEST, *PMAHF_BATCH_REQUEST;
+
+typedef struct _MAHF_BATCH_RESULT {
+    LONG Status;                // NTSTATUS of the sub-command
+    ULONG OutputOffset;         // From the start of the batch output
+    ULONG BytesReturned;
+    ULONG Reserved;
+} MAHF_BATCH_RESULT, *PMAHF_BATCH_RESULT;
+
+typedef struct _MAHF_BATCH_RESPONSE {
+    ULONG CommandCount;         // Sub-commands executed
+    ULONG FailedCount;
+    MAHF_BATCH_RESULT Results[ANYSIZE_ARRAY];
+} MAHF_BATCH_RESPONSE, *PMAHF_BATCH_RESPONSE;
+
+// Aggregated performance data (IOCTL_MAHF_GET_PERFORMANCE_DATA output)
+typedef struct _MAHF_PERFORMANCE_DATA {
+    ULONG State;
+    ULONG Usage;
+    ULONG Temperature;
+    ULONG PowerConsumption;     // Watts, package domain; 0 if not metered
+    ULONG CurrentFrequency;
+    ULONG Voltage;              // mV, 0 if not measured
+} MAHF_PERFORMANCE_DATA, *PMAHF_PERFORMANCE_DATA;
+
+// IOCTL_MAHF_GET_METRIC_SUMMARY output
+// Distribution of each per-core metric across all logical processors.
+#define MAHF_METRIC_FREQUENCY       0
+#define MAHF_METRIC_TEMPERATURE     1
+#define MAHF_METRIC_UTILIZATION     2
+#define MAHF_METRIC_COUNT           3
+
+typedef struct _MAHF_METRIC_STATS {
+    ULONG64 Sum;
+    ULONG Min;
+    ULONG Max;
+    ULONG Mean;
+    ULONG Variance;             // Population variance, units squared
+} MAHF_METRIC_STATS, *PMAHF_METRIC_STATS;
+
+typedef struct _MAHF_METRIC_SUMMARY {
+    ULONG ProcessorCount;
+    ULONG Reserved;
+    MAHF_METRIC_STATS Metrics[MAHF_METRIC_COUNT];
+} MAHF_METRIC_SUMMARY, *PMAHF_METRIC_SUMMARY;
+
+// Utilization governor
+// While enabled, every PeriodMs each logical processor's frequency is
+// scaled toward the middle of the [DownThreshold, UpThreshold] band once
+// its utilization has stayed outside the band for HysteresisSamples
+// periods, and no more often than RateLimitMs per processor. Setting a
+// fixed performance state disables the governor.
+#define MAHF_GOVERNOR_MIN_PERIOD_MS     10
+#define MAHF_GOVERNOR_MAX_PERIOD_MS     1000
+#define MAHF_GOVERNOR_MAX_HYSTERESIS    100
+#define MAHF_GOVERNOR_MAX_RATE_LIMIT_MS 60000
+
+typedef struct _MAHF_GOVERNOR_CONFIG {
+    ULONG Enabled;
+    ULONG PeriodMs;
+    ULONG UpThreshold;          // Percent
+    ULONG DownThreshold;        // Percent, below UpThreshold
+    ULONG HysteresisSamples;
+    ULONG RateLimitMs;
+} MAHF_GOVERNOR_CONFIG, *PMAHF_GOVERNOR_CONFIG;
+
+typedef struct _MAHF_GOVERNOR_STATS {
+    ULONG64 Ticks;
+    ULONG64 SkippedTicks;       // Control path was busy
+    ULONG64 Raises;
+    ULONG64 Lowers;
+    ULONG64 HeldByHysteresis;
+    ULONG64 HeldByRateLimit;
+    ULONG64 LastTickTime;       // Interrupt time, 100 ns units
+    ULONG LastAverageUtilization;
+    ULONG LastAverageFrequency;
+} MAHF_GOVERNOR_STATS, *PMAHF_GOVERNOR_STATS;
+
+// IOCTL_MAHF_GET_GOVERNOR output
+typedef struct _MAHF_GOVERNOR_STATUS {
+    MAHF_GOVERNOR_CONFIG Config;
+    MAHF_GOVERNOR_STATS Stats;
+} MAHF_GOVERNOR_STATUS, *PMAHF_GOVERNOR_STATUS;
+
+// Thermal controller
+// A PID loop on the hottest digital thermal sensor lowers a frequency cap
+// before the part reaches its own PROCHOT throttle. The setpoint is the
+// thermal limit, but at least Margin degrees below TjMax. Every policy
+// (fixed state, governor) is clamped to the cap.
+#define MAHF_THERMAL_FLAG_SENSORS   0x00000001  // Sensors present, loop running
+#define MAHF_THERMAL_FLAG_CAPPED    0x00000002  // Cap below maximum frequency
+#define MAHF_THERMAL_FLAG_PROCHOT   0x00000004  // Hardware throttle seen last period
+
+typedef struct _MAHF_THERMAL_STATUS {
+    ULONG Flags;
+    ULONG TjMax;                // Celsius
+    ULONG Setpoint;
+    ULONG HottestTemperature;   // Any core or package sensor
+    ULONG HottestProcessor;
+    ULONG PackageTemperature;   // Hottest package sensor
+    ULONG FrequencyCap;         // MHz
+    ULONG PeriodMs;
+    LONG ProportionalTerm;      // MHz
+    LONG IntegralTerm;
+    LONG DerivativeTerm;
+    ULONG Reserved;
+    ULONG64 Ticks;
+    ULONG64 SkippedTicks;       // Control path was busy
+    ULONG64 CapChanges;
+    ULONG64 ProchotSamples;     // Sensor reads with PROCHOT asserted
+} MAHF_THERMAL_STATUS, *PMAHF_THERMAL_STATUS;
+
+// Energy metering and power limit
+// RAPL energy counters are 32 bits and wrap within minutes under load; the
+// driver folds them into 64-bit totals every period. Power is averaged over
+// the configured window. Each package is held to PowerLimit watts by a
+// feedback loop on a per-package frequency cap, alongside the thermal cap.
+#define MAHF_POWER_DOMAIN_PACKAGE   0
+#define MAHF_POWER_DOMAIN_CORES     1
+#define MAHF_POWER_DOMAIN_DRAM      2
+#define MAHF_POWER_DOMAIN_COUNT     3
+
+#define MAHF_ENERGY_FLAG_METERING   0x00000001  // RAPL present, loop running
+#define MAHF_ENERGY_FLAG_CAPPED     0x00000002  // A package cap is below maximum
+#define MAHF_ENERGY_FLAG_VOLTAGE    0x00000004  // Voltage is measured
+
+typedef struct _MAHF_ENERGY_DOMAIN {
+    ULONG64 EnergyMicrojoules;  // All packages, since driver start or reset
+    ULONG PowerMilliwatts;      // Average over WindowMs
+    ULONG Supported;
+} MAHF_ENERGY_DOMAIN, *PMAHF_ENERGY_DOMAIN;
+
+typedef struct _MAHF_ENERGY_STATUS {
+    ULONG Flags;
+    ULONG PowerLimit;           // Watts per package
+    ULONG PeriodMs;
+    ULONG WindowMs;             // Span the averages actually cover
+    ULONG FrequencyCap;         // MHz, lowest package cap
+    ULONG Voltage;              // mV, highest core; 0 if not measured
+    ULONG64 Ticks;
+    ULONG64 SkippedTicks;       // Control path was busy
+    ULONG64 CapChanges;
+    MAHF_ENERGY_DOMAIN Domains[MAHF_POWER_DOMAIN_COUNT];
+} MAHF_ENERGY_STATUS, *PMAHF_ENERGY_STATUS;
+
+// Performance profiles
+// A profile is a named operating point: a frequency range per core type,
+// an energy/performance bias, whether turbo ratios may be used, and
+// optional thermal and power limits. Up to MAHF_MAX_PROFILES are kept in
+// the service Parameters key and survive reboots. Selecting a profile runs
+// every processor at its type's ceiling, or lets the governor move within
+// the range when it is enabled; the thermal and power caps still apply.
+// Setting a fixed performance state deselects the active profile.
+#define MAHF_MAX_PROFILES           16
+#define MAHF_PROFILE_NAME_LENGTH    32      // WCHARs, including the NUL
+#define MAHF_CORE_TYPE_COUNT        3
+#define MAHF_ENERGY_BIAS_MAX        15      // 0 performance, 15 energy saving
+#define MAHF_PROFILE_NONE           0xFFFFFFFF
+
+// MHz; 0 leaves that end unbounded. A core type whose range is all zero
+// uses the MAHF_CORE_TYPE_UNKNOWN entry, so single-type parts only need that.
+typedef struct _MAHF_FREQUENCY_RANGE {
+    ULONG MinFrequency;
+    ULONG MaxFrequency;
+} MAHF_FREQUENCY_RANGE, *PMAHF_FREQUENCY_RANGE;
+
+// IOCTL_MAHF_SET_PROFILE input; replaces a profile of the same name
+typedef struct _MAHF_PROFILE {
+    WCHAR Name[MAHF_PROFILE_NAME_LENGTH];
+    MAHF_FREQUENCY_RANGE Frequency[MAHF_CORE_TYPE_COUNT];  // By MAHF_CORE_TYPE_*
+    ULONG EnergyPerformanceBias;
+    ULONG TurboEnabled;         // Ceilings above base frequency are allowed
+    ULONG ThermalLimit;         // Celsius, 0 keeps the current limit
+    ULONG PowerLimit;           // Watts, 0 keeps the current limit
+} MAHF_PROFILE, *PMAHF_PROFILE;
+
+// IOCTL_MAHF_SELECT_PROFILE and IOCTL_MAHF_DELETE_PROFILE input. Selecting
+// an empty name deselects the active profile.
+typedef struct _MAHF_PROFILE_NAME {
+    WCHAR Name[MAHF_PROFILE_NAME_LENGTH];
+} MAHF_PROFILE_NAME, *PMAHF_PROFILE_NAME;
+
+// IOCTL_MAHF_GET_PROFILES output
+typedef struct _MAHF_PROFILE_LIST {
+    ULONG ProfileCount;
+    ULONG ActiveIndex;          // Into Profiles, MAHF_PROFILE_NONE if none
+    MAHF_PROFILE Profiles[MAHF_MAX_PROFILES];
+} MAHF_PROFILE_LIST, *PMAHF_PROFILE_LIST;
+
+// Notifications
+// The driver records condition changes as events in a ring of
+// MAHF_NOTIFY_RING_SIZE, numbered like telemetry samples. A wait completes
+// as soon as the ring holds an event at or after StartSequence whose type
+// is in EventMask; until then the driver keeps it pending, so clients block
+// on overlapped I/O instead of polling. Cancel a pending wait with CancelIoEx.
+// Default thresholds are device-wide (IOCTL_MAHF_SET_NOTIFICATION) and every
+// event is edge-triggered: it is posted once when a condition starts or ends.
+// A wait may bring its own thresholds instead (MAHF_NOTIFY_WAIT_CONFIG).
+#define MAHF_NOTIFY_RING_SIZE       256     // Events, power of two
+#define MAHF_NOTIFY_MAX_EVENTS      16      // Per completed wait
+
+#define MAHF_NOTIFY_TEMPERATURE     0x00000001  // Hottest core crossed the threshold
+#define MAHF_NOTIFY_STATE           0x00000002  // Performance state or profile changed
+#define MAHF_NOTIFY_THROTTLE        0x00000004  // A frequency cap engaged or released, or PROCHOT
+#define MAHF_NOTIFY_UTILIZATION     0x00000008  // Average utilization left or re-entered the band
+#define MAHF_NOTIFY_ALL             0x0000000F
+
+// Detail of a MAHF_NOTIFY_THROTTLE event
+#define MAHF_NOTIFY_THROTTLE_THERMAL    1
+#define MAHF_NOTIFY_THROTTLE_POWER      2
+#define MAHF_NOTIFY_THROTTLE_PROCHOT    3
+
+// Detail of a MAHF_NOTIFY_UTILIZATION event
+#define MAHF_NOTIFY_BAND_INSIDE     0
+#define MAHF_NOTIFY_BAND_ABOVE      1
+#define MAHF_NOTIFY_BAND_BELOW      2
+
+// IOCTL_MAHF_SET_NOTIFICATION input
+typedef struct _MAHF_NOTIFY_CONFIG {
+    ULONG TemperatureThreshold;     // Celsius, 0 disables
+    ULONG TemperatureHysteresis;    // Degrees below the threshold to re-arm
+    ULONG UtilizationLow;           // Percent; a band of 0-0 disables
+    ULONG UtilizationHigh;
+} MAHF_NOTIFY_CONFIG, *PMAHF_NOTIFY_CONFIG;
+
+// Value and Detail by type:
+//   TEMPERATURE  hottest core, Celsius; 1 over the threshold, 0 back under
+//   STATE        PERFORMANCE_STATE_*; 1 if a profile is active
+//   THROTTLE     cap in MHz (maximum frequency when released), or Celsius
+//                for PROCHOT; MAHF_NOTIFY_THROTTLE_*
+//   UTILIZATION  average percent; MAHF_NOTIFY_BAND_*
+typedef struct _MAHF_NOTIFY_EVENT {
+    ULONG64 Sequence;
+    ULONG64 Timestamp;          // Interrupt time, 100 ns units
+    ULONG Type;                 // One MAHF_NOTIFY_* bit
+    ULONG Value;
+    ULONG Detail;
+    ULONG Reserved;
+} MAHF_NOTIFY_EVENT, *PMAHF_NOTIFY_EVENT;
+
+// IOCTL_MAHF_WAIT_NOTIFICATION input
+typedef struct _MAHF_NOTIFY_WAIT {
+    ULONG64 StartSequence;      // NextSequence from the previous wait, 0 first time
+    ULONG EventMask;            // MAHF_NOTIFY_* bits
+    ULONG Reserved;
+} MAHF_NOTIFY_WAIT, *PMAHF_NOTIFY_WAIT;
+
+// IOCTL_MAHF_WAIT_NOTIFICATION input with the caller's own thresholds, which
+// nothing else sees. The wait skips the TEMPERATURE and UTILIZATION events
+// posted for the device-wide ones and instead completes with one of its own
+// when the latest telemetry tick puts a condition on the other side of
+// Config from the state given here. Pass back the Detail of the last such
+// event of each type; 0 (under, inside the band) the first time. These
+// events are not in the ring, and their Sequence is the NextSequence they
+// were returned with.
+typedef struct _MAHF_NOTIFY_WAIT_CONFIG {
+    MAHF_NOTIFY_WAIT Wait;
+    MAHF_NOTIFY_CONFIG Config;
+    ULONG OverTemperature;      // Detail of the last TEMPERATURE event
+    ULONG Band;                 // Detail of the last UTILIZATION event
+} MAHF_NOTIFY_WAIT_CONFIG, *PMAHF_NOTIFY_WAIT_CONFIG;
+
+// IOCTL_MAHF_WAIT_NOTIFICATION output
+typedef struct _MAHF_NOTIFY_RESPONSE {
+    ULONG64 NextSequence;       // Pass back as StartSequence on the next wait
+    ULONG64 LostEvents;         // Overwritten before this wait could see them
+    ULONG EventCount;
+    ULONG Reserved;
+    MAHF_NOTIFY_EVENT Events[MAHF_NOTIFY_MAX_EVENTS];
+} MAHF_NOTIFY_RESPONSE, *PMAHF_NOTIFY_RESPONSE;
+
+// Statistics
+// Every processor counts into its own cache lines; IOCTL_MAHF_GET_STATISTICS
+// adds them up when asked. Each counter is exact, but the counters of one
+// histogram may be read a few operations apart. Latencies are measured with
+// the performance counter, in nanoseconds: bucket N holds times from 2^N up
+// to 2^(N+1) ns (bucket 0 also holds 0), the last one everything longer.
+#define MAHF_LATENCY_BUCKETS        32
+
+// IOCTLs by function code, 0x800 first; anything else is only counted in
+// the totals. A batch is timed as one IOCTL_MAHF_BATCH, and a notification
+// wait until it is completed or parked.
+#define MAHF_STAT_IOCTL_FIRST       0x800
+#define MAHF_STAT_IOCTL_COUNT       22
+#define MAHF_STAT_IOCTL_INDEX(Code) ((((Code) >> 2) & 0xFFF) - MAHF_STAT_IOCTL_FIRST)
+
+// Hardware accesses that reach the backend; cache hits are not timed
+#define MAHF_STAT_MSR_READ          0
+#define MAHF_STAT_MSR_WRITE         1
+#define MAHF_STAT_CPUID             2
+#define MAHF_STAT_MSR_COUNT         3
+
+#define MAHF_STAT_STATE_COUNT       4   // PERFORMANCE_STATE_*
+
+typedef struct _MAHF_LATENCY_HISTOGRAM {
+    ULONG64 Count;
+    ULONG64 Failed;
+    ULONG64 TotalNs;
+    ULONG64 MaxNs;
+    ULONG64 Buckets[MAHF_LATENCY_BUCKETS];
+} MAHF_LATENCY_HISTOGRAM, *PMAHF_LATENCY_HISTOGRAM;
+
+// IOCTL_MAHF_GET_STATISTICS output; counts since the driver loaded
+typedef struct _MAHF_STATISTICS {
+    ULONG ProcessorCount;       // Per-processor blocks merged
+    ULONG BucketCount;          // MAHF_LATENCY_BUCKETS
+    ULONG64 TotalOperations;    // Requests, including ones that never dispatched
+    ULONG64 FailedOperations;
+    MAHF_LATENCY_HISTOGRAM Ioctl[MAHF_STAT_IOCTL_COUNT];
+    MAHF_LATENCY_HISTOGRAM Msr[MAHF_STAT_MSR_COUNT];
+    // Fixed state changes, [from][to]; failed when a processor refused the
+    // new ratio
+    MAHF_LATENCY_HISTOGRAM Transition[MAHF_STAT_STATE_COUNT][MAHF_STAT_STATE_COUNT];
+    // Per-processor ratio changes from the governor and the limit loops
+    MAHF_LATENCY_HISTOGRAM Retarget;
+} MAHF_STATISTICS, *PMAHF_STATISTICS;
+
+// Shared telemetry section
+// The driver publishes a read-only snapshot of its core table into a named
+// section on every telemetry tick. Readers use Generation as a sequence
+// lock: retry while it is odd or changed across the copy. A reloaded driver
+// creates a new section, so a reader whose view has Magic cleared, or a
+// Generation that stopped moving, should map the section again.
+#define MAHF_SHARED_SECTION_KERNEL_NAME L"\\BaseNamedObjects\\MahfCPUTelemetry"
+#define MAHF_SHARED_SECTION_NAME        TEXT("Global\\MahfCPUTelemetry")
+#define MAHF_SHARED_MAGIC               0x5348414D  // 'MAHS'
+#define MAHF_SHARED_VERSION             1
+#define MAHF_SHARED_MAX_CORES           256
+
+typedef struct _MAHF_SHARED_CORE {
+    ULONG CoreId;
+    ULONG PackageId;
+    ULONG CurrentFrequency;
+    ULONG BaseFrequency;
+    ULONG MaxFrequency;
+    ULONG Temperature;
+    ULONG Utilization;
+    ULONG CurrentState;
+} MAHF_SHARED_CORE, *PMAHF_SHARED_CORE;
+
+typedef struct _MAHF_SHARED_TELEMETRY {
+    ULONG Magic;                // Cleared when the driver unloads
+    ULONG Version;
+    volatile LONG Generation;   // Odd while the driver is writing
+    ULONG CoreCount;
+    ULONG64 UpdateTime;         // Interrupt time of the last publish
+    ULONG64 TelemetrySequence;  // Ring head at the last publish
+    ULONG64 TotalOperations;
+    ULONG64 FailedOperations;
+    ULONG GlobalState;
+    ULONG GlobalPowerLimit;
+    ULONG GlobalThermalLimit;
+    ULONG TurboBoostEnabled;
+    MAHF_PERFORMANCE_DATA Performance;
+    MAHF_SHARED_CORE Cores[MAHF_SHARED_MAX_CORES];
+} MAHF_SHARED_TELEMETRY, *PMAHF_SHARED_TELEMETRY;
+
 #endif // _MAHF_CORE_H_
\ No newline at end of file
@@ -0,0 +1,1254 @@
+/*
+ * Mahf Firmware CPU Driver - Host Build Support
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * POSIX implementation of the NT and KMDF subset declared in mahf_host.h
+ */
+
+#include "mahf_host.h"
+#include "mahf_hw.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define HOST_ALIGNMENT          64
+#define HOST_UNIX_EPOCH         116444736000000000ULL
+#define HOST_BUFFER_BYTES       65536   // Per-thread system buffer, grown on demand
+
+// Kept in line with the simulated backend's APERF/MPERF busy share
+#define HOST_BUSY_PERCENT       50
+
+DRIVER_INITIALIZE DriverEntry;
+
+BOOLEAN MahfHostDebugPrint = FALSE;
+
+static ULONG HostProcessorCount = 1;
+static __thread ULONG HostProcessor;
+static __thread KIRQL HostIrql;
+
+//
+// Objects
+//
+
+typedef enum _HOST_OBJECT_TYPE {
+    HostObjectDriver = 1,
+    HostObjectDevice,
+    HostObjectQueue,
+    HostObjectRequest,
+    HostObjectTimer,
+    HostObjectWaitLock
+} HOST_OBJECT_TYPE;
+
+// Leads every framework object. Objects other than requests are linked on
+// HostObjects, newest first, and torn down together by MahfHostStop.
+typedef struct _HOST_OBJECT {
+    HOST_OBJECT_TYPE Type;
+    struct _HOST_OBJECT *Next;
+    EVT_WDF_OBJECT_CONTEXT_CLEANUP *EvtCleanupCallback;
+    PVOID Context;
+} HOST_OBJECT, *PHOST_OBJECT;
+
+struct WDFDRIVER__ {
+    HOST_OBJECT Header;
+    WDF_DRIVER_CONFIG Config;
+};
+
+struct WDFDEVICE_INIT {
+    WDF_PNPPOWER_EVENT_CALLBACKS PnpPower;
+    SIZE_T RequestContextSize;
+};
+
+struct WDFDEVICE__ {
+    HOST_OBJECT Header;
+    WDF_PNPPOWER_EVENT_CALLBACKS PnpPower;
+    SIZE_T RequestContextSize;
+    WDFQUEUE DefaultQueue;
+};
+
+struct WDFREQUEST__ {
+    HOST_OBJECT Header;
+    ULONG IoControlCode;
+    PUCHAR Buffer;                  // METHOD_BUFFERED system buffer
+    SIZE_T BufferSize;
+    SIZE_T InputLength;
+    SIZE_T OutputLength;
+    NTSTATUS Status;
+    ULONG_PTR Information;
+    BOOLEAN Completed;
+    BOOLEAN Parked;                 // Held by a manual queue past its send
+    struct WDFREQUEST__ *QueueNext;
+};
+
+struct WDFQUEUE__ {
+    HOST_OBJECT Header;
+    WDFDEVICE Device;
+    WDF_IO_QUEUE_CONFIG Config;
+    pthread_mutex_t Lock;           // Sequential dispatch, manual list
+    WDFREQUEST Head;                // Manual queue, oldest first
+};
+
+struct WDFTIMER__ {
+    HOST_OBJECT Header;
+    WDF_TIMER_CONFIG Config;
+    WDFOBJECT Parent;
+    volatile LONG Started;
+    ULONG64 Due;                // Simulated clock, 100 ns
+};
+
+struct WDFWAITLOCK__ {
+    HOST_OBJECT Header;
+    pthread_mutex_t Lock;
+};
+
+static PHOST_OBJECT HostObjects;
+static WDFDRIVER HostDriver;
+static WDFDEVICE HostDevice;
+
+// Per-thread request reused for every send that completes inline
+static __thread WDFREQUEST HostRequest;
+
+static PVOID HostAllocate(SIZE_T Size)
+{
+    PVOID memory = NULL;
+    
+    if (posix_memalign(&memory, HOST_ALIGNMENT, Size ? Size : 1) != 0) {
+        return NULL;
+    }
+    
+    return memory;
+}
+
+static PVOID HostCreateObject(HOST_OBJECT_TYPE Type, SIZE_T Size, PWDF_OBJECT_ATTRIBUTES Attributes)
+{
+    SIZE_T contextSize = Attributes ? Attributes->ContextSizeOverride : 0;
+    SIZE_T headerSize = (Size + HOST_ALIGNMENT - 1) & ~(SIZE_T)(HOST_ALIGNMENT - 1);
+    PHOST_OBJECT object = (PHOST_OBJECT)HostAllocate(headerSize + contextSize);
+    
+    if (!object) {
+        return NULL;
+    }
+    
+    memset(object, 0, headerSize + contextSize);
+    object->Type = Type;
+    object->Context = contextSize ? (PUCHAR)object + headerSize : NULL;
+    object->EvtCleanupCallback = Attributes ? Attributes->EvtCleanupCallback : NULL;
+    
+    if (Type != HostObjectRequest) {
+        object->Next = HostObjects;
+        HostObjects = object;
+    }
+    
+    return object;
+}
+
+static VOID HostFreeObject(PHOST_OBJECT Object)
+{
+    if (Object->Type == HostObjectQueue) {
+        pthread_mutex_destroy(&((WDFQUEUE)Object)->Lock);
+    } else if (Object->Type == HostObjectWaitLock) {
+        pthread_mutex_destroy(&((WDFWAITLOCK)Object)->Lock);
+    } else if (Object->Type == HostObjectRequest) {
+        free(((WDFREQUEST)Object)->Buffer);
+    }
+    
+    free(Object);
+}
+
+PVOID MahfHostObjectContext(WDFOBJECT Handle)
+{
+    return Handle ? ((PHOST_OBJECT)Handle)->Context : NULL;
+}
+
+// Objects are only deleted as a group, by MahfHostStop
+VOID WdfObjectDelete(WDFOBJECT Object)
+{
+    UNREFERENCED_PARAMETER(Object);
+}
+
+//
+// Processors and interrupt levels
+//
+
+VOID MahfHostSetProcessor(ULONG Processor)
+{
+    HostProcessor = Processor % HostProcessorCount;
+}
+
+KIRQL KeGetCurrentIrql(VOID)
+{
+    return HostIrql;
+}
+
+VOID KeRaiseIrql(KIRQL NewIrql, KIRQL *OldIrql)
+{
+    *OldIrql = HostIrql;
+    HostIrql = NewIrql;
+}
+
+VOID KeLowerIrql(KIRQL NewIrql)
+{
+    HostIrql = NewIrql;
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+    if (ProcNumber) {
+        ProcNumber->Group = (USHORT)(HostProcessor / MAHF_HOST_GROUP_SIZE);
+        ProcNumber->Number = (UCHAR)(HostProcessor % MAHF_HOST_GROUP_SIZE);
+        ProcNumber->Reserved = 0;
+    }
+    
+    return HostProcessor;
+}
+
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber)
+{
+    ULONG first = (ULONG)GroupNumber * MAHF_HOST_GROUP_SIZE;
+    
+    if (GroupNumber == ALL_PROCESSOR_GROUPS) {
+        return HostProcessorCount;
+    }
+    
+    return first < HostProcessorCount ? min(HostProcessorCount - first, MAHF_HOST_GROUP_SIZE) : 0;
+}
+
+USHORT KeQueryActiveGroupCount(VOID)
+{
+    return (USHORT)((HostProcessorCount + MAHF_HOST_GROUP_SIZE - 1) / MAHF_HOST_GROUP_SIZE);
+}
+
+ULONG KeGetProcessorIndexFromNumber(PPROCESSOR_NUMBER ProcNumber)
+{
+    ULONG index = (ULONG)ProcNumber->Group * MAHF_HOST_GROUP_SIZE + ProcNumber->Number;
+    
+    return index < HostProcessorCount ? index : MAXULONG;
+}
+
+// Runs the thread on the lowest processor in the affinity mask
+VOID KeSetSystemGroupAffinityThread(PGROUP_AFFINITY Affinity, PGROUP_AFFINITY PreviousAffinity)
+{
+    ULONG number = Affinity->Mask ? (ULONG)__builtin_ctzll(Affinity->Mask) : 0;
+    
+    if (PreviousAffinity) {
+        memset(PreviousAffinity, 0, sizeof(GROUP_AFFINITY));
+        PreviousAffinity->Group = (USHORT)(HostProcessor / MAHF_HOST_GROUP_SIZE);
+        PreviousAffinity->Mask = (KAFFINITY)1 << (HostProcessor % MAHF_HOST_GROUP_SIZE);
+    }
+    
+    MahfHostSetProcessor((ULONG)Affinity->Group * MAHF_HOST_GROUP_SIZE + number);
+}
+
+VOID KeRevertToUserGroupAffinityThread(PGROUP_AFFINITY PreviousAffinity)
+{
+    KeSetSystemGroupAffinityThread(PreviousAffinity, NULL);
+}
+
+// Every processor in turn on this thread; the caller's processor and IRQL
+// are restored afterwards
+ULONG_PTR KeIpiGenericCall(PKIPI_BROADCAST_WORKER BroadcastFunction, ULONG_PTR Context)
+{
+    ULONG processor = HostProcessor;
+    KIRQL irql = HostIrql;
+    ULONG_PTR result = 0;
+    
+    HostIrql = IPI_LEVEL;
+    
+    for (ULONG i = 0; i < HostProcessorCount; i++) {
+        HostProcessor = i;
+        result = BroadcastFunction(Context);
+    }
+    
+    HostProcessor = processor;
+    HostIrql = irql;
+    
+    return result;
+}
+
+// The hardware backend's clock, so a physics model's time is the driver's
+ULONG64 KeQueryInterruptTime(VOID)
+{
+    return MahfHwSimulatedNow();
+}
+
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    CurrentTime->QuadPart = (LONGLONG)((ULONG64)now.tv_sec * 10000000 +
+                                       (ULONG64)now.tv_nsec / 100 + HOST_UNIX_EPOCH);
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+    struct timespec now;
+    LARGE_INTEGER counter;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter.QuadPart = (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+    
+    if (PerformanceFrequency) {
+        PerformanceFrequency->QuadPart = 1000000000;
+    }
+    
+    return counter;
+}
+
+//
+// Spin locks
+//
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, KIRQL *OldIrql)
+{
+    KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+    
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED) != 0) {
+            YieldProcessor();
+        }
+    }
+}
+
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+{
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+    KeLowerIrql(NewIrql);
+}
+
+//
+// Memory, strings and debug output
+//
+
+PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    PVOID memory = HostAllocate(NumberOfBytes);
+    
+    UNREFERENCED_PARAMETER(Tag);
+    
+    if (memory && !(Flags & POOL_FLAG_UNINITIALIZED)) {
+        memset(memory, 0, NumberOfBytes);
+    }
+    
+    return memory;
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    free(P);
+}
+
+SIZE_T RtlCompareMemory(const VOID *Source1, const VOID *Source2, SIZE_T Length)
+{
+    const UCHAR *left = (const UCHAR *)Source1;
+    const UCHAR *right = (const UCHAR *)Source2;
+    SIZE_T i = 0;
+    
+    while (i < Length && left[i] == right[i]) {
+        i++;
+    }
+    
+    return i;
+}
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source)
+{
+    SIZE_T length = Source ? wcslen(Source) * sizeof(WCHAR) : 0;
+    
+    Destination->Buffer = (PWSTR)Source;
+    Destination->Length = (USHORT)length;
+    Destination->MaximumLength = (USHORT)(Source ? length + sizeof(WCHAR) : 0);
+}
+
+NTSTATUS RtlStringCbCopyA(CHAR *Destination, SIZE_T Size, const CHAR *Source)
+{
+    SIZE_T length;
+    
+    if (Size == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    length = strlen(Source);
+    if (length >= Size) {
+        memcpy(Destination, Source, Size - 1);
+        Destination[Size - 1] = '\0';
+        return STATUS_BUFFER_OVERFLOW;
+    }
+    
+    memcpy(Destination, Source, length + 1);
+    return STATUS_SUCCESS;
+}
+
+ULONG DbgPrint(const char *Format, ...)
+{
+    va_list arguments;
+    
+    if (MahfHostDebugPrint) {
+        va_start(arguments, Format);
+        vfprintf(stderr, Format, arguments);
+        va_end(arguments);
+    }
+    
+    return 0;
+}
+
+//
+// Sections, MDLs and security
+//
+
+typedef struct _HOST_SECTION {
+    SIZE_T Size;
+    PVOID View;
+} HOST_SECTION, *PHOST_SECTION;
+
+static PVOID HostSid;
+static SE_EXPORTS HostSeExports = { &HostSid, &HostSid, &HostSid };
+PSE_EXPORTS SeExports = &HostSeExports;
+
+NTSTATUS ZwCreateSection(HANDLE *SectionHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+                         PLARGE_INTEGER MaximumSize, ULONG PageProtection, ULONG AllocationAttributes,
+                         HANDLE FileHandle)
+{
+    PHOST_SECTION section;
+    
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectAttributes);
+    UNREFERENCED_PARAMETER(PageProtection);
+    UNREFERENCED_PARAMETER(AllocationAttributes);
+    UNREFERENCED_PARAMETER(FileHandle);
+    
+    section = (PHOST_SECTION)calloc(1, sizeof(HOST_SECTION));
+    if (!section) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    section->Size = (SIZE_T)MaximumSize->QuadPart;
+    section->View = ExAllocatePool2(POOL_FLAG_NON_PAGED, section->Size, 0);
+    if (!section->View) {
+        free(section);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    *SectionHandle = section;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwClose(HANDLE Handle)
+{
+    PHOST_SECTION section = (PHOST_SECTION)Handle;
+    
+    free(section->View);
+    free(section);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ULONG DesiredAccess, PVOID ObjectType,
+                                   KPROCESSOR_MODE AccessMode, PVOID *Object, PVOID HandleInformation)
+{
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectType);
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(HandleInformation);
+    
+    *Object = Handle;
+    return STATUS_SUCCESS;
+}
+
+VOID ObfDereferenceObject(PVOID Object)
+{
+    UNREFERENCED_PARAMETER(Object);
+}
+
+NTSTATUS MmMapViewInSystemSpace(PVOID Section, PVOID *MappedBase, PSIZE_T ViewSize)
+{
+    PHOST_SECTION section = (PHOST_SECTION)Section;
+    
+    *MappedBase = section->View;
+    *ViewSize = section->Size;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS MmUnmapViewInSystemSpace(PVOID MappedBase)
+{
+    UNREFERENCED_PARAMETER(MappedBase);
+    return STATUS_SUCCESS;
+}
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer,
+                   BOOLEAN ChargeQuota, PVOID Irp)
+{
+    PMDL mdl = (PMDL)calloc(1, sizeof(MDL));
+    
+    UNREFERENCED_PARAMETER(SecondaryBuffer);
+    UNREFERENCED_PARAMETER(ChargeQuota);
+    UNREFERENCED_PARAMETER(Irp);
+    
+    if (mdl) {
+        mdl->MappedSystemVa = VirtualAddress;
+        mdl->ByteCount = Length;
+    }
+    
+    return mdl;
+}
+
+VOID IoFreeMdl(PMDL Mdl)
+{
+    free(Mdl);
+}
+
+VOID MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE AccessMode, LOCK_OPERATION Operation)
+{
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(Operation);
+    
+    Mdl->MdlFlags |= MDL_PAGES_LOCKED;
+}
+
+VOID MmUnlockPages(PMDL Mdl)
+{
+    Mdl->MdlFlags &= ~MDL_PAGES_LOCKED;
+}
+
+PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority)
+{
+    UNREFERENCED_PARAMETER(Priority);
+    return Mdl->MappedSystemVa;
+}
+
+NTSTATUS RtlCreateSecurityDescriptor(PVOID SecurityDescriptor, ULONG Revision)
+{
+    UNREFERENCED_PARAMETER(SecurityDescriptor);
+    UNREFERENCED_PARAMETER(Revision);
+    return STATUS_SUCCESS;
+}
+
+// As for a SID with two subauthorities, like the well-known ones
+ULONG RtlLengthSid(PSID Sid)
+{
+    UNREFERENCED_PARAMETER(Sid);
+    return 16;
+}
+
+NTSTATUS RtlCreateAcl(PACL Acl, ULONG AclLength, ULONG AclRevision)
+{
+    UNREFERENCED_PARAMETER(AclLength);
+    
+    Acl->AclRevision = (UCHAR)AclRevision;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS RtlAddAccessAllowedAce(PACL Acl, ULONG AceRevision, ULONG AccessMask, PSID Sid)
+{
+    UNREFERENCED_PARAMETER(Acl);
+    UNREFERENCED_PARAMETER(AceRevision);
+    UNREFERENCED_PARAMETER(AccessMask);
+    UNREFERENCED_PARAMETER(Sid);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS RtlSetDaclSecurityDescriptor(PVOID SecurityDescriptor, BOOLEAN DaclPresent, PACL Dacl,
+                                      BOOLEAN DaclDefaulted)
+{
+    UNREFERENCED_PARAMETER(SecurityDescriptor);
+    UNREFERENCED_PARAMETER(DaclPresent);
+    UNREFERENCED_PARAMETER(Dacl);
+    UNREFERENCED_PARAMETER(DaclDefaulted);
+    return STATUS_SUCCESS;
+}
+
+// Mirrors the SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION layout in mahf_core.c
+typedef struct _HOST_PROCESSOR_TIMES {
+    LARGE_INTEGER IdleTime;
+    LARGE_INTEGER KernelTime;
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER DpcTime;
+    LARGE_INTEGER InterruptTime;
+    ULONG InterruptCount;
+} HOST_PROCESSOR_TIMES, *PHOST_PROCESSOR_TIMES;
+
+NTSTATUS ZwQuerySystemInformation(ULONG SystemInformationClass, PVOID SystemInformation,
+                                  ULONG SystemInformationLength, PULONG ReturnLength)
+{
+    PHOST_PROCESSOR_TIMES times = (PHOST_PROCESSOR_TIMES)SystemInformation;
+    USHORT group = (USHORT)(HostProcessor / MAHF_HOST_GROUP_SIZE);
+    ULONG count = KeQueryActiveProcessorCountEx(group);
+    ULONG64 now = KeQueryInterruptTime();
+    
+    if (SystemInformationClass != 8) {
+        return STATUS_NOT_IMPLEMENTED;
+    }
+    
+    count = min(count, SystemInformationLength / (ULONG)sizeof(HOST_PROCESSOR_TIMES));
+    memset(times, 0, count * sizeof(HOST_PROCESSOR_TIMES));
+    
+    for (ULONG n = 0; n < count; n++) {
+        ULONG index = (ULONG)group * MAHF_HOST_GROUP_SIZE + n;
+        ULONG busy = HOST_BUSY_PERCENT + (index % 4) * 10;
+        MAHF_SIM_CPU_STATE state;
+        
+        times[n].KernelTime.QuadPart = (LONGLONG)now;
+        times[n].IdleTime.QuadPart = (LONGLONG)(now / 100 * (100 - busy));
+        
+        if (MahfHwSimulatedGetCpu(index, &state)) {
+            times[n].IdleTime.QuadPart = (LONGLONG)(now - min(state.BusyTime, now));
+        }
+    }
+    
+    if (ReturnLength) {
+        *ReturnLength = count * (ULONG)sizeof(HOST_PROCESSOR_TIMES);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+//
+// Driver and device
+//
+
+NTSTATUS WdfDriverCreate(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath,
+                         PWDF_OBJECT_ATTRIBUTES DriverAttributes, PWDF_DRIVER_CONFIG DriverConfig,
+                         WDFDRIVER *Driver)
+{
+    WDFDRIVER driver;
+    
+    UNREFERENCED_PARAMETER(DriverObject);
+    UNREFERENCED_PARAMETER(RegistryPath);
+    
+    driver = (WDFDRIVER)HostCreateObject(HostObjectDriver, sizeof(*driver), DriverAttributes);
+    if (!driver) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    driver->Config = *DriverConfig;
+    HostDriver = driver;
+    
+    if (Driver) {
+        *Driver = driver;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+VOID WdfDeviceInitSetExclusive(PWDFDEVICE_INIT DeviceInit, BOOLEAN IsExclusive)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(IsExclusive);
+}
+
+VOID WdfDeviceInitSetDeviceType(PWDFDEVICE_INIT DeviceInit, ULONG DeviceType)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(DeviceType);
+}
+
+VOID WdfDeviceInitSetIoType(PWDFDEVICE_INIT DeviceInit, WDF_DEVICE_IO_TYPE IoType)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(IoType);
+}
+
+NTSTATUS WdfDeviceInitAssignSDDLString(PWDFDEVICE_INIT DeviceInit, PCWSTR SDDLString)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(SDDLString);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceInitAssignName(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING DeviceName)
+{
+    UNREFERENCED_PARAMETER(DeviceInit);
+    UNREFERENCED_PARAMETER(DeviceName);
+    return STATUS_SUCCESS;
+}
+
+VOID WdfDeviceInitSetPnpPowerEventCallbacks(PWDFDEVICE_INIT DeviceInit,
+                                            PWDF_PNPPOWER_EVENT_CALLBACKS PnpPowerEventCallbacks)
+{
+    DeviceInit->PnpPower = *PnpPowerEventCallbacks;
+}
+
+VOID WdfDeviceInitSetRequestAttributes(PWDFDEVICE_INIT DeviceInit, PWDF_OBJECT_ATTRIBUTES RequestAttributes)
+{
+    DeviceInit->RequestContextSize = RequestAttributes->ContextSizeOverride;
+}
+
+NTSTATUS WdfDeviceCreate(PWDFDEVICE_INIT *DeviceInit, PWDF_OBJECT_ATTRIBUTES DeviceAttributes,
+                         WDFDEVICE *Device)
+{
+    WDFDEVICE device = (WDFDEVICE)HostCreateObject(HostObjectDevice, sizeof(*device), DeviceAttributes);
+    
+    if (!device) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    device->PnpPower = (*DeviceInit)->PnpPower;
+    device->RequestContextSize = (*DeviceInit)->RequestContextSize;
+    HostDevice = device;
+    
+    *DeviceInit = NULL;
+    *Device = device;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceCreateSymbolicLink(WDFDEVICE Device, PCUNICODE_STRING SymbolicLinkName)
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(SymbolicLinkName);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceCreateDeviceInterface(WDFDEVICE Device, const GUID *InterfaceClassGUID,
+                                        PCUNICODE_STRING ReferenceString)
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(InterfaceClassGUID);
+    UNREFERENCED_PARAMETER(ReferenceString);
+    return STATUS_SUCCESS;
+}
+
+//
+// Queues and requests
+//
+
+NTSTATUS WdfIoQueueCreate(WDFDEVICE Device, PWDF_IO_QUEUE_CONFIG Config,
+                          PWDF_OBJECT_ATTRIBUTES QueueAttributes, WDFQUEUE *Queue)
+{
+    WDFQUEUE queue = (WDFQUEUE)HostCreateObject(HostObjectQueue, sizeof(*queue), QueueAttributes);
+    
+    if (!queue) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    queue->Device = Device;
+    queue->Config = *Config;
+    pthread_mutex_init(&queue->Lock, NULL);
+    
+    if (Config->DefaultQueue) {
+        Device->DefaultQueue = queue;
+    }
+    
+    if (Queue) {
+        *Queue = queue;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+WDFDEVICE WdfIoQueueGetDevice(WDFQUEUE Queue)
+{
+    return Queue->Device;
+}
+
+// Dispatch is synchronous, so nothing is in flight to wait for
+VOID WdfIoQueueStopSynchronously(WDFQUEUE Queue)
+{
+    UNREFERENCED_PARAMETER(Queue);
+}
+
+VOID WdfIoQueueStart(WDFQUEUE Queue)
+{
+    UNREFERENCED_PARAMETER(Queue);
+}
+
+static VOID HostDispatch(WDFQUEUE Queue, WDFREQUEST Request)
+{
+    if (Queue->Config.DispatchType == WdfIoQueueDispatchManual) {
+        WDFREQUEST *tail;
+        
+        pthread_mutex_lock(&Queue->Lock);
+        for (tail = &Queue->Head; *tail; tail = &(*tail)->QueueNext) {
+        }
+        Request->QueueNext = NULL;
+        Request->Parked = TRUE;
+        *tail = Request;
+        pthread_mutex_unlock(&Queue->Lock);
+        return;
+    }
+    
+    if (Queue->Config.DispatchType == WdfIoQueueDispatchSequential) {
+        pthread_mutex_lock(&Queue->Lock);
+    }
+    
+    Queue->Config.EvtIoDeviceControl(Queue, Request, Request->OutputLength,
+                                     Request->InputLength, Request->IoControlCode);
+    
+    if (Queue->Config.DispatchType == WdfIoQueueDispatchSequential) {
+        pthread_mutex_unlock(&Queue->Lock);
+    }
+}
+
+NTSTATUS WdfIoQueueFindRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFFILEOBJECT FileObject,
+                               PVOID Parameters, WDFREQUEST *OutRequest)
+{
+    NTSTATUS status = STATUS_NO_MORE_ENTRIES;
+    WDFREQUEST request;
+    
+    UNREFERENCED_PARAMETER(FileObject);
+    UNREFERENCED_PARAMETER(Parameters);
+    
+    pthread_mutex_lock(&Queue->Lock);
+    
+    request = Queue->Head;
+    if (FoundRequest) {
+        while (request && request != FoundRequest) {
+            request = request->QueueNext;
+        }
+        
+        if (!request) {
+            status = STATUS_NOT_FOUND;
+        }
+        
+        request = request ? request->QueueNext : NULL;
+    }
+    
+    if (request) {
+        *OutRequest = request;
+        status = STATUS_SUCCESS;
+    }
+    
+    pthread_mutex_unlock(&Queue->Lock);
+    return status;
+}
+
+NTSTATUS WdfIoQueueRetrieveFoundRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFREQUEST *OutRequest)
+{
+    NTSTATUS status = STATUS_NOT_FOUND;
+    WDFREQUEST *link;
+    
+    pthread_mutex_lock(&Queue->Lock);
+    
+    for (link = &Queue->Head; *link; link = &(*link)->QueueNext) {
+        if (*link == FoundRequest) {
+            *link = FoundRequest->QueueNext;
+            FoundRequest->QueueNext = NULL;
+            *OutRequest = FoundRequest;
+            status = STATUS_SUCCESS;
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&Queue->Lock);
+    return status;
+}
+
+static NTSTATUS HostRetrieveBuffer(WDFREQUEST Request, SIZE_T Length, size_t MinimumLength,
+                                   PVOID *Buffer, size_t *BufferLength)
+{
+    if (Length == 0 || Length < MinimumLength) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    *Buffer = Request->Buffer;
+    if (BufferLength) {
+        *BufferLength = Length;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestRetrieveInputBuffer(WDFREQUEST Request, size_t MinimumRequiredLength,
+                                       PVOID *Buffer, size_t *Length)
+{
+    return HostRetrieveBuffer(Request, Request->InputLength, MinimumRequiredLength, Buffer, Length);
+}
+
+NTSTATUS WdfRequestRetrieveOutputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize,
+                                        PVOID *Buffer, size_t *Length)
+{
+    return HostRetrieveBuffer(Request, Request->OutputLength, MinimumRequiredSize, Buffer, Length);
+}
+
+NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST Request, WDFQUEUE DestinationQueue)
+{
+    HostDispatch(DestinationQueue, Request);
+    return STATUS_SUCCESS;
+}
+
+// A request completed after its send returned has no one left to read it
+VOID WdfRequestCompleteWithInformation(WDFREQUEST Request, NTSTATUS Status, ULONG_PTR Information)
+{
+    Request->Status = Status;
+    Request->Information = Information;
+    Request->Completed = TRUE;
+    
+    if (Request->Parked && Request != HostRequest) {
+        HostFreeObject(&Request->Header);
+    }
+}
+
+VOID WdfRequestComplete(WDFREQUEST Request, NTSTATUS Status)
+{
+    WdfRequestCompleteWithInformation(Request, Status, 0);
+}
+
+VOID WdfRequestStopAcknowledge(WDFREQUEST Request, BOOLEAN Requeue)
+{
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(Requeue);
+}
+
+// Reuses the thread's request unless the driver still holds it
+static WDFREQUEST HostGetRequest(WDFDEVICE Device, SIZE_T BufferSize)
+{
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFREQUEST request = HostRequest;
+    
+    if (!request || (request->Parked && !request->Completed)) {
+        WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+        attributes.ContextSizeOverride = Device->RequestContextSize;
+        
+        request = (WDFREQUEST)HostCreateObject(HostObjectRequest, sizeof(*request), &attributes);
+        if (!request) {
+            return NULL;
+        }
+        
+        HostRequest = request;
+    }
+    
+    if (request->BufferSize < BufferSize) {
+        SIZE_T size = max(BufferSize, (SIZE_T)HOST_BUFFER_BYTES);
+        PUCHAR buffer = (PUCHAR)HostAllocate(size);
+        
+        if (!buffer) {
+            return NULL;
+        }
+        
+        free(request->Buffer);
+        request->Buffer = buffer;
+        request->BufferSize = size;
+    }
+    
+    request->Completed = FALSE;
+    request->Parked = FALSE;
+    request->Status = STATUS_PENDING;
+    request->Information = 0;
+    
+    return request;
+}
+
+NTSTATUS MahfHostDeviceControl(WDFDEVICE Device, ULONG IoControlCode,
+                               const VOID *InputBuffer, ULONG InputLength,
+                               PVOID OutputBuffer, ULONG OutputLength, PULONG_PTR Information)
+{
+    WDFREQUEST request = HostGetRequest(Device, max(InputLength, OutputLength));
+    
+    if (Information) {
+        *Information = 0;
+    }
+    
+    if (!request) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    request->IoControlCode = IoControlCode;
+    request->InputLength = InputBuffer ? InputLength : 0;
+    request->OutputLength = OutputBuffer ? OutputLength : 0;
+    
+    if (request->InputLength) {
+        memcpy(request->Buffer, InputBuffer, request->InputLength);
+    }
+    
+    HostDispatch(Device->DefaultQueue, request);
+    
+    if (!request->Completed) {
+        // Parked; this thread moves on to a fresh request
+        HostRequest = NULL;
+        return STATUS_PENDING;
+    }
+    
+    if (request->Information && request->OutputLength) {
+        memcpy(OutputBuffer, request->Buffer, min(request->Information, request->OutputLength));
+    }
+    
+    if (Information) {
+        *Information = request->Information;
+    }
+    
+    return request->Status;
+}
+
+//
+// Timers
+//
+
+NTSTATUS WdfTimerCreate(PWDF_TIMER_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes, WDFTIMER *Timer)
+{
+    WDFTIMER timer = (WDFTIMER)HostCreateObject(HostObjectTimer, sizeof(*timer), Attributes);
+    
+    if (!timer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    timer->Config = *Config;
+    timer->Parent = Attributes ? Attributes->ParentObject : NULL;
+    
+    *Timer = timer;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN WdfTimerStart(WDFTIMER Timer, LONGLONG DueTime)
+{
+    ULONG64 now = KeQueryInterruptTime();
+    
+    // Negative is relative, positive absolute; only MahfHostAdvance looks
+    Timer->Due = DueTime < 0 ? now + (ULONG64)-DueTime : max((ULONG64)DueTime, now);
+    return (BOOLEAN)InterlockedExchange(&Timer->Started, TRUE);
+}
+
+BOOLEAN WdfTimerStop(WDFTIMER Timer, BOOLEAN Wait)
+{
+    UNREFERENCED_PARAMETER(Wait);
+    return (BOOLEAN)InterlockedExchange(&Timer->Started, FALSE);
+}
+
+WDFOBJECT WdfTimerGetParentObject(WDFTIMER Timer)
+{
+    return Timer->Parent;
+}
+
+VOID MahfHostRunTimers(ULONG Ticks)
+{
+    PHOST_OBJECT timers[64];
+    ULONG count = 0;
+    
+    // HostObjects is newest first
+    for (PHOST_OBJECT object = HostObjects; object; object = object->Next) {
+        if (object->Type == HostObjectTimer && count < RTL_NUMBER_OF(timers)) {
+            timers[count++] = object;
+        }
+    }
+    
+    for (ULONG tick = 0; tick < Ticks; tick++) {
+        for (ULONG i = count; i-- > 0;) {
+            WDFTIMER timer = (WDFTIMER)timers[i];
+            
+            if (!timer->Started) {
+                continue;
+            }
+            
+            if (timer->Config.Period == 0) {
+                timer->Started = FALSE;
+            }
+            
+            timer->Config.EvtTimerFunc(timer);
+        }
+    }
+}
+
+NTSTATUS MahfHostAdvance(ULONG Milliseconds)
+{
+    ULONG64 now = MahfHwSimulatedNow();
+    ULONG64 end = now + (ULONG64)Milliseconds * 10000;
+    MAHF_SIM_CPU_STATE probe;
+    
+    if (!MahfHwSimulatedGetCpu(0, &probe)) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    
+    for (;;) {
+        WDFTIMER next = NULL;
+        
+        // Earliest due; the list is newest first, so ties go to the oldest
+        for (PHOST_OBJECT object = HostObjects; object; object = object->Next) {
+            WDFTIMER timer = (WDFTIMER)object;
+            
+            if (object->Type == HostObjectTimer && timer->Started && timer->Due <= end &&
+                (!next || timer->Due <= next->Due)) {
+                next = timer;
+            }
+        }
+        
+        if (!next) {
+            break;
+        }
+        
+        // Whole microseconds only; the remainder waits for the next timer
+        MahfHwSimulatedAdvance((next->Due - now) / 10);
+        now = MahfHwSimulatedNow();
+        
+        if (next->Config.Period == 0) {
+            next->Started = FALSE;
+        } else {
+            next->Due += (ULONG64)next->Config.Period * 10000;
+        }
+        
+        next->Config.EvtTimerFunc(next);
+    }
+    
+    MahfHwSimulatedAdvance((end - now) / 10);
+    return STATUS_SUCCESS;
+}
+
+//
+// Wait locks and registry
+//
+
+NTSTATUS WdfWaitLockCreate(PWDF_OBJECT_ATTRIBUTES LockAttributes, WDFWAITLOCK *Lock)
+{
+    WDFWAITLOCK lock = (WDFWAITLOCK)HostCreateObject(HostObjectWaitLock, sizeof(*lock), LockAttributes);
+    
+    if (!lock) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    pthread_mutex_init(&lock->Lock, NULL);
+    
+    *Lock = lock;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfWaitLockAcquire(WDFWAITLOCK Lock, PLONGLONG Timeout)
+{
+    if (Timeout && *Timeout == 0) {
+        return pthread_mutex_trylock(&Lock->Lock) == 0 ? STATUS_SUCCESS : STATUS_TIMEOUT;
+    }
+    
+    pthread_mutex_lock(&Lock->Lock);
+    return STATUS_SUCCESS;
+}
+
+VOID WdfWaitLockRelease(WDFWAITLOCK Lock)
+{
+    pthread_mutex_unlock(&Lock->Lock);
+}
+
+NTSTATUS WdfDriverOpenParametersRegistryKey(WDFDRIVER Driver, ULONG DesiredAccess,
+                                            PWDF_OBJECT_ATTRIBUTES KeyAttributes, WDFKEY *Key)
+{
+    UNREFERENCED_PARAMETER(Driver);
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(KeyAttributes);
+    
+    *Key = NULL;
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+VOID WdfRegistryClose(WDFKEY Key)
+{
+    UNREFERENCED_PARAMETER(Key);
+}
+
+NTSTATUS WdfRegistryQueryULong(WDFKEY Key, PCUNICODE_STRING ValueName, PULONG Value)
+{
+    UNREFERENCED_PARAMETER(Key);
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(Value);
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS WdfRegistryQueryValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueLength,
+                               PVOID Value, PULONG ValueLengthQueried, PULONG ValueType)
+{
+    UNREFERENCED_PARAMETER(Key);
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(ValueLength);
+    UNREFERENCED_PARAMETER(Value);
+    UNREFERENCED_PARAMETER(ValueLengthQueried);
+    UNREFERENCED_PARAMETER(ValueType);
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS WdfRegistryAssignValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueType,
+                                ULONG ValueLength, PVOID Value)
+{
+    UNREFERENCED_PARAMETER(Key);
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(ValueType);
+    UNREFERENCED_PARAMETER(ValueLength);
+    UNREFERENCED_PARAMETER(Value);
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+//
+// Host control
+//
+
+NTSTATUS MahfHostStart(ULONG ProcessorCount, WDFDEVICE *Device)
+{
+    struct WDFDEVICE_INIT init;
+    PWDFDEVICE_INIT deviceInit = &init;
+    NTSTATUS status;
+    
+    if (ProcessorCount == 0 || ProcessorCount > MAHF_HW_MAX_CPUS || HostDriver) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    HostProcessorCount = ProcessorCount;
+    HostProcessor = 0;
+    HostIrql = PASSIVE_LEVEL;
+    
+    status = DriverEntry(NULL, NULL);
+    if (!NT_SUCCESS(status)) {
+        MahfHostStop();
+        return status;
+    }
+    
+    memset(&init, 0, sizeof(init));
+    status = HostDriver->Config.EvtDriverDeviceAdd(HostDriver, deviceInit);
+    if (!NT_SUCCESS(status) || !HostDevice) {
+        MahfHostStop();
+        return NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+    }
+    
+    if (HostDevice->PnpPower.EvtDeviceD0Entry) {
+        status = HostDevice->PnpPower.EvtDeviceD0Entry(HostDevice, WdfPowerDeviceD3Final);
+        if (!NT_SUCCESS(status)) {
+            MahfHostStop();
+            return status;
+        }
+    }
+    
+    *Device = HostDevice;
+    return STATUS_SUCCESS;
+}
+
+VOID MahfHostStop(VOID)
+{
+    PHOST_OBJECT object;
+    
+    if (HostDevice && HostDevice->PnpPower.EvtDeviceD0Exit) {
+        HostDevice->PnpPower.EvtDeviceD0Exit(HostDevice, WdfPowerDeviceD3Final);
+    }
+    
+    // Children before their parents: the list is newest first
+    for (object = HostObjects; object; object = object->Next) {
+        if (object->EvtCleanupCallback) {
+            object->EvtCleanupCallback(object);
+        }
+    }
+    
+    if (HostDriver && HostDriver->Config.EvtDriverUnload) {
+        HostDriver->Config.EvtDriverUnload(HostDriver);
+    }
+    
+    while (HostObjects) {
+        object = HostObjects;
+        HostObjects = object->Next;
+        
+        if (object->Type == HostObjectQueue) {
+            WDFQUEUE queue = (WDFQUEUE)object;
+            
+            while (queue->Head) {
+                WDFREQUEST request = queue->Head;
+                
+                queue->Head = request->QueueNext;
+                if (request != HostRequest) {
+                    HostFreeObject(&request->Header);
+                }
+            }
+        }
+        
+        HostFreeObject(object);
+    }
+    
+    HostDriver = NULL;
+    HostDevice = NULL;
+}
\ No newline at end of file
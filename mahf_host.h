@@ -0,0 +1,734 @@
+/*
+ * Mahf Firmware CPU Driver - Host Build Support
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * The subset of the NT and KMDF interfaces used by mahf_core.c, implemented
+ * in mahf_host.c on top of POSIX threads, so the driver's dispatch and
+ * policy code can be built into an ordinary Linux program (MAHF_HOST) and
+ * driven by tools such as mahf_bench
+ */
+
+#ifndef _MAHF_HOST_H_
+#define _MAHF_HOST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <wchar.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+// SummarizeMetric's SSE2 path is keyed on the MSVC target macros
+#if defined(__x86_64__) && !defined(_M_AMD64)
+#define _M_AMD64 1
+#elif defined(__i386__) && !defined(_M_IX86)
+#define _M_IX86 1
+#endif
+#include <emmintrin.h>
+#endif
+
+//
+// Base types
+//
+
+typedef int32_t NTSTATUS;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG, ULONG32, *PULONG32, DWORD;
+typedef int64_t LONG64, *PLONG64, LONGLONG, *PLONGLONG;
+typedef uint64_t ULONG64, *PULONG64, ULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef int16_t SHORT;
+typedef uint16_t USHORT, *PUSHORT;
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN, BYTE, KIRQL;
+typedef char CHAR, *PCHAR;
+typedef wchar_t WCHAR, *PWCHAR, *PWSTR;
+typedef const WCHAR *PCWSTR;
+typedef int INT;
+typedef unsigned int UINT;
+typedef void VOID, *PVOID, *HANDLE;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef ULONG_PTR KAFFINITY;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+typedef struct _GUID {
+    ULONG Data1;
+    USHORT Data2;
+    USHORT Data3;
+    UCHAR Data4[8];
+} GUID;
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR Number;
+    UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef struct _GROUP_AFFINITY {
+    KAFFINITY Mask;
+    USHORT Group;
+    USHORT Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+#define TRUE    1
+#define FALSE   0
+
+#define CONST                   const
+#define NTSYSAPI
+#define NTAPI
+#define FORCEINLINE             static inline
+#define DECLSPEC_ALIGN(x)       __attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN     DECLSPEC_ALIGN(64)
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define ANYSIZE_ARRAY           1
+
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Out_
+#define _Out_opt_
+#define _Use_decl_annotations_
+#define _IRQL_requires_max_(x)
+
+#define UNREFERENCED_PARAMETER(P)   ((void)(P))
+#define FIELD_OFFSET(Type, Field)   ((LONG)offsetof(Type, Field))
+#define RTL_NUMBER_OF(A)            (sizeof(A) / sizeof((A)[0]))
+#define ARRAYSIZE(A)                RTL_NUMBER_OF(A)
+#define C_ASSERT(e)                 _Static_assert(e, #e)
+
+#ifndef min
+#define min(a, b)   (((a) < (b)) ? (a) : (b))
+#define max(a, b)   (((a) > (b)) ? (a) : (b))
+#endif
+
+#define MAXUCHAR    0xFF
+#define MAXUSHORT   0xFFFF
+#define MAXLONG     0x7FFFFFFFL
+#define MAXULONG    0xFFFFFFFFUL
+#define MAXLONG64   0x7FFFFFFFFFFFFFFFLL
+#define MAXULONG64  0xFFFFFFFFFFFFFFFFULL
+
+// Structured exception handling: nothing here faults, so the guarded
+// block always runs and the handler never does
+#define __try                   if (1)
+#define __except(Filter)        else
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+//
+// Status codes
+//
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                  ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                  ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED          ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST   ((NTSTATUS)0xC0000010L)
+#define STATUS_ACCESS_DENIED            ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_DATA_ERROR        ((NTSTATUS)0xC000009CL)
+#define STATUS_DEVICE_NOT_READY         ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED                ((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184L)
+#define STATUS_NOT_FOUND                ((NTSTATUS)0xC0000225L)
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+//
+// I/O control codes
+//
+
+#define METHOD_BUFFERED         0
+#define METHOD_IN_DIRECT        1
+#define METHOD_OUT_DIRECT       2
+#define METHOD_NEITHER          3
+#define FILE_ANY_ACCESS         0
+#define FILE_READ_ACCESS        1
+#define FILE_WRITE_ACCESS       2
+#define FILE_READ_DATA          FILE_READ_ACCESS
+#define FILE_WRITE_DATA         FILE_WRITE_ACCESS
+#define FILE_DEVICE_UNKNOWN     0x00000022
+
+#define DEFINE_GUID(Name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    static const GUID Name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+
+//
+// Interrupt levels and processors
+//
+// Each thread has its own IRQL and current processor. A thread starts on
+// processor 0 and moves with MahfHostSetProcessor or a group affinity
+// change; a broadcast IPI runs its worker once per simulated processor, in
+// order, on the calling thread.
+//
+
+#define PASSIVE_LEVEL           0
+#define APC_LEVEL               1
+#define DISPATCH_LEVEL          2
+#define IPI_LEVEL               29
+#define HIGH_LEVEL              31
+
+#define ALL_PROCESSOR_GROUPS    0xFFFF
+#define MAHF_HOST_GROUP_SIZE    64
+
+KIRQL KeGetCurrentIrql(VOID);
+VOID KeRaiseIrql(KIRQL NewIrql, KIRQL *OldIrql);
+VOID KeLowerIrql(KIRQL NewIrql);
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber);
+USHORT KeQueryActiveGroupCount(VOID);
+ULONG KeGetProcessorIndexFromNumber(PPROCESSOR_NUMBER ProcNumber);
+VOID KeSetSystemGroupAffinityThread(PGROUP_AFFINITY Affinity, PGROUP_AFFINITY PreviousAffinity);
+VOID KeRevertToUserGroupAffinityThread(PGROUP_AFFINITY PreviousAffinity);
+
+typedef ULONG_PTR KIPI_BROADCAST_WORKER(ULONG_PTR Argument);
+typedef KIPI_BROADCAST_WORKER *PKIPI_BROADCAST_WORKER;
+
+ULONG_PTR KeIpiGenericCall(PKIPI_BROADCAST_WORKER BroadcastFunction, ULONG_PTR Context);
+
+// 100 ns units; interrupt time from boot, system time from 1601
+ULONG64 KeQueryInterruptTime(VOID);
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime);
+
+// The host's monotonic clock at 1 GHz; real time even under a physics model
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+
+//
+// Synchronization
+//
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, KIRQL *OldIrql);
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+
+#define KeMemoryBarrier()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define MemoryBarrier()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define _ReadWriteBarrier()     __asm__ __volatile__("" ::: "memory")
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor()        _mm_pause()
+#else
+#define YieldProcessor()        ((void)0)
+#endif
+
+// Interlocked operations return what the Windows versions return: the new
+// value for Increment/Decrement/Add, the old one for the rest
+FORCEINLINE LONG InterlockedIncrement(volatile LONG *Target) { return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedDecrement(volatile LONG *Target) { return __atomic_sub_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchange(volatile LONG *Target, LONG Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchangeAdd(volatile LONG *Target, LONG Value) { return __atomic_fetch_add(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedOr(volatile LONG *Target, LONG Value) { return __atomic_fetch_or(Target, Value, __ATOMIC_SEQ_CST); }
+
+FORCEINLINE LONG InterlockedCompareExchange(volatile LONG *Target, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONG64 InterlockedIncrement64(volatile LONG64 *Target) { return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedDecrement64(volatile LONG64 *Target) { return __atomic_sub_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedExchange64(volatile LONG64 *Target, LONG64 Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedExchangeAdd64(volatile LONG64 *Target, LONG64 Value) { return __atomic_fetch_add(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedAdd64(volatile LONG64 *Target, LONG64 Value) { return __atomic_add_fetch(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedOr64(volatile LONG64 *Target, LONG64 Value) { return __atomic_fetch_or(Target, Value, __ATOMIC_SEQ_CST); }
+
+FORCEINLINE LONG64 InterlockedCompareExchange64(volatile LONG64 *Target, LONG64 Exchange, LONG64 Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE PVOID InterlockedExchangePointer(PVOID volatile *Target, PVOID Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+
+FORCEINLINE PVOID InterlockedCompareExchangePointer(PVOID volatile *Target, PVOID Exchange, PVOID Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONG ReadNoFence(const volatile LONG *Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE LONG ReadAcquire(const volatile LONG *Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE LONG64 ReadNoFence64(const volatile LONG64 *Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE LONG64 ReadAcquire64(const volatile LONG64 *Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE PVOID ReadPointerAcquire(PVOID const volatile *Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE VOID WriteNoFence(volatile LONG *Destination, LONG Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteRelease(volatile LONG *Destination, LONG Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+FORCEINLINE VOID WriteNoFence64(volatile LONG64 *Destination, LONG64 Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteRelease64(volatile LONG64 *Destination, LONG64 Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+FORCEINLINE VOID WritePointerRelease(PVOID volatile *Destination, PVOID Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+
+//
+// Memory and strings
+//
+
+#define POOL_FLAG_UNINITIALIZED 0x0000000000000002ULL
+#define POOL_FLAG_CACHE_ALIGNED 0x0000000000000004ULL
+#define POOL_FLAG_NON_PAGED     0x0000000000000040ULL
+#define POOL_FLAG_PAGED         0x0000000000000100ULL
+
+// Always cache aligned, zeroed unless POOL_FLAG_UNINITIALIZED
+PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag);
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag);
+#define ExFreePool(P)           ExFreePoolWithTag((P), 0)
+
+#define RtlZeroMemory(Dest, Length)         memset((Dest), 0, (Length))
+#define RtlFillMemory(Dest, Length, Fill)   memset((Dest), (Fill), (Length))
+#define RtlCopyMemory(Dest, Src, Length)    memcpy((Dest), (Src), (Length))
+#define RtlMoveMemory(Dest, Src, Length)    memmove((Dest), (Src), (Length))
+#define RtlEqualMemory(A, B, Length)        (memcmp((A), (B), (Length)) == 0)
+
+// Bytes that match before the first difference
+SIZE_T RtlCompareMemory(const VOID *Source1, const VOID *Source2, SIZE_T Length);
+
+#define RTL_CONSTANT_STRING(s) \
+    { (USHORT)(sizeof(s) - sizeof((s)[0])), (USHORT)sizeof(s), (PWSTR)(s) }
+#define DECLARE_CONST_UNICODE_STRING(Name, s) \
+    const UNICODE_STRING Name = RTL_CONSTANT_STRING(s)
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source);
+NTSTATUS RtlStringCbCopyA(CHAR *Destination, SIZE_T Size, const CHAR *Source);
+
+// Silent unless MahfHostDebugPrint is set; then written to stderr
+extern BOOLEAN MahfHostDebugPrint;
+
+ULONG DbgPrint(const char *Format, ...);
+#define KdPrint(x)              ((void)0)
+
+//
+// Sections, MDLs and security
+//
+// A section is a zeroed allocation, its handle and object both point at
+// it, and a view is the allocation itself. Security calls succeed without
+// effect.
+//
+
+typedef struct _OBJECT_ATTRIBUTES {
+    ULONG Length;
+    PUNICODE_STRING ObjectName;
+    ULONG Attributes;
+    PVOID SecurityDescriptor;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define InitializeObjectAttributes(p, n, a, r, s) do {  \
+        (p)->Length = sizeof(OBJECT_ATTRIBUTES);        \
+        (p)->ObjectName = (n);                          \
+        (p)->Attributes = (a);                          \
+        (p)->SecurityDescriptor = (s);                  \
+        (void)(r);                                      \
+    } while (0)
+
+#define OBJ_CASE_INSENSITIVE    0x00000040
+#define OBJ_KERNEL_HANDLE       0x00000200
+#define SECTION_QUERY           0x0001
+#define SECTION_MAP_WRITE       0x0002
+#define SECTION_MAP_READ        0x0004
+#define SECTION_ALL_ACCESS      0x000F001F
+#define PAGE_READONLY           0x02
+#define PAGE_READWRITE          0x04
+#define SEC_COMMIT              0x08000000
+
+typedef CHAR KPROCESSOR_MODE;
+#define KernelMode              0
+#define UserMode                1
+
+NTSTATUS ZwCreateSection(HANDLE *SectionHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+                         PLARGE_INTEGER MaximumSize, ULONG PageProtection, ULONG AllocationAttributes,
+                         HANDLE FileHandle);
+NTSTATUS ZwClose(HANDLE Handle);
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ULONG DesiredAccess, PVOID ObjectType,
+                                   KPROCESSOR_MODE AccessMode, PVOID *Object, PVOID HandleInformation);
+VOID ObfDereferenceObject(PVOID Object);
+#define ObDereferenceObject(Object) ObfDereferenceObject(Object)
+NTSTATUS MmMapViewInSystemSpace(PVOID Section, PVOID *MappedBase, PSIZE_T ViewSize);
+NTSTATUS MmUnmapViewInSystemSpace(PVOID MappedBase);
+
+typedef struct _MDL {
+    USHORT MdlFlags;
+    PVOID MappedSystemVa;
+    ULONG ByteCount;
+} MDL, *PMDL;
+
+typedef enum _LOCK_OPERATION {
+    IoReadAccess,
+    IoWriteAccess,
+    IoModifyAccess
+} LOCK_OPERATION;
+
+#define MDL_PAGES_LOCKED        0x0002
+#define NormalPagePriority      16
+#define MdlMappingNoExecute     0x40000000
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer,
+                   BOOLEAN ChargeQuota, PVOID Irp);
+VOID IoFreeMdl(PMDL Mdl);
+VOID MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE AccessMode, LOCK_OPERATION Operation);
+VOID MmUnlockPages(PMDL Mdl);
+PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority);
+
+typedef struct _SECURITY_DESCRIPTOR {
+    UCHAR Opaque[64];
+} SECURITY_DESCRIPTOR, *PSECURITY_DESCRIPTOR;
+
+typedef struct _ACL {
+    UCHAR AclRevision;
+} ACL, *PACL;
+
+typedef PVOID PSID;
+
+typedef struct _ACCESS_ALLOWED_ACE {
+    UCHAR AceType;
+    UCHAR AceFlags;
+    USHORT AceSize;
+    ULONG Mask;
+    ULONG SidStart;
+} ACCESS_ALLOWED_ACE, *PACCESS_ALLOWED_ACE;
+
+typedef struct _SE_EXPORTS {
+    PSID SeLocalSystemSid;
+    PSID SeAliasAdminsSid;
+    PSID SeWorldSid;
+} SE_EXPORTS, *PSE_EXPORTS;
+
+extern PSE_EXPORTS SeExports;
+
+#define SECURITY_DESCRIPTOR_REVISION 1
+#define ACL_REVISION            2
+
+NTSTATUS RtlCreateSecurityDescriptor(PVOID SecurityDescriptor, ULONG Revision);
+ULONG RtlLengthSid(PSID Sid);
+NTSTATUS RtlCreateAcl(PACL Acl, ULONG AclLength, ULONG AclRevision);
+NTSTATUS RtlAddAccessAllowedAce(PACL Acl, ULONG AceRevision, ULONG AccessMask, PSID Sid);
+NTSTATUS RtlSetDaclSecurityDescriptor(PVOID SecurityDescriptor, BOOLEAN DaclPresent, PACL Dacl,
+                                      BOOLEAN DaclDefaulted);
+
+// SystemProcessorPerformanceInformation only: times for the calling
+// thread's group, with each processor busy the same share of host time
+// as the simulated hardware backend reports through APERF/MPERF, or as
+// busy as its physics model says
+NTSTATUS ZwQuerySystemInformation(ULONG SystemInformationClass, PVOID SystemInformation,
+                                  ULONG SystemInformationLength, PULONG ReturnLength);
+
+//
+// Framework objects
+//
+// Every handle is a host object carrying its context, allocated at the
+// size named by WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE. Requests are
+// dispatched synchronously on the sending thread: parallel queues call
+// straight into the driver, sequential queues under a per-queue lock, and
+// manual queues hold requests until the driver retrieves them. Timers run
+// only when MahfHostRunTimers or MahfHostAdvance fires them. The
+// parameters key does not exist, so the driver keeps its defaults.
+//
+
+typedef struct WDFDRIVER__ *WDFDRIVER;
+typedef struct WDFDEVICE__ *WDFDEVICE;
+typedef struct WDFQUEUE__ *WDFQUEUE;
+typedef struct WDFREQUEST__ *WDFREQUEST;
+typedef struct WDFTIMER__ *WDFTIMER;
+typedef struct WDFWAITLOCK__ *WDFWAITLOCK;
+typedef struct WDFKEY__ *WDFKEY;
+typedef struct WDFFILEOBJECT__ *WDFFILEOBJECT;
+typedef PVOID WDFOBJECT;
+typedef struct WDFDEVICE_INIT WDFDEVICE_INIT, *PWDFDEVICE_INIT;
+
+typedef struct _DRIVER_OBJECT *PDRIVER_OBJECT;
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+
+typedef enum _WDF_TRI_STATE {
+    WdfFalse = FALSE,
+    WdfTrue = TRUE,
+    WdfUseDefault = 2
+} WDF_TRI_STATE;
+
+typedef enum _WDF_EXECUTION_LEVEL {
+    WdfExecutionLevelInvalid,
+    WdfExecutionLevelInheritFromParent,
+    WdfExecutionLevelPassive,
+    WdfExecutionLevelDispatch
+} WDF_EXECUTION_LEVEL;
+
+typedef enum _WDF_SYNCHRONIZATION_SCOPE {
+    WdfSynchronizationScopeInvalid,
+    WdfSynchronizationScopeInheritFromParent,
+    WdfSynchronizationScopeDevice,
+    WdfSynchronizationScopeQueue,
+    WdfSynchronizationScopeNone
+} WDF_SYNCHRONIZATION_SCOPE;
+
+typedef VOID EVT_WDF_OBJECT_CONTEXT_CLEANUP(WDFOBJECT Object);
+typedef EVT_WDF_OBJECT_CONTEXT_CLEANUP EVT_WDF_DEVICE_CONTEXT_CLEANUP;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES {
+    ULONG Size;
+    EVT_WDF_OBJECT_CONTEXT_CLEANUP *EvtCleanupCallback;
+    EVT_WDF_OBJECT_CONTEXT_CLEANUP *EvtDestroyCallback;
+    WDF_EXECUTION_LEVEL ExecutionLevel;
+    WDF_SYNCHRONIZATION_SCOPE SynchronizationScope;
+    WDFOBJECT ParentObject;
+    SIZE_T ContextSizeOverride;     // Context bytes
+    const VOID *ContextTypeInfo;
+} WDF_OBJECT_ATTRIBUTES, *PWDF_OBJECT_ATTRIBUTES;
+
+#define WDF_NO_OBJECT_ATTRIBUTES    NULL
+#define WDF_NO_HANDLE               NULL
+
+FORCEINLINE VOID WDF_OBJECT_ATTRIBUTES_INIT(PWDF_OBJECT_ATTRIBUTES Attributes)
+{
+    memset(Attributes, 0, sizeof(WDF_OBJECT_ATTRIBUTES));
+    Attributes->Size = sizeof(WDF_OBJECT_ATTRIBUTES);
+    Attributes->ExecutionLevel = WdfExecutionLevelInheritFromParent;
+    Attributes->SynchronizationScope = WdfSynchronizationScopeInheritFromParent;
+}
+
+PVOID MahfHostObjectContext(WDFOBJECT Handle);
+
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(Attributes, Type) \
+    (WDF_OBJECT_ATTRIBUTES_INIT(Attributes), (Attributes)->ContextSizeOverride = sizeof(Type))
+#define WdfObjectGetTypedContext(Handle, Type) \
+    ((Type *)MahfHostObjectContext((WDFOBJECT)(Handle)))
+#define WDF_DECLARE_CONTEXT_TYPE(Type) \
+    extern int MahfHostContextType_##Type
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(Type, Accessor) \
+    static inline Type *Accessor(WDFOBJECT Handle) { return (Type *)MahfHostObjectContext(Handle); } \
+    extern int MahfHostContextType_##Type
+
+VOID WdfObjectDelete(WDFOBJECT Object);
+#define WdfObjectReference(Object)      ((void)(Object))
+#define WdfObjectDereference(Object)    ((void)(Object))
+
+// Driver
+typedef NTSTATUS EVT_WDF_DRIVER_DEVICE_ADD(WDFDRIVER Driver, PWDFDEVICE_INIT DeviceInit);
+typedef VOID EVT_WDF_DRIVER_UNLOAD(WDFDRIVER Driver);
+
+typedef struct _WDF_DRIVER_CONFIG {
+    ULONG Size;
+    EVT_WDF_DRIVER_DEVICE_ADD *EvtDriverDeviceAdd;
+    EVT_WDF_DRIVER_UNLOAD *EvtDriverUnload;
+    ULONG DriverInitFlags;
+    ULONG DriverPoolTag;
+} WDF_DRIVER_CONFIG, *PWDF_DRIVER_CONFIG;
+
+FORCEINLINE VOID WDF_DRIVER_CONFIG_INIT(PWDF_DRIVER_CONFIG Config, EVT_WDF_DRIVER_DEVICE_ADD *EvtDriverDeviceAdd)
+{
+    memset(Config, 0, sizeof(WDF_DRIVER_CONFIG));
+    Config->Size = sizeof(WDF_DRIVER_CONFIG);
+    Config->EvtDriverDeviceAdd = EvtDriverDeviceAdd;
+}
+
+NTSTATUS WdfDriverCreate(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath,
+                         PWDF_OBJECT_ATTRIBUTES DriverAttributes, PWDF_DRIVER_CONFIG DriverConfig,
+                         WDFDRIVER *Driver);
+
+// Device
+typedef enum _WDF_DEVICE_IO_TYPE {
+    WdfDeviceIoUndefined,
+    WdfDeviceIoNeither,
+    WdfDeviceIoBuffered,
+    WdfDeviceIoDirect
+} WDF_DEVICE_IO_TYPE;
+
+typedef enum _WDF_POWER_DEVICE_STATE {
+    WdfPowerDeviceInvalid,
+    WdfPowerDeviceD0,
+    WdfPowerDeviceD1,
+    WdfPowerDeviceD2,
+    WdfPowerDeviceD3,
+    WdfPowerDeviceD3Final
+} WDF_POWER_DEVICE_STATE;
+
+typedef NTSTATUS EVT_WDF_DEVICE_D0_ENTRY(WDFDEVICE Device, WDF_POWER_DEVICE_STATE PreviousState);
+typedef NTSTATUS EVT_WDF_DEVICE_D0_EXIT(WDFDEVICE Device, WDF_POWER_DEVICE_STATE TargetState);
+
+typedef struct _WDF_PNPPOWER_EVENT_CALLBACKS {
+    ULONG Size;
+    EVT_WDF_DEVICE_D0_ENTRY *EvtDeviceD0Entry;
+    EVT_WDF_DEVICE_D0_EXIT *EvtDeviceD0Exit;
+} WDF_PNPPOWER_EVENT_CALLBACKS, *PWDF_PNPPOWER_EVENT_CALLBACKS;
+
+FORCEINLINE VOID WDF_PNPPOWER_EVENT_CALLBACKS_INIT(PWDF_PNPPOWER_EVENT_CALLBACKS Callbacks)
+{
+    memset(Callbacks, 0, sizeof(WDF_PNPPOWER_EVENT_CALLBACKS));
+    Callbacks->Size = sizeof(WDF_PNPPOWER_EVENT_CALLBACKS);
+}
+
+VOID WdfDeviceInitSetExclusive(PWDFDEVICE_INIT DeviceInit, BOOLEAN IsExclusive);
+VOID WdfDeviceInitSetDeviceType(PWDFDEVICE_INIT DeviceInit, ULONG DeviceType);
+VOID WdfDeviceInitSetIoType(PWDFDEVICE_INIT DeviceInit, WDF_DEVICE_IO_TYPE IoType);
+NTSTATUS WdfDeviceInitAssignSDDLString(PWDFDEVICE_INIT DeviceInit, PCWSTR SDDLString);
+NTSTATUS WdfDeviceInitAssignName(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING DeviceName);
+VOID WdfDeviceInitSetPnpPowerEventCallbacks(PWDFDEVICE_INIT DeviceInit,
+                                            PWDF_PNPPOWER_EVENT_CALLBACKS PnpPowerEventCallbacks);
+VOID WdfDeviceInitSetRequestAttributes(PWDFDEVICE_INIT DeviceInit, PWDF_OBJECT_ATTRIBUTES RequestAttributes);
+NTSTATUS WdfDeviceCreate(PWDFDEVICE_INIT *DeviceInit, PWDF_OBJECT_ATTRIBUTES DeviceAttributes,
+                         WDFDEVICE *Device);
+NTSTATUS WdfDeviceCreateSymbolicLink(WDFDEVICE Device, PCUNICODE_STRING SymbolicLinkName);
+NTSTATUS WdfDeviceCreateDeviceInterface(WDFDEVICE Device, const GUID *InterfaceClassGUID,
+                                        PCUNICODE_STRING ReferenceString);
+
+// Queues and requests
+typedef enum _WDF_IO_QUEUE_DISPATCH_TYPE {
+    WdfIoQueueDispatchInvalid,
+    WdfIoQueueDispatchSequential,
+    WdfIoQueueDispatchParallel,
+    WdfIoQueueDispatchManual
+} WDF_IO_QUEUE_DISPATCH_TYPE;
+
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(WDFQUEUE Queue, WDFREQUEST Request, size_t OutputBufferLength,
+                                                size_t InputBufferLength, ULONG IoControlCode);
+typedef VOID EVT_WDF_IO_QUEUE_IO_STOP(WDFQUEUE Queue, WDFREQUEST Request, ULONG ActionFlags);
+typedef VOID EVT_WDF_IO_QUEUE_IO_RESUME(WDFQUEUE Queue, WDFREQUEST Request);
+
+typedef struct _WDF_IO_QUEUE_CONFIG {
+    ULONG Size;
+    WDF_IO_QUEUE_DISPATCH_TYPE DispatchType;
+    WDF_TRI_STATE PowerManaged;
+    BOOLEAN AllowZeroLengthRequests;
+    BOOLEAN DefaultQueue;
+    EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL *EvtIoDeviceControl;
+    EVT_WDF_IO_QUEUE_IO_STOP *EvtIoStop;
+    EVT_WDF_IO_QUEUE_IO_RESUME *EvtIoResume;
+} WDF_IO_QUEUE_CONFIG, *PWDF_IO_QUEUE_CONFIG;
+
+FORCEINLINE VOID WDF_IO_QUEUE_CONFIG_INIT(PWDF_IO_QUEUE_CONFIG Config, WDF_IO_QUEUE_DISPATCH_TYPE DispatchType)
+{
+    memset(Config, 0, sizeof(WDF_IO_QUEUE_CONFIG));
+    Config->Size = sizeof(WDF_IO_QUEUE_CONFIG);
+    Config->DispatchType = DispatchType;
+    Config->PowerManaged = WdfUseDefault;
+}
+
+FORCEINLINE VOID WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(PWDF_IO_QUEUE_CONFIG Config,
+                                                        WDF_IO_QUEUE_DISPATCH_TYPE DispatchType)
+{
+    WDF_IO_QUEUE_CONFIG_INIT(Config, DispatchType);
+    Config->DefaultQueue = TRUE;
+}
+
+NTSTATUS WdfIoQueueCreate(WDFDEVICE Device, PWDF_IO_QUEUE_CONFIG Config,
+                          PWDF_OBJECT_ATTRIBUTES QueueAttributes, WDFQUEUE *Queue);
+WDFDEVICE WdfIoQueueGetDevice(WDFQUEUE Queue);
+VOID WdfIoQueueStopSynchronously(WDFQUEUE Queue);
+VOID WdfIoQueueStart(WDFQUEUE Queue);
+NTSTATUS WdfIoQueueFindRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFFILEOBJECT FileObject,
+                               PVOID Parameters, WDFREQUEST *OutRequest);
+NTSTATUS WdfIoQueueRetrieveFoundRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFREQUEST *OutRequest);
+
+NTSTATUS WdfRequestRetrieveInputBuffer(WDFREQUEST Request, size_t MinimumRequiredLength,
+                                       PVOID *Buffer, size_t *Length);
+NTSTATUS WdfRequestRetrieveOutputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize,
+                                        PVOID *Buffer, size_t *Length);
+NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST Request, WDFQUEUE DestinationQueue);
+VOID WdfRequestComplete(WDFREQUEST Request, NTSTATUS Status);
+VOID WdfRequestCompleteWithInformation(WDFREQUEST Request, NTSTATUS Status, ULONG_PTR Information);
+VOID WdfRequestStopAcknowledge(WDFREQUEST Request, BOOLEAN Requeue);
+
+// Timers
+typedef VOID EVT_WDF_TIMER(WDFTIMER Timer);
+
+typedef struct _WDF_TIMER_CONFIG {
+    ULONG Size;
+    EVT_WDF_TIMER *EvtTimerFunc;
+    ULONG Period;
+    BOOLEAN AutomaticSerialization;
+    ULONG TolerableDelay;
+    BOOLEAN UseHighResolutionTimer;
+} WDF_TIMER_CONFIG, *PWDF_TIMER_CONFIG;
+
+FORCEINLINE VOID WDF_TIMER_CONFIG_INIT(PWDF_TIMER_CONFIG Config, EVT_WDF_TIMER *EvtTimerFunc)
+{
+    memset(Config, 0, sizeof(WDF_TIMER_CONFIG));
+    Config->Size = sizeof(WDF_TIMER_CONFIG);
+    Config->EvtTimerFunc = EvtTimerFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+FORCEINLINE VOID WDF_TIMER_CONFIG_INIT_PERIODIC(PWDF_TIMER_CONFIG Config, EVT_WDF_TIMER *EvtTimerFunc, LONG Period)
+{
+    WDF_TIMER_CONFIG_INIT(Config, EvtTimerFunc);
+    Config->Period = (ULONG)Period;
+}
+
+#define WDF_REL_TIMEOUT_IN_MS(Ms)   (-((LONGLONG)(Ms) * 10000))
+#define WDF_REL_TIMEOUT_IN_US(Us)   (-((LONGLONG)(Us) * 10))
+
+NTSTATUS WdfTimerCreate(PWDF_TIMER_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes, WDFTIMER *Timer);
+BOOLEAN WdfTimerStart(WDFTIMER Timer, LONGLONG DueTime);
+BOOLEAN WdfTimerStop(WDFTIMER Timer, BOOLEAN Wait);
+WDFOBJECT WdfTimerGetParentObject(WDFTIMER Timer);
+
+// Wait locks
+NTSTATUS WdfWaitLockCreate(PWDF_OBJECT_ATTRIBUTES LockAttributes, WDFWAITLOCK *Lock);
+NTSTATUS WdfWaitLockAcquire(WDFWAITLOCK Lock, PLONGLONG Timeout);
+VOID WdfWaitLockRelease(WDFWAITLOCK Lock);
+
+// Registry
+#define KEY_READ                0x00020019
+#define KEY_WRITE               0x00020006
+#define REG_SZ                  1
+#define REG_BINARY              3
+#define REG_DWORD               4
+
+NTSTATUS WdfDriverOpenParametersRegistryKey(WDFDRIVER Driver, ULONG DesiredAccess,
+                                            PWDF_OBJECT_ATTRIBUTES KeyAttributes, WDFKEY *Key);
+VOID WdfRegistryClose(WDFKEY Key);
+NTSTATUS WdfRegistryQueryULong(WDFKEY Key, PCUNICODE_STRING ValueName, PULONG Value);
+NTSTATUS WdfRegistryQueryValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueLength,
+                               PVOID Value, PULONG ValueLengthQueried, PULONG ValueType);
+NTSTATUS WdfRegistryAssignValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueType,
+                                ULONG ValueLength, PVOID Value);
+
+//
+// Host control
+//
+
+// Loads the driver on ProcessorCount simulated processors: DriverEntry,
+// device add, then D0 entry. One device at a time.
+NTSTATUS MahfHostStart(ULONG ProcessorCount, WDFDEVICE *Device);
+
+// D0 exit, cleanup callbacks, unload; frees every framework object
+VOID MahfHostStop(VOID);
+
+// Sends an IOCTL through the device's default queue, METHOD_BUFFERED: the
+// input is copied into a system buffer the driver replies in, and up to
+// OutputLength bytes of the reply are copied back. Returns STATUS_PENDING
+// if the driver parked the request; it is freed when later completed.
+NTSTATUS MahfHostDeviceControl(WDFDEVICE Device, ULONG IoControlCode,
+                               const VOID *InputBuffer, ULONG InputLength,
+                               PVOID OutputBuffer, ULONG OutputLength, PULONG_PTR Information);
+
+// Moves the calling thread to a simulated processor
+VOID MahfHostSetProcessor(ULONG Processor);
+
+// Fires every started timer Ticks times, in creation order. One-shot
+// timers are stopped before their callback, which may start them again.
+VOID MahfHostRunTimers(ULONG Ticks);
+
+// Runs simulated time forward with the hardware backend's physics model
+// (MahfHwSimulatedConfigure before MahfHostStart), firing each timer as
+// its due time passes. The driver's clock is the model's, so it sees
+// Milliseconds go by. STATUS_INVALID_DEVICE_STATE without a model.
+NTSTATUS MahfHostAdvance(ULONG Milliseconds);
+
+#endif // _MAHF_HOST_H_
\ No newline at end of file
@@ -0,0 +1,1252 @@
+/*
+ * Mahf Firmware CPU Driver - Hardware Access Backends
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Simulated, Linux and record/replay implementations of MAHF_HW_OPS
+ */
+
+#include "mahf_hw.h"
+
+#if !defined(_KERNEL_MODE)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#endif
+
+#if defined(__linux__) && !defined(_KERNEL_MODE)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+#define HW_ATOMIC_INC64(Target) ((ULONG64)InterlockedIncrement64((volatile LONG64*)(Target)))
+#define HW_ZERO(Dest, Length)   RtlZeroMemory((Dest), (Length))
+#define HW_COPY(Dest, Src, Length) RtlCopyMemory((Dest), (Src), (Length))
+#define HW_TRY_LOCK(Lock)       (InterlockedCompareExchange((Lock), 1, 0) == 0)
+#define HW_UNLOCK(Lock)         InterlockedExchange((Lock), 0)
+#define HW_PAUSE()              YieldProcessor()
+#else
+#define HW_ATOMIC_INC64(Target) __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define HW_ZERO(Dest, Length)   memset((Dest), 0, (Length))
+#define HW_COPY(Dest, Src, Length) memcpy((Dest), (Src), (Length))
+#define HW_TRY_LOCK(Lock)       (__atomic_exchange_n((Lock), 1, __ATOMIC_ACQUIRE) == 0)
+#define HW_UNLOCK(Lock)         __atomic_store_n((Lock), 0, __ATOMIC_RELEASE)
+#define HW_PAUSE()              ((void)0)
+#endif
+
+// Monotonic clock, 100 ns units
+static ULONG64 HwNow(VOID)
+{
+#if defined(_KERNEL_MODE)
+    return KeQueryInterruptTime();
+#elif defined(_WIN32)
+    return GetTickCount64() * 10000;
+#else
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONG64)now.tv_sec * 10000000 + (ULONG64)now.tv_nsec / 100;
+#endif
+}
+
+const MAHF_HW_OPS *g_HwBackend = &MahfHwSimulated;
+
+// Select Backend
+VOID MahfHwSelect(const MAHF_HW_OPS *Backend)
+{
+    if (Backend) {
+        g_HwBackend = Backend;
+    }
+}
+
+//
+// Simulated backend
+//
+
+// PLATFORM_INFO: max non-turbo ratio 30 (bits 15:8), max efficiency ratio 8
+// (bits 47:40). TURBO_RATIO_LIMIT: 45 for every active-core count.
+// TEMPERATURE_TARGET: TjMax 100 C (bits 23:16).
+#define SIM_PLATFORM_INFO       0x0000080000001E00ULL
+#define SIM_TURBO_RATIO_LIMIT   0x2D2D2D2D2D2D2D2DULL
+#define SIM_TEMPERATURE_TARGET  0x0000000000640000ULL
+#define SIM_TJMAX               100
+#define SIM_BASE_RATIO          30
+#define SIM_EFFICIENCY_RATIO    8
+#define SIM_TURBO_RATIO         45
+#define SIM_TEMPERATURE         40
+#define SIM_ENERGY_BIAS         6
+
+// Settled temperature is SIM_AMBIENT + ratio * SIM_HEAT_PER_RATIO / 2; each
+// sensor read closes 1 / SIM_THERMAL_LAG of the gap, and at least a degree.
+// Ratio 30 settles at 75 C, ratio 45 at 97 C.
+#define SIM_AMBIENT             30
+#define SIM_HEAT_PER_RATIO      3
+#define SIM_THERMAL_LAG         16
+
+// RAPL units: power 1/8 W, energy 2^-14 J, time 2^-10 s. Each online CPU
+// draws SIM_IDLE_MW + ratio^2 * SIM_MW_PER_RATIO2 mW, the cores domain is
+// SIM_CORES_SHARE percent of that, and DRAM a flat SIM_DRAM_MW per package.
+// Core voltage in PERF_STATUS 47:32 is 700 mV + 12.5 mV per ratio step,
+// in 1/8192 V.
+#define SIM_RAPL_POWER_UNIT     0x00000000000A0E03ULL
+#define SIM_ENERGY_SHIFT        14
+#define SIM_IDLE_MW             300
+#define SIM_MW_PER_RATIO2       4
+#define SIM_CORES_SHARE         80
+#define SIM_DRAM_MW             2000
+#define SIM_MAX_PACKAGES        8
+#define SIM_DOMAINS             3
+
+// Counter rates per 100 ns: TSC/MPERF at the base ratio, APERF at the
+// programmed ratio, both times 100 MHz
+#define SIM_TICKS_PER_RATIO     10
+#define SIM_BUSY_PERCENT        50
+
+// Hybrid layout: the first SIM_P_THREADS CPUs are SMT-2 performance cores,
+// the rest single-threaded efficiency cores. APIC IDs step by 2 past the
+// P-cores, as on real hybrid parts where the SMT field is package-wide.
+// SIM_PACKAGE_SHIFT puts 128 APIC IDs in a package, so large CPU counts
+// also exercise multi-package enumeration.
+#define SIM_P_THREADS           16
+#define SIM_SMT_SHIFT           1
+#define SIM_PACKAGE_SHIFT       7
+
+// Physics model: PROCHOT releases this many degrees below TjMax, and
+// workloads without a curve ask for SIM_DEFAULT_DEMAND percent
+#define SIM_THROTTLE_HYSTERESIS 2
+#define SIM_DEFAULT_DEMAND      50
+
+static const char SimBrandString[48] = "Mahf Simulated CPU @ 3.00GHz";
+
+typedef struct _SIM_CPU {
+    ULONG64 PerfCtl;
+    ULONG Temperature;
+    BOOLEAN Online;                 // Has accessed the backend
+    ULONG64 CounterUpdate;          // HwNow of the last APERF/MPERF advance
+    ULONG64 Mperf;
+    ULONG64 Aperf;
+    ULONG64 EnergyBias;
+    
+    // Physics model only
+    LONG64 MicroC;                  // Temperature, millionths of a degree
+    ULONG Ratio;                    // Delivered
+    ULONG Demand;
+    ULONG Busy;                     // Per mille
+    ULONG PowerMw;
+    BOOLEAN Throttled;
+    ULONG64 BusyTime;
+    ULONG64 ThrottledTime;
+    ULONG64 RequestedWork;
+    ULONG64 DeliveredWork;
+    ULONG64 EnergyNj;
+} SIM_CPU;
+
+// Energy counters are kept in 2^-14 J units; Remainder holds what is left
+// over below one unit, scaled by 10^6. Any CPU of the package may read
+// them from its IPI callback, so everything here is updated under Lock,
+// an interlocked flag that is safe to take at any IRQL.
+typedef struct _SIM_PACKAGE {
+    volatile LONG Lock;
+    ULONG64 LastUpdate;
+    ULONG Counter[SIM_DOMAINS];     // Package, PP0, DRAM
+    ULONG64 Remainder[SIM_DOMAINS];
+} SIM_PACKAGE;
+
+// Package node of the physics model
+typedef struct _SIM_PACKAGE_NODE {
+    LONG64 MicroC;
+    ULONG PowerMw;
+    ULONG64 EnergyNj;
+} SIM_PACKAGE_NODE;
+
+// Set up once by MahfHwSimulatedReset before the driver touches the
+// backend. After that a CPU writes only its own SimCpus slot, and shared
+// package state goes through SimLockPackage.
+static SIM_CPU SimCpus[MAHF_HW_MAX_CPUS];
+static SIM_PACKAGE SimPackages[SIM_MAX_PACKAGES];
+static volatile BOOLEAN SimInitialized;
+
+static MAHF_SIM_MODEL SimModel;
+static BOOLEAN SimModelActive;
+static ULONG64 SimClock;            // 100 ns units
+static MAHF_SIM_WORKLOAD SimWorkloads[MAHF_HW_MAX_CPUS];
+static SIM_PACKAGE_NODE SimPackageNodes[SIM_MAX_PACKAGES];
+
+VOID MahfHwSimulatedReset(VOID)
+{
+    LONG64 ambient = (LONG64)SimModel.AmbientMilliC * 1000;
+    
+    HW_ZERO(SimCpus, sizeof(SimCpus));
+    
+    for (ULONG i = 0; i < MAHF_HW_MAX_CPUS; i++) {
+        SimCpus[i].PerfCtl = (ULONG64)SIM_BASE_RATIO << 8;
+        SimCpus[i].Temperature = SIM_TEMPERATURE;
+        SimCpus[i].EnergyBias = SIM_ENERGY_BIAS;
+        
+        if (SimModelActive) {
+            SimCpus[i].MicroC = ambient;
+            SimCpus[i].Temperature = (ULONG)(ambient > 0 ? ambient / 1000000 : 0);
+            SimCpus[i].Ratio = SIM_BASE_RATIO;
+        }
+    }
+    
+    HW_ZERO(SimPackages, sizeof(SimPackages));
+    HW_ZERO(SimPackageNodes, sizeof(SimPackageNodes));
+    
+    for (ULONG p = 0; p < SIM_MAX_PACKAGES; p++) {
+        SimPackageNodes[p].MicroC = ambient;
+    }
+    
+    SimClock = 0;
+    SimInitialized = TRUE;
+}
+
+static VOID SimLockPackage(SIM_PACKAGE *Package)
+{
+    while (!HW_TRY_LOCK(&Package->Lock)) {
+        HW_PAUSE();
+    }
+}
+
+static VOID SimUnlockPackage(SIM_PACKAGE *Package)
+{
+    HW_UNLOCK(&Package->Lock);
+}
+
+// Model time once configured, so every counter moves only when it advances
+static ULONG64 SimNow(VOID)
+{
+    return SimModelActive ? SimClock : HwNow();
+}
+
+ULONG64 MahfHwSimulatedNow(VOID)
+{
+    return SimNow();
+}
+
+static ULONG SimApicId(ULONG Cpu);
+
+static ULONG SimPackageOf(ULONG Cpu)
+{
+    return (SimApicId(Cpu) >> SIM_PACKAGE_SHIFT) % SIM_MAX_PACKAGES;
+}
+
+static VOID SimHeat(SIM_CPU *Cpu)
+{
+    LONG ratio = (LONG)((Cpu->PerfCtl >> 8) & 0xFF);
+    LONG settled = SIM_AMBIENT + ratio * SIM_HEAT_PER_RATIO / 2;
+    LONG current = (LONG)Cpu->Temperature;
+    LONG step = (settled - current) / SIM_THERMAL_LAG;
+    
+    if (SimModelActive) {
+        return;
+    }
+    
+    if (step == 0 && settled != current) {
+        step = settled > current ? 1 : -1;
+    }
+    
+    current += step;
+    Cpu->Temperature = (ULONG)(current < SIM_TJMAX ? current : SIM_TJMAX);
+}
+
+// Hottest CPU sharing Cpu's package
+static ULONG SimPackageTemperature(ULONG Cpu)
+{
+    ULONG package = SimApicId(Cpu) >> SIM_PACKAGE_SHIFT;
+    ULONG hottest = 0;
+    
+    for (ULONG i = 0; i < MAHF_HW_MAX_CPUS; i++) {
+        if ((SimApicId(i) >> SIM_PACKAGE_SHIFT) == package && SimCpus[i].Temperature > hottest) {
+            hottest = SimCpus[i].Temperature;
+        }
+    }
+    
+    return hottest;
+}
+
+// Add Milliwatts per domain over Elapsed (100 ns) to the package's counters
+static VOID SimDepositEnergy(SIM_PACKAGE *Package, const ULONG64 *Milliwatts, ULONG64 Elapsed)
+{
+    // mW * 100 ns = 10^-4 uJ; one energy unit is 10^6 / 2^14 uJ
+    for (ULONG d = 0; d < SIM_DOMAINS; d++) {
+        ULONG64 scaled = Package->Remainder[d] +
+                         (Milliwatts[d] * Elapsed << SIM_ENERGY_SHIFT) / 10000;
+        
+        Package->Counter[d] += (ULONG)(scaled / 1000000);
+        Package->Remainder[d] = scaled % 1000000;
+    }
+}
+
+// Integrate the package's power since the last read of any of its counters.
+// The physics model deposits its own energy as it steps. Caller holds the
+// package lock.
+static VOID SimAccumulateEnergy(ULONG Package)
+{
+    SIM_PACKAGE *package = &SimPackages[Package];
+    ULONG64 now = HwNow();
+    ULONG64 elapsed = now - package->LastUpdate;
+    ULONG64 milliwatts[SIM_DOMAINS] = {0, 0, SIM_DRAM_MW};
+    
+    if (SimModelActive) {
+        return;
+    }
+    
+    if (package->LastUpdate == 0) {
+        package->LastUpdate = now;
+        return;
+    }
+    
+    package->LastUpdate = now;
+    
+    // Bounds the arithmetic below; nothing polls this rarely
+    if (elapsed > 10 * 10000000ULL) {
+        elapsed = 10 * 10000000ULL;
+    }
+    
+    for (ULONG i = 0; i < MAHF_HW_MAX_CPUS; i++) {
+        ULONG64 ratio = (SimCpus[i].PerfCtl >> 8) & 0xFF;
+        
+        if (SimCpus[i].Online && (SimApicId(i) >> SIM_PACKAGE_SHIFT) == Package) {
+            milliwatts[0] += SIM_IDLE_MW + ratio * ratio * SIM_MW_PER_RATIO2;
+        }
+    }
+    
+    milliwatts[1] = milliwatts[0] * SIM_CORES_SHARE / 100;
+    milliwatts[0] += SIM_DRAM_MW;
+    
+    SimDepositEnergy(package, milliwatts, elapsed);
+}
+
+// Advance MPERF and APERF by the busy share of the time since the last read
+static VOID SimAdvanceCounters(SIM_CPU *Cpu, ULONG Index)
+{
+    ULONG64 now = HwNow();
+    ULONG64 busy;
+    
+    if (SimModelActive) {
+        return;
+    }
+    
+    if (Cpu->CounterUpdate != 0) {
+        busy = (now - Cpu->CounterUpdate) * (SIM_BUSY_PERCENT + (Index % 4) * 10) / 100;
+        Cpu->Mperf += busy * SIM_BASE_RATIO * SIM_TICKS_PER_RATIO;
+        Cpu->Aperf += busy * ((Cpu->PerfCtl >> 8) & 0xFF) * SIM_TICKS_PER_RATIO;
+    }
+    
+    Cpu->CounterUpdate = now;
+}
+
+static ULONG64 SimEnergy(ULONG Cpu, ULONG Domain)
+{
+    ULONG package = SimPackageOf(Cpu);
+    ULONG64 counter;
+    
+    SimLockPackage(&SimPackages[package]);
+    SimAccumulateEnergy(package);
+    counter = SimPackages[package].Counter[Domain];
+    SimUnlockPackage(&SimPackages[package]);
+    
+    return counter;
+}
+
+static NTSTATUS SimReadMsr(ULONG Cpu, ULONG Register, PULONG64 Value)
+{
+    SIM_CPU *cpu;
+    ULONG64 ratio;
+    
+    if (!Value || Cpu >= MAHF_HW_MAX_CPUS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!SimInitialized) {
+        *Value = 0;
+        return STATUS_DEVICE_NOT_READY;
+    }
+    
+    cpu = &SimCpus[Cpu];
+    cpu->Online = TRUE;
+    
+    switch (Register) {
+        case MSR_PERF_STATUS:
+            // Current ratio in bits 15:8 tracks the requested ratio, or the
+            // model's delivered one
+            ratio = SimModelActive ? cpu->Ratio : (cpu->PerfCtl >> 8) & 0xFF;
+            *Value = ratio << 8;
+            *Value |= ((5734ULL + ratio * 102) & 0xFFFF) << 32;
+            break;
+            
+        case MSR_PERF_CTL:
+            *Value = cpu->PerfCtl;
+            break;
+            
+        case MSR_TSC:
+            *Value = SimNow() * SIM_BASE_RATIO * SIM_TICKS_PER_RATIO;
+            break;
+            
+        case MSR_MPERF:
+            SimAdvanceCounters(cpu, Cpu);
+            *Value = cpu->Mperf;
+            break;
+            
+        case MSR_APERF:
+            SimAdvanceCounters(cpu, Cpu);
+            *Value = cpu->Aperf;
+            break;
+            
+        case MSR_THERM_STATUS:
+            // Reading valid (bit 31), digital readout below TjMax in 22:16,
+            // PROCHOT (bit 0)
+            SimHeat(cpu);
+            *Value = (1ULL << 31) | ((ULONG64)(SIM_TJMAX - cpu->Temperature) << 16);
+            *Value |= cpu->Throttled ? 1 : 0;
+            break;
+            
+        case MSR_ENERGY_PERF_BIAS:
+            *Value = cpu->EnergyBias;
+            break;
+            
+        case MSR_PACKAGE_THERM_STATUS:
+            // Same readout field, no valid bit
+            *Value = (ULONG64)(SIM_TJMAX - SimPackageTemperature(Cpu)) << 16;
+            break;
+            
+        case MSR_PLATFORM_INFO:
+            *Value = SIM_PLATFORM_INFO;
+            break;
+            
+        case MSR_TEMPERATURE_TARGET:
+            *Value = SIM_TEMPERATURE_TARGET;
+            break;
+            
+        case MSR_TURBO_RATIO_LIMIT:
+            *Value = SIM_TURBO_RATIO_LIMIT;
+            break;
+            
+        case MSR_RAPL_POWER_UNIT:
+            *Value = SIM_RAPL_POWER_UNIT;
+            break;
+            
+        case MSR_PKG_ENERGY_STATUS:
+            *Value = SimEnergy(Cpu, 0);
+            break;
+            
+        case MSR_PP0_ENERGY_STATUS:
+            *Value = SimEnergy(Cpu, 1);
+            break;
+            
+        case MSR_DRAM_ENERGY_STATUS:
+            *Value = SimEnergy(Cpu, 2);
+            break;
+            
+        default:
+            *Value = 0;
+            return STATUS_NOT_SUPPORTED;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS SimWriteMsr(ULONG Cpu, ULONG Register, ULONG64 Value)
+{
+    if (Cpu >= MAHF_HW_MAX_CPUS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!SimInitialized) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+    
+    SimCpus[Cpu].Online = TRUE;
+    
+    switch (Register) {
+        case MSR_PERF_CTL:
+            // Busy time so far counts at the old ratio
+            SimAdvanceCounters(&SimCpus[Cpu], Cpu);
+            SimCpus[Cpu].PerfCtl = Value;
+            return STATUS_SUCCESS;
+            
+        case MSR_ENERGY_PERF_BIAS:
+            // Bits 3:0; the rest are reserved and fault on hardware
+            if (Value & ~0xFULL) {
+                return STATUS_INVALID_PARAMETER;
+            }
+            SimCpus[Cpu].EnergyBias = Value;
+            return STATUS_SUCCESS;
+            
+        default:
+            return STATUS_NOT_SUPPORTED;
+    }
+}
+
+static ULONG SimApicId(ULONG Cpu)
+{
+    return Cpu < SIM_P_THREADS ? Cpu : SIM_P_THREADS + (Cpu - SIM_P_THREADS) * 2;
+}
+
+static NTSTATUS SimCpuid(ULONG Cpu, ULONG Function, ULONG SubFunction, PULONG32 Registers)
+{
+    ULONG apicId = SimApicId(Cpu);
+    
+    if (!Registers || Cpu >= MAHF_HW_MAX_CPUS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    HW_ZERO(Registers, 4 * sizeof(ULONG32));
+    
+    switch (Function) {
+        case 0:
+            // Vendor string "GenuineIntel"
+            Registers[0] = 0x0000001F;
+            Registers[1] = 0x756E6547;
+            Registers[2] = 0x6C65746E;
+            Registers[3] = 0x49656E69;
+            break;
+            
+        case 1:
+            // Processor info, initial APIC ID in EBX 31:24
+            Registers[0] = 0x000906A0;
+            Registers[1] = 0x000C0800 | ((apicId & 0xFF) << 24);
+            Registers[2] = 0x7FFAFBBF;
+            Registers[3] = 0xBFEBFBFF;
+            break;
+            
+        case 6:
+            // Digital thermal sensor (EAX[0]), package thermal management (EAX[6]),
+            // APERF/MPERF (ECX[0]), ENERGY_PERF_BIAS (ECX[3])
+            Registers[0] = (1 << 0) | (1 << 6);
+            Registers[2] = (1 << 0) | (1 << 3);
+            break;
+            
+        case 7:
+            // Hybrid part, EDX[15]
+            if (SubFunction == 0) {
+                Registers[3] = 1 << 15;
+            }
+            break;
+            
+        case 0xB:
+        case 0x1F:
+            // SMT then core level; sub-leaf 2 is invalid and ends the list
+            if (SubFunction == 0) {
+                Registers[0] = SIM_SMT_SHIFT;
+                Registers[1] = Cpu < SIM_P_THREADS ? 2 : 1;
+                Registers[2] = (1 << 8) | SubFunction;
+            } else if (SubFunction == 1) {
+                Registers[0] = SIM_PACKAGE_SHIFT;
+                Registers[1] = 1 << (SIM_PACKAGE_SHIFT - SIM_SMT_SHIFT);
+                Registers[2] = (2 << 8) | SubFunction;
+            } else {
+                Registers[2] = SubFunction;
+            }
+            Registers[3] = apicId;
+            break;
+            
+        case 0x1A:
+            // Core type: 0x40 Core (performance), 0x20 Atom (efficiency)
+            Registers[0] = (Cpu < SIM_P_THREADS ? 0x40UL : 0x20UL) << 24;
+            break;
+            
+        case 0x80000000:
+            Registers[0] = 0x80000008;
+            break;
+            
+        case 0x80000002:
+        case 0x80000003:
+        case 0x80000004:
+            HW_COPY(Registers, &SimBrandString[(Function - 0x80000002) * 16], 16);
+            break;
+            
+        default:
+            break;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+const MAHF_HW_OPS MahfHwSimulated = {
+    "simulated",
+    SimReadMsr,
+    SimWriteMsr,
+    SimCpuid
+};
+
+// Physics model
+
+VOID MahfHwSimulatedDefaultModel(PMAHF_SIM_MODEL Model)
+{
+    Model->StepUs = 1000;
+    Model->AmbientMilliC = 25000;
+    Model->CapacitancePf = 1100;
+    Model->IdleMw = 150;
+    Model->LeakageMw = 300;
+    Model->LeakagePerMilleC = 15;
+    Model->CoreHeatCapacity = 10000;            // 0.01 J/C, 20 ms to the package
+    Model->CoreResistance = 2000;
+    Model->PackageHeatCapacity = 40000000;      // 40 J/C, 8 s to ambient
+    Model->PackageResistance = 200;
+    Model->UncoreMw = 5000;
+    Model->DramMw = SIM_DRAM_MW;
+}
+
+VOID MahfHwSimulatedConfigure(const MAHF_SIM_MODEL *Model)
+{
+    MAHF_SIM_MODEL defaults;
+    ULONG64 tau;
+    
+    MahfHwSimulatedDefaultModel(&defaults);
+    
+    SimModelActive = Model != NULL;
+    SimModel = Model ? *Model : defaults;
+    
+    // Divisors, and a step the explicit integration stays stable at: an
+    // eighth of the CPU's thermal time constant
+    if (SimModel.CoreHeatCapacity == 0) {
+        SimModel.CoreHeatCapacity = defaults.CoreHeatCapacity;
+    }
+    if (SimModel.CoreResistance == 0) {
+        SimModel.CoreResistance = defaults.CoreResistance;
+    }
+    if (SimModel.PackageHeatCapacity == 0) {
+        SimModel.PackageHeatCapacity = defaults.PackageHeatCapacity;
+    }
+    if (SimModel.PackageResistance == 0) {
+        SimModel.PackageResistance = defaults.PackageResistance;
+    }
+    
+    tau = (ULONG64)SimModel.CoreResistance * SimModel.CoreHeatCapacity / 1000;
+    if (SimModel.StepUs == 0 || SimModel.StepUs > tau / 8) {
+        SimModel.StepUs = (ULONG)(tau / 8 > 0 ? tau / 8 : 1);
+    }
+    
+    for (ULONG i = 0; i < MAHF_HW_MAX_CPUS; i++) {
+        HW_ZERO(&SimWorkloads[i], sizeof(SimWorkloads[i]));
+        SimWorkloads[i].Shape = MAHF_SIM_SHAPE_CONSTANT;
+        SimWorkloads[i].Low = SIM_DEFAULT_DEMAND;
+    }
+    
+    MahfHwSimulatedReset();
+}
+
+VOID MahfHwSimulatedSetWorkload(ULONG Cpu, const MAHF_SIM_WORKLOAD *Workload)
+{
+    if (Cpu < MAHF_HW_MAX_CPUS && Workload) {
+        SimWorkloads[Cpu] = *Workload;
+    }
+}
+
+ULONG MahfHwSimulatedPackageOf(ULONG Cpu)
+{
+    return SimPackageOf(Cpu);
+}
+
+// Seeded 32-bit mix for random demand levels
+static ULONG SimHash(ULONG Seed, ULONG Index)
+{
+    ULONG x = Seed * 0x9E3779B1UL ^ Index * 0x85EBCA77UL;
+    
+    x ^= x >> 16;
+    x *= 0x7FEB352DUL;
+    x ^= x >> 15;
+    x *= 0x846CA68BUL;
+    x ^= x >> 16;
+    return x;
+}
+
+// Demand of Cpu at the current model time, percent of one CPU at base
+static ULONG SimDemand(ULONG Cpu)
+{
+    const MAHF_SIM_WORKLOAD *workload = &SimWorkloads[Cpu];
+    ULONG64 ms = SimClock / 10000 + workload->PhaseMs;
+    ULONG span = workload->High > workload->Low ? workload->High - workload->Low : 0;
+    ULONG period = workload->PeriodMs;
+    ULONG phase;
+    ULONG half;
+    
+    if (period == 0) {
+        return workload->Low;
+    }
+    
+    phase = (ULONG)(ms % period);
+    
+    switch (workload->Shape) {
+        case MAHF_SIM_SHAPE_SQUARE:
+            return (ULONG64)phase * 100 < (ULONG64)period * workload->DutyPercent ?
+                workload->High : workload->Low;
+            
+        case MAHF_SIM_SHAPE_TRIANGLE:
+            half = period / 2 > 0 ? period / 2 : 1;
+            if (phase < half) {
+                return workload->Low + (ULONG)((ULONG64)span * phase / half);
+            }
+            return workload->Low + (ULONG)((ULONG64)span * (period - phase) / (period - half));
+            
+        case MAHF_SIM_SHAPE_RANDOM:
+            return workload->Low +
+                   SimHash(workload->Seed ^ Cpu, (ULONG)(ms / period)) % (span + 1);
+            
+        default:
+            return workload->Low;
+    }
+}
+
+// One integration step of Step microseconds
+static VOID SimStep(ULONG Step)
+{
+    const MAHF_SIM_MODEL *model = &SimModel;
+    LONG64 ambient = (LONG64)model->AmbientMilliC * 1000;
+    ULONG64 elapsed = (ULONG64)Step * 10;
+    ULONG64 coresMw[SIM_MAX_PACKAGES];
+    LONG64 inflowMw[SIM_MAX_PACKAGES];
+    BOOLEAN populated[SIM_MAX_PACKAGES];
+    
+    HW_ZERO(coresMw, sizeof(coresMw));
+    HW_ZERO(inflowMw, sizeof(inflowMw));
+    HW_ZERO(populated, sizeof(populated));
+    
+    for (ULONG i = 0; i < MAHF_HW_MAX_CPUS; i++) {
+        SIM_CPU *cpu = &SimCpus[i];
+        ULONG package = SimPackageOf(i);
+        ULONG ratio = (ULONG)((cpu->PerfCtl >> 8) & 0xFF);
+        LONG64 degrees = cpu->MicroC / 1000000;
+        LONG64 excess = (cpu->MicroC - ambient) / 1000;
+        ULONG64 millivolts;
+        ULONG64 power;
+        ULONG64 busyTime;
+        LONG64 flow;
+        
+        if (!cpu->Online) {
+            continue;
+        }
+        
+        populated[package] = TRUE;
+        
+        if (degrees >= SIM_TJMAX) {
+            cpu->Throttled = TRUE;
+        } else if (degrees < SIM_TJMAX - SIM_THROTTLE_HYSTERESIS) {
+            cpu->Throttled = FALSE;
+        }
+        
+        ratio = ratio < SIM_EFFICIENCY_RATIO ? SIM_EFFICIENCY_RATIO : ratio;
+        ratio = ratio > SIM_TURBO_RATIO ? SIM_TURBO_RATIO : ratio;
+        ratio = cpu->Throttled ? SIM_EFFICIENCY_RATIO : ratio;
+        
+        cpu->Ratio = ratio;
+        cpu->Demand = SimDemand(i);
+        cpu->Busy = cpu->Demand * 10 * SIM_BASE_RATIO / ratio;
+        cpu->Busy = cpu->Busy > 1000 ? 1000 : cpu->Busy;
+        
+        // Same voltage as PERF_STATUS reports: 700 mV + 12.5 mV per ratio step
+        millivolts = 700 + ratio * 25 / 2;
+        
+        // C * V^2 * f while busy, in pF * mV^2 * MHz = 10^-9 mW
+        power = (ULONG64)model->CapacitancePf * millivolts * millivolts * (ratio * 100) / 1000000 *
+                cpu->Busy / 1000000;
+        power += (ULONG64)model->IdleMw * (1000 - cpu->Busy) / 1000;
+        power += (ULONG64)model->LeakageMw * millivolts *
+                 (ULONG64)(1000000 + (excess > 0 ? excess : 0) * model->LeakagePerMilleC) / 1000000000;
+        
+        // uC / (mC/W) = mW; mW * us = nJ; nJ / (uJ/C) = mC
+        flow = (cpu->MicroC - SimPackageNodes[package].MicroC) / (LONG64)model->CoreResistance;
+        cpu->MicroC += ((LONG64)power - flow) * Step * 1000 / (LONG64)model->CoreHeatCapacity;
+        
+        degrees = cpu->MicroC / 1000000;
+        cpu->Temperature = (ULONG)(degrees < 0 ? 0 : degrees > SIM_TJMAX ? SIM_TJMAX : degrees);
+        cpu->PowerMw = (ULONG)power;
+        
+        busyTime = elapsed * cpu->Busy / 1000;
+        cpu->Mperf += busyTime * SIM_BASE_RATIO * SIM_TICKS_PER_RATIO;
+        cpu->Aperf += busyTime * ratio * SIM_TICKS_PER_RATIO;
+        cpu->BusyTime += busyTime;
+        cpu->ThrottledTime += cpu->Throttled ? elapsed : 0;
+        cpu->RequestedWork += (ULONG64)cpu->Demand * Step * 10;
+        cpu->DeliveredWork += (ULONG64)cpu->Busy * Step * ratio / SIM_BASE_RATIO;
+        cpu->EnergyNj += power * Step;
+        
+        coresMw[package] += power;
+        inflowMw[package] += flow;
+    }
+    
+    for (ULONG p = 0; p < SIM_MAX_PACKAGES; p++) {
+        SIM_PACKAGE_NODE *node = &SimPackageNodes[p];
+        ULONG64 milliwatts[SIM_DOMAINS];
+        LONG64 outflow;
+        
+        if (!populated[p]) {
+            continue;
+        }
+        
+        outflow = (node->MicroC - ambient) / (LONG64)model->PackageResistance;
+        node->MicroC += (inflowMw[p] + (LONG64)model->UncoreMw - outflow) * Step * 1000 /
+                        (LONG64)model->PackageHeatCapacity;
+        
+        milliwatts[1] = coresMw[p];
+        milliwatts[2] = model->DramMw;
+        milliwatts[0] = coresMw[p] + model->UncoreMw + model->DramMw;
+        
+        SimLockPackage(&SimPackages[p]);
+        SimDepositEnergy(&SimPackages[p], milliwatts, elapsed);
+        SimUnlockPackage(&SimPackages[p]);
+        node->PowerMw = (ULONG)milliwatts[0];
+        node->EnergyNj += milliwatts[0] * Step;
+    }
+    
+    SimClock += elapsed;
+}
+
+VOID MahfHwSimulatedAdvance(ULONG64 Microseconds)
+{
+    if (!SimModelActive || !SimInitialized) {
+        return;
+    }
+    
+    while (Microseconds > 0) {
+        ULONG step = Microseconds < SimModel.StepUs ? (ULONG)Microseconds : SimModel.StepUs;
+        
+        SimStep(step);
+        Microseconds -= step;
+    }
+}
+
+BOOLEAN MahfHwSimulatedGetCpu(ULONG Cpu, PMAHF_SIM_CPU_STATE State)
+{
+    const SIM_CPU *cpu;
+    
+    if (!SimModelActive || Cpu >= MAHF_HW_MAX_CPUS || !State) {
+        return FALSE;
+    }
+    
+    cpu = &SimCpus[Cpu];
+    
+    HW_ZERO(State, sizeof(*State));
+    State->TemperatureMilliC = (LONG)(cpu->MicroC / 1000);
+    State->PowerMw = cpu->PowerMw;
+    State->Ratio = cpu->Ratio;
+    State->DemandPercent = cpu->Demand;
+    State->BusyPerMille = cpu->Busy;
+    State->Throttled = cpu->Throttled;
+    State->BusyTime = cpu->BusyTime;
+    State->ThrottledTime = cpu->ThrottledTime;
+    State->RequestedWork = cpu->RequestedWork;
+    State->DeliveredWork = cpu->DeliveredWork;
+    State->EnergyUj = cpu->EnergyNj / 1000;
+    return TRUE;
+}
+
+BOOLEAN MahfHwSimulatedGetPackage(ULONG Package, PMAHF_SIM_PACKAGE_STATE State)
+{
+    const SIM_PACKAGE_NODE *node;
+    
+    if (!SimModelActive || Package >= SIM_MAX_PACKAGES || !State) {
+        return FALSE;
+    }
+    
+    node = &SimPackageNodes[Package];
+    
+    HW_ZERO(State, sizeof(*State));
+    State->TemperatureMilliC = (LONG)(node->MicroC / 1000);
+    State->PowerMw = node->PowerMw;
+    State->EnergyUj = node->EnergyNj / 1000;
+    return TRUE;
+}
+
+//
+// Linux backend
+//
+
+#if defined(__linux__) && !defined(_KERNEL_MODE)
+
+static int LinuxMsrFds[MAHF_HW_MAX_CPUS];
+
+static NTSTATUS LinuxStatus(int Error)
+{
+    switch (Error) {
+        case EACCES:
+        case EPERM:
+            return STATUS_ACCESS_DENIED;
+        case EIO:
+        case ENXIO:
+        case ENOENT:
+            return STATUS_NOT_SUPPORTED;
+        default:
+            return STATUS_UNSUCCESSFUL;
+    }
+}
+
+// Descriptors are opened on first use and kept; fd 0 means not yet opened
+static int LinuxOpenMsr(ULONG Cpu)
+{
+    char path[32];
+    int fd = LinuxMsrFds[Cpu];
+    
+    if (fd > 0) {
+        return fd;
+    }
+    
+    snprintf(path, sizeof(path), "/dev/cpu/%u/msr", Cpu);
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        fd = open(path, O_RDONLY);
+    }
+    
+    if (fd > 0) {
+        LinuxMsrFds[Cpu] = fd;
+    }
+    
+    return fd;
+}
+
+static NTSTATUS LinuxReadMsr(ULONG Cpu, ULONG Register, PULONG64 Value)
+{
+    int fd;
+    
+    if (!Value || Cpu >= MAHF_HW_MAX_CPUS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    fd = LinuxOpenMsr(Cpu);
+    if (fd < 0) {
+        return LinuxStatus(errno);
+    }
+    
+    if (pread(fd, Value, sizeof(*Value), Register) != sizeof(*Value)) {
+        *Value = 0;
+        return LinuxStatus(errno);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS LinuxWriteMsr(ULONG Cpu, ULONG Register, ULONG64 Value)
+{
+    int fd;
+    
+    if (Cpu >= MAHF_HW_MAX_CPUS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    fd = LinuxOpenMsr(Cpu);
+    if (fd < 0) {
+        return LinuxStatus(errno);
+    }
+    
+    if (pwrite(fd, &Value, sizeof(Value), Register) != sizeof(Value)) {
+        return LinuxStatus(errno);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+// The cpuid device takes the leaf in the low 32 bits of the offset and the
+// subleaf in the high 32 bits, and runs the instruction on that CPU
+static NTSTATUS LinuxCpuid(ULONG Cpu, ULONG Function, ULONG SubFunction, PULONG32 Registers)
+{
+    char path[32];
+    int fd;
+    ssize_t bytes;
+    
+    if (!Registers || Cpu >= MAHF_HW_MAX_CPUS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    snprintf(path, sizeof(path), "/dev/cpu/%u/cpuid", Cpu);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return LinuxStatus(errno);
+    }
+    
+    bytes = pread(fd, Registers, 4 * sizeof(ULONG32),
+                  (off_t)(((ULONG64)SubFunction << 32) | Function));
+    close(fd);
+    
+    if (bytes != 4 * sizeof(ULONG32)) {
+        return LinuxStatus(errno);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+VOID MahfHwLinuxClose(VOID)
+{
+    for (ULONG i = 0; i < MAHF_HW_MAX_CPUS; i++) {
+        if (LinuxMsrFds[i] > 0) {
+            close(LinuxMsrFds[i]);
+            LinuxMsrFds[i] = 0;
+        }
+    }
+}
+
+const MAHF_HW_OPS MahfHwLinux = {
+    "linux",
+    LinuxReadMsr,
+    LinuxWriteMsr,
+    LinuxCpuid
+};
+
+#endif // __linux__
+
+//
+// Record/replay backends
+//
+
+static const MAHF_HW_OPS *RecordInner = &MahfHwSimulated;
+static PMAHF_HW_RECORD RecordBuffer;
+static ULONG64 RecordCapacity;
+static volatile ULONG64 RecordNext;
+
+VOID MahfHwRecordStart(const MAHF_HW_OPS *Inner, PMAHF_HW_RECORD Records, ULONG64 Capacity)
+{
+    RecordInner = Inner ? Inner : &MahfHwSimulated;
+    RecordBuffer = Records;
+    RecordCapacity = Records ? Capacity : 0;
+    RecordNext = 0;
+}
+
+// Records past the capacity are counted but dropped
+ULONG64 MahfHwRecordCount(VOID)
+{
+    return RecordNext < RecordCapacity ? RecordNext : RecordCapacity;
+}
+
+static VOID RecordAppend(ULONG Op, ULONG Cpu, ULONG Register, ULONG SubFunction,
+                         NTSTATUS Status, ULONG64 Value0, ULONG64 Value1)
+{
+    ULONG64 index = HW_ATOMIC_INC64(&RecordNext) - 1;
+    PMAHF_HW_RECORD record;
+    
+    if (index >= RecordCapacity) {
+        return;
+    }
+    
+    record = &RecordBuffer[index];
+    record->Op = Op;
+    record->Cpu = Cpu;
+    record->Register = Register;
+    record->SubFunction = SubFunction;
+    record->Status = Status;
+    record->Reserved = 0;
+    record->Value[0] = Value0;
+    record->Value[1] = Value1;
+}
+
+static NTSTATUS RecordReadMsr(ULONG Cpu, ULONG Register, PULONG64 Value)
+{
+    NTSTATUS status = RecordInner->ReadMsr(Cpu, Register, Value);
+    
+    RecordAppend(MAHF_HW_OP_READ_MSR, Cpu, Register, 0, status, Value ? *Value : 0, 0);
+    return status;
+}
+
+static NTSTATUS RecordWriteMsr(ULONG Cpu, ULONG Register, ULONG64 Value)
+{
+    NTSTATUS status = RecordInner->WriteMsr(Cpu, Register, Value);
+    
+    RecordAppend(MAHF_HW_OP_WRITE_MSR, Cpu, Register, 0, status, Value, 0);
+    return status;
+}
+
+static NTSTATUS RecordCpuid(ULONG Cpu, ULONG Function, ULONG SubFunction, PULONG32 Registers)
+{
+    NTSTATUS status = RecordInner->Cpuid(Cpu, Function, SubFunction, Registers);
+    
+    if (Registers) {
+        RecordAppend(MAHF_HW_OP_CPUID, Cpu, Function, SubFunction, status,
+                     ((ULONG64)Registers[1] << 32) | Registers[0],
+                     ((ULONG64)Registers[3] << 32) | Registers[2]);
+    }
+    
+    return status;
+}
+
+const MAHF_HW_OPS MahfHwRecord = {
+    "record",
+    RecordReadMsr,
+    RecordWriteMsr,
+    RecordCpuid
+};
+
+static const MAHF_HW_RECORD *ReplayRecords;
+static ULONG64 ReplayCount;
+static ULONG64 ReplayCursor[MAHF_HW_MAX_CPUS];
+static volatile LONG ReplayDiverged;
+
+VOID MahfHwReplayStart(const MAHF_HW_RECORD *Records, ULONG64 Count)
+{
+    ReplayRecords = Records;
+    ReplayCount = Records ? Count : 0;
+    ReplayDiverged = FALSE;
+    
+    for (ULONG i = 0; i < MAHF_HW_MAX_CPUS; i++) {
+        ReplayCursor[i] = 0;
+    }
+}
+
+BOOLEAN MahfHwReplayDiverged(VOID)
+{
+    return ReplayDiverged != FALSE;
+}
+
+// Next record made on this CPU; an access that does not match it means the
+// code under replay no longer behaves like the recorded run
+static const MAHF_HW_RECORD *ReplayNext(ULONG Cpu, ULONG Op, ULONG Register, ULONG SubFunction)
+{
+    ULONG64 index;
+    
+    if (Cpu >= MAHF_HW_MAX_CPUS) {
+        return NULL;
+    }
+    
+    for (index = ReplayCursor[Cpu]; index < ReplayCount; index++) {
+        if (ReplayRecords[index].Cpu == Cpu) {
+            break;
+        }
+    }
+    
+    if (index >= ReplayCount) {
+        ReplayCursor[Cpu] = ReplayCount;
+        ReplayDiverged = TRUE;
+        return NULL;
+    }
+    
+    ReplayCursor[Cpu] = index + 1;
+    
+    if (ReplayRecords[index].Op != Op ||
+        ReplayRecords[index].Register != Register ||
+        ReplayRecords[index].SubFunction != SubFunction) {
+        ReplayDiverged = TRUE;
+        return NULL;
+    }
+    
+    return &ReplayRecords[index];
+}
+
+static NTSTATUS ReplayReadMsr(ULONG Cpu, ULONG Register, PULONG64 Value)
+{
+    const MAHF_HW_RECORD *record = ReplayNext(Cpu, MAHF_HW_OP_READ_MSR, Register, 0);
+    
+    if (!Value) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!record) {
+        *Value = 0;
+        return STATUS_DEVICE_DATA_ERROR;
+    }
+    
+    *Value = record->Value[0];
+    return record->Status;
+}
+
+static NTSTATUS ReplayWriteMsr(ULONG Cpu, ULONG Register, ULONG64 Value)
+{
+    const MAHF_HW_RECORD *record = ReplayNext(Cpu, MAHF_HW_OP_WRITE_MSR, Register, 0);
+    
+    if (!record) {
+        return STATUS_DEVICE_DATA_ERROR;
+    }
+    
+    if (record->Value[0] != Value) {
+        ReplayDiverged = TRUE;
+    }
+    
+    return record->Status;
+}
+
+static NTSTATUS ReplayCpuid(ULONG Cpu, ULONG Function, ULONG SubFunction, PULONG32 Registers)
+{
+    const MAHF_HW_RECORD *record = ReplayNext(Cpu, MAHF_HW_OP_CPUID, Function, SubFunction);
+    
+    if (!Registers) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    if (!record) {
+        HW_ZERO(Registers, 4 * sizeof(ULONG32));
+        return STATUS_DEVICE_DATA_ERROR;
+    }
+    
+    Registers[0] = (ULONG32)record->Value[0];
+    Registers[1] = (ULONG32)(record->Value[0] >> 32);
+    Registers[2] = (ULONG32)record->Value[1];
+    Registers[3] = (ULONG32)(record->Value[1] >> 32);
+    return record->Status;
+}
+
+const MAHF_HW_OPS MahfHwReplay = {
+    "replay",
+    ReplayReadMsr,
+    ReplayWriteMsr,
+    ReplayCpuid
+};
+
+//
+// Trace files
+//
+
+#if !defined(_KERNEL_MODE)
+
+NTSTATUS MahfHwTraceSave(const char *Path, const MAHF_HW_RECORD *Records, ULONG64 Count)
+{
+    MAHF_HW_TRACE_HEADER header;
+    FILE *file = fopen(Path, "wb");
+    BOOLEAN ok;
+    
+    if (!file) {
+        return STATUS_ACCESS_DENIED;
+    }
+    
+    header.Magic = MAHF_HW_TRACE_MAGIC;
+    header.Version = MAHF_HW_TRACE_VERSION;
+    header.RecordCount = Count;
+    
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         (Count == 0 || fwrite(Records, sizeof(MAHF_HW_RECORD), (size_t)Count, file) == Count);
+         
+    return (fclose(file) == 0 && ok) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+// The record array is malloc'ed; the caller frees it
+NTSTATUS MahfHwTraceLoad(const char *Path, PMAHF_HW_RECORD *Records, PULONG64 Count)
+{
+    MAHF_HW_TRACE_HEADER header;
+    PMAHF_HW_RECORD records;
+    FILE *file = fopen(Path, "rb");
+    
+    *Records = NULL;
+    *Count = 0;
+    
+    if (!file) {
+        return STATUS_ACCESS_DENIED;
+    }
+    
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.Magic != MAHF_HW_TRACE_MAGIC ||
+        header.Version != MAHF_HW_TRACE_VERSION) {
+        fclose(file);
+        return STATUS_DEVICE_DATA_ERROR;
+    }
+    
+    records = (PMAHF_HW_RECORD)malloc((size_t)(header.RecordCount ? header.RecordCount : 1) *
+                                      sizeof(MAHF_HW_RECORD));
+    if (!records) {
+        fclose(file);
+        return STATUS_UNSUCCESSFUL;
+    }
+    
+    if (fread(records, sizeof(MAHF_HW_RECORD), (size_t)header.RecordCount, file) !=
+        header.RecordCount) {
+        free(records);
+        fclose(file);
+        return STATUS_DEVICE_DATA_ERROR;
+    }
+    
+    fclose(file);
+    
+    *Records = records;
+    *Count = header.RecordCount;
+    return STATUS_SUCCESS;
+}
+
+#endif // !_KERNEL_MODE
\ No newline at end of file
@@ -0,0 +1,241 @@
+/*
+ * Mahf Firmware CPU Driver - Hardware Access Backends
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * MSR and CPUID access behind a backend table, so the same policy code
+ * runs in the driver, on a Linux build machine, or against a captured trace
+ */
+
+#ifndef _MAHF_HW_H_
+#define _MAHF_HW_H_
+
+#if defined(_KERNEL_MODE)
+#include <ntddk.h>
+#elif defined(MAHF_HOST)
+#include "mahf_host.h"
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+// Host builds without the Windows headers
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int32_t NTSTATUS;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG;
+typedef uint32_t ULONG32, *PULONG32;
+typedef int64_t LONG64;
+typedef uint64_t ULONG64, *PULONG64;
+typedef unsigned char UCHAR, BOOLEAN;
+typedef void VOID, *PVOID;
+
+#define TRUE    1
+#define FALSE   0
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_ACCESS_DENIED            ((NTSTATUS)0xC0000022L)
+#define STATUS_DEVICE_DATA_ERROR        ((NTSTATUS)0xC000009CL)
+#define STATUS_DEVICE_NOT_READY         ((NTSTATUS)0xC00000A3L)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001AL)
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#endif
+
+#define MAHF_HW_MAX_CPUS        256
+
+// MSRs used by the driver
+#define MSR_TSC                 0x010
+#define MSR_MPERF               0x0E7
+#define MSR_APERF               0x0E8
+#define MSR_PLATFORM_INFO       0x0CE
+#define MSR_PERF_STATUS         0x198
+#define MSR_PERF_CTL            0x199
+#define MSR_THERM_STATUS        0x19C
+#define MSR_TEMPERATURE_TARGET  0x1A2
+#define MSR_TURBO_RATIO_LIMIT   0x1AD
+#define MSR_ENERGY_PERF_BIAS    0x1B0
+#define MSR_PACKAGE_THERM_STATUS 0x1B1
+
+// RAPL: units in 0x606, 32-bit wrapping energy counters per domain
+#define MSR_RAPL_POWER_UNIT     0x606
+#define MSR_PKG_ENERGY_STATUS   0x611
+#define MSR_DRAM_ENERGY_STATUS  0x619
+#define MSR_PP0_ENERGY_STATUS   0x639
+
+// AMD equivalents; core energy is per core rather than per package
+#define MSR_AMD_RAPL_POWER_UNIT     0xC0010299
+#define MSR_AMD_CORE_ENERGY_STATUS  0xC001029A
+#define MSR_AMD_PKG_ENERGY_STATUS   0xC001029B
+
+// Backend table
+// Every operation names the logical processor it targets. Backends that can
+// only reach the current processor (the driver's) are called on the target
+// processor by the caller.
+typedef struct _MAHF_HW_OPS {
+    const char *Name;
+    NTSTATUS (*ReadMsr)(ULONG Cpu, ULONG Register, PULONG64 Value);
+    NTSTATUS (*WriteMsr)(ULONG Cpu, ULONG Register, ULONG64 Value);
+    NTSTATUS (*Cpuid)(ULONG Cpu, ULONG Function, ULONG SubFunction, PULONG32 Registers);
+} MAHF_HW_OPS, *PMAHF_HW_OPS;
+
+// Selected once at startup; every access is a call through this table
+extern const MAHF_HW_OPS *g_HwBackend;
+
+VOID MahfHwSelect(const MAHF_HW_OPS *Backend);
+
+// Simulated processor
+// Per-CPU register file: PERF_STATUS follows the last PERF_CTL written on
+// that CPU; constants describe a 3.0 GHz base, 4.5 GHz turbo part. Each
+// THERM_STATUS read moves the CPU's temperature a step toward a level set
+// by its ratio, so the thermal loop has something to push against. RAPL
+// counters integrate a per-CPU power that also follows the ratio, over
+// the host clock, for every CPU that has touched the backend. TSC runs at
+// the base frequency; each CPU is busy a fixed share of the time (50-80 %,
+// by CPU number), and MPERF and APERF advance only while busy, at the base
+// and the programmed frequency. ENERGY_PERF_BIAS holds whatever was last
+// written to it, default 6 (balanced).
+extern const MAHF_HW_OPS MahfHwSimulated;
+
+// Restores the power-on register file. DriverEntry calls it once when it
+// selects this backend, before any CPU can reach it; accesses before then
+// fail with STATUS_DEVICE_NOT_READY.
+VOID MahfHwSimulatedReset(VOID);
+
+// Physics model
+// Optional replacement for the fixed heating and busy shares above, for
+// tools that evaluate policies. Time stands still except through
+// MahfHwSimulatedAdvance, which integrates in fixed steps:
+//   - work arrives on each CPU along its demand curve; the busy share is
+//     that demand over the delivered frequency, at most 100 %
+//   - a CPU draws C * V^2 * f while busy, plus a clock-gated floor and
+//     leakage that grows with voltage and temperature
+//   - heat flows from each CPU to its package and from the package to
+//     ambient through thermal resistances into heat capacities
+//   - a CPU at TjMax runs at the efficiency ratio, as PROCHOT would, until
+//     it has cooled 2 C, and flags THERM_STATUS bit 0 meanwhile
+// TSC, APERF/MPERF, the sensors and RAPL all report the model, and the
+// arithmetic is integer only, so a run repeats exactly on any machine.
+// Reset keeps the model and workloads and restarts its clock at zero.
+// Not thread-safe against accesses while advancing.
+#define MAHF_SIM_SHAPE_CONSTANT 0       // Low throughout
+#define MAHF_SIM_SHAPE_SQUARE   1       // High for DutyPercent of each period
+#define MAHF_SIM_SHAPE_TRIANGLE 2       // Low to High and back each period
+#define MAHF_SIM_SHAPE_RANDOM   3       // A seeded level in [Low, High] each period
+
+typedef struct _MAHF_SIM_WORKLOAD {
+    ULONG Shape;
+    ULONG Low;                  // Demand, percent of one CPU at base frequency
+    ULONG High;
+    ULONG PeriodMs;
+    ULONG DutyPercent;
+    ULONG PhaseMs;              // Offset into the period
+    ULONG Seed;
+} MAHF_SIM_WORKLOAD, *PMAHF_SIM_WORKLOAD;
+
+typedef struct _MAHF_SIM_MODEL {
+    ULONG StepUs;               // Integration step
+    LONG AmbientMilliC;
+    ULONG CapacitancePf;        // Switched capacitance per CPU
+    ULONG IdleMw;               // Per CPU, clock gated
+    ULONG LeakageMw;            // Per CPU at 1 V and ambient
+    ULONG LeakagePerMilleC;     // Leakage growth per degree over ambient, 1/1000
+    ULONG CoreHeatCapacity;     // uJ/C per CPU
+    ULONG CoreResistance;       // CPU to package, milli-C/W
+    ULONG PackageHeatCapacity;  // uJ/C
+    ULONG PackageResistance;    // Package to ambient, milli-C/W
+    ULONG UncoreMw;             // Per package, outside the cores domain
+    ULONG DramMw;               // Per package
+} MAHF_SIM_MODEL, *PMAHF_SIM_MODEL;
+
+typedef struct _MAHF_SIM_CPU_STATE {
+    LONG TemperatureMilliC;
+    ULONG PowerMw;
+    ULONG Ratio;                // Delivered, after any thermal clamp
+    ULONG DemandPercent;
+    ULONG BusyPerMille;
+    BOOLEAN Throttled;
+    ULONG64 BusyTime;           // 100 ns units since reset
+    ULONG64 ThrottledTime;
+    ULONG64 RequestedWork;      // Nanoseconds at base frequency
+    ULONG64 DeliveredWork;
+    ULONG64 EnergyUj;
+} MAHF_SIM_CPU_STATE, *PMAHF_SIM_CPU_STATE;
+
+typedef struct _MAHF_SIM_PACKAGE_STATE {
+    LONG TemperatureMilliC;
+    ULONG PowerMw;              // Cores, uncore and DRAM
+    ULONG64 EnergyUj;
+} MAHF_SIM_PACKAGE_STATE, *PMAHF_SIM_PACKAGE_STATE;
+
+// A mid-size desktop part: about 4 W per CPU busy at base, 8 W at turbo
+VOID MahfHwSimulatedDefaultModel(PMAHF_SIM_MODEL Model);
+
+// Turns the model on, or off with NULL, and resets the backend. Every CPU
+// starts with a constant 50 % demand.
+VOID MahfHwSimulatedConfigure(const MAHF_SIM_MODEL *Model);
+VOID MahfHwSimulatedSetWorkload(ULONG Cpu, const MAHF_SIM_WORKLOAD *Workload);
+VOID MahfHwSimulatedAdvance(ULONG64 Microseconds);
+
+// Backend clock in 100 ns units: model time, or the host clock without one
+ULONG64 MahfHwSimulatedNow(VOID);
+
+// Power and energy cover the CPU's own draw; FALSE without a model
+BOOLEAN MahfHwSimulatedGetCpu(ULONG Cpu, PMAHF_SIM_CPU_STATE State);
+BOOLEAN MahfHwSimulatedGetPackage(ULONG Package, PMAHF_SIM_PACKAGE_STATE State);
+ULONG MahfHwSimulatedPackageOf(ULONG Cpu);
+
+#if defined(__linux__) && !defined(_KERNEL_MODE)
+// /dev/cpu/N/msr and /dev/cpu/N/cpuid (msr and cpuid modules, root)
+extern const MAHF_HW_OPS MahfHwLinux;
+
+VOID MahfHwLinuxClose(VOID);
+#endif
+
+// Record/replay
+// Recording forwards to another backend and appends every access to a
+// caller-owned array. Replay answers from such an array: each CPU consumes
+// the records made on that CPU in order, so traces captured from parallel
+// IPIs replay deterministically regardless of interleaving.
+#define MAHF_HW_OP_READ_MSR     1
+#define MAHF_HW_OP_WRITE_MSR    2
+#define MAHF_HW_OP_CPUID        3
+
+typedef struct _MAHF_HW_RECORD {
+    ULONG Op;
+    ULONG Cpu;
+    ULONG Register;             // MSR, or CPUID function
+    ULONG SubFunction;
+    NTSTATUS Status;
+    ULONG Reserved;
+    ULONG64 Value[2];           // MSR value, or EAX:EBX and ECX:EDX
+} MAHF_HW_RECORD, *PMAHF_HW_RECORD;
+
+#define MAHF_HW_TRACE_MAGIC     0x43525448  // 'HTRC'
+#define MAHF_HW_TRACE_VERSION   1
+
+typedef struct _MAHF_HW_TRACE_HEADER {
+    ULONG Magic;
+    ULONG Version;
+    ULONG64 RecordCount;
+} MAHF_HW_TRACE_HEADER, *PMAHF_HW_TRACE_HEADER;
+
+extern const MAHF_HW_OPS MahfHwRecord;
+extern const MAHF_HW_OPS MahfHwReplay;
+
+VOID MahfHwRecordStart(const MAHF_HW_OPS *Inner, PMAHF_HW_RECORD Records, ULONG64 Capacity);
+ULONG64 MahfHwRecordCount(VOID);
+VOID MahfHwReplayStart(const MAHF_HW_RECORD *Records, ULONG64 Count);
+BOOLEAN MahfHwReplayDiverged(VOID);
+
+#if !defined(_KERNEL_MODE)
+// Trace files: MAHF_HW_TRACE_HEADER followed by RecordCount records
+NTSTATUS MahfHwTraceSave(const char *Path, const MAHF_HW_RECORD *Records, ULONG64 Count);
+NTSTATUS MahfHwTraceLoad(const char *Path, PMAHF_HW_RECORD *Records, PULONG64 Count);
+#endif
+
+#endif // _MAHF_HW_H_
\ No newline at end of file
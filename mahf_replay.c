@@ -0,0 +1,635 @@
+/*
+ * Mahf Firmware CPU Driver - Trace Replay Scorecard
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Replays a production telemetry log through the driver's state selection
+ * on the simulated backend's physics model and scores each policy
+ *
+ *   mahf_replay [--policy SPEC]... [--jobs N] [--base-mhz N] [--limit C]
+ *               [--ambient C] [--resolution-ms N] [--from T] [--to T]
+ *               [--csv FILE] segment.tlog...
+ *
+ *   cc -O2 -DMAHF_HOST -o mahf_replay mahf_replay.c mahf_tlog.c mahf_host.c mahf_core.c mahf_hw.c -lpthread
+ *
+ * The trace is the service's telemetry log (mahf_tlog.h): each core's
+ * utilization at its recorded frequency becomes demand in percent of one
+ * CPU at --base-mhz (default 3000, the simulated part's base). A core
+ * recorded at 100 % may have wanted more; the replay cannot tell.
+ *
+ * SPEC is one of
+ *   powersave, balanced, performance, extreme   that state throughout
+ *   recorded                                    the states the machine ran
+ *   governor[:UP,DOWN,HYSTERESIS,PERIOD_MS]     the utilization governor
+ * and defaults to all of them with the governor's default settings.
+ *
+ * Every policy replays in its own process, --jobs at a time (default one
+ * per online CPU), so the scorecard does not depend on the job count. It
+ * gives energy, time with any core above --limit (default 95 C, the
+ * driver's default setpoint), CPU time under PROCHOT, and the share of
+ * the demanded work delivered.
+ */
+
+#include "mahf_host.h"
+#include "mahf_core.h"
+#include "mahf_hw.h"
+#include "mahf_tlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define REPLAY_UNIX_EPOCH       116444736000000000ULL
+#define REPLAY_MAX_POLICIES     32
+#define REPLAY_MAX_GAP_MS       60000       // Longer gaps in the log are cut to this
+#define REPLAY_DEFAULT_BASE_MHZ 3000
+#define REPLAY_DEFAULT_LIMIT_C  95
+#define REPLAY_DEFAULT_RESOLUTION_MS 100
+
+#define REPLAY_POLICY_STATE     0
+#define REPLAY_POLICY_RECORDED  1
+#define REPLAY_POLICY_GOVERNOR  2
+
+static const char *StateNames[] = { "powersave", "balanced", "performance", "extreme" };
+
+typedef struct _REPLAY_POLICY {
+    char Name[48];
+    ULONG Kind;
+    ULONG State;                        // REPLAY_POLICY_STATE
+    MAHF_GOVERNOR_CONFIG Governor;      // REPLAY_POLICY_GOVERNOR; zero fields keep defaults
+} REPLAY_POLICY, *PREPLAY_POLICY;
+
+// The trace, tick-major: Demand[tick * CoreCount + core]
+typedef struct _REPLAY_TRACE {
+    ULONG CoreCount;
+    ULONG64 TickCount;
+    ULONG64 Capacity;
+    PULONG64 Times;
+    PULONG Demand;
+    PUCHAR States;                      // Core 0's state column
+} REPLAY_TRACE, *PREPLAY_TRACE;
+
+typedef struct _REPLAY_SCORE {
+    NTSTATUS Status;
+    ULONG Reserved;
+    ULONG64 DurationMs;
+    ULONG64 EnergyUj;
+    ULONG64 OverLimitMs;                // Any core above the limit
+    ULONG64 ThrottledTime;              // CPU-time, 100 ns
+    ULONG64 RequestedWork;
+    ULONG64 DeliveredWork;
+    ULONG StateChanges;
+    LONG PeakMilliC;
+} REPLAY_SCORE, *PREPLAY_SCORE;
+
+typedef struct _REPLAY_OPTIONS {
+    ULONG BaseMhz;
+    LONG LimitMilliC;
+    LONG AmbientMilliC;
+    ULONG ResolutionMs;
+    ULONG64 From;
+    ULONG64 To;
+} REPLAY_OPTIONS, *PREPLAY_OPTIONS;
+
+static ULONG64 Times[MAHF_TLOG_MAX_TICKS];
+static ULONG Values[MAHF_TLOG_METRIC_COUNT][MAHF_TLOG_MAX_CORES * MAHF_TLOG_MAX_TICKS];
+
+// YYYY-MM-DDTHH:MM:SS, UTC, to 100 ns units since 1601
+static BOOLEAN ReplayParseTime(const char *Text, PULONG64 Time)
+{
+    struct tm utc;
+    time_t seconds;
+    
+    memset(&utc, 0, sizeof(utc));
+    
+    if (sscanf(Text, "%d-%d-%dT%d:%d:%d", &utc.tm_year, &utc.tm_mon, &utc.tm_mday,
+               &utc.tm_hour, &utc.tm_min, &utc.tm_sec) != 6) {
+        return FALSE;
+    }
+    
+    utc.tm_year -= 1900;
+    utc.tm_mon -= 1;
+    seconds = timegm(&utc);
+    
+    if (seconds < 0) {
+        return FALSE;
+    }
+    
+    *Time = (ULONG64)seconds * 10000000 + REPLAY_UNIX_EPOCH;
+    return TRUE;
+}
+
+// Segment names carry their start time, so a name sort is a time sort
+static int ReplayCompareNames(const void *Left, const void *Right)
+{
+    const char *left = *(const char * const *)Left;
+    const char *right = *(const char * const *)Right;
+    const char *leftName = strrchr(left, '/');
+    const char *rightName = strrchr(right, '/');
+    
+    return strcmp(leftName ? leftName + 1 : left, rightName ? rightName + 1 : right);
+}
+
+static BOOLEAN ReplayParsePolicy(const char *Text, PREPLAY_POLICY Policy)
+{
+    unsigned values[4] = { 0, 0, 0, 0 };
+    
+    memset(Policy, 0, sizeof(*Policy));
+    snprintf(Policy->Name, sizeof(Policy->Name), "%s", Text);
+    
+    for (ULONG i = 0; i < RTL_NUMBER_OF(StateNames); i++) {
+        if (strcmp(Text, StateNames[i]) == 0) {
+            Policy->Kind = REPLAY_POLICY_STATE;
+            Policy->State = i;
+            return TRUE;
+        }
+    }
+    
+    if (strcmp(Text, "recorded") == 0) {
+        Policy->Kind = REPLAY_POLICY_RECORDED;
+        return TRUE;
+    }
+    
+    if (strncmp(Text, "governor", 8) == 0) {
+        if (Text[8] == ':' &&
+            sscanf(Text + 9, "%u,%u,%u,%u", &values[0], &values[1], &values[2], &values[3]) < 1) {
+            return FALSE;
+        }
+        
+        if (Text[8] != ':' && Text[8] != '\0') {
+            return FALSE;
+        }
+        
+        Policy->Kind = REPLAY_POLICY_GOVERNOR;
+        Policy->Governor.UpThreshold = values[0];
+        Policy->Governor.DownThreshold = values[1];
+        Policy->Governor.HysteresisSamples = values[2];
+        Policy->Governor.PeriodMs = values[3];
+        return TRUE;
+    }
+    
+    return FALSE;
+}
+
+static BOOLEAN ReplayGrow(PREPLAY_TRACE Trace, ULONG64 Needed)
+{
+    ULONG64 capacity = Trace->Capacity ? Trace->Capacity : 4096;
+    PULONG64 times;
+    PULONG demand;
+    PUCHAR states;
+    
+    if (Needed <= Trace->Capacity) {
+        return TRUE;
+    }
+    
+    while (capacity < Needed) {
+        capacity *= 2;
+    }
+    
+    times = (PULONG64)realloc(Trace->Times, capacity * sizeof(ULONG64));
+    if (times) {
+        Trace->Times = times;
+    }
+    
+    demand = (PULONG)realloc(Trace->Demand, capacity * Trace->CoreCount * sizeof(ULONG));
+    if (demand) {
+        Trace->Demand = demand;
+    }
+    
+    states = (PUCHAR)realloc(Trace->States, capacity);
+    if (states) {
+        Trace->States = states;
+    }
+    
+    if (!times || !demand || !states) {
+        return FALSE;
+    }
+    
+    Trace->Capacity = capacity;
+    return TRUE;
+}
+
+// Appends a segment's ticks in [From, To]; segments must come in time order.
+// FALSE only when out of memory; unreadable segments are skipped.
+static BOOLEAN ReplayLoadSegment(const char *Path, const REPLAY_OPTIONS *Options, PREPLAY_TRACE Trace)
+{
+    MAHF_TLOG_FILE file;
+    ULONG64 bad = 0;
+    
+    if (!MahfTlogMap(Path, &file)) {
+        fprintf(stderr, "%s: not a telemetry log\n", Path);
+        return TRUE;
+    }
+    
+    if (Trace->CoreCount == 0) {
+        Trace->CoreCount = min(file.Header->CoreCount, MAHF_HW_MAX_CPUS);
+    } else if (Trace->CoreCount != min(file.Header->CoreCount, MAHF_HW_MAX_CPUS)) {
+        fprintf(stderr, "%s: %u cores, expected %u; skipped\n",
+                Path, file.Header->CoreCount, Trace->CoreCount);
+        MahfTlogUnmap(&file);
+        return TRUE;
+    }
+    
+    for (ULONG i = MahfTlogSeek(&file, Options->From); i < file.BlockCount; i++) {
+        const MAHF_TLOG_BLOCK *block;
+        ULONG ticks;
+        
+        if (file.Index[i].FirstTime > Options->To) {
+            break;
+        }
+        
+        block = MahfTlogBlock(&file, i);
+        
+        if (!block || !MahfTlogDecodeTimes(block, Times) ||
+            !MahfTlogDecodeMetric(block, MAHF_TLOG_FREQUENCY, Values[MAHF_TLOG_FREQUENCY]) ||
+            !MahfTlogDecodeMetric(block, MAHF_TLOG_UTILIZATION, Values[MAHF_TLOG_UTILIZATION]) ||
+            !MahfTlogDecodeMetric(block, MAHF_TLOG_STATE, Values[MAHF_TLOG_STATE])) {
+            bad++;
+            continue;
+        }
+        
+        ticks = block->TickCount;
+        
+        for (ULONG t = 0; t < ticks; t++) {
+            PULONG demand;
+            
+            if (Times[t] < Options->From || Times[t] > Options->To ||
+                (Trace->TickCount && Times[t] <= Trace->Times[Trace->TickCount - 1])) {
+                continue;
+            }
+            
+            if (!ReplayGrow(Trace, Trace->TickCount + 1)) {
+                MahfTlogUnmap(&file);
+                return FALSE;
+            }
+            
+            demand = &Trace->Demand[Trace->TickCount * Trace->CoreCount];
+            
+            // Work done, in percent of a CPU at the replay's base frequency
+            for (ULONG c = 0; c < Trace->CoreCount; c++) {
+                demand[c] = (ULONG)((ULONG64)Values[MAHF_TLOG_UTILIZATION][c * ticks + t] *
+                                    Values[MAHF_TLOG_FREQUENCY][c * ticks + t] / Options->BaseMhz);
+            }
+            
+            Trace->Times[Trace->TickCount] = Times[t];
+            Trace->States[Trace->TickCount] = (UCHAR)Values[MAHF_TLOG_STATE][t];
+            Trace->TickCount++;
+        }
+    }
+    
+    if (bad != 0) {
+        fprintf(stderr, "%s: %llu damaged blocks skipped\n", Path, (unsigned long long)bad);
+    }
+    
+    MahfTlogUnmap(&file);
+    return TRUE;
+}
+
+static NTSTATUS ReplayControl(WDFDEVICE Device, ULONG IoControlCode, const VOID *Input,
+                              ULONG InputLength, PVOID Output, ULONG OutputLength)
+{
+    ULONG_PTR information;
+    
+    return MahfHostDeviceControl(Device, IoControlCode, Input, InputLength,
+                                 Output, OutputLength, &information);
+}
+
+static NTSTATUS ReplaySetState(WDFDEVICE Device, ULONG State)
+{
+    return ReplayControl(Device, IOCTL_MAHF_SET_PERFORMANCE_STATE, &State, sizeof(State), NULL, 0);
+}
+
+static NTSTATUS ReplayStartGovernor(WDFDEVICE Device, const MAHF_GOVERNOR_CONFIG *Overrides)
+{
+    MAHF_GOVERNOR_STATUS current;
+    NTSTATUS status;
+    
+    status = ReplayControl(Device, IOCTL_MAHF_GET_GOVERNOR, NULL, 0, &current, sizeof(current));
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    
+    current.Config.Enabled = TRUE;
+    current.Config.UpThreshold = Overrides->UpThreshold ? Overrides->UpThreshold : current.Config.UpThreshold;
+    current.Config.DownThreshold = Overrides->DownThreshold ? Overrides->DownThreshold : current.Config.DownThreshold;
+    current.Config.HysteresisSamples = Overrides->HysteresisSamples ?
+        Overrides->HysteresisSamples : current.Config.HysteresisSamples;
+    current.Config.PeriodMs = Overrides->PeriodMs ? Overrides->PeriodMs : current.Config.PeriodMs;
+    
+    return ReplayControl(Device, IOCTL_MAHF_SET_GOVERNOR, &current.Config, sizeof(current.Config), NULL, 0);
+}
+
+// Advance Milliseconds in Resolution chunks, timing how long any core
+// spends over the limit
+static VOID ReplayAdvance(ULONG Milliseconds, ULONG CoreCount, const REPLAY_OPTIONS *Options,
+                          PREPLAY_SCORE Score)
+{
+    while (Milliseconds > 0) {
+        ULONG chunk = min(Milliseconds, Options->ResolutionMs);
+        BOOLEAN over = FALSE;
+        
+        MahfHostAdvance(chunk);
+        
+        for (ULONG c = 0; c < CoreCount; c++) {
+            MAHF_SIM_CPU_STATE cpu;
+            
+            MahfHwSimulatedGetCpu(c, &cpu);
+            over = over || cpu.TemperatureMilliC > Options->LimitMilliC;
+            Score->PeakMilliC = max(Score->PeakMilliC, cpu.TemperatureMilliC);
+        }
+        
+        Score->OverLimitMs += over ? chunk : 0;
+        Score->DurationMs += chunk;
+        Milliseconds -= chunk;
+    }
+}
+
+// One policy over the whole trace, in a process of its own
+static VOID ReplayRun(const REPLAY_TRACE *Trace, const REPLAY_POLICY *Policy,
+                      const REPLAY_OPTIONS *Options, PREPLAY_SCORE Score)
+{
+    MAHF_SIM_MODEL model;
+    WDFDEVICE device;
+    ULONG state = (ULONG)-1;
+    ULONG lastPackage = MahfHwSimulatedPackageOf(Trace->CoreCount - 1);
+    
+    memset(Score, 0, sizeof(*Score));
+    
+    MahfHwSimulatedDefaultModel(&model);
+    model.AmbientMilliC = Options->AmbientMilliC;
+    MahfHwSimulatedConfigure(&model);
+    
+    Score->Status = MahfHostStart(Trace->CoreCount, &device);
+    if (!NT_SUCCESS(Score->Status)) {
+        return;
+    }
+    
+    if (Policy->Kind == REPLAY_POLICY_STATE) {
+        Score->Status = ReplaySetState(device, Policy->State);
+    } else if (Policy->Kind == REPLAY_POLICY_GOVERNOR) {
+        Score->Status = ReplayStartGovernor(device, &Policy->Governor);
+    }
+    
+    // Each interval carries the demand measured at its end
+    for (ULONG64 t = 1; t < Trace->TickCount && NT_SUCCESS(Score->Status); t++) {
+        const ULONG *demand = &Trace->Demand[t * Trace->CoreCount];
+        ULONG64 gap = (Trace->Times[t] - Trace->Times[t - 1]) / 10000;
+        
+        if (Policy->Kind == REPLAY_POLICY_RECORDED && Trace->States[t] != state) {
+            state = Trace->States[t];
+            Score->Status = ReplaySetState(device, state);
+            Score->StateChanges++;
+        }
+        
+        for (ULONG c = 0; c < Trace->CoreCount; c++) {
+            MAHF_SIM_WORKLOAD workload;
+            
+            memset(&workload, 0, sizeof(workload));
+            workload.Shape = MAHF_SIM_SHAPE_CONSTANT;
+            workload.Low = demand[c];
+            MahfHwSimulatedSetWorkload(c, &workload);
+        }
+        
+        ReplayAdvance((ULONG)max(min(gap, REPLAY_MAX_GAP_MS), 1), Trace->CoreCount, Options, Score);
+    }
+    
+    for (ULONG c = 0; c < Trace->CoreCount; c++) {
+        MAHF_SIM_CPU_STATE cpu;
+        
+        MahfHwSimulatedGetCpu(c, &cpu);
+        Score->ThrottledTime += cpu.ThrottledTime;
+        Score->RequestedWork += cpu.RequestedWork;
+        Score->DeliveredWork += cpu.DeliveredWork;
+    }
+    
+    for (ULONG p = 0; p <= lastPackage; p++) {
+        MAHF_SIM_PACKAGE_STATE package;
+        
+        MahfHwSimulatedGetPackage(p, &package);
+        Score->EnergyUj += package.EnergyUj;
+    }
+    
+    MahfHostStop();
+}
+
+// Forks up to Jobs replays at a time; each reports its score through a pipe
+static BOOLEAN ReplayAll(const REPLAY_TRACE *Trace, const REPLAY_POLICY *Policies, ULONG PolicyCount,
+                         const REPLAY_OPTIONS *Options, ULONG Jobs, PREPLAY_SCORE Scores)
+{
+    pid_t pids[REPLAY_MAX_POLICIES];
+    int pipes[REPLAY_MAX_POLICIES];
+    ULONG started = 0;
+    ULONG finished = 0;
+    
+    fflush(stdout);
+    fflush(stderr);
+    
+    while (finished < PolicyCount) {
+        while (started < PolicyCount && started - finished < Jobs) {
+            int fds[2];
+            
+            if (pipe(fds) != 0) {
+                return FALSE;
+            }
+            
+            pids[started] = fork();
+            
+            if (pids[started] < 0) {
+                return FALSE;
+            }
+            
+            if (pids[started] == 0) {
+                REPLAY_SCORE score;
+                
+                close(fds[0]);
+                ReplayRun(Trace, &Policies[started], Options, &score);
+                _exit(write(fds[1], &score, sizeof(score)) == sizeof(score) ? 0 : 1);
+            }
+            
+            close(fds[1]);
+            pipes[started] = fds[0];
+            started++;
+        }
+        
+        // Collect in order; later jobs keep running meanwhile
+        if (read(pipes[finished], &Scores[finished], sizeof(REPLAY_SCORE)) != sizeof(REPLAY_SCORE)) {
+            memset(&Scores[finished], 0, sizeof(REPLAY_SCORE));
+            Scores[finished].Status = STATUS_UNSUCCESSFUL;
+        }
+        
+        close(pipes[finished]);
+        waitpid(pids[finished], NULL, 0);
+        finished++;
+    }
+    
+    return TRUE;
+}
+
+static VOID ReplayUsage(const char *Program)
+{
+    fprintf(stderr, "Usage: %s [--policy SPEC]... [--jobs N] [--base-mhz N] [--limit C]\n"
+                    "       [--ambient C] [--resolution-ms N] [--from T] [--to T] [--csv FILE]\n"
+                    "       segment.tlog...\n", Program);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *defaults[] = {
+        "recorded", "powersave", "balanced", "performance", "extreme", "governor"
+    };
+    REPLAY_POLICY policies[REPLAY_MAX_POLICIES];
+    REPLAY_SCORE scores[REPLAY_MAX_POLICIES];
+    REPLAY_OPTIONS options;
+    REPLAY_TRACE trace;
+    ULONG policyCount = 0;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    ULONG jobs = online > 0 ? (ULONG)online : 1;
+    const char *csvPath = NULL;
+    char **paths;
+    int pathCount = 0;
+    int failures = 0;
+    
+    memset(&options, 0, sizeof(options));
+    options.BaseMhz = REPLAY_DEFAULT_BASE_MHZ;
+    options.LimitMilliC = REPLAY_DEFAULT_LIMIT_C * 1000;
+    options.ResolutionMs = REPLAY_DEFAULT_RESOLUTION_MS;
+    options.To = ~0ULL;
+    
+    {
+        MAHF_SIM_MODEL model;
+        
+        MahfHwSimulatedDefaultModel(&model);
+        options.AmbientMilliC = model.AmbientMilliC;
+    }
+    
+    paths = (char **)calloc(argc, sizeof(char *));
+    if (!paths) {
+        return 1;
+    }
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            if (policyCount == REPLAY_MAX_POLICIES || !ReplayParsePolicy(argv[++i], &policies[policyCount])) {
+                fprintf(stderr, "Bad or too many policies: %s\n", argv[i]);
+                return 1;
+            }
+            policyCount++;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--base-mhz") == 0 && i + 1 < argc) {
+            options.BaseMhz = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            options.LimitMilliC = (LONG)(strtod(argv[++i], NULL) * 1000);
+        } else if (strcmp(argv[i], "--ambient") == 0 && i + 1 < argc) {
+            options.AmbientMilliC = (LONG)(strtod(argv[++i], NULL) * 1000);
+        } else if (strcmp(argv[i], "--resolution-ms") == 0 && i + 1 < argc) {
+            options.ResolutionMs = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            if (!ReplayParseTime(argv[++i], &options.From)) {
+                fprintf(stderr, "Bad time: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            if (!ReplayParseTime(argv[++i], &options.To)) {
+                fprintf(stderr, "Bad time: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csvPath = argv[++i];
+        } else if (argv[i][0] == '-') {
+            ReplayUsage(argv[0]);
+            return 1;
+        } else {
+            paths[pathCount++] = argv[i];
+        }
+    }
+    
+    if (pathCount == 0 || jobs == 0 || options.BaseMhz == 0 || options.ResolutionMs == 0) {
+        ReplayUsage(argv[0]);
+        return 1;
+    }
+    
+    if (policyCount == 0) {
+        for (ULONG i = 0; i < RTL_NUMBER_OF(defaults); i++) {
+            ReplayParsePolicy(defaults[i], &policies[policyCount++]);
+        }
+    }
+    
+    qsort(paths, pathCount, sizeof(char *), ReplayCompareNames);
+    
+    memset(&trace, 0, sizeof(trace));
+    
+    for (int i = 0; i < pathCount; i++) {
+        if (!ReplayLoadSegment(paths[i], &options, &trace)) {
+            fprintf(stderr, "Out of memory loading %s\n", paths[i]);
+            return 1;
+        }
+    }
+    
+    if (trace.TickCount < 2) {
+        fprintf(stderr, "No samples in range\n");
+        return 1;
+    }
+    
+    printf("%llu ticks on %u cores, %.0f s; %u policies, %u at a time\n\n",
+           (unsigned long long)trace.TickCount, trace.CoreCount,
+           (double)(trace.Times[trace.TickCount - 1] - trace.Times[0]) / 1e7, policyCount, jobs);
+    
+    if (!ReplayAll(&trace, policies, policyCount, &options, jobs, scores)) {
+        fprintf(stderr, "Cannot start replays\n");
+        return 1;
+    }
+    
+    printf("%-28s %10s %8s %10s %10s %9s %7s\n",
+           "policy", "energy J", "avg W", "over s", "prochot s", "deliver%", "peak C");
+    
+    for (ULONG i = 0; i < policyCount; i++) {
+        PREPLAY_SCORE score = &scores[i];
+        
+        if (!NT_SUCCESS(score->Status)) {
+            printf("%-28s failed: 0x%08X\n", policies[i].Name, (unsigned)score->Status);
+            failures++;
+            continue;
+        }
+        
+        printf("%-28s %10.1f %8.2f %10.1f %10.2f %9.2f %7.1f\n", policies[i].Name,
+               score->EnergyUj / 1e6,
+               score->DurationMs ? score->EnergyUj / 1e3 / score->DurationMs : 0.0,
+               score->OverLimitMs / 1e3, score->ThrottledTime / 1e7,
+               score->RequestedWork ? 100.0 * score->DeliveredWork / score->RequestedWork : 100.0,
+               score->PeakMilliC / 1000.0);
+    }
+    
+    if (csvPath) {
+        FILE *csv = fopen(csvPath, "w");
+        
+        if (!csv) {
+            fprintf(stderr, "Cannot write %s\n", csvPath);
+            return 1;
+        }
+        
+        fprintf(csv, "policy,energy_j,duration_s,over_limit_s,prochot_cpu_s,delivered_pct,peak_c,state_changes\n");
+        
+        for (ULONG i = 0; i < policyCount; i++) {
+            PREPLAY_SCORE score = &scores[i];
+            
+            if (NT_SUCCESS(score->Status)) {
+                fprintf(csv, "%s,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%u\n", policies[i].Name,
+                        score->EnergyUj / 1e6, score->DurationMs / 1e3, score->OverLimitMs / 1e3,
+                        score->ThrottledTime / 1e7,
+                        score->RequestedWork ? 100.0 * score->DeliveredWork / score->RequestedWork : 100.0,
+                        score->PeakMilliC / 1000.0, score->StateChanges);
+            }
+        }
+        
+        fclose(csv);
+    }
+    
+    free(trace.Times);
+    free(trace.Demand);
+    free(trace.States);
+    free(paths);
+    return failures ? 1 : 0;
+}
\ No newline at end of file
@@ -6,16 +6,231 @@
  * Version: 3.0.0
  */
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <stdio.h>
 #include <tchar.h>
 #include <strsafe.h>
+#include <tlhelp32.h>
+#include <evntrace.h>
+#include <evntcons.h>
+#include <tdh.h>
+#include <sddl.h>
+#include "mahf_core.h"
+#include "mahf_broker.h"
+#include "mahf_tlog.h"
+
+#pragma comment(lib, "tdh.lib")
+#pragma comment(lib, "ws2_32.lib")
 
 // Service configuration
 #define SERVICE_NAME  _T("MahfCPUService")
 #define SERVICE_DISPLAY_NAME  _T("Mahf CPU Service")
 #define SERVICE_DESCRIPTION  _T("Manages Mahf Firmware CPU Driver")
 
+// Workload profile switching
+// Rules live in the service's Parameters key: WorkloadRules is a
+// REG_MULTI_SZ of "image.exe=Profile" entries, highest priority first;
+// IdleProfile is selected when no rule matches (empty deselects). A change
+// is applied once DebounceMs has passed since the first process event that
+// could affect it, and never sooner than MinDwellMs after the last switch.
+// A switch that fails stays pending and is tried again DebounceMs later,
+// but no more often than WORKLOAD_MIN_RETRY_MS.
+#define WORKLOAD_PARAMETERS_KEY     L"SYSTEM\\CurrentControlSet\\Services\\MahfCPUService\\Parameters"
+#define WORKLOAD_TRACE_NAME         L"MahfCPUWorkload"
+#define WORKLOAD_MAX_RULES          64
+#define WORKLOAD_DEFAULT_DEBOUNCE_MS 2000
+#define WORKLOAD_DEFAULT_DWELL_MS   10000
+#define WORKLOAD_MIN_RETRY_MS       1000
+#define WORKLOAD_POLL_MS            5000    // Only if process events are unavailable
+#define WORKLOAD_IDLE               ((DWORD)-1)
+#define WORKLOAD_UNKNOWN            ((DWORD)-2)
+
+// Microsoft-Windows-Kernel-Process, WINEVENT_KEYWORD_PROCESS
+static const GUID KernelProcessProvider =
+    { 0x22fb2cd6, 0x0e7b, 0x422b, { 0xa0, 0xc7, 0x2f, 0xad, 0x1f, 0xd0, 0xe7, 0x16 } };
+#define KERNEL_PROCESS_KEYWORD      0x10
+#define KERNEL_PROCESS_START        1
+#define KERNEL_PROCESS_STOP         2
+
+// Telemetry history
+// Per-core samples from the shared section are appended to a rotating log
+// (see mahf_tlog.h) every HistoryPeriodMs. HistoryDirectory may hold
+// environment variables; an empty value turns the log off.
+#define HISTORY_DEFAULT_DIRECTORY   "%ProgramData%\\Mahf\\History"
+#define HISTORY_DEFAULT_PERIOD_MS   100
+#define HISTORY_DEFAULT_SEGMENT_MB  64
+#define HISTORY_DEFAULT_SEGMENT_HOURS 24
+#define HISTORY_DEFAULT_RETAIN_DAYS 28
+#define HISTORY_BLOCK_TICKS         100     // 10 s per block at the default period
+#define HISTORY_DEFAULT_FREQUENCY_STEP_MHZ 25
+#define HISTORY_DEFAULT_DEADBAND    1       // Percent utilization, degrees Celsius
+#define HISTORY_100NS_PER_HOUR      36000000000ULL
+
+// Shared telemetry section
+// A view whose Generation has not moved for SHARED_STALE_MS, or whose Magic
+// the driver cleared on unload, is mapped again, at most every
+// SHARED_REOPEN_MS; the same goes for a section that was not there yet.
+#define SHARED_STALE_MS             (2 * MAHF_TELEMETRY_MAX_PERIOD_MS)
+#define SHARED_REOPEN_MS            1000
+
+// Client broker
+// The service holds the only device handle and serves other processes
+// (see mahf_broker.h). BrokerCoalesceMs is the least age a cached read may
+// reach before it is refreshed, whatever the client asks for;
+// BrokerPeriodMs is how often the broker section is checked for a newer
+// driver snapshot.
+#define BROKER_DEFAULT_COALESCE_MS  50
+#define BROKER_DEFAULT_PERIOD_MS    50
+#define BROKER_MAX_CLIENTS          64
+#define BROKER_CACHE_BYTES          8192    // Largest cached reply
+#define BROKER_PEEK_MS              1000    // Client liveness check while a wait is pending
+
+// SYSTEM and Administrators: full access. Other logged-on users may read
+// and write messages and set the read mode, but not create pipe instances.
+#define BROKER_PIPE_SDDL            _T("D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x12019b;;;AU)")
+#define BROKER_SECTION_SDDL         _T("D:P(A;;GA;;;SY)(A;;GR;;;BA)(A;;GR;;;AU)")
+
+// Metrics endpoint
+// The shared telemetry in the Prometheus text format, at
+// http://127.0.0.1:MetricsPort/metrics; MetricsPort 0 turns it off. The
+// page is laid out once per core table with every value in a fixed-width
+// field, so a scrape rewrites only the values that changed and sends the
+// page as it stands. A connection has METRICS_TIMEOUT_MS to send its
+// request line and to take the page.
+#define METRICS_DEFAULT_PORT        9478
+#define METRICS_TEXT_BYTES          (160 * 1024)
+#define METRICS_REQUEST_BYTES       4096
+#define METRICS_TIMEOUT_MS          100
+#define METRICS_MAX_CLIENTS         16      // Connections still sending their request
+#define METRICS_GAUGE_WIDTH         10      // Digits of a ULONG
+#define METRICS_COUNTER_WIDTH       20      // Digits of a ULONG64
+
+// Per-core series, in page order
+#define METRICS_CORE_FREQUENCY      0
+#define METRICS_CORE_TEMPERATURE    1
+#define METRICS_CORE_UTILIZATION    2
+#define METRICS_CORE_STATE          3
+#define METRICS_CORE_SERIES         4
+
+// Service-wide series, after the per-core ones
+#define METRICS_UP                  0
+#define METRICS_OPERATIONS          1
+#define METRICS_FAILED_OPERATIONS   2
+#define METRICS_GLOBAL_SERIES       3
+
+typedef struct _WORKLOAD_RULE {
+    WCHAR ImageName[MAX_PATH];
+    WCHAR Profile[MAHF_PROFILE_NAME_LENGTH];
+} WORKLOAD_RULE, *PWORKLOAD_RULE;
+
+// Written by the worker thread only, under g_WorkloadLock; the trace
+// callback reads the rules under the same lock
+typedef struct _WORKLOAD_CONFIG {
+    WORKLOAD_RULE Rules[WORKLOAD_MAX_RULES];
+    DWORD RuleCount;
+    WCHAR IdleProfile[MAHF_PROFILE_NAME_LENGTH];
+    DWORD DebounceMs;
+    DWORD MinDwellMs;
+} WORKLOAD_CONFIG, *PWORKLOAD_CONFIG;
+
+typedef struct _WORKLOAD_TRACE_PROPERTIES {
+    EVENT_TRACE_PROPERTIES Properties;
+    WCHAR LoggerName[64];
+} WORKLOAD_TRACE_PROPERTIES;
+
+// One connected pipe client, owned by the broker thread and served by its
+// own thread
+typedef struct _BROKER_CLIENT {
+    HANDLE Pipe;
+    HANDLE Thread;
+    HANDLE IoEvent;             // Manual-reset, for the client thread's pipe I/O
+    DWORD ProcessId;
+    BOOL Administrator;
+    volatile LONG Finished;     // Set as the client thread exits
+    ULONG64 Request[MAHF_BROKER_MAX_MESSAGE / sizeof(ULONG64)];
+    ULONG64 Response[MAHF_BROKER_MAX_MESSAGE / sizeof(ULONG64)];
+} BROKER_CLIENT, *PBROKER_CLIENT;
+
+// Last driver reply to one read IOCTL
+typedef struct _BROKER_CACHE_ENTRY {
+    SRWLOCK Lock;               // Exclusive while the driver is being read
+    LONG Epoch;                 // g_BrokerCacheEpoch before the read
+    ULONGLONG Time;             // GetTickCount64 after the read, 0 before the first
+    DWORD Error;
+    DWORD Length;
+    ULONG64 Data[BROKER_CACHE_BYTES / sizeof(ULONG64)];
+} BROKER_CACHE_ENTRY, *PBROKER_CACHE_ENTRY;
+
+typedef struct _BROKER_LEASE {
+    PBROKER_CLIENT Holder;      // NULL when free
+    DWORD ProcessId;
+    ULONGLONG Expiry;           // GetTickCount64
+} BROKER_LEASE, *PBROKER_LEASE;
+
+typedef struct _METRICS_SERIES {
+    PCSTR Name;
+    PCSTR Type;
+    PCSTR Help;
+    ULONG Width;
+} METRICS_SERIES, *PMETRICS_SERIES;
+
+typedef struct _METRICS_FIELD {
+    ULONG Offset;               // Into the page text
+    ULONG Width;                // 0 if it did not fit
+    ULONG64 Value;              // As rendered
+} METRICS_FIELD, *PMETRICS_FIELD;
+
+// Rendered exposition, owned by the metrics thread
+typedef struct _METRICS_PAGE {
+    ULONG Length;
+    ULONG CoreCount;
+    ULONG CoreId[MAHF_SHARED_MAX_CORES];        // Labels the page was laid out with
+    ULONG PackageId[MAHF_SHARED_MAX_CORES];
+    METRICS_FIELD Core[METRICS_CORE_SERIES][MAHF_SHARED_MAX_CORES];
+    METRICS_FIELD Global[METRICS_GLOBAL_SERIES];
+    CHAR Text[METRICS_TEXT_BYTES];
+} METRICS_PAGE, *PMETRICS_PAGE;
+
+// Connection waiting for its request line, owned by the metrics thread
+typedef struct _METRICS_CLIENT {
+    SOCKET Socket;              // INVALID_SOCKET if the slot is free
+    ULONGLONG Deadline;         // GetTickCount64
+    int Length;
+    CHAR Request[METRICS_REQUEST_BYTES];
+} METRICS_CLIENT, *PMETRICS_CLIENT;
+
+static const METRICS_SERIES g_MetricsCoreSeries[METRICS_CORE_SERIES] =
+{
+    { "mahf_core_frequency_mhz", "gauge", "Current core frequency in MHz.", METRICS_GAUGE_WIDTH },
+    { "mahf_core_temperature_celsius", "gauge", "Core temperature in degrees Celsius.", METRICS_GAUGE_WIDTH },
+    { "mahf_core_utilization_percent", "gauge", "Core utilization in percent.", METRICS_GAUGE_WIDTH },
+    { "mahf_core_state", "gauge",
+      "Core performance state: 0 power save, 1 balanced, 2 performance, 3 extreme.", METRICS_GAUGE_WIDTH }
+};
+
+static const METRICS_SERIES g_MetricsGlobalSeries[METRICS_GLOBAL_SERIES] =
+{
+    { "mahf_driver_up", "gauge", "1 while the driver is publishing telemetry.", 1 },
+    { "mahf_driver_operations_total", "counter", "IOCTLs handled by the driver.", METRICS_COUNTER_WIDTH },
+    { "mahf_driver_failed_operations_total", "counter", "IOCTLs the driver failed.", METRICS_COUNTER_WIDTH }
+};
+
+// Reads without input; anything the driver answers the same for every
+// caller can be shared
+static const DWORD g_BrokerCachedIoctls[] =
+{
+    IOCTL_MAHF_GET_CPU_INFO,
+    IOCTL_MAHF_GET_PERFORMANCE_DATA,
+    IOCTL_MAHF_GET_TOPOLOGY,
+    IOCTL_MAHF_GET_METRIC_SUMMARY,
+    IOCTL_MAHF_GET_GOVERNOR,
+    IOCTL_MAHF_GET_THERMAL,
+    IOCTL_MAHF_GET_ENERGY,
+    IOCTL_MAHF_GET_PROFILES
+};
+
 // Global variables
 SERVICE_STATUS g_ServiceStatus = {0};
 SERVICE_STATUS_HANDLE g_StatusHandle = NULL;
@@ -24,13 +239,109 @@ HANDLE g_ServiceStopEvent = INVALID_HANDLE_VALUE;
 // Driver communication handle
 HANDLE g_DriverHandle = INVALID_HANDLE_VALUE;
 
+// Shared telemetry section published by the driver; readers copy from the
+// view under the lock shared, and it is remapped under the lock exclusive
+HANDLE g_SharedSection = NULL;
+const MAHF_SHARED_TELEMETRY *g_SharedTelemetry = NULL;
+SRWLOCK g_SharedLock = SRWLOCK_INIT;
+volatile LONG g_SharedGeneration = 0;       // Last generation a reader saw
+volatile LONG64 g_SharedChanged = 0;        // GetTickCount64 when it last moved
+volatile LONG64 g_SharedReopened = 0;       // GetTickCount64 of the last remap
+
+// Workload detection
+WORKLOAD_CONFIG g_Workload = {0};
+SRWLOCK g_WorkloadLock = SRWLOCK_INIT;
+HANDLE g_WorkloadChangedEvent = NULL;       // Auto-reset, set by the trace callback
+HANDLE g_WorkloadParamEvent = NULL;         // Auto-reset, SERVICE_CONTROL_PARAMCHANGE
+TRACEHANDLE g_TraceSession = 0;
+TRACEHANDLE g_TraceHandle = INVALID_PROCESSTRACE_HANDLE;
+HANDLE g_TraceThread = NULL;
+WORKLOAD_TRACE_PROPERTIES g_TraceProperties;
+
+// Telemetry history, owned by the history thread
+MAHF_TLOG_WRITER g_History;
+MAHF_SHARED_TELEMETRY g_HistorySnapshot;
+MAHF_TLOG_SAMPLE g_HistorySamples[MAHF_SHARED_MAX_CORES];
+
+// Client broker
+HANDLE g_BrokerSection = NULL;
+PMAHF_SHARED_TELEMETRY g_BrokerTelemetry = NULL;
+MAHF_SHARED_TELEMETRY g_BrokerSnapshot;             // Broker thread only
+PBROKER_CLIENT g_BrokerClients[BROKER_MAX_CLIENTS]; // Broker thread only
+volatile LONG g_BrokerClientCount = 0;
+BROKER_CACHE_ENTRY g_BrokerCache[ARRAYSIZE(g_BrokerCachedIoctls)];
+volatile LONG g_BrokerCacheEpoch = 0;               // Bumped by each successful control command
+SRWLOCK g_BrokerControlLock = SRWLOCK_INIT;         // Serializes control commands, guards g_BrokerLease
+BROKER_LEASE g_BrokerLease = {0};
+DWORD g_BrokerCoalesceMs = BROKER_DEFAULT_COALESCE_MS;
+DWORD g_BrokerPeriodMs = BROKER_DEFAULT_PERIOD_MS;
+volatile LONG64 g_BrokerRequests = 0;
+volatile LONG64 g_BrokerDriverReads = 0;
+volatile LONG64 g_BrokerCachedReads = 0;
+volatile LONG64 g_BrokerRejectedControls = 0;
+
+// Metrics endpoint, owned by the metrics thread
+METRICS_PAGE g_Metrics;
+MAHF_SHARED_TELEMETRY g_MetricsSnapshot;
+METRICS_CLIENT g_MetricsClients[METRICS_MAX_CLIENTS];
+
 // Function declarations
 VOID WINAPI ServiceMain(DWORD argc, LPTSTR *argv);
 VOID WINAPI ServiceCtrlHandler(DWORD);
 DWORD WINAPI ServiceWorkerThread(LPVOID lpParam);
+DWORD WINAPI HistoryThread(LPVOID lpParam);
+BOOL OpenHistory(ULONG coreCount, PDWORD periodMs);
+DWORD WINAPI BrokerThread(LPVOID lpParam);
+DWORD WINAPI BrokerClientThread(LPVOID lpParam);
+VOID LoadBrokerSettings();
+HANDLE CreateBrokerPipe(BOOL first);
+BOOL StartBrokerClient(HANDLE pipe);
+VOID ReapBrokerClients(BOOL all);
+BOOL IdentifyBrokerClient(PBROKER_CLIENT client);
+BOOL BrokerPipeIo(PBROKER_CLIENT client, BOOL write, PVOID buffer, DWORD size, LPDWORD transferred);
+DWORD DispatchBrokerRequest(PBROKER_CLIENT client, DWORD requestLength);
+DWORD ReadBrokerCache(DWORD index, DWORD maxAgeMs, PVOID output, DWORD outputSize,
+                      LPDWORD bytesReturned, PULONG ageMs);
+BOOL SendBrokerControl(PBROKER_CLIENT client, DWORD ioControlCode, LPVOID inputBuffer, DWORD inputSize,
+                       LPVOID outputBuffer, DWORD outputSize, LPDWORD bytesReturned);
+DWORD AcquireBrokerLease(PBROKER_CLIENT client, const MAHF_BROKER_LEASE *lease, DWORD inputSize);
+BOOL ReleaseBrokerLease(PBROKER_CLIENT client);
+DWORD GetBrokerStatus(PVOID output, DWORD outputSize, LPDWORD bytesReturned);
+BOOL OpenBrokerSection();
+VOID CloseBrokerSection();
+VOID PublishBrokerSection();
+DWORD WINAPI MetricsThread(LPVOID lpParam);
+DWORD LoadMetricsPort();
+SOCKET OpenMetricsListener(USHORT port);
+VOID AcceptMetricsClients(SOCKET listener, WSAEVENT socketEvent);
+BOOL ReadMetricsRequest(PMETRICS_CLIENT client);
+VOID CloseMetricsClient(PMETRICS_CLIENT client);
+VOID ServeMetrics(SOCKET client, PCSTR request);
+VOID UpdateMetricsPage();
+VOID LayoutMetricsPage(const MAHF_SHARED_TELEMETRY *snapshot, ULONG coreCount);
+VOID AppendMetricsText(PCSTR format, ...);
+VOID AppendMetricsField(PMETRICS_FIELD field, ULONG width);
+VOID SetMetricsField(PMETRICS_FIELD field, ULONG64 value);
 BOOL InitializeDriverConnection();
 VOID CloseDriverConnection();
 BOOL SendDriverCommand(DWORD ioControlCode, LPVOID inputBuffer, DWORD inputSize, LPVOID outputBuffer, DWORD outputSize);
+BOOL SendDriverRequest(DWORD ioControlCode, LPVOID inputBuffer, DWORD inputSize, LPVOID outputBuffer,
+                       DWORD outputSize, LPDWORD bytesReturned, HANDLE clientPipe);
+BOOL SendDriverBatch(const MAHF_BATCH_COMMAND *commands, const LPCVOID *inputs, DWORD commandCount,
+                     DWORD flags, PMAHF_BATCH_RESPONSE response, DWORD responseSize);
+BOOL OpenSharedTelemetry();
+VOID CloseSharedTelemetry();
+BOOL ReadSharedTelemetry(PMAHF_SHARED_TELEMETRY snapshot);
+BOOL CopySharedTelemetry(PMAHF_SHARED_TELEMETRY snapshot, PLONG generation);
+VOID LoadWorkloadRules();
+DWORD FindWorkloadRule(PCWSTR imageName);
+DWORD EvaluateWorkload();
+BOOL ApplyWorkloadProfile(DWORD rule);
+BOOL StartProcessTrace();
+VOID StopProcessTrace();
+VOID InitializeTraceProperties();
+DWORD WINAPI ProcessTraceThread(LPVOID lpParam);
+VOID WINAPI OnProcessEvent(PEVENT_RECORD eventRecord);
 
 // Service entry point
 int _tmain(int argc, TCHAR *argv[])
@@ -89,7 +400,9 @@ VOID WINAPI ServiceMain(DWORD argc, LPTSTR *argv)
     
     // Create stop event
     g_ServiceStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (g_ServiceStopEvent == NULL)
+    g_WorkloadChangedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    g_WorkloadParamEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (g_ServiceStopEvent == NULL || g_WorkloadChangedEvent == NULL || g_WorkloadParamEvent == NULL)
     {
         g_ServiceStatus.dwCurrentState = SERVICE_STOPPED;
         g_ServiceStatus.dwWin32ExitCode = GetLastError();
@@ -108,7 +421,7 @@ VOID WINAPI ServiceMain(DWORD argc, LPTSTR *argv)
     }
     
     // Report running status
-    g_ServiceStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP;
+    g_ServiceStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PARAMCHANGE;
     g_ServiceStatus.dwCurrentState = SERVICE_RUNNING;
     g_ServiceStatus.dwWin32ExitCode = 0;
     g_ServiceStatus.dwCheckPoint = 0;
@@ -118,18 +431,43 @@ VOID WINAPI ServiceMain(DWORD argc, LPTSTR *argv)
         OutputDebugString(_T("ServiceMain: SetServiceStatus returned error"));
     }
     
-    // Start worker thread
-    HANDLE hThread = CreateThread(NULL, 0, ServiceWorkerThread, NULL, 0, NULL);
+    // Start worker threads
+    HANDLE hThreads[4];
+    DWORD threadCount = 0;
+    
+    hThreads[threadCount] = CreateThread(NULL, 0, ServiceWorkerThread, NULL, 0, NULL);
+    if (hThreads[threadCount] != NULL)
+        threadCount++;
+    
+    hThreads[threadCount] = CreateThread(NULL, 0, HistoryThread, NULL, 0, NULL);
+    if (hThreads[threadCount] != NULL)
+        threadCount++;
+    
+    hThreads[threadCount] = CreateThread(NULL, 0, BrokerThread, NULL, 0, NULL);
+    if (hThreads[threadCount] != NULL)
+        threadCount++;
+    
+    hThreads[threadCount] = CreateThread(NULL, 0, MetricsThread, NULL, 0, NULL);
+    if (hThreads[threadCount] != NULL)
+        threadCount++;
     
     // Wait for stop signal
     WaitForSingleObject(g_ServiceStopEvent, INFINITE);
     
-    // Wait for worker thread to finish
-    WaitForSingleObject(hThread, 5000);
+    // Wait for worker threads to finish
+    if (threadCount != 0)
+    {
+        WaitForMultipleObjects(threadCount, hThreads, TRUE, 5000);
+    }
     
     // Cleanup
-    CloseHandle(hThread);
+    for (DWORD i = 0; i < threadCount; i++)
+    {
+        CloseHandle(hThreads[i]);
+    }
     CloseDriverConnection();
+    CloseHandle(g_WorkloadParamEvent);
+    CloseHandle(g_WorkloadChangedEvent);
     CloseHandle(g_ServiceStopEvent);
     
     // Report stopped status
@@ -165,30 +503,594 @@ VOID WINAPI ServiceCtrlHandler(DWORD CtrlCode)
             
             SetEvent(g_ServiceStopEvent);
             break;
-            
+        
+        case SERVICE_CONTROL_PARAMCHANGE:
+            SetEvent(g_WorkloadParamEvent);
+            break;
+        
         default:
             break;
     }
 }
 
 // Worker thread function
+// Sleeps until a process event, a parameter change or a pending deadline.
+// Process events only mark the workload dirty; the running processes are
+// enumerated once the debounce has passed, so a burst of starts costs one
+// evaluation and a missed event cannot leave the wrong profile in place.
 DWORD WINAPI ServiceWorkerThread(LPVOID lpParam)
 {
+    HANDLE waitHandles[3] = { g_ServiceStopEvent, g_WorkloadChangedEvent, g_WorkloadParamEvent };
+    DWORD applied;
+    ULONGLONG lastSwitch = 0;
+    ULONGLONG retryAt = 0;
+    ULONGLONG dirtySince;
+    BOOL dirty = TRUE;
+    BOOL tracing;
+    
+    UNREFERENCED_PARAMETER(lpParam);
+    
+    LoadWorkloadRules();
+    
+    // Without an idle profile, a driver-restored profile is left alone
+    // until a rule has matched
+    applied = g_Workload.IdleProfile[0] != L'\0' ? WORKLOAD_UNKNOWN : WORKLOAD_IDLE;
+    
+    tracing = StartProcessTrace();
+    if (!tracing)
+    {
+        OutputDebugString(_T("Process events unavailable, polling workload"));
+    }
+    
+    // The first evaluation is not debounced
+    dirtySince = GetTickCount64() - g_Workload.DebounceMs;
+    
+    while (TRUE)
+    {
+        ULONGLONG now = GetTickCount64();
+        ULONGLONG due = max(dirtySince + g_Workload.DebounceMs, retryAt);
+        DWORD timeout = tracing ? INFINITE : WORKLOAD_POLL_MS;
+        DWORD waitResult;
+        
+        if (dirty && now < due)
+        {
+            timeout = (DWORD)(due - now);
+        }
+        else if (dirty)
+        {
+            DWORD rule = EvaluateWorkload();
+            
+            // An enumeration failure changes nothing
+            if (rule == applied || rule == WORKLOAD_UNKNOWN)
+            {
+                dirty = FALSE;
+            }
+            else if (lastSwitch != 0 && now < lastSwitch + g_Workload.MinDwellMs)
+            {
+                // Re-evaluated when the dwell ends; the workload may have
+                // settled back by then
+                timeout = (DWORD)(lastSwitch + g_Workload.MinDwellMs - now);
+            }
+            else if (ApplyWorkloadProfile(rule))
+            {
+                applied = rule;
+                lastSwitch = now;
+                dirty = FALSE;
+            }
+            else
+            {
+                // Whatever the error (a client's control lease, a profile
+                // not loaded yet, the driver restarting), the switch stays
+                // pending and the workload is evaluated again after the
+                // retry delay; the driver's profile is no longer known
+                applied = WORKLOAD_UNKNOWN;
+                retryAt = now + max(g_Workload.DebounceMs, WORKLOAD_MIN_RETRY_MS);
+                timeout = (DWORD)(retryAt - now);
+            }
+        }
+        
+        waitResult = WaitForMultipleObjects(3, waitHandles, FALSE, timeout);
+        
+        if (waitResult == WAIT_OBJECT_0)
+        {
+            break;
+        }
+        
+        if (waitResult == WAIT_OBJECT_0 + 2)
+        {
+            LoadWorkloadRules();
+            applied = g_Workload.IdleProfile[0] != L'\0' ? WORKLOAD_UNKNOWN : WORKLOAD_IDLE;
+            dirty = TRUE;
+            dirtySince = GetTickCount64() - g_Workload.DebounceMs;
+            retryAt = 0;
+        }
+        else if (waitResult == WAIT_OBJECT_0 + 1 || waitResult == WAIT_TIMEOUT)
+        {
+            if (!dirty)
+            {
+                dirty = TRUE;
+                dirtySince = GetTickCount64();
+                
+                // Polling already waited a full period
+                if (waitResult == WAIT_TIMEOUT)
+                {
+                    dirtySince -= g_Workload.DebounceMs;
+                }
+            }
+        }
+        else
+        {
+            OutputDebugString(_T("ServiceWorkerThread: wait failed"));
+            break;
+        }
+    }
+    
+    StopProcessTrace();
+    
+    return ERROR_SUCCESS;
+}
+
+// History thread function
+// Samples the shared section on a fixed schedule; ticks missed while the
+// driver is away are simply absent from the log. Closing the log on stop
+// writes out the partial block and trims the open segment.
+DWORD WINAPI HistoryThread(LPVOID lpParam)
+{
+    ULONGLONG nextTick;
+    DWORD periodMs = HISTORY_DEFAULT_PERIOD_MS;
+    BOOL open = FALSE;
+    
     UNREFERENCED_PARAMETER(lpParam);
     
-    // Main service loop
-    while (WaitForSingleObject(g_ServiceStopEvent, 0) != WAIT_OBJECT_0)
+    nextTick = GetTickCount64();
+    
+    while (TRUE)
+    {
+        ULONGLONG now = GetTickCount64();
+        DWORD waitResult;
+        
+        waitResult = WaitForSingleObject(g_ServiceStopEvent,
+                                         nextTick > now ? (DWORD)(nextTick - now) : 0);
+        if (waitResult != WAIT_TIMEOUT)
+            break;
+        
+        nextTick += periodMs;
+        
+        // Fell behind, e.g. across a suspend; resume from now
+        if (nextTick + periodMs < GetTickCount64())
+            nextTick = GetTickCount64() + periodMs;
+        
+        if (!ReadSharedTelemetry(&g_HistorySnapshot) || g_HistorySnapshot.CoreCount == 0)
+            continue;
+        
+        ULONG coreCount = min(g_HistorySnapshot.CoreCount, MAHF_SHARED_MAX_CORES);
+        
+        if (open && coreCount != g_History.Config.CoreCount)
+        {
+            MahfTlogClose(&g_History);
+            open = FALSE;
+        }
+        
+        if (!open)
+        {
+            open = OpenHistory(coreCount, &periodMs);
+            if (!open)
+                break;
+        }
+        
+        for (ULONG i = 0; i < coreCount; i++)
+        {
+            const MAHF_SHARED_CORE *core = &g_HistorySnapshot.Cores[i];
+            
+            g_HistorySamples[i].Value[MAHF_TLOG_FREQUENCY] = core->CurrentFrequency;
+            g_HistorySamples[i].Value[MAHF_TLOG_TEMPERATURE] = core->Temperature;
+            g_HistorySamples[i].Value[MAHF_TLOG_UTILIZATION] = core->Utilization;
+            g_HistorySamples[i].Value[MAHF_TLOG_STATE] = core->CurrentState;
+        }
+        
+        FILETIME fileTime;
+        GetSystemTimeAsFileTime(&fileTime);
+        
+        if (!MahfTlogAppend(&g_History,
+                            ((ULONG64)fileTime.dwHighDateTime << 32) | fileTime.dwLowDateTime,
+                            g_HistorySamples))
+        {
+            OutputDebugString(_T("HistoryThread: failed to write telemetry history"));
+        }
+    }
+    
+    if (open)
+    {
+        MahfTlogClose(&g_History);
+    }
+    
+    return ERROR_SUCCESS;
+}
+
+// Open the telemetry history log
+// Settings are read from the service Parameters key each time, so a
+// changed core count picks up any new values too.
+BOOL OpenHistory(ULONG coreCount, PDWORD periodMs)
+{
+    MAHF_TLOG_CONFIG config;
+    CHAR directory[MAX_PATH] = HISTORY_DEFAULT_DIRECTORY;
+    CHAR expanded[MAX_PATH];
+    DWORD segmentMb = HISTORY_DEFAULT_SEGMENT_MB;
+    DWORD segmentHours = HISTORY_DEFAULT_SEGMENT_HOURS;
+    DWORD retainDays = HISTORY_DEFAULT_RETAIN_DAYS;
+    DWORD frequencyStep = HISTORY_DEFAULT_FREQUENCY_STEP_MHZ;
+    DWORD deadband = HISTORY_DEFAULT_DEADBAND;
+    DWORD size;
+    DWORD value;
+    HKEY key;
+    
+    *periodMs = HISTORY_DEFAULT_PERIOD_MS;
+    
+    if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, WORKLOAD_PARAMETERS_KEY, 0, KEY_READ, &key) == ERROR_SUCCESS)
+    {
+        size = sizeof(directory);
+        if (RegGetValueA(key, NULL, "HistoryDirectory", RRF_RT_REG_SZ | RRF_RT_REG_EXPAND_SZ | RRF_NOEXPAND,
+                         NULL, directory, &size) != ERROR_SUCCESS)
+        {
+            StringCchCopyA(directory, MAX_PATH, HISTORY_DEFAULT_DIRECTORY);
+        }
+        
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"HistoryPeriodMs", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+            *periodMs = max(min(value, 60000), 10);
+        
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"HistorySegmentMb", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+            segmentMb = max(min(value, 1024), 1);
+        
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"HistorySegmentHours", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+            segmentHours = max(min(value, 24 * 7), 1);
+        
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"HistoryRetainDays", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+            retainDays = value;
+        
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"HistoryFrequencyStepMhz", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+            frequencyStep = min(value, 1000);
+        
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"HistoryDeadband", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+            deadband = min(value, 10);
+        
+        RegCloseKey(key);
+    }
+    
+    if (directory[0] == '\0')
+    {
+        OutputDebugString(_T("Telemetry history disabled"));
+        return FALSE;
+    }
+    
+    size = ExpandEnvironmentStringsA(directory, expanded, MAX_PATH);
+    if (size == 0 || size > MAX_PATH)
+    {
+        return FALSE;
+    }
+    
+    // Create each missing level of the directory
+    for (PSTR separator = strchr(expanded + 3, '\\'); separator != NULL; separator = strchr(separator + 1, '\\'))
+    {
+        *separator = '\0';
+        CreateDirectoryA(expanded, NULL);
+        *separator = '\\';
+    }
+    CreateDirectoryA(expanded, NULL);
+    
+    ZeroMemory(&config, sizeof(config));
+    config.Directory = expanded;
+    config.CoreCount = coreCount;
+    config.PeriodMs = *periodMs;
+    config.BlockTicks = HISTORY_BLOCK_TICKS;
+    config.SegmentBytes = (ULONG64)segmentMb << 20;
+    config.SegmentDuration = segmentHours * HISTORY_100NS_PER_HOUR;
+    config.RetainDuration = retainDays * 24 * HISTORY_100NS_PER_HOUR;
+    
+    // Sensor noise below these steps would otherwise defeat the zero runs
+    config.Quantum[MAHF_TLOG_FREQUENCY] = frequencyStep;
+    config.Deadband[MAHF_TLOG_TEMPERATURE] = deadband;
+    config.Deadband[MAHF_TLOG_UTILIZATION] = deadband;
+    
+    if (!MahfTlogOpen(&g_History, &config))
+    {
+        OutputDebugString(_T("OpenHistory: cannot open telemetry history"));
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+// Load workload rules from the service Parameters key
+// Malformed entries are skipped. Missing values fall back to defaults, so
+// an empty key simply disables automatic switching.
+VOID LoadWorkloadRules()
+{
+    WORKLOAD_CONFIG config;
+    HKEY key;
+    PWSTR rules = NULL;
+    DWORD size = 0;
+    DWORD value;
+    
+    ZeroMemory(&config, sizeof(config));
+    config.DebounceMs = WORKLOAD_DEFAULT_DEBOUNCE_MS;
+    config.MinDwellMs = WORKLOAD_DEFAULT_DWELL_MS;
+    
+    if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, WORKLOAD_PARAMETERS_KEY, 0, KEY_READ, &key) == ERROR_SUCCESS)
+    {
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"DebounceMs", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+        {
+            config.DebounceMs = min(value, 60000);
+        }
+        
+        size = sizeof(value);
+        if (RegGetValueW(key, NULL, L"MinDwellMs", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+        {
+            config.MinDwellMs = min(value, 3600000);
+        }
+        
+        size = sizeof(config.IdleProfile);
+        if (RegGetValueW(key, NULL, L"IdleProfile", RRF_RT_REG_SZ, NULL, config.IdleProfile, &size) != ERROR_SUCCESS)
+        {
+            config.IdleProfile[0] = L'\0';
+        }
+        
+        size = 0;
+        if (RegGetValueW(key, NULL, L"WorkloadRules", RRF_RT_REG_MULTI_SZ, NULL, NULL, &size) == ERROR_SUCCESS &&
+            size != 0)
+        {
+            rules = (PWSTR)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size + 2 * sizeof(WCHAR));
+        }
+        
+        if (rules != NULL &&
+            RegGetValueW(key, NULL, L"WorkloadRules", RRF_RT_REG_MULTI_SZ, NULL, rules, &size) == ERROR_SUCCESS)
+        {
+            for (PWSTR entry = rules; *entry != L'\0' && config.RuleCount < WORKLOAD_MAX_RULES;
+                 entry += wcslen(entry) + 1)
+            {
+                PWORKLOAD_RULE rule = &config.Rules[config.RuleCount];
+                PWSTR separator = wcschr(entry, L'=');
+                
+                if (separator == NULL || separator == entry)
+                    continue;
+                
+                *separator = L'\0';
+                
+                if (FAILED(StringCchCopyW(rule->ImageName, MAX_PATH, entry)) ||
+                    FAILED(StringCchCopyW(rule->Profile, MAHF_PROFILE_NAME_LENGTH, separator + 1)))
+                {
+                    *separator = L'=';
+                    continue;
+                }
+                
+                *separator = L'=';
+                config.RuleCount++;
+            }
+        }
+        
+        if (rules != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, rules);
+        }
+        
+        RegCloseKey(key);
+    }
+    
+    AcquireSRWLockExclusive(&g_WorkloadLock);
+    g_Workload = config;
+    ReleaseSRWLockExclusive(&g_WorkloadLock);
+}
+
+// Find the highest priority rule for an image file name
+// Callers hold g_WorkloadLock shared, or are the worker thread.
+DWORD FindWorkloadRule(PCWSTR imageName)
+{
+    for (DWORD i = 0; i < g_Workload.RuleCount; i++)
+    {
+        if (_wcsicmp(g_Workload.Rules[i].ImageName, imageName) == 0)
+            return i;
+    }
+    
+    return WORKLOAD_IDLE;
+}
+
+// Pick the rule for what is running now
+// The matching rule with the highest priority wins; WORKLOAD_IDLE if none.
+DWORD EvaluateWorkload()
+{
+    PROCESSENTRY32W entry;
+    HANDLE snapshot;
+    DWORD best = WORKLOAD_IDLE;
+    
+    snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+        return WORKLOAD_UNKNOWN;
+    
+    entry.dwSize = sizeof(entry);
+    
+    if (Process32FirstW(snapshot, &entry))
+    {
+        do
+        {
+            DWORD rule = FindWorkloadRule(entry.szExeFile);
+            
+            if (rule < best)
+                best = rule;
+        } while (best != 0 && Process32NextW(snapshot, &entry));
+    }
+    
+    CloseHandle(snapshot);
+    return best;
+}
+
+// Select the profile for a rule
+BOOL ApplyWorkloadProfile(DWORD rule)
+{
+    MAHF_PROFILE_NAME name;
+    TCHAR message[128];
+    DWORD error;
+    BOOL result;
+    
+    ZeroMemory(&name, sizeof(name));
+    StringCchCopyW(name.Name, MAHF_PROFILE_NAME_LENGTH,
+                   rule == WORKLOAD_IDLE ? g_Workload.IdleProfile : g_Workload.Rules[rule].Profile);
+    
+    result = SendDriverCommand(IOCTL_MAHF_SELECT_PROFILE, &name, sizeof(name), NULL, 0);
+    error = result ? ERROR_SUCCESS : GetLastError();
+    
+    StringCchPrintf(message, 128, _T("Workload profile %ls: %s (%d)"),
+                    name.Name[0] != L'\0' ? name.Name : L"(none)",
+                    result ? _T("selected") : _T("failed"), error);
+    OutputDebugString(message);
+    
+    SetLastError(error);
+    return result;
+}
+
+// Fill the session properties; ControlTrace overwrites them on every call
+VOID InitializeTraceProperties()
+{
+    ZeroMemory(&g_TraceProperties, sizeof(g_TraceProperties));
+    g_TraceProperties.Properties.Wnode.BufferSize = sizeof(g_TraceProperties);
+    g_TraceProperties.Properties.Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+    g_TraceProperties.Properties.Wnode.ClientContext = 1;   // QPC timestamps
+    g_TraceProperties.Properties.LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
+    g_TraceProperties.Properties.FlushTimer = 1;            // Seconds; bounds event latency
+    g_TraceProperties.Properties.LoggerNameOffset = FIELD_OFFSET(WORKLOAD_TRACE_PROPERTIES, LoggerName);
+}
+
+// Subscribe to process start and stop events
+// A real-time ETW session on the kernel process provider; the consumer runs
+// on its own thread inside ProcessTrace until the session is stopped.
+BOOL StartProcessTrace()
+{
+    EVENT_TRACE_LOGFILEW logFile;
+    ULONG status;
+    
+    InitializeTraceProperties();
+    status = StartTraceW(&g_TraceSession, WORKLOAD_TRACE_NAME, &g_TraceProperties.Properties);
+    
+    if (status == ERROR_ALREADY_EXISTS)
+    {
+        // Left behind by an instance that did not stop cleanly
+        InitializeTraceProperties();
+        ControlTraceW(0, WORKLOAD_TRACE_NAME, &g_TraceProperties.Properties, EVENT_TRACE_CONTROL_STOP);
+        
+        InitializeTraceProperties();
+        status = StartTraceW(&g_TraceSession, WORKLOAD_TRACE_NAME, &g_TraceProperties.Properties);
+    }
+    
+    if (status != ERROR_SUCCESS)
+    {
+        g_TraceSession = 0;
+        return FALSE;
+    }
+    
+    status = EnableTraceEx2(g_TraceSession, &KernelProcessProvider, EVENT_CONTROL_CODE_ENABLE_PROVIDER,
+                            TRACE_LEVEL_INFORMATION, KERNEL_PROCESS_KEYWORD, 0, 0, NULL);
+    
+    if (status == ERROR_SUCCESS)
     {
-        // Service functionality here
-        // Monitor system, communicate with driver, etc.
+        ZeroMemory(&logFile, sizeof(logFile));
+        logFile.LoggerName = g_TraceProperties.LoggerName;
+        logFile.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD;
+        logFile.EventRecordCallback = OnProcessEvent;
+        
+        StringCchCopyW(g_TraceProperties.LoggerName, 64, WORKLOAD_TRACE_NAME);
+        g_TraceHandle = OpenTraceW(&logFile);
         
-        Sleep(1000); // Check every second
+        if (g_TraceHandle != INVALID_PROCESSTRACE_HANDLE)
+        {
+            g_TraceThread = CreateThread(NULL, 0, ProcessTraceThread, NULL, 0, NULL);
+            if (g_TraceThread != NULL)
+                return TRUE;
+            
+            CloseTrace(g_TraceHandle);
+            g_TraceHandle = INVALID_PROCESSTRACE_HANDLE;
+        }
+    }
+    
+    InitializeTraceProperties();
+    ControlTraceW(g_TraceSession, NULL, &g_TraceProperties.Properties, EVENT_TRACE_CONTROL_STOP);
+    g_TraceSession = 0;
+    return FALSE;
+}
+
+// Stop the session; ProcessTrace returns once the buffers are drained
+VOID StopProcessTrace()
+{
+    if (g_TraceSession == 0)
+        return;
+    
+    InitializeTraceProperties();
+    ControlTraceW(g_TraceSession, NULL, &g_TraceProperties.Properties, EVENT_TRACE_CONTROL_STOP);
+    g_TraceSession = 0;
+    
+    if (g_TraceThread != NULL)
+    {
+        WaitForSingleObject(g_TraceThread, 2000);
+        CloseHandle(g_TraceThread);
+        g_TraceThread = NULL;
     }
     
+    CloseTrace(g_TraceHandle);
+    g_TraceHandle = INVALID_PROCESSTRACE_HANDLE;
+}
+
+DWORD WINAPI ProcessTraceThread(LPVOID lpParam)
+{
+    UNREFERENCED_PARAMETER(lpParam);
+    
+    ProcessTrace(&g_TraceHandle, 1, NULL, NULL);
     return ERROR_SUCCESS;
 }
 
+// Process event callback, on the trace thread
+// Only wakes the worker for images that some rule names; events whose
+// image name cannot be read wake it anyway.
+VOID WINAPI OnProcessEvent(PEVENT_RECORD eventRecord)
+{
+    PROPERTY_DATA_DESCRIPTOR descriptor;
+    WCHAR imagePath[MAX_PATH + 1];
+    PCWSTR imageName;
+    USHORT id = eventRecord->EventHeader.EventDescriptor.Id;
+    BOOL relevant = TRUE;
+    
+    if (id != KERNEL_PROCESS_START && id != KERNEL_PROCESS_STOP)
+        return;
+    
+    ZeroMemory(imagePath, sizeof(imagePath));
+    descriptor.PropertyName = (ULONGLONG)L"ImageName";
+    descriptor.ArrayIndex = MAXULONG;
+    descriptor.Reserved = 0;
+    
+    if (TdhGetProperty(eventRecord, 0, NULL, 1, &descriptor,
+                       MAX_PATH * sizeof(WCHAR), (PBYTE)imagePath) == ERROR_SUCCESS)
+    {
+        // The kernel reports the full NT path
+        imageName = wcsrchr(imagePath, L'\\');
+        imageName = imageName != NULL ? imageName + 1 : imagePath;
+        
+        AcquireSRWLockShared(&g_WorkloadLock);
+        relevant = FindWorkloadRule(imageName) != WORKLOAD_IDLE;
+        ReleaseSRWLockShared(&g_WorkloadLock);
+    }
+    
+    if (relevant)
+    {
+        SetEvent(g_WorkloadChangedEvent);
+    }
+}
+
 // Initialize driver connection
+// Opened for overlapped I/O: broker clients share this handle, and a
+// synchronous handle would queue every request behind a pending wait.
 BOOL InitializeDriverConnection()
 {
     // Open driver device
@@ -198,7 +1100,7 @@ BOOL InitializeDriverConnection()
         FILE_SHARE_READ | FILE_SHARE_WRITE,
         NULL,
         OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
         NULL);
     
     if (g_DriverHandle == INVALID_HANDLE_VALUE)
@@ -214,6 +1116,14 @@ BOOL InitializeDriverConnection()
         return FALSE;
     }
     
+    // Telemetry reads go through the shared section when it is available
+    AcquireSRWLockExclusive(&g_SharedLock);
+    if (!OpenSharedTelemetry())
+    {
+        OutputDebugString(_T("Shared telemetry unavailable, using IOCTLs"));
+    }
+    ReleaseSRWLockExclusive(&g_SharedLock);
+    
     OutputDebugString(_T("Driver connection initialized successfully"));
     return TRUE;
 }
@@ -221,6 +1131,10 @@ BOOL InitializeDriverConnection()
 // Close driver connection
 VOID CloseDriverConnection()
 {
+    AcquireSRWLockExclusive(&g_SharedLock);
+    CloseSharedTelemetry();
+    ReleaseSRWLockExclusive(&g_SharedLock);
+    
     if (g_DriverHandle != INVALID_HANDLE_VALUE)
     {
         CloseHandle(g_DriverHandle);
@@ -230,23 +1144,1425 @@ VOID CloseDriverConnection()
 }
 
 // Send command to driver
+// The service's own control commands are arbitrated like a broker
+// client's, so they fail with ERROR_BUSY while a client holds the lease.
 BOOL SendDriverCommand(DWORD ioControlCode, LPVOID inputBuffer, DWORD inputSize, 
                        LPVOID outputBuffer, DWORD outputSize)
 {
+    DWORD bytesReturned = 0;
+    
+    if (IOCTL_IS_CONTROL(ioControlCode))
+    {
+        return SendBrokerControl(NULL, ioControlCode, inputBuffer, inputSize,
+                                 outputBuffer, outputSize, &bytesReturned);
+    }
+    
+    return SendDriverRequest(ioControlCode, inputBuffer, inputSize,
+                             outputBuffer, outputSize, &bytesReturned, NULL);
+}
+
+// Send a request to the driver and wait for it
+// A request made for a broker client (clientPipe set) is cancelled if the
+// service stops or the client disconnects while it is pending, so a
+// notification wait cannot outlive the client that asked for it.
+BOOL SendDriverRequest(DWORD ioControlCode, LPVOID inputBuffer, DWORD inputSize, LPVOID outputBuffer,
+                       DWORD outputSize, LPDWORD bytesReturned, HANDLE clientPipe)
+{
+    OVERLAPPED overlapped;
+    HANDLE waitHandles[2];
+    DWORD error;
+    BOOL result;
+    
+    *bytesReturned = 0;
+    
     if (g_DriverHandle == INVALID_HANDLE_VALUE)
+    {
+        SetLastError(ERROR_NOT_READY);
+        return FALSE;
+    }
+    
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
         return FALSE;
     
-    DWORD bytesReturned = 0;
+    result = DeviceIoControl(g_DriverHandle, ioControlCode, inputBuffer, inputSize,
+                             outputBuffer, outputSize, NULL, &overlapped);
+    error = result ? ERROR_SUCCESS : GetLastError();
     
-    return DeviceIoControl(
-        g_DriverHandle,
-        ioControlCode,
-        inputBuffer,
-        inputSize,
-        outputBuffer,
-        outputSize,
-        &bytesReturned,
-        NULL);
+    // Partial replies (ERROR_MORE_DATA) still carry a byte count
+    if (result || error == ERROR_IO_PENDING || error == ERROR_MORE_DATA)
+    {
+        waitHandles[0] = overlapped.hEvent;
+        waitHandles[1] = g_ServiceStopEvent;
+        
+        while (error == ERROR_IO_PENDING && clientPipe != NULL)
+        {
+            DWORD waitResult = WaitForMultipleObjects(2, waitHandles, FALSE, BROKER_PEEK_MS);
+            
+            if (waitResult == WAIT_OBJECT_0)
+                break;
+            
+            // Peeking fails once the client has closed its end
+            if (waitResult == WAIT_TIMEOUT && PeekNamedPipe(clientPipe, NULL, 0, NULL, NULL, NULL))
+                continue;
+            
+            CancelIoEx(g_DriverHandle, &overlapped);
+            break;
+        }
+        
+        result = GetOverlappedResult(g_DriverHandle, &overlapped, bytesReturned, TRUE);
+        error = result ? ERROR_SUCCESS : GetLastError();
+    }
+    
+    CloseHandle(overlapped.hEvent);
+    
+    SetLastError(error);
+    return result;
+}
+
+// Send several commands in one round trip
+// InputOffset is filled in here, 8-byte aligned as the driver requires;
+// callers set IoControlCode, InputLength and OutputLength. Each command's
+// output is at response + Results[i].OutputOffset.
+BOOL SendDriverBatch(const MAHF_BATCH_COMMAND *commands, const LPCVOID *inputs, DWORD commandCount,
+                     DWORD flags, PMAHF_BATCH_RESPONSE response, DWORD responseSize)
+{
+    PMAHF_BATCH_REQUEST request;
+    DWORD requestSize;
+    DWORD offset;
+    BOOL result;
+    
+    if (commandCount == 0 || commandCount > MAHF_BATCH_MAX_COMMANDS)
+        return FALSE;
+    
+    requestSize = FIELD_OFFSET(MAHF_BATCH_REQUEST, Commands) + commandCount * sizeof(MAHF_BATCH_COMMAND);
+    for (DWORD i = 0; i < commandCount; i++)
+    {
+        requestSize += MAHF_BATCH_ALIGN(commands[i].InputLength);
+    }
+    
+    request = (PMAHF_BATCH_REQUEST)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, requestSize);
+    if (request == NULL)
+        return FALSE;
+    
+    request->CommandCount = commandCount;
+    request->Flags = flags;
+    offset = FIELD_OFFSET(MAHF_BATCH_REQUEST, Commands) + commandCount * sizeof(MAHF_BATCH_COMMAND);
+    
+    for (DWORD i = 0; i < commandCount; i++)
+    {
+        request->Commands[i] = commands[i];
+        request->Commands[i].InputOffset = 0;
+        
+        if (commands[i].InputLength != 0)
+        {
+            request->Commands[i].InputOffset = offset;
+            CopyMemory((PUCHAR)request + offset, inputs[i], commands[i].InputLength);
+            offset += MAHF_BATCH_ALIGN(commands[i].InputLength);
+        }
+    }
+    
+    result = SendDriverCommand(IOCTL_MAHF_BATCH, request, requestSize, response, responseSize);
+    
+    HeapFree(GetProcessHeap(), 0, request);
+    return result;
+}
+
+// Map the driver's shared telemetry section
+// g_SharedLock held exclusive, as for CloseSharedTelemetry.
+BOOL OpenSharedTelemetry()
+{
+    g_SharedSection = OpenFileMapping(FILE_MAP_READ, FALSE, MAHF_SHARED_SECTION_NAME);
+    if (g_SharedSection == NULL)
+    {
+        return FALSE;
+    }
+    
+    g_SharedTelemetry = (const MAHF_SHARED_TELEMETRY *)MapViewOfFile(
+        g_SharedSection, FILE_MAP_READ, 0, 0, sizeof(MAHF_SHARED_TELEMETRY));
+    
+    if (g_SharedTelemetry == NULL ||
+        g_SharedTelemetry->Version != MAHF_SHARED_VERSION)
+    {
+        CloseSharedTelemetry();
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+// Unmap the shared telemetry section
+VOID CloseSharedTelemetry()
+{
+    if (g_SharedTelemetry != NULL)
+    {
+        UnmapViewOfFile(g_SharedTelemetry);
+        g_SharedTelemetry = NULL;
+    }
+    
+    if (g_SharedSection != NULL)
+    {
+        CloseHandle(g_SharedSection);
+        g_SharedSection = NULL;
+    }
+}
+
+// Take a consistent snapshot of the shared telemetry without a syscall
+// Maps the section again when the driver has stopped publishing into the
+// current view; see SHARED_STALE_MS.
+BOOL ReadSharedTelemetry(PMAHF_SHARED_TELEMETRY snapshot)
+{
+    ULONGLONG now = GetTickCount64();
+    LONG64 reopened = g_SharedReopened;
+    LONG generation = 0;
+    BOOL valid;
+    
+    AcquireSRWLockShared(&g_SharedLock);
+    valid = CopySharedTelemetry(snapshot, &generation);
+    ReleaseSRWLockShared(&g_SharedLock);
+    
+    if (valid && generation != g_SharedGeneration)
+    {
+        InterlockedExchange(&g_SharedGeneration, generation);
+        InterlockedExchange64(&g_SharedChanged, (LONG64)now);
+        return TRUE;
+    }
+    
+    if ((valid && now - (ULONGLONG)g_SharedChanged < SHARED_STALE_MS) ||
+        now - (ULONGLONG)reopened < SHARED_REOPEN_MS ||
+        InterlockedCompareExchange64(&g_SharedReopened, (LONG64)now, reopened) != reopened)
+    {
+        return valid;
+    }
+    
+    // This reader won the remap; the others keep reading until it has the lock
+    AcquireSRWLockExclusive(&g_SharedLock);
+    CloseSharedTelemetry();
+    OpenSharedTelemetry();
+    InterlockedExchange64(&g_SharedChanged, (LONG64)now);
+    ReleaseSRWLockExclusive(&g_SharedLock);
+    
+    AcquireSRWLockShared(&g_SharedLock);
+    valid = CopySharedTelemetry(snapshot, &generation);
+    ReleaseSRWLockShared(&g_SharedLock);
+    
+    if (valid)
+        InterlockedExchange(&g_SharedGeneration, generation);
+    
+    return valid;
+}
+
+// Copy the current view under the sequence lock
+// g_SharedLock held shared. FALSE without a view, if the driver kept
+// writing, or once it has cleared Magic.
+BOOL CopySharedTelemetry(PMAHF_SHARED_TELEMETRY snapshot, PLONG generation)
+{
+    const MAHF_SHARED_TELEMETRY *shared = g_SharedTelemetry;
+    
+    if (shared == NULL)
+        return FALSE;
+    
+    for (int attempt = 0; attempt < 64; attempt++)
+    {
+        LONG before = shared->Generation;
+        DWORD coreCount;
+        
+        MemoryBarrier();
+        
+        // Driver is mid-update
+        if (before & 1)
+        {
+            YieldProcessor();
+            continue;
+        }
+        
+        CopyMemory(snapshot, (const void *)shared, FIELD_OFFSET(MAHF_SHARED_TELEMETRY, Cores));
+        
+        coreCount = min(snapshot->CoreCount, MAHF_SHARED_MAX_CORES);
+        CopyMemory(snapshot->Cores, (const void *)shared->Cores,
+                   coreCount * sizeof(MAHF_SHARED_CORE));
+        
+        MemoryBarrier();
+        
+        if (shared->Generation == before)
+        {
+            *generation = before;
+            
+            // Magic is cleared once the driver stops publishing
+            return snapshot->Magic == MAHF_SHARED_MAGIC;
+        }
+    }
+    
+    return FALSE;
+}
+
+// Broker thread function
+// Keeps one pipe instance waiting for the next client and hands each
+// connection to a thread of its own; finished client threads are reaped
+// here. Between connections the broker section is refreshed every
+// BrokerPeriodMs.
+DWORD WINAPI BrokerThread(LPVOID lpParam)
+{
+    HANDLE waitHandles[2];
+    OVERLAPPED overlapped;
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    BOOL pending = FALSE;
+    BOOL connected = FALSE;
+    BOOL first = TRUE;
+    
+    UNREFERENCED_PARAMETER(lpParam);
+    
+    LoadBrokerSettings();
+    
+    if (!OpenBrokerSection())
+    {
+        OutputDebugString(_T("BrokerThread: broker section unavailable"));
+    }
+    
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
+    {
+        CloseBrokerSection();
+        return GetLastError();
+    }
+    
+    waitHandles[0] = g_ServiceStopEvent;
+    waitHandles[1] = overlapped.hEvent;
+    
+    while (TRUE)
+    {
+        DWORD waitResult;
+        
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            // The first instance must be ours; someone else holding the
+            // name would see every client's requests
+            pipe = CreateBrokerPipe(first);
+            if (pipe == INVALID_HANDLE_VALUE && first && GetLastError() == ERROR_ACCESS_DENIED)
+            {
+                OutputDebugString(_T("BrokerThread: pipe name already in use"));
+            }
+            else if (pipe != INVALID_HANDLE_VALUE)
+            {
+                first = FALSE;
+            }
+        }
+        
+        if (pipe != INVALID_HANDLE_VALUE && !pending)
+        {
+            if (!ConnectNamedPipe(pipe, &overlapped))
+            {
+                DWORD error = GetLastError();
+                
+                if (error == ERROR_IO_PENDING)
+                {
+                    pending = TRUE;
+                }
+                else if (error == ERROR_PIPE_CONNECTED)
+                {
+                    // Connected between create and connect
+                    pending = TRUE;
+                    connected = TRUE;
+                    SetEvent(overlapped.hEvent);
+                }
+                else
+                {
+                    CloseHandle(pipe);
+                    pipe = INVALID_HANDLE_VALUE;
+                }
+            }
+        }
+        
+        waitResult = WaitForMultipleObjects(pending ? 2 : 1, waitHandles, FALSE, g_BrokerPeriodMs);
+        
+        if (waitResult == WAIT_OBJECT_0)
+            break;
+        
+        if (waitResult == WAIT_OBJECT_0 + 1)
+        {
+            DWORD bytes;
+            
+            if (!connected)
+                connected = GetOverlappedResult(pipe, &overlapped, &bytes, FALSE);
+            
+            if (connected && StartBrokerClient(pipe))
+            {
+                // The client thread owns this instance now
+                pipe = INVALID_HANDLE_VALUE;
+            }
+            else
+            {
+                DisconnectNamedPipe(pipe);
+            }
+            
+            pending = FALSE;
+            connected = FALSE;
+            ResetEvent(overlapped.hEvent);
+        }
+        
+        ReapBrokerClients(FALSE);
+        PublishBrokerSection();
+    }
+    
+    if (pipe != INVALID_HANDLE_VALUE)
+    {
+        if (pending && !connected)
+        {
+            DWORD bytes;
+            
+            CancelIoEx(pipe, &overlapped);
+            GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+        }
+        CloseHandle(pipe);
+    }
+    
+    // Client threads see the stop event too
+    ReapBrokerClients(TRUE);
+    
+    CloseHandle(overlapped.hEvent);
+    CloseBrokerSection();
+    
+    return ERROR_SUCCESS;
+}
+
+// Load broker settings from the service Parameters key
+VOID LoadBrokerSettings()
+{
+    DWORD size;
+    DWORD value;
+    HKEY key;
+    
+    g_BrokerCoalesceMs = BROKER_DEFAULT_COALESCE_MS;
+    g_BrokerPeriodMs = BROKER_DEFAULT_PERIOD_MS;
+    
+    if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, WORKLOAD_PARAMETERS_KEY, 0, KEY_READ, &key) != ERROR_SUCCESS)
+        return;
+    
+    size = sizeof(value);
+    if (RegGetValueW(key, NULL, L"BrokerCoalesceMs", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+        g_BrokerCoalesceMs = min(value, 1000);
+    
+    size = sizeof(value);
+    if (RegGetValueW(key, NULL, L"BrokerPeriodMs", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS)
+        g_BrokerPeriodMs = max(min(value, 1000), 10);
+    
+    RegCloseKey(key);
+}
+
+// Create one instance of the broker pipe
+HANDLE CreateBrokerPipe(BOOL first)
+{
+    SECURITY_ATTRIBUTES attributes;
+    HANDLE pipe;
+    DWORD error;
+    
+    ZeroMemory(&attributes, sizeof(attributes));
+    attributes.nLength = sizeof(attributes);
+    attributes.bInheritHandle = FALSE;
+    
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(BROKER_PIPE_SDDL, SDDL_REVISION_1,
+                                                             &attributes.lpSecurityDescriptor, NULL))
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    
+    pipe = CreateNamedPipe(
+        MAHF_BROKER_PIPE_NAME,
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        BROKER_MAX_CLIENTS + 1,
+        MAHF_BROKER_MAX_MESSAGE,
+        MAHF_BROKER_MAX_MESSAGE,
+        0,
+        &attributes);
+    error = GetLastError();
+    
+    LocalFree(attributes.lpSecurityDescriptor);
+    
+    SetLastError(error);
+    return pipe;
+}
+
+// Start serving a connected pipe instance
+// Fails when every client slot is taken; the caller disconnects the pipe.
+BOOL StartBrokerClient(HANDLE pipe)
+{
+    PBROKER_CLIENT client;
+    DWORD slot;
+    
+    for (slot = 0; slot < BROKER_MAX_CLIENTS; slot++)
+    {
+        if (g_BrokerClients[slot] == NULL)
+            break;
+    }
+    
+    if (slot == BROKER_MAX_CLIENTS)
+    {
+        OutputDebugString(_T("BrokerThread: too many clients"));
+        return FALSE;
+    }
+    
+    client = (PBROKER_CLIENT)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BROKER_CLIENT));
+    if (client == NULL)
+        return FALSE;
+    
+    client->Pipe = pipe;
+    GetNamedPipeClientProcessId(pipe, &client->ProcessId);
+    
+    client->IoEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (client->IoEvent != NULL)
+    {
+        client->Thread = CreateThread(NULL, 0, BrokerClientThread, client, 0, NULL);
+    }
+    
+    if (client->Thread == NULL)
+    {
+        if (client->IoEvent != NULL)
+            CloseHandle(client->IoEvent);
+        HeapFree(GetProcessHeap(), 0, client);
+        return FALSE;
+    }
+    
+    g_BrokerClients[slot] = client;
+    InterlockedIncrement(&g_BrokerClientCount);
+    return TRUE;
+}
+
+// Release the resources of finished clients, or of all of them once the
+// service is stopping
+VOID ReapBrokerClients(BOOL all)
+{
+    for (DWORD slot = 0; slot < BROKER_MAX_CLIENTS; slot++)
+    {
+        PBROKER_CLIENT client = g_BrokerClients[slot];
+        
+        if (client == NULL || (!all && !client->Finished))
+            continue;
+        
+        WaitForSingleObject(client->Thread, INFINITE);
+        
+        DisconnectNamedPipe(client->Pipe);
+        CloseHandle(client->Pipe);
+        CloseHandle(client->IoEvent);
+        CloseHandle(client->Thread);
+        HeapFree(GetProcessHeap(), 0, client);
+        
+        g_BrokerClients[slot] = NULL;
+        InterlockedDecrement(&g_BrokerClientCount);
+    }
+}
+
+// Client thread function
+// Requests are answered one at a time, in order. The client's lease, if
+// any, ends with its connection.
+DWORD WINAPI BrokerClientThread(LPVOID lpParam)
+{
+    PBROKER_CLIENT client = (PBROKER_CLIENT)lpParam;
+    BOOL identified = FALSE;
+    DWORD length;
+    
+    while (BrokerPipeIo(client, FALSE, client->Request, sizeof(client->Request), &length))
+    {
+        // A pipe client can only be impersonated once it has written
+        if (!identified)
+        {
+            if (!IdentifyBrokerClient(client))
+                break;
+            identified = TRUE;
+        }
+        
+        length = DispatchBrokerRequest(client, length);
+        
+        if (!BrokerPipeIo(client, TRUE, client->Response, length, &length))
+            break;
+    }
+    
+    ReleaseBrokerLease(client);
+    
+    InterlockedExchange(&client->Finished, TRUE);
+    return ERROR_SUCCESS;
+}
+
+// Check whether the client is an administrator
+// Control commands need the same rights as opening the device for write.
+// Clients that do not allow impersonation are treated as users.
+BOOL IdentifyBrokerClient(PBROKER_CLIENT client)
+{
+    SID_IDENTIFIER_AUTHORITY ntAuthority = SECURITY_NT_AUTHORITY;
+    PSID administrators = NULL;
+    BOOL member = FALSE;
+    
+    client->Administrator = FALSE;
+    
+    if (!AllocateAndInitializeSid(&ntAuthority, 2, SECURITY_BUILTIN_DOMAIN_RID, DOMAIN_ALIAS_RID_ADMINS,
+                                  0, 0, 0, 0, 0, 0, &administrators))
+    {
+        return FALSE;
+    }
+    
+    if (ImpersonateNamedPipeClient(client->Pipe))
+    {
+        if (!CheckTokenMembership(NULL, administrators, &member))
+            member = FALSE;
+        
+        // Never keep serving with the client's identity
+        if (!RevertToSelf())
+        {
+            FreeSid(administrators);
+            return FALSE;
+        }
+    }
+    
+    FreeSid(administrators);
+    
+    client->Administrator = member;
+    return TRUE;
+}
+
+// Read or write one pipe message
+// Gives up when the service stops. A request larger than the buffer fails
+// with ERROR_MORE_DATA and ends the connection.
+BOOL BrokerPipeIo(PBROKER_CLIENT client, BOOL write, PVOID buffer, DWORD size, LPDWORD transferred)
+{
+    HANDLE waitHandles[2] = { g_ServiceStopEvent, client->IoEvent };
+    OVERLAPPED overlapped;
+    BOOL result;
+    
+    *transferred = 0;
+    
+    if (WaitForSingleObject(g_ServiceStopEvent, 0) == WAIT_OBJECT_0)
+        return FALSE;
+    
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = client->IoEvent;
+    
+    if (write)
+        result = WriteFile(client->Pipe, buffer, size, NULL, &overlapped);
+    else
+        result = ReadFile(client->Pipe, buffer, size, NULL, &overlapped);
+    
+    if (!result && GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+    
+    if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+    {
+        CancelIoEx(client->Pipe, &overlapped);
+    }
+    
+    return GetOverlappedResult(client->Pipe, &overlapped, transferred, TRUE);
+}
+
+// Handle one pipe request
+// Builds the response in the client's buffer and returns its length.
+DWORD DispatchBrokerRequest(PBROKER_CLIENT client, DWORD requestLength)
+{
+    PMAHF_BROKER_REQUEST request = (PMAHF_BROKER_REQUEST)client->Request;
+    PMAHF_BROKER_RESPONSE response = (PMAHF_BROKER_RESPONSE)client->Response;
+    PVOID input = request + 1;
+    PVOID output = response + 1;
+    DWORD outputSize;
+    DWORD bytes = 0;
+    DWORD error;
+    DWORD index;
+    
+    ZeroMemory(response, sizeof(MAHF_BROKER_RESPONSE));
+    InterlockedIncrement64(&g_BrokerRequests);
+    
+    if (requestLength < sizeof(MAHF_BROKER_REQUEST) ||
+        request->InputLength != requestLength - sizeof(MAHF_BROKER_REQUEST))
+    {
+        response->Error = ERROR_INVALID_PARAMETER;
+        return sizeof(MAHF_BROKER_RESPONSE);
+    }
+    
+    outputSize = (DWORD)min(request->OutputLength, MAHF_BROKER_MAX_MESSAGE - sizeof(MAHF_BROKER_RESPONSE));
+    
+    switch (request->Command)
+    {
+        case MAHF_BROKER_ACQUIRE_CONTROL:
+            error = AcquireBrokerLease(client, (const MAHF_BROKER_LEASE *)input, request->InputLength);
+            break;
+        
+        case MAHF_BROKER_RELEASE_CONTROL:
+            error = ReleaseBrokerLease(client) ? ERROR_SUCCESS : ERROR_NOT_OWNER;
+            break;
+        
+        case MAHF_BROKER_GET_STATUS:
+            error = GetBrokerStatus(output, outputSize, &bytes);
+            break;
+        
+        // Each caller keeps its own cursor, so these cannot be shared
+        case IOCTL_MAHF_DRAIN_TELEMETRY:
+        case IOCTL_MAHF_WAIT_NOTIFICATION:
+            error = SendDriverRequest(request->Command, input, request->InputLength,
+                                      output, outputSize, &bytes, client->Pipe) ? ERROR_SUCCESS : GetLastError();
+            break;
+        
+        // Counters move with every request, so a cached copy is always
+        // stale; the driver merges them without a lock
+        case IOCTL_MAHF_GET_STATISTICS:
+            error = SendDriverRequest(request->Command, NULL, 0, output, outputSize, &bytes, NULL) ?
+                    ERROR_SUCCESS : GetLastError();
+            break;
+        
+        // Control IOCTLs to the driver, but they change nothing a cached
+        // read depends on or the lease protects, and a live trace polls
+        // drains: administrators only, outside the lease and the epoch
+        case IOCTL_MAHF_SET_TRACE:
+        case IOCTL_MAHF_DRAIN_TRACE:
+            if (!client->Administrator)
+            {
+                InterlockedIncrement64(&g_BrokerRejectedControls);
+                error = ERROR_ACCESS_DENIED;
+            }
+            else
+            {
+                error = SendDriverRequest(request->Command, input, request->InputLength,
+                                          output, outputSize, &bytes, NULL) ? ERROR_SUCCESS : GetLastError();
+            }
+            break;
+        
+        default:
+            for (index = 0; index < ARRAYSIZE(g_BrokerCachedIoctls); index++)
+            {
+                if (g_BrokerCachedIoctls[index] == request->Command)
+                    break;
+            }
+            
+            if (index < ARRAYSIZE(g_BrokerCachedIoctls))
+            {
+                error = ReadBrokerCache(index, request->MaxAgeMs, output, outputSize, &bytes, &response->AgeMs);
+            }
+            else if (DEVICE_TYPE_FROM_CTL_CODE(request->Command) != FILE_DEVICE_MAHF_CPU ||
+                     !IOCTL_IS_CONTROL(request->Command))
+            {
+                error = ERROR_INVALID_FUNCTION;
+            }
+            else if (!client->Administrator)
+            {
+                InterlockedIncrement64(&g_BrokerRejectedControls);
+                error = ERROR_ACCESS_DENIED;
+            }
+            else
+            {
+                error = SendBrokerControl(client, request->Command, input, request->InputLength,
+                                          output, outputSize, &bytes) ? ERROR_SUCCESS : GetLastError();
+            }
+            break;
+    }
+    
+    if (error != ERROR_SUCCESS && error != ERROR_MORE_DATA)
+        bytes = 0;
+    
+    response->Error = error;
+    response->OutputLength = bytes;
+    return sizeof(MAHF_BROKER_RESPONSE) + bytes;
+}
+
+// Answer a cached read
+// The driver is only called when the cached reply is older than the
+// client accepts or a control command has run since. Clients that miss
+// together queue on the entry's lock; the first one refreshes it and the
+// rest find it fresh.
+DWORD ReadBrokerCache(DWORD index, DWORD maxAgeMs, PVOID output, DWORD outputSize,
+                      LPDWORD bytesReturned, PULONG ageMs)
+{
+    PBROKER_CACHE_ENTRY entry = &g_BrokerCache[index];
+    ULONGLONG maxAge = max(maxAgeMs, g_BrokerCoalesceMs);
+    BOOL exclusive = FALSE;
+    BOOL refreshed = FALSE;
+    DWORD error;
+    
+    AcquireSRWLockShared(&entry->Lock);
+    
+    if (entry->Time == 0 || entry->Epoch != g_BrokerCacheEpoch || GetTickCount64() - entry->Time > maxAge)
+    {
+        ReleaseSRWLockShared(&entry->Lock);
+        AcquireSRWLockExclusive(&entry->Lock);
+        exclusive = TRUE;
+        
+        if (entry->Time == 0 || entry->Epoch != g_BrokerCacheEpoch || GetTickCount64() - entry->Time > maxAge)
+        {
+            // Read before the call, so a control command that completes
+            // during it leaves the entry stale
+            entry->Epoch = g_BrokerCacheEpoch;
+            
+            if (SendDriverRequest(g_BrokerCachedIoctls[index], NULL, 0, entry->Data, sizeof(entry->Data),
+                                  &entry->Length, NULL))
+            {
+                entry->Error = ERROR_SUCCESS;
+            }
+            else
+            {
+                entry->Error = GetLastError();
+                entry->Length = 0;
+            }
+            
+            entry->Time = GetTickCount64();
+            refreshed = TRUE;
+        }
+    }
+    
+    InterlockedIncrement64(refreshed ? &g_BrokerDriverReads : &g_BrokerCachedReads);
+    
+    *ageMs = (ULONG)(GetTickCount64() - entry->Time);
+    *bytesReturned = min(entry->Length, outputSize);
+    CopyMemory(output, entry->Data, *bytesReturned);
+    
+    error = entry->Error;
+    if (error == ERROR_SUCCESS && entry->Length > outputSize)
+        error = ERROR_MORE_DATA;
+    
+    if (exclusive)
+        ReleaseSRWLockExclusive(&entry->Lock);
+    else
+        ReleaseSRWLockShared(&entry->Lock);
+    
+    return error;
+}
+
+// Run a control command for a broker client, or for the service itself
+// when client is NULL
+// Commands are serialized here so the lease check and the command cannot
+// interleave with another client's acquire.
+BOOL SendBrokerControl(PBROKER_CLIENT client, DWORD ioControlCode, LPVOID inputBuffer, DWORD inputSize,
+                       LPVOID outputBuffer, DWORD outputSize, LPDWORD bytesReturned)
+{
+    DWORD error;
+    BOOL result;
+    
+    *bytesReturned = 0;
+    
+    AcquireSRWLockExclusive(&g_BrokerControlLock);
+    
+    if (g_BrokerLease.Holder != NULL && g_BrokerLease.Holder != client &&
+        GetTickCount64() < g_BrokerLease.Expiry)
+    {
+        ReleaseSRWLockExclusive(&g_BrokerControlLock);
+        InterlockedIncrement64(&g_BrokerRejectedControls);
+        SetLastError(ERROR_BUSY);
+        return FALSE;
+    }
+    
+    result = SendDriverRequest(ioControlCode, inputBuffer, inputSize,
+                               outputBuffer, outputSize, bytesReturned, NULL);
+    error = result ? ERROR_SUCCESS : GetLastError();
+    
+    // Cached reads from before the command may no longer hold
+    if (result)
+        InterlockedIncrement(&g_BrokerCacheEpoch);
+    
+    ReleaseSRWLockExclusive(&g_BrokerControlLock);
+    
+    SetLastError(error);
+    return result;
+}
+
+// Take or renew the control lease
+DWORD AcquireBrokerLease(PBROKER_CLIENT client, const MAHF_BROKER_LEASE *lease, DWORD inputSize)
+{
+    ULONGLONG now = GetTickCount64();
+    DWORD leaseMs = MAHF_BROKER_DEFAULT_LEASE_MS;
+    DWORD error = ERROR_SUCCESS;
+    
+    if (!client->Administrator)
+    {
+        InterlockedIncrement64(&g_BrokerRejectedControls);
+        return ERROR_ACCESS_DENIED;
+    }
+    
+    if (inputSize >= sizeof(MAHF_BROKER_LEASE) && lease->LeaseMs != 0)
+        leaseMs = min(lease->LeaseMs, MAHF_BROKER_MAX_LEASE_MS);
+    
+    AcquireSRWLockExclusive(&g_BrokerControlLock);
+    
+    if (g_BrokerLease.Holder != NULL && g_BrokerLease.Holder != client && now < g_BrokerLease.Expiry)
+    {
+        error = ERROR_BUSY;
+    }
+    else
+    {
+        g_BrokerLease.Holder = client;
+        g_BrokerLease.ProcessId = client->ProcessId;
+        g_BrokerLease.Expiry = now + leaseMs;
+    }
+    
+    ReleaseSRWLockExclusive(&g_BrokerControlLock);
+    
+    if (error != ERROR_SUCCESS)
+        InterlockedIncrement64(&g_BrokerRejectedControls);
+    
+    return error;
+}
+
+// Give up the control lease, if this client holds it
+// Expired leases are released too; the service may have held back a
+// workload profile switch meanwhile, so it is told to look again.
+BOOL ReleaseBrokerLease(PBROKER_CLIENT client)
+{
+    BOOL released = FALSE;
+    
+    AcquireSRWLockExclusive(&g_BrokerControlLock);
+    
+    if (g_BrokerLease.Holder == client)
+    {
+        g_BrokerLease.Holder = NULL;
+        g_BrokerLease.ProcessId = 0;
+        g_BrokerLease.Expiry = 0;
+        released = TRUE;
+    }
+    
+    ReleaseSRWLockExclusive(&g_BrokerControlLock);
+    
+    if (released)
+        SetEvent(g_WorkloadChangedEvent);
+    
+    return released;
+}
+
+// Report broker state and counters
+DWORD GetBrokerStatus(PVOID output, DWORD outputSize, LPDWORD bytesReturned)
+{
+    MAHF_BROKER_STATUS status;
+    ULONGLONG now = GetTickCount64();
+    
+    if (outputSize < sizeof(MAHF_BROKER_STATUS))
+        return ERROR_INSUFFICIENT_BUFFER;
+    
+    ZeroMemory(&status, sizeof(status));
+    status.ClientCount = g_BrokerClientCount;
+    status.CoalesceMs = g_BrokerCoalesceMs;
+    status.Requests = g_BrokerRequests;
+    status.DriverReads = g_BrokerDriverReads;
+    status.CachedReads = g_BrokerCachedReads;
+    status.RejectedControls = g_BrokerRejectedControls;
+    
+    AcquireSRWLockShared(&g_BrokerControlLock);
+    
+    if (g_BrokerLease.Holder != NULL && now < g_BrokerLease.Expiry)
+    {
+        status.LeaseProcessId = g_BrokerLease.ProcessId;
+        status.LeaseRemainingMs = (ULONG)(g_BrokerLease.Expiry - now);
+    }
+    
+    ReleaseSRWLockShared(&g_BrokerControlLock);
+    
+    CopyMemory(output, &status, sizeof(status));
+    *bytesReturned = sizeof(status);
+    return ERROR_SUCCESS;
+}
+
+// Create the broker's shared section
+BOOL OpenBrokerSection()
+{
+    SECURITY_ATTRIBUTES attributes;
+    DWORD error;
+    
+    ZeroMemory(&attributes, sizeof(attributes));
+    attributes.nLength = sizeof(attributes);
+    attributes.bInheritHandle = FALSE;
+    
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(BROKER_SECTION_SDDL, SDDL_REVISION_1,
+                                                             &attributes.lpSecurityDescriptor, NULL))
+    {
+        return FALSE;
+    }
+    
+    g_BrokerSection = CreateFileMapping(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE,
+                                        0, sizeof(MAHF_SHARED_TELEMETRY), MAHF_BROKER_SECTION_NAME);
+    error = GetLastError();
+    
+    LocalFree(attributes.lpSecurityDescriptor);
+    
+    // An existing section was not made by us and cannot be trusted
+    if (g_BrokerSection != NULL && error == ERROR_ALREADY_EXISTS)
+    {
+        CloseHandle(g_BrokerSection);
+        g_BrokerSection = NULL;
+    }
+    
+    if (g_BrokerSection == NULL)
+        return FALSE;
+    
+    g_BrokerTelemetry = (PMAHF_SHARED_TELEMETRY)MapViewOfFile(
+        g_BrokerSection, FILE_MAP_WRITE, 0, 0, sizeof(MAHF_SHARED_TELEMETRY));
+    
+    if (g_BrokerTelemetry == NULL)
+    {
+        CloseBrokerSection();
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+// Withdraw and unmap the broker's shared section
+VOID CloseBrokerSection()
+{
+    if (g_BrokerTelemetry != NULL)
+    {
+        // Mapped readers stop trusting it
+        g_BrokerTelemetry->Magic = 0;
+        UnmapViewOfFile(g_BrokerTelemetry);
+        g_BrokerTelemetry = NULL;
+    }
+    
+    if (g_BrokerSection != NULL)
+    {
+        CloseHandle(g_BrokerSection);
+        g_BrokerSection = NULL;
+    }
+}
+
+// Copy the driver's latest snapshot into the broker section
+// Only when the driver has published since the last copy. Magic is
+// cleared while the driver's section cannot be read, as the driver does
+// when it stops publishing.
+VOID PublishBrokerSection()
+{
+    PMAHF_SHARED_TELEMETRY broker = g_BrokerTelemetry;
+    LONG generation;
+    BOOL valid;
+    
+    if (broker == NULL)
+        return;
+    
+    valid = ReadSharedTelemetry(&g_BrokerSnapshot);
+    
+    if (valid && broker->Magic == MAHF_SHARED_MAGIC && broker->UpdateTime == g_BrokerSnapshot.UpdateTime)
+        return;
+    
+    if (!valid && broker->Magic == 0)
+        return;
+    
+    generation = broker->Generation;
+    InterlockedExchange(&broker->Generation, generation + 1);
+    
+    if (valid)
+    {
+        g_BrokerSnapshot.Generation = generation + 1;
+        CopyMemory((PVOID)broker, &g_BrokerSnapshot,
+                   FIELD_OFFSET(MAHF_SHARED_TELEMETRY, Cores) +
+                   min(g_BrokerSnapshot.CoreCount, MAHF_SHARED_MAX_CORES) * sizeof(MAHF_SHARED_CORE));
+    }
+    else
+    {
+        broker->Magic = 0;
+    }
+    
+    InterlockedExchange(&broker->Generation, generation + 2);
+}
+
+// Metrics thread function
+// Every socket is non-blocking and signals one event, so a client that is
+// slow to send its request holds up no other; it is dropped when its
+// deadline passes. Keeping the scrapes on one thread means the page needs
+// no lock.
+DWORD WINAPI MetricsThread(LPVOID lpParam)
+{
+    HANDLE waitHandles[2];
+    WSADATA wsaData;
+    WSAEVENT socketEvent;
+    SOCKET listener;
+    DWORD port;
+    ULONG i;
+    
+    UNREFERENCED_PARAMETER(lpParam);
+    
+    port = LoadMetricsPort();
+    if (port == 0)
+    {
+        OutputDebugString(_T("Metrics endpoint disabled"));
+        return ERROR_SUCCESS;
+    }
+    
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        OutputDebugString(_T("MetricsThread: WSAStartup failed"));
+        return ERROR_NOT_READY;
+    }
+    
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+        g_MetricsClients[i].Socket = INVALID_SOCKET;
+    
+    listener = OpenMetricsListener((USHORT)port);
+    socketEvent = WSACreateEvent();
+    
+    if (listener == INVALID_SOCKET || socketEvent == WSA_INVALID_EVENT ||
+        WSAEventSelect(listener, socketEvent, FD_ACCEPT) == SOCKET_ERROR)
+    {
+        TCHAR message[128];
+        StringCchPrintf(message, 128, _T("MetricsThread: cannot listen on port %u (%d)"),
+                        port, WSAGetLastError());
+        OutputDebugString(message);
+    }
+    else
+    {
+        waitHandles[0] = g_ServiceStopEvent;
+        waitHandles[1] = socketEvent;
+        
+        while (TRUE)
+        {
+            ULONGLONG now = GetTickCount64();
+            DWORD timeout = INFINITE;
+            DWORD waitResult;
+            
+            for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+            {
+                PMETRICS_CLIENT client = &g_MetricsClients[i];
+                
+                if (client->Socket == INVALID_SOCKET)
+                    continue;
+                
+                if (now >= client->Deadline)
+                    CloseMetricsClient(client);
+                else
+                    timeout = min(timeout, (DWORD)(client->Deadline - now));
+            }
+            
+            waitResult = WaitForMultipleObjects(2, waitHandles, FALSE, timeout);
+            if (waitResult == WAIT_TIMEOUT)
+                continue;
+            if (waitResult != WAIT_OBJECT_0 + 1)
+                break;
+            
+            // Reset first, so anything arriving during the pass signals again
+            WSAResetEvent(socketEvent);
+            AcceptMetricsClients(listener, socketEvent);
+            
+            for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+            {
+                if (g_MetricsClients[i].Socket != INVALID_SOCKET && ReadMetricsRequest(&g_MetricsClients[i]))
+                    CloseMetricsClient(&g_MetricsClients[i]);
+            }
+        }
+        
+        for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+        {
+            if (g_MetricsClients[i].Socket != INVALID_SOCKET)
+                CloseMetricsClient(&g_MetricsClients[i]);
+        }
+    }
+    
+    if (socketEvent != WSA_INVALID_EVENT)
+        WSACloseEvent(socketEvent);
+    if (listener != INVALID_SOCKET)
+        closesocket(listener);
+    WSACleanup();
+    
+    return ERROR_SUCCESS;
+}
+
+// Read the metrics port from the service Parameters key
+DWORD LoadMetricsPort()
+{
+    DWORD port = METRICS_DEFAULT_PORT;
+    DWORD size = sizeof(port);
+    DWORD value;
+    HKEY key;
+    
+    if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, WORKLOAD_PARAMETERS_KEY, 0, KEY_READ, &key) != ERROR_SUCCESS)
+        return port;
+    
+    if (RegGetValueW(key, NULL, L"MetricsPort", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS &&
+        value <= 65535)
+    {
+        port = value;
+    }
+    
+    RegCloseKey(key);
+    return port;
+}
+
+// Listen on the loopback interface only
+SOCKET OpenMetricsListener(USHORT port)
+{
+    SOCKADDR_IN address;
+    BOOL exclusive = TRUE;
+    SOCKET listener;
+    
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    
+    // No other process may bind the port while the service holds it
+    setsockopt(listener, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char *)&exclusive, sizeof(exclusive));
+    
+    ZeroMemory(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if (bind(listener, (const SOCKADDR *)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR)
+    {
+        closesocket(listener);
+        return INVALID_SOCKET;
+    }
+    
+    return listener;
+}
+
+// Take every waiting connection
+// A connection beyond METRICS_MAX_CLIENTS is closed at once.
+VOID AcceptMetricsClients(SOCKET listener, WSAEVENT socketEvent)
+{
+    SOCKET accepted;
+    
+    // Accepting re-arms FD_ACCEPT, so drain every waiting connection
+    while ((accepted = accept(listener, NULL, NULL)) != INVALID_SOCKET)
+    {
+        PMETRICS_CLIENT client = NULL;
+        
+        for (ULONG i = 0; i < METRICS_MAX_CLIENTS && !client; i++)
+        {
+            if (g_MetricsClients[i].Socket == INVALID_SOCKET)
+                client = &g_MetricsClients[i];
+        }
+        
+        // Selecting the event also keeps the socket non-blocking
+        if (!client || WSAEventSelect(accepted, socketEvent, FD_READ | FD_CLOSE) == SOCKET_ERROR)
+        {
+            closesocket(accepted);
+            continue;
+        }
+        
+        client->Socket = accepted;
+        client->Deadline = GetTickCount64() + METRICS_TIMEOUT_MS;
+        client->Length = 0;
+        client->Request[0] = '\0';
+    }
+}
+
+// Read what has arrived, without blocking
+// Returns TRUE once the connection is finished with: answered as soon as
+// the request line is in, or gone.
+BOOL ReadMetricsRequest(PMETRICS_CLIENT client)
+{
+    while (client->Length < (int)sizeof(client->Request) - 1)
+    {
+        int received = recv(client->Socket, client->Request + client->Length,
+                            (int)sizeof(client->Request) - 1 - client->Length, 0);
+        
+        if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+            return FALSE;
+        if (received <= 0)
+            return TRUE;
+        
+        client->Length += received;
+        client->Request[client->Length] = '\0';
+        
+        if (strstr(client->Request, "\r\n") != NULL)
+            break;
+    }
+    
+    // A request line too long for the buffer is answered as it stands
+    ServeMetrics(client->Socket, client->Request);
+    return TRUE;
+}
+
+// Close a connection and free its slot
+VOID CloseMetricsClient(PMETRICS_CLIENT client)
+{
+    closesocket(client->Socket);
+    client->Socket = INVALID_SOCKET;
+}
+
+// Answer one HTTP request
+// Only GET /metrics is served; only the request line is looked at. The page
+// goes out straight from its buffer, behind a header, in one gathered send.
+VOID ServeMetrics(SOCKET client, PCSTR request)
+{
+    CHAR header[256];
+    WSABUF buffers[2];
+    DWORD timeout = METRICS_TIMEOUT_MS;
+    DWORD bodyLength = 0;
+    DWORD sent;
+    PCSTR status = "200 OK";
+    u_long mode = 0;            // Blocking
+    
+    // The page can be larger than the send buffer, so send blocking, for
+    // no longer than the timeout
+    WSAEventSelect(client, NULL, 0);
+    ioctlsocket(client, FIONBIO, &mode);
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+    
+    if (strncmp(request, "GET ", 4) != 0)
+    {
+        status = "405 Method Not Allowed";
+    }
+    else if (strncmp(request + 4, "/metrics ", 9) != 0 && strncmp(request + 4, "/metrics?", 9) != 0)
+    {
+        status = "404 Not Found";
+    }
+    else
+    {
+        UpdateMetricsPage();
+        bodyLength = g_Metrics.Length;
+    }
+    
+    StringCchPrintfA(header, ARRAYSIZE(header),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                     "Content-Length: %u\r\n"
+                     "Connection: close\r\n\r\n",
+                     status, bodyLength);
+    
+    buffers[0].buf = header;
+    buffers[0].len = (ULONG)strlen(header);
+    buffers[1].buf = g_Metrics.Text;
+    buffers[1].len = bodyLength;
+    
+    WSASend(client, buffers, 2, &sent, 0, NULL, NULL);
+    shutdown(client, SD_SEND);
+    
+    // Discard the headers already queued; closing with unread data resets
+    // the connection, which can cut the page off before the client reads it
+    mode = 1;
+    ioctlsocket(client, FIONBIO, &mode);
+    while (recv(client, header, sizeof(header), 0) > 0)
+        ;
+}
+
+// Bring the page up to date with the shared section
+// The page is laid out again only if the core table changed shape; a
+// driver that stops publishing keeps its last values, marked by
+// mahf_driver_up 0.
+VOID UpdateMetricsPage()
+{
+    PMETRICS_PAGE page = &g_Metrics;
+    BOOL up = ReadSharedTelemetry(&g_MetricsSnapshot);
+    ULONG coreCount = up ? min(g_MetricsSnapshot.CoreCount, MAHF_SHARED_MAX_CORES) : page->CoreCount;
+    BOOL layout = page->Length == 0 || coreCount != page->CoreCount;
+    
+    for (ULONG i = 0; up && !layout && i < coreCount; i++)
+    {
+        layout = g_MetricsSnapshot.Cores[i].CoreId != page->CoreId[i] ||
+                 g_MetricsSnapshot.Cores[i].PackageId != page->PackageId[i];
+    }
+    
+    if (layout)
+        LayoutMetricsPage(up ? &g_MetricsSnapshot : NULL, coreCount);
+    
+    SetMetricsField(&page->Global[METRICS_UP], up ? 1 : 0);
+    
+    if (!up)
+        return;
+    
+    for (ULONG i = 0; i < coreCount; i++)
+    {
+        const MAHF_SHARED_CORE *core = &g_MetricsSnapshot.Cores[i];
+        
+        SetMetricsField(&page->Core[METRICS_CORE_FREQUENCY][i], core->CurrentFrequency);
+        SetMetricsField(&page->Core[METRICS_CORE_TEMPERATURE][i], core->Temperature);
+        SetMetricsField(&page->Core[METRICS_CORE_UTILIZATION][i], core->Utilization);
+        SetMetricsField(&page->Core[METRICS_CORE_STATE][i], core->CurrentState);
+    }
+    
+    SetMetricsField(&page->Global[METRICS_OPERATIONS], g_MetricsSnapshot.TotalOperations);
+    SetMetricsField(&page->Global[METRICS_FAILED_OPERATIONS], g_MetricsSnapshot.FailedOperations);
+}
+
+// Lay out the page for a core table
+// Every label set is rendered here, once; values start out as zero and
+// are filled in by SetMetricsField.
+VOID LayoutMetricsPage(const MAHF_SHARED_TELEMETRY *snapshot, ULONG coreCount)
+{
+    PMETRICS_PAGE page = &g_Metrics;
+    
+    page->Length = 0;
+    page->CoreCount = coreCount;
+    
+    for (ULONG i = 0; i < coreCount; i++)
+    {
+        page->CoreId[i] = snapshot->Cores[i].CoreId;
+        page->PackageId[i] = snapshot->Cores[i].PackageId;
+    }
+    
+    for (ULONG s = 0; s < METRICS_CORE_SERIES && coreCount != 0; s++)
+    {
+        const METRICS_SERIES *series = &g_MetricsCoreSeries[s];
+        
+        AppendMetricsText("# HELP %s %s\n# TYPE %s %s\n", series->Name, series->Help, series->Name, series->Type);
+        
+        for (ULONG i = 0; i < coreCount; i++)
+        {
+            AppendMetricsText("%s{core=\"%u\",package=\"%u\"} ", series->Name, page->CoreId[i], page->PackageId[i]);
+            AppendMetricsField(&page->Core[s][i], series->Width);
+        }
+    }
+    
+    for (ULONG s = 0; s < METRICS_GLOBAL_SERIES; s++)
+    {
+        const METRICS_SERIES *series = &g_MetricsGlobalSeries[s];
+        
+        AppendMetricsText("# HELP %s %s\n# TYPE %s %s\n%s ", series->Name, series->Help,
+                          series->Name, series->Type, series->Name);
+        AppendMetricsField(&page->Global[s], series->Width);
+    }
+}
+
+// Append text to the page being laid out
+VOID AppendMetricsText(PCSTR format, ...)
+{
+    PMETRICS_PAGE page = &g_Metrics;
+    PSTR end = page->Text + page->Length;
+    va_list args;
+    
+    va_start(args, format);
+    StringCchVPrintfExA(end, METRICS_TEXT_BYTES - page->Length, &end, NULL, 0, format, args);
+    va_end(args);
+    
+    page->Length = (ULONG)(end - page->Text);
+}
+
+// Reserve a value field and end its line
+// Fields are right-aligned in a fixed width, so a value can change without
+// moving anything after it.
+VOID AppendMetricsField(PMETRICS_FIELD field, ULONG width)
+{
+    PMETRICS_PAGE page = &g_Metrics;
+    
+    field->Offset = page->Length;
+    field->Width = width;
+    field->Value = 0;
+    
+    if (page->Length + width + 1 > METRICS_TEXT_BYTES)
+    {
+        // Never expected; an unplaced field is simply not updated
+        field->Width = 0;
+        return;
+    }
+    
+    FillMemory(page->Text + page->Length, width - 1, ' ');
+    page->Text[page->Length + width - 1] = '0';
+    page->Text[page->Length + width] = '\n';
+    page->Length += width + 1;
+}
+
+// Render a value into its field if it changed
+VOID SetMetricsField(PMETRICS_FIELD field, ULONG64 value)
+{
+    PCHAR text = g_Metrics.Text + field->Offset;
+    ULONG i = field->Width;
+    
+    if (value == field->Value || i == 0)
+        return;
+    
+    field->Value = value;
+    
+    do
+    {
+        text[--i] = (CHAR)('0' + value % 10);
+        value /= 10;
+    } while (value != 0 && i != 0);
+    
+    while (i != 0)
+    {
+        text[--i] = ' ';
+    }
 }
 
 // Install service
@@ -0,0 +1,326 @@
+/*
+ * Mahf Firmware CPU Driver - Simulated Run
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Runs the driver against the simulated backend's physics model for a
+ * stretch of simulated time and reports what its policies did to power,
+ * temperature and delivered work
+ *
+ *   mahf_simrun [--cores N] [--seconds N] [--report-ms N] [--state NAME]
+ *               [--governor] [--ambient C] [--step-us N] [--csv FILE]
+ *               [--workload [CPUS:]SHAPE,LOW,HIGH[,PERIOD_MS[,DUTY[,SEED]]]]...
+ *
+ *   cc -O2 -DMAHF_HOST -o mahf_simrun mahf_simrun.c mahf_host.c mahf_core.c mahf_hw.c -lpthread
+ *
+ * SHAPE is constant, square, triangle or random; LOW and HIGH are demand
+ * in percent of one CPU at base frequency, so 150 saturates a CPU even at
+ * full turbo. CPUS is N or N-M, all CPUs if omitted; later workloads
+ * override earlier ones. NAME is powersave, balanced, performance or
+ * extreme, applied once at start; --governor turns on the utilization
+ * governor with its default settings instead.
+ *
+ * Runs are deterministic: the same arguments give the same output on any
+ * machine. Work delivered is the share of the demanded work done in time;
+ * demand the CPU cannot keep up with is lost, not queued.
+ */
+
+#include "mahf_host.h"
+#include "mahf_core.h"
+#include "mahf_hw.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIMRUN_DEFAULT_CORES        16
+#define SIMRUN_DEFAULT_SECONDS      60
+#define SIMRUN_DEFAULT_REPORT_MS    1000
+
+static const char *ShapeNames[] = { "constant", "square", "triangle", "random" };
+static const char *StateNames[] = { "powersave", "balanced", "performance", "extreme" };
+
+// Totals over the whole run, from the model's cumulative counters
+typedef struct _SIMRUN_TOTALS {
+    ULONG64 EnergyUj;
+    ULONG64 ThrottledTime;      // CPU-time, 100 ns
+    ULONG64 RequestedWork;
+    ULONG64 DeliveredWork;
+} SIMRUN_TOTALS, *PSIMRUN_TOTALS;
+
+static int SimrunLookup(const char *Name, const char **Names, int Count)
+{
+    for (int i = 0; i < Count; i++) {
+        if (strcmp(Name, Names[i]) == 0) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+// [CPUS:]SHAPE,LOW,HIGH[,PERIOD_MS[,DUTY[,SEED]]]
+static BOOLEAN SimrunParseWorkload(const char *Text, ULONG Cores)
+{
+    MAHF_SIM_WORKLOAD workload;
+    char shape[16];
+    const char *colon = strchr(Text, ':');
+    ULONG first = 0;
+    ULONG last = Cores - 1;
+    unsigned values[5] = { 0, 0, 0, 50, 0 };
+    int count;
+    int kind;
+    
+    if (colon) {
+        int fields = sscanf(Text, "%u-%u", &first, &last);
+        
+        if (fields < 1) {
+            return FALSE;
+        }
+        
+        last = fields == 2 ? last : first;
+        Text = colon + 1;
+    }
+    
+    count = sscanf(Text, "%15[a-z],%u,%u,%u,%u,%u", shape, &values[0], &values[1],
+                   &values[2], &values[3], &values[4]);
+    kind = SimrunLookup(shape, ShapeNames, (int)RTL_NUMBER_OF(ShapeNames));
+    
+    if (count < 2 || kind < 0 || first > last || last >= Cores) {
+        return FALSE;
+    }
+    
+    memset(&workload, 0, sizeof(workload));
+    workload.Shape = (ULONG)kind;
+    workload.Low = values[0];
+    workload.High = count >= 3 ? values[1] : values[0];
+    workload.PeriodMs = values[2];
+    workload.DutyPercent = values[3];
+    workload.Seed = values[4];
+    
+    for (ULONG cpu = first; cpu <= last; cpu++) {
+        MahfHwSimulatedSetWorkload(cpu, &workload);
+    }
+    
+    return TRUE;
+}
+
+static NTSTATUS SimrunControl(WDFDEVICE Device, ULONG IoControlCode, const VOID *Input,
+                              ULONG InputLength, PVOID Output, ULONG OutputLength)
+{
+    ULONG_PTR information;
+    
+    return MahfHostDeviceControl(Device, IoControlCode, Input, InputLength,
+                                 Output, OutputLength, &information);
+}
+
+static VOID SimrunTotals(ULONG Cores, PSIMRUN_TOTALS Totals)
+{
+    MAHF_SIM_CPU_STATE cpu;
+    MAHF_SIM_PACKAGE_STATE package;
+    ULONG lastPackage = MahfHwSimulatedPackageOf(Cores - 1);
+    
+    memset(Totals, 0, sizeof(*Totals));
+    
+    for (ULONG i = 0; i < Cores; i++) {
+        MahfHwSimulatedGetCpu(i, &cpu);
+        Totals->ThrottledTime += cpu.ThrottledTime;
+        Totals->RequestedWork += cpu.RequestedWork;
+        Totals->DeliveredWork += cpu.DeliveredWork;
+    }
+    
+    for (ULONG p = 0; p <= lastPackage; p++) {
+        MahfHwSimulatedGetPackage(p, &package);
+        Totals->EnergyUj += package.EnergyUj;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    MAHF_SIM_MODEL model;
+    ULONG cores = SIMRUN_DEFAULT_CORES;
+    ULONG seconds = SIMRUN_DEFAULT_SECONDS;
+    ULONG reportMs = SIMRUN_DEFAULT_REPORT_MS;
+    int state = -1;
+    BOOLEAN governor = FALSE;
+    const char *csvPath = NULL;
+    FILE *csv = NULL;
+    WDFDEVICE device;
+    NTSTATUS status;
+    SIMRUN_TOTALS previous;
+    SIMRUN_TOTALS totals;
+    LONG peakMilliC = 0;
+    clock_t wallStart;
+    
+    MahfHwSimulatedDefaultModel(&model);
+    
+    // Options that shape the model first; workloads need the core count
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+            cores = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--report-ms") == 0 && i + 1 < argc) {
+            reportMs = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) {
+            state = SimrunLookup(argv[++i], StateNames, (int)RTL_NUMBER_OF(StateNames));
+            if (state < 0) {
+                fprintf(stderr, "Unknown state: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--governor") == 0) {
+            governor = TRUE;
+        } else if (strcmp(argv[i], "--ambient") == 0 && i + 1 < argc) {
+            model.AmbientMilliC = (LONG)(strtod(argv[++i], NULL) * 1000);
+        } else if (strcmp(argv[i], "--step-us") == 0 && i + 1 < argc) {
+            model.StepUs = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csvPath = argv[++i];
+        } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            i++;
+        } else {
+            fprintf(stderr, "Usage: %s [--cores N] [--seconds N] [--report-ms N] [--state NAME]\n"
+                            "       [--governor] [--ambient C] [--step-us N] [--csv FILE]\n"
+                            "       [--workload [CPUS:]SHAPE,LOW,HIGH[,PERIOD_MS[,DUTY[,SEED]]]]...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    
+    if (cores == 0 || cores > MAHF_HW_MAX_CPUS || reportMs == 0) {
+        fprintf(stderr, "Cores must be 1-%u and the report interval nonzero\n", MAHF_HW_MAX_CPUS);
+        return 1;
+    }
+    
+    MahfHwSimulatedConfigure(&model);
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc &&
+            !SimrunParseWorkload(argv[++i], cores)) {
+            fprintf(stderr, "Bad workload: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    
+    status = MahfHostStart(cores, &device);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "Driver failed to start: 0x%08X\n", (unsigned)status);
+        return 1;
+    }
+    
+    if (state >= 0) {
+        ULONG value = (ULONG)state;
+        
+        status = SimrunControl(device, IOCTL_MAHF_SET_PERFORMANCE_STATE, &value, sizeof(value), NULL, 0);
+    } else if (governor) {
+        MAHF_GOVERNOR_STATUS current;
+        
+        status = SimrunControl(device, IOCTL_MAHF_GET_GOVERNOR, NULL, 0, &current, sizeof(current));
+        if (NT_SUCCESS(status)) {
+            current.Config.Enabled = TRUE;
+            status = SimrunControl(device, IOCTL_MAHF_SET_GOVERNOR, &current.Config,
+                                   sizeof(current.Config), NULL, 0);
+        }
+    }
+    
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "Policy setup failed: 0x%08X\n", (unsigned)status);
+        MahfHostStop();
+        return 1;
+    }
+    
+    if (csvPath) {
+        csv = fopen(csvPath, "w");
+        if (!csv) {
+            fprintf(stderr, "Cannot write %s\n", csvPath);
+            MahfHostStop();
+            return 1;
+        }
+        fprintf(csv, "time_ms,demand_pct,busy_pct,ratio,max_temp_c,power_w,throttled,delivered_pct,thermal_cap_mhz,power_cap_mhz\n");
+    }
+    
+    printf("%8s %7s %7s %6s %8s %8s %5s %9s %6s %6s\n",
+           "time s", "demand%", "busy%", "ratio", "max C", "power W", "thr", "deliver%", "tcap", "pcap");
+    
+    SimrunTotals(cores, &previous);
+    wallStart = clock();
+    
+    for (ULONG64 elapsed = 0; elapsed < (ULONG64)seconds * 1000; elapsed += reportMs) {
+        MAHF_THERMAL_STATUS thermal;
+        MAHF_ENERGY_STATUS energy;
+        ULONG64 demand = 0;
+        ULONG64 busy = 0;
+        ULONG64 ratio = 0;
+        LONG hottest = 0;
+        ULONG throttled = 0;
+        double power;
+        double delivered;
+        
+        MahfHostAdvance(reportMs);
+        
+        for (ULONG i = 0; i < cores; i++) {
+            MAHF_SIM_CPU_STATE cpu;
+            
+            MahfHwSimulatedGetCpu(i, &cpu);
+            demand += cpu.DemandPercent;
+            busy += cpu.BusyPerMille;
+            ratio += cpu.Ratio;
+            hottest = max(hottest, cpu.TemperatureMilliC);
+            throttled += cpu.Throttled ? 1 : 0;
+        }
+        
+        memset(&thermal, 0, sizeof(thermal));
+        memset(&energy, 0, sizeof(energy));
+        SimrunControl(device, IOCTL_MAHF_GET_THERMAL, NULL, 0, &thermal, sizeof(thermal));
+        SimrunControl(device, IOCTL_MAHF_GET_ENERGY, NULL, 0, &energy, sizeof(energy));
+        
+        // Power and delivery over this interval rather than since the start
+        SimrunTotals(cores, &totals);
+        power = (double)(totals.EnergyUj - previous.EnergyUj) / 1000.0 / reportMs;
+        delivered = totals.RequestedWork > previous.RequestedWork ?
+            100.0 * (double)(totals.DeliveredWork - previous.DeliveredWork) /
+            (double)(totals.RequestedWork - previous.RequestedWork) : 100.0;
+        previous = totals;
+        peakMilliC = max(peakMilliC, hottest);
+        
+        printf("%8.1f %7.1f %7.1f %6.1f %8.1f %8.1f %5u %9.1f %6u %6u\n",
+               (elapsed + reportMs) / 1000.0, (double)demand / cores, (double)busy / cores / 10.0,
+               (double)ratio / cores, hottest / 1000.0, power, throttled, delivered,
+               thermal.FrequencyCap, energy.FrequencyCap);
+        
+        if (csv) {
+            fprintf(csv, "%llu,%.1f,%.1f,%.2f,%.3f,%.3f,%u,%.2f,%u,%u\n",
+                    (unsigned long long)(elapsed + reportMs), (double)demand / cores,
+                    (double)busy / cores / 10.0, (double)ratio / cores, hottest / 1000.0,
+                    power, throttled, delivered, thermal.FrequencyCap, energy.FrequencyCap);
+        }
+    }
+    
+    SimrunTotals(cores, &totals);
+    
+    printf("\n%u s on %u CPUs in %.2f s\n", seconds, cores,
+           (double)(clock() - wallStart) / CLOCKS_PER_SEC);
+    printf("Energy:      %.1f J, %.1f W average\n", totals.EnergyUj / 1e6,
+           seconds ? totals.EnergyUj / 1e6 / seconds : 0.0);
+    printf("Peak:        %.1f C\n", peakMilliC / 1000.0);
+    printf("Throttled:   %.2f CPU-s\n", totals.ThrottledTime / 1e7);
+    printf("Delivered:   %.1f %% of demanded work\n",
+           totals.RequestedWork ? 100.0 * (double)totals.DeliveredWork / (double)totals.RequestedWork : 100.0);
+    
+    if (governor) {
+        MAHF_GOVERNOR_STATUS current;
+        
+        if (NT_SUCCESS(SimrunControl(device, IOCTL_MAHF_GET_GOVERNOR, NULL, 0, &current, sizeof(current)))) {
+            printf("Governor:    %llu ticks, %llu raises, %llu lowers\n",
+                   (unsigned long long)current.Stats.Ticks, (unsigned long long)current.Stats.Raises,
+                   (unsigned long long)current.Stats.Lowers);
+        }
+    }
+    
+    if (csv) {
+        fclose(csv);
+    }
+    
+    MahfHostStop();
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,837 @@
+/*
+ * Mahf Firmware CPU Driver - Telemetry Log
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Segment writer with rotation and retention, and the block decoder
+ */
+
+#include "mahf_tlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define TLOG_FENCE()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define TLOG_FENCE()            MemoryBarrier()
+#endif
+
+#define TLOG_VARINT_MAX         10          // Bytes in a 64-bit varint
+#define TLOG_ALIGN(Length)      (((Length) + 7) & ~(ULONG64)7)
+#define TLOG_GROW(Length)       (((Length) + MAHF_TLOG_GROW_BYTES - 1) & ~(ULONG64)(MAHF_TLOG_GROW_BYTES - 1))
+#define TLOG_TICKS_PER_MS       10000
+#define TLOG_MIN_INDEX          64
+#define TLOG_UNIX_EPOCH         116444736000000000ULL   // 1970 in 100 ns since 1601
+
+//
+// Encoding
+//
+
+static ULONG TlogChecksum(const UCHAR *Data, ULONG64 Length)
+{
+    ULONG hash = 2166136261u;
+    
+    for (ULONG64 i = 0; i < Length; i++) {
+        hash = (hash ^ Data[i]) * 16777619u;
+    }
+    
+    return hash;
+}
+
+static PUCHAR TlogPutVarint(PUCHAR Out, ULONG64 Value)
+{
+    while (Value >= 0x80) {
+        *Out++ = (UCHAR)(Value | 0x80);
+        Value >>= 7;
+    }
+    
+    *Out++ = (UCHAR)Value;
+    return Out;
+}
+
+static const UCHAR *TlogGetVarint(const UCHAR *In, const UCHAR *End, PULONG64 Value)
+{
+    ULONG64 value = 0;
+    
+    for (ULONG shift = 0; In < End && shift < 64; shift += 7) {
+        UCHAR byte = *In++;
+        
+        value |= (ULONG64)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *Value = value;
+            return In;
+        }
+    }
+    
+    return NULL;
+}
+
+// Deltas to tokens; a run of zeros becomes one token
+static PUCHAR TlogEncodeDeltas(PUCHAR Out, const LONG64 *Deltas, ULONG Count)
+{
+    ULONG64 run = 0;
+    
+    for (ULONG i = 0; i < Count; i++) {
+        if (Deltas[i] == 0) {
+            run++;
+            continue;
+        }
+        
+        if (run != 0) {
+            Out = TlogPutVarint(Out, (run << 1) | 1);
+            run = 0;
+        }
+        
+        // Zigzag, then the token's tag bit
+        Out = TlogPutVarint(Out, (((ULONG64)Deltas[i] << 1) ^ (ULONG64)(Deltas[i] >> 63)) << 1);
+    }
+    
+    if (run != 0) {
+        Out = TlogPutVarint(Out, (run << 1) | 1);
+    }
+    
+    return Out;
+}
+
+// Tokens back to deltas; NULL if the column is malformed
+static const UCHAR *TlogDecodeDeltas(const UCHAR *In, const UCHAR *End, PLONG64 Deltas, ULONG Count)
+{
+    ULONG i = 0;
+    
+    while (i < Count) {
+        ULONG64 token;
+        
+        In = TlogGetVarint(In, End, &token);
+        if (!In) {
+            return NULL;
+        }
+        
+        if (token & 1) {
+            ULONG64 run = token >> 1;
+            
+            if (run == 0 || run > Count - i) {
+                return NULL;
+            }
+            
+            memset(&Deltas[i], 0, (size_t)run * sizeof(LONG64));
+            i += (ULONG)run;
+        } else {
+            ULONG64 zigzag = token >> 1;
+            
+            Deltas[i++] = (LONG64)(zigzag >> 1) ^ -(LONG64)(zigzag & 1);
+        }
+    }
+    
+    return In;
+}
+
+// Encode the buffered ticks into Scratch; returns the block length
+static ULONG TlogEncodeBlock(PMAHF_TLOG_WRITER Writer)
+{
+    PMAHF_TLOG_BLOCK block = (PMAHF_TLOG_BLOCK)Writer->Scratch;
+    ULONG coreCount = Writer->Config.CoreCount;
+    ULONG ticks = Writer->Ticks;
+    LONG64 deltas[MAHF_TLOG_MAX_TICKS];
+    LONG64 previous = 0;
+    LONG64 previousDelta = 0;
+    PUCHAR out = Writer->Scratch + sizeof(MAHF_TLOG_BLOCK);
+    ULONG length;
+    
+    block->Magic = MAHF_TLOG_BLOCK_MAGIC;
+    block->FirstTime = Writer->Times[0];
+    block->LastTime = Writer->Times[ticks - 1];
+    block->TickCount = ticks;
+    block->CoreCount = coreCount;
+    
+    // Milliseconds from FirstTime, as deltas of deltas
+    block->TimeOffset = (ULONG)(out - Writer->Scratch);
+    
+    for (ULONG t = 0; t < ticks; t++) {
+        LONG64 ms = (LONG64)((Writer->Times[t] - block->FirstTime) / TLOG_TICKS_PER_MS);
+        LONG64 delta = ms - previous;
+        
+        deltas[t] = delta - previousDelta;
+        previous = ms;
+        previousDelta = delta;
+    }
+    
+    out = TlogEncodeDeltas(out, deltas, ticks);
+    
+    for (ULONG m = 0; m < MAHF_TLOG_METRIC_COUNT; m++) {
+        block->MetricOffset[m] = (ULONG)(out - Writer->Scratch);
+        
+        for (ULONG c = 0; c < coreCount; c++) {
+            const MAHF_TLOG_SAMPLE *sample = &Writer->Samples[c];
+            ULONG last = 0;
+            
+            for (ULONG t = 0; t < ticks; t++, sample += coreCount) {
+                deltas[t] = (LONG64)sample->Value[m] - (LONG64)last;
+                last = sample->Value[m];
+            }
+            
+            out = TlogEncodeDeltas(out, deltas, ticks);
+        }
+    }
+    
+    length = (ULONG)TLOG_ALIGN((ULONG64)(out - Writer->Scratch));
+    memset(out, 0, length - (out - Writer->Scratch));
+    
+    block->Length = length;
+    block->Checksum = TlogChecksum(Writer->Scratch + block->TimeOffset, length - block->TimeOffset);
+    
+    return length;
+}
+
+//
+// Segment files
+//
+
+// mahf-YYYYMMDD-HHMMSSmmm.tlog, UTC; names sort in time order
+static VOID TlogSegmentName(ULONG64 Time, char *Name, size_t Length)
+{
+#if defined(_WIN32)
+    FILETIME fileTime;
+    SYSTEMTIME utc;
+    
+    fileTime.dwLowDateTime = (DWORD)Time;
+    fileTime.dwHighDateTime = (DWORD)(Time >> 32);
+    FileTimeToSystemTime(&fileTime, &utc);
+    
+    _snprintf_s(Name, Length, _TRUNCATE, "mahf-%04u%02u%02u-%02u%02u%02u%03u" MAHF_TLOG_EXTENSION,
+                utc.wYear, utc.wMonth, utc.wDay, utc.wHour, utc.wMinute, utc.wSecond,
+                utc.wMilliseconds);
+#else
+    time_t seconds = (time_t)((Time - TLOG_UNIX_EPOCH) / 10000000);
+    struct tm utc;
+    
+    gmtime_r(&seconds, &utc);
+    snprintf(Name, Length, "mahf-%04d%02d%02d-%02d%02d%02d%03u" MAHF_TLOG_EXTENSION,
+             utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+             utc.tm_hour, utc.tm_min, utc.tm_sec,
+             (unsigned)((Time / TLOG_TICKS_PER_MS) % 1000));
+#endif
+}
+
+// Delete segments that started more than a segment duration before the
+// retention window, so everything in them is older than the window
+static VOID TlogPrune(PMAHF_TLOG_WRITER Writer, ULONG64 Now)
+{
+    ULONG64 span = Writer->Config.RetainDuration + Writer->Config.SegmentDuration;
+    char cutoff[64];
+    char path[512];
+    
+    if (Writer->Config.RetainDuration == 0 || Now <= TLOG_UNIX_EPOCH + span) {
+        return;
+    }
+    
+    TlogSegmentName(Now - span, cutoff, sizeof(cutoff));
+    
+#if defined(_WIN32)
+    {
+        WIN32_FIND_DATAA find;
+        HANDLE search;
+        
+        _snprintf_s(path, sizeof(path), _TRUNCATE, "%s\\mahf-*" MAHF_TLOG_EXTENSION, Writer->Directory);
+        
+        search = FindFirstFileA(path, &find);
+        if (search == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        
+        do {
+            if (strlen(find.cFileName) == strlen(cutoff) && strcmp(find.cFileName, cutoff) < 0) {
+                _snprintf_s(path, sizeof(path), _TRUNCATE, "%s\\%s", Writer->Directory, find.cFileName);
+                DeleteFileA(path);
+            }
+        } while (FindNextFileA(search, &find));
+        
+        FindClose(search);
+    }
+#else
+    {
+        DIR *directory = opendir(Writer->Directory);
+        struct dirent *entry;
+        
+        if (!directory) {
+            return;
+        }
+        
+        while ((entry = readdir(directory)) != NULL) {
+            if (strncmp(entry->d_name, "mahf-", 5) == 0 &&
+                strlen(entry->d_name) == strlen(cutoff) && strcmp(entry->d_name, cutoff) < 0) {
+                snprintf(path, sizeof(path), "%s/%s", Writer->Directory, entry->d_name);
+                unlink(path);
+            }
+        }
+        
+        closedir(directory);
+    }
+#endif
+}
+
+// Trim the segment to its committed data and close it
+static VOID TlogCloseSegment(PMAHF_TLOG_WRITER Writer)
+{
+    PMAHF_TLOG_HEADER header = (PMAHF_TLOG_HEADER)Writer->Base;
+    ULONG64 end;
+    
+    if (!Writer->Base) {
+        return;
+    }
+    
+    header->Closed = TRUE;
+    end = header->DataEnd;
+    
+#if defined(_WIN32)
+    {
+        LARGE_INTEGER position;
+        
+        UnmapViewOfFile(Writer->Base);
+        CloseHandle(Writer->Mapping);
+        
+        position.QuadPart = (LONGLONG)end;
+        if (SetFilePointerEx(Writer->File, position, NULL, FILE_BEGIN)) {
+            SetEndOfFile(Writer->File);
+        }
+        
+        CloseHandle(Writer->File);
+        Writer->Mapping = NULL;
+        Writer->File = INVALID_HANDLE_VALUE;
+    }
+#else
+    munmap(Writer->Base, (size_t)Writer->Size);
+    if (ftruncate(Writer->File, (off_t)end) != 0) {
+        // Left at its grown size; readers stop at DataEnd
+    }
+    close(Writer->File);
+    Writer->File = -1;
+#endif
+    
+    Writer->Base = NULL;
+    Writer->Size = 0;
+}
+
+// Extend the open segment's file to Size bytes and map all of it again.
+// On failure the segment is closed as it stands, like one left by a crash.
+static BOOLEAN TlogMapSegment(PMAHF_TLOG_WRITER Writer, ULONG64 Size)
+{
+#if defined(_WIN32)
+    if (Writer->Base) {
+        UnmapViewOfFile(Writer->Base);
+        CloseHandle(Writer->Mapping);
+    }
+    
+    // A mapping larger than the file extends it
+    Writer->Mapping = CreateFileMappingA(Writer->File, NULL, PAGE_READWRITE,
+                                         (DWORD)(Size >> 32), (DWORD)Size, NULL);
+    Writer->Base = Writer->Mapping ?
+                   (PUCHAR)MapViewOfFile(Writer->Mapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    
+    if (!Writer->Base) {
+        if (Writer->Mapping) {
+            CloseHandle(Writer->Mapping);
+        }
+        CloseHandle(Writer->File);
+        Writer->Mapping = NULL;
+        Writer->File = INVALID_HANDLE_VALUE;
+        Writer->Size = 0;
+        return FALSE;
+    }
+#else
+    if (Writer->Base) {
+        munmap(Writer->Base, (size_t)Writer->Size);
+    }
+    
+    if (ftruncate(Writer->File, (off_t)Size) != 0 ||
+        (Writer->Base = (PUCHAR)mmap(NULL, (size_t)Size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, Writer->File, 0)) == MAP_FAILED) {
+        Writer->Base = NULL;
+        close(Writer->File);
+        Writer->File = -1;
+        Writer->Size = 0;
+        return FALSE;
+    }
+#endif
+    
+    Writer->Size = Size;
+    return TRUE;
+}
+
+// Create a segment starting at Time, with its index sized for the
+// configured rotation and room for the index alone; blocks grow it
+static BOOLEAN TlogOpenSegment(PMAHF_TLOG_WRITER Writer, ULONG64 Time)
+{
+    PMAHF_TLOG_CONFIG config = &Writer->Config;
+    PMAHF_TLOG_HEADER header;
+    ULONG64 blockTime = (ULONG64)config->BlockTicks * config->PeriodMs * TLOG_TICKS_PER_MS;
+    ULONG64 capacity;
+    ULONG64 dataOffset;
+    char name[64];
+    char path[512];
+    
+    // Room for twice the expected number of blocks, in case the period
+    // drifts or the service flushes short blocks
+    capacity = config->SegmentDuration ? config->SegmentDuration / blockTime * 2 : 0;
+    capacity = max(capacity, config->SegmentBytes / 4096);
+    capacity = min(capacity, config->SegmentBytes / 4 / sizeof(MAHF_TLOG_INDEX_ENTRY));
+    capacity = max(capacity, TLOG_MIN_INDEX);
+    dataOffset = TLOG_ALIGN(sizeof(MAHF_TLOG_HEADER) + capacity * sizeof(MAHF_TLOG_INDEX_ENTRY));
+    
+    TlogSegmentName(Time, name, sizeof(name));
+    
+#if defined(_WIN32)
+    _snprintf_s(path, sizeof(path), _TRUNCATE, "%s\\%s", Writer->Directory, name);
+    
+    Writer->File = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                               FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                               CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (Writer->File == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+    
+    if (!TlogMapSegment(Writer, min(TLOG_GROW(dataOffset), config->SegmentBytes))) {
+        DeleteFileA(path);
+        return FALSE;
+    }
+#else
+    snprintf(path, sizeof(path), "%s/%s", Writer->Directory, name);
+    
+    Writer->File = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (Writer->File < 0) {
+        return FALSE;
+    }
+    
+    if (!TlogMapSegment(Writer, min(TLOG_GROW(dataOffset), config->SegmentBytes))) {
+        unlink(path);
+        return FALSE;
+    }
+#endif
+    
+    Writer->SegmentStart = Time;
+    
+    // The new file reads as zeros, so only the header needs writing
+    header = (PMAHF_TLOG_HEADER)Writer->Base;
+    header->Magic = MAHF_TLOG_MAGIC;
+    header->Version = MAHF_TLOG_VERSION;
+    header->CoreCount = config->CoreCount;
+    header->PeriodMs = config->PeriodMs;
+    header->StartTime = Time;
+    header->IndexOffset = sizeof(MAHF_TLOG_HEADER);
+    header->IndexCapacity = (ULONG)capacity;
+    header->DataOffset = dataOffset;
+    header->DataEnd = header->DataOffset;
+    header->BlockCount = 0;
+    header->Closed = FALSE;
+    
+    TlogPrune(Writer, Time);
+    
+    return TRUE;
+}
+
+//
+// Writer
+//
+
+BOOLEAN MahfTlogOpen(PMAHF_TLOG_WRITER Writer, const MAHF_TLOG_CONFIG *Config)
+{
+    ULONG64 minimum;
+    
+    memset(Writer, 0, sizeof(MAHF_TLOG_WRITER));
+#if defined(_WIN32)
+    Writer->File = INVALID_HANDLE_VALUE;
+#else
+    Writer->File = -1;
+#endif
+    
+    if (!Config || !Config->Directory ||
+        Config->CoreCount == 0 || Config->CoreCount > MAHF_TLOG_MAX_CORES ||
+        Config->BlockTicks == 0 || Config->BlockTicks > MAHF_TLOG_MAX_TICKS ||
+        Config->PeriodMs == 0) {
+        return FALSE;
+    }
+    
+    Writer->Config = *Config;
+    strncpy(Writer->Directory, Config->Directory, sizeof(Writer->Directory) - 1);
+    Writer->Config.Directory = Writer->Directory;
+    
+    // Every token is at most one varint, one per value in the worst case
+    Writer->ScratchSize = (ULONG)TLOG_ALIGN(sizeof(MAHF_TLOG_BLOCK) +
+        (ULONG64)Config->BlockTicks * (1 + Config->CoreCount * MAHF_TLOG_METRIC_COUNT) * TLOG_VARINT_MAX);
+    
+    // The index takes at most a quarter of a segment, so this leaves room
+    // for at least one worst-case block after it
+    minimum = sizeof(MAHF_TLOG_HEADER) + TLOG_MIN_INDEX * sizeof(MAHF_TLOG_INDEX_ENTRY) +
+              Writer->ScratchSize;
+    Writer->Config.SegmentBytes = TLOG_ALIGN(max(Config->SegmentBytes, minimum * 4));
+    
+    Writer->Samples = (PMAHF_TLOG_SAMPLE)calloc((size_t)Config->BlockTicks * Config->CoreCount,
+                                                sizeof(MAHF_TLOG_SAMPLE));
+    Writer->Held = (PMAHF_TLOG_SAMPLE)calloc(Config->CoreCount, sizeof(MAHF_TLOG_SAMPLE));
+    Writer->Scratch = (PUCHAR)malloc(Writer->ScratchSize);
+    
+    if (!Writer->Samples || !Writer->Held || !Writer->Scratch) {
+        MahfTlogClose(Writer);
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+// Time is UTC in 100 ns units; Cores holds CoreCount samples
+BOOLEAN MahfTlogAppend(PMAHF_TLOG_WRITER Writer, ULONG64 Time, const MAHF_TLOG_SAMPLE *Cores)
+{
+    PMAHF_TLOG_CONFIG config = &Writer->Config;
+    PMAHF_TLOG_SAMPLE samples;
+    BOOLEAN ok = TRUE;
+    
+    if (!Writer->Samples) {
+        return FALSE;
+    }
+    
+    // A clock set backwards starts a new block, keeping the index sorted
+    // within the block at least
+    if (Writer->Ticks != 0 && Time < Writer->Times[Writer->Ticks - 1]) {
+        ok = MahfTlogFlush(Writer);
+    }
+    
+    Writer->Times[Writer->Ticks] = Time;
+    samples = &Writer->Samples[(size_t)Writer->Ticks * config->CoreCount];
+    
+    // Quantize, then keep the held value unless the new one is outside the
+    // deadband around it
+    for (ULONG c = 0; c < config->CoreCount; c++) {
+        for (ULONG m = 0; m < MAHF_TLOG_METRIC_COUNT; m++) {
+            ULONG value = Cores[c].Value[m];
+            ULONG held = Writer->Held[c].Value[m];
+            
+            if (config->Quantum[m] > 1) {
+                value = (ULONG)(((ULONG64)value + config->Quantum[m] / 2) / config->Quantum[m] *
+                                config->Quantum[m]);
+            }
+            
+            if (Writer->Primed && (value > held ? value - held : held - value) <= config->Deadband[m]) {
+                value = held;
+            }
+            
+            samples[c].Value[m] = value;
+        }
+    }
+    
+    memcpy(Writer->Held, samples, (size_t)config->CoreCount * sizeof(MAHF_TLOG_SAMPLE));
+    Writer->Primed = TRUE;
+    Writer->Ticks++;
+    
+    if (Writer->Ticks == config->BlockTicks) {
+        ok = MahfTlogFlush(Writer) && ok;
+    }
+    
+    return ok;
+}
+
+// Write the buffered ticks out as one block, rotating first if needed.
+// The buffered ticks are dropped either way.
+BOOLEAN MahfTlogFlush(PMAHF_TLOG_WRITER Writer)
+{
+    PMAHF_TLOG_HEADER header;
+    PMAHF_TLOG_INDEX_ENTRY entry;
+    ULONG length;
+    ULONG64 firstTime;
+    
+    if (Writer->Ticks == 0) {
+        return TRUE;
+    }
+    
+    length = TlogEncodeBlock(Writer);
+    firstTime = Writer->Times[0];
+    Writer->Ticks = 0;
+    
+    header = (PMAHF_TLOG_HEADER)Writer->Base;
+    
+    if (header &&
+        (header->DataEnd + length > Writer->Config.SegmentBytes ||
+         header->BlockCount >= header->IndexCapacity ||
+         (Writer->Config.SegmentDuration != 0 &&
+          firstTime >= Writer->SegmentStart + Writer->Config.SegmentDuration))) {
+        TlogCloseSegment(Writer);
+        header = NULL;
+    }
+    
+    if (!header) {
+        if (!TlogOpenSegment(Writer, firstTime)) {
+            return FALSE;
+        }
+        
+        header = (PMAHF_TLOG_HEADER)Writer->Base;
+    }
+    
+    if (header->DataEnd + length > Writer->Size) {
+        if (!TlogMapSegment(Writer, min(TLOG_GROW(header->DataEnd + length), Writer->Config.SegmentBytes))) {
+            return FALSE;
+        }
+        
+        header = (PMAHF_TLOG_HEADER)Writer->Base;
+    }
+    
+    // Block, then its index entry, then the counts that make both visible
+    memcpy(Writer->Base + header->DataEnd, Writer->Scratch, length);
+    
+    entry = (PMAHF_TLOG_INDEX_ENTRY)(Writer->Base + header->IndexOffset) + header->BlockCount;
+    entry->FirstTime = firstTime;
+    entry->Offset = header->DataEnd;
+    
+    TLOG_FENCE();
+    header->DataEnd += length;
+    header->BlockCount++;
+    
+    // Push the block toward the disk so a crash loses at most the ticks
+    // still buffered
+#if defined(_WIN32)
+    FlushViewOfFile(Writer->Base + entry->Offset, length);
+    FlushViewOfFile(Writer->Base, header->DataOffset);
+#else
+    msync(Writer->Base, (size_t)header->DataEnd, MS_ASYNC);
+#endif
+    
+    return TRUE;
+}
+
+VOID MahfTlogClose(PMAHF_TLOG_WRITER Writer)
+{
+    if (Writer->Samples) {
+        MahfTlogFlush(Writer);
+    }
+    
+    TlogCloseSegment(Writer);
+    
+    free(Writer->Samples);
+    free(Writer->Held);
+    free(Writer->Scratch);
+    Writer->Samples = NULL;
+    Writer->Held = NULL;
+    Writer->Scratch = NULL;
+}
+
+//
+// Reader
+//
+
+BOOLEAN MahfTlogMap(const char *Path, PMAHF_TLOG_FILE File)
+{
+    const MAHF_TLOG_HEADER *header;
+    
+    memset(File, 0, sizeof(MAHF_TLOG_FILE));
+    
+#if defined(_WIN32)
+    {
+        LARGE_INTEGER size;
+        
+        // Shared for writing: the service may still be appending
+        File->File = CreateFileA(Path, GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (File->File == INVALID_HANDLE_VALUE) {
+            return FALSE;
+        }
+        
+        if (!GetFileSizeEx(File->File, &size) || size.QuadPart < (LONGLONG)sizeof(MAHF_TLOG_HEADER)) {
+            CloseHandle(File->File);
+            return FALSE;
+        }
+        
+        File->Size = (ULONG64)size.QuadPart;
+        File->Mapping = CreateFileMappingA(File->File, NULL, PAGE_READONLY, 0, 0, NULL);
+        File->Base = File->Mapping ?
+                     (const UCHAR *)MapViewOfFile(File->Mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        
+        if (!File->Base) {
+            if (File->Mapping) {
+                CloseHandle(File->Mapping);
+            }
+            CloseHandle(File->File);
+            return FALSE;
+        }
+    }
+#else
+    {
+        struct stat status;
+        int fd = open(Path, O_RDONLY);
+        
+        if (fd < 0) {
+            return FALSE;
+        }
+        
+        if (fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(MAHF_TLOG_HEADER)) {
+            close(fd);
+            return FALSE;
+        }
+        
+        File->Size = (ULONG64)status.st_size;
+        File->Base = (const UCHAR *)mmap(NULL, (size_t)File->Size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        
+        if (File->Base == MAP_FAILED) {
+            File->Base = NULL;
+            return FALSE;
+        }
+        
+        madvise((void *)File->Base, (size_t)File->Size, MADV_SEQUENTIAL);
+    }
+#endif
+    
+    header = (const MAHF_TLOG_HEADER *)File->Base;
+    
+    if (header->Magic != MAHF_TLOG_MAGIC || header->Version != MAHF_TLOG_VERSION ||
+        header->CoreCount == 0 || header->CoreCount > MAHF_TLOG_MAX_CORES ||
+        header->IndexOffset + (ULONG64)header->IndexCapacity * sizeof(MAHF_TLOG_INDEX_ENTRY) >
+            File->Size) {
+        MahfTlogUnmap(File);
+        return FALSE;
+    }
+    
+    // Counts first; the index entries and blocks they cover were written
+    // before them
+    File->BlockCount = min(header->BlockCount, header->IndexCapacity);
+    TLOG_FENCE();
+    
+    File->Header = header;
+    File->Index = (const MAHF_TLOG_INDEX_ENTRY *)(File->Base + header->IndexOffset);
+    
+    return TRUE;
+}
+
+VOID MahfTlogUnmap(PMAHF_TLOG_FILE File)
+{
+#if defined(_WIN32)
+    if (File->Base) {
+        UnmapViewOfFile(File->Base);
+    }
+    if (File->Mapping) {
+        CloseHandle(File->Mapping);
+    }
+    if (File->File && File->File != INVALID_HANDLE_VALUE) {
+        CloseHandle(File->File);
+    }
+#else
+    if (File->Base) {
+        munmap((void *)File->Base, (size_t)File->Size);
+    }
+#endif
+    
+    memset(File, 0, sizeof(MAHF_TLOG_FILE));
+}
+
+// Binary search for the last block starting at or before Time; that block
+// may still hold samples after Time
+ULONG MahfTlogSeek(const MAHF_TLOG_FILE *File, ULONG64 Time)
+{
+    ULONG low = 0;
+    ULONG high = File->BlockCount;
+    
+    while (low < high) {
+        ULONG middle = low + (high - low) / 2;
+        
+        if (File->Index[middle].FirstTime <= Time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    return low ? low - 1 : 0;
+}
+
+const MAHF_TLOG_BLOCK *MahfTlogBlock(const MAHF_TLOG_FILE *File, ULONG Index)
+{
+    const MAHF_TLOG_BLOCK *block;
+    ULONG64 offset;
+    
+    if (Index >= File->BlockCount) {
+        return NULL;
+    }
+    
+    offset = File->Index[Index].Offset;
+    if (offset + sizeof(MAHF_TLOG_BLOCK) > File->Size) {
+        return NULL;
+    }
+    
+    block = (const MAHF_TLOG_BLOCK *)(File->Base + offset);
+    
+    if (block->Magic != MAHF_TLOG_BLOCK_MAGIC ||
+        block->Length < sizeof(MAHF_TLOG_BLOCK) || offset + block->Length > File->Size ||
+        block->TickCount == 0 || block->TickCount > MAHF_TLOG_MAX_TICKS ||
+        block->CoreCount != File->Header->CoreCount ||
+        block->TimeOffset < sizeof(MAHF_TLOG_BLOCK) || block->TimeOffset > block->Length) {
+        return NULL;
+    }
+    
+    for (ULONG m = 0; m < MAHF_TLOG_METRIC_COUNT; m++) {
+        if (block->MetricOffset[m] < block->TimeOffset || block->MetricOffset[m] > block->Length) {
+            return NULL;
+        }
+    }
+    
+    if (TlogChecksum((const UCHAR *)block + block->TimeOffset, block->Length - block->TimeOffset) !=
+        block->Checksum) {
+        return NULL;
+    }
+    
+    return block;
+}
+
+BOOLEAN MahfTlogDecodeTimes(const MAHF_TLOG_BLOCK *Block, PULONG64 Times)
+{
+    const UCHAR *in = (const UCHAR *)Block + Block->TimeOffset;
+    const UCHAR *end = (const UCHAR *)Block + Block->Length;
+    LONG64 deltas[MAHF_TLOG_MAX_TICKS];
+    LONG64 ms = 0;
+    LONG64 delta = 0;
+    
+    if (!TlogDecodeDeltas(in, end, deltas, Block->TickCount)) {
+        return FALSE;
+    }
+    
+    for (ULONG t = 0; t < Block->TickCount; t++) {
+        delta += deltas[t];
+        ms += delta;
+        Times[t] = Block->FirstTime + (ULONG64)ms * TLOG_TICKS_PER_MS;
+    }
+    
+    return TRUE;
+}
+
+BOOLEAN MahfTlogDecodeMetric(const MAHF_TLOG_BLOCK *Block, ULONG Metric, PULONG Values)
+{
+    const UCHAR *in;
+    const UCHAR *end = (const UCHAR *)Block + Block->Length;
+    LONG64 deltas[MAHF_TLOG_MAX_TICKS];
+    ULONG ticks = Block->TickCount;
+    
+    if (Metric >= MAHF_TLOG_METRIC_COUNT) {
+        return FALSE;
+    }
+    
+    in = (const UCHAR *)Block + Block->MetricOffset[Metric];
+    
+    for (ULONG c = 0; c < Block->CoreCount; c++, Values += ticks) {
+        ULONG value = 0;
+        
+        in = TlogDecodeDeltas(in, end, deltas, ticks);
+        if (!in) {
+            return FALSE;
+        }
+        
+        for (ULONG t = 0; t < ticks; t++) {
+            value += (ULONG)deltas[t];
+            Values[t] = value;
+        }
+    }
+    
+    return TRUE;
+}
\ No newline at end of file
@@ -0,0 +1,182 @@
+/*
+ * Mahf Firmware CPU Driver - Telemetry Log
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * On-disk per-core history written by the service and read back by
+ * mahf_tlogdump, on Windows or on a Linux analysis machine
+ */
+
+#ifndef _MAHF_TLOG_H_
+#define _MAHF_TLOG_H_
+
+#if defined(MAHF_HOST)
+#include "mahf_host.h"
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+// Host builds without the Windows headers
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONG64, *PLONG64;
+typedef uint64_t ULONG64, *PULONG64;
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN;
+typedef void VOID, *PVOID;
+
+#define TRUE    1
+#define FALSE   0
+
+#ifndef min
+#define min(a, b)   (((a) < (b)) ? (a) : (b))
+#define max(a, b)   (((a) > (b)) ? (a) : (b))
+#endif
+#endif
+
+// Layout
+// A log is a directory of segment files, one per rotation, named
+// mahf-YYYYMMDD-HHMMSSmmm.tlog after their UTC start time so that a directory
+// listing sorts them. A segment is a MAHF_TLOG_HEADER, a fixed-size block
+// index, then blocks. Each block covers up to BlockTicks consecutive ticks
+// and stands alone (a keyframe): a time column, then one column group per
+// metric holding every core's column in turn.
+//
+// Columns are delta-encoded from zero and written as varint tokens:
+//   (zigzag(delta) << 1)       a non-zero delta
+//   (run << 1) | 1             run zero deltas
+// so a value that holds still costs one token per block. Times are kept in
+// milliseconds from the block's FirstTime and encoded as deltas of deltas,
+// which a steady sampling period turns into a single zero run.
+//
+// The writer can round each value to a quantum and hold it until it moves
+// by more than a deadband, so that sensor noise encodes as zero runs.
+//
+// The writer grows the segment's file and mapping MAHF_TLOG_GROW_BYTES at a
+// time, commits a block by bumping DataEnd and BlockCount after its bytes
+// are in place, and trims the file on close. A segment that was not closed
+// is at most one growth step past its data; readers stop at BlockCount.
+#define MAHF_TLOG_MAGIC         0x474C544D  // 'MTLG'
+#define MAHF_TLOG_VERSION       1
+#define MAHF_TLOG_BLOCK_MAGIC   0x4B4C4254  // 'TBLK'
+#define MAHF_TLOG_MAX_CORES     256
+#define MAHF_TLOG_MAX_TICKS     1024        // Per block
+#define MAHF_TLOG_GROW_BYTES    0x100000    // Segment growth step
+#define MAHF_TLOG_EXTENSION     ".tlog"
+
+// Metric column groups, in block order after the time column
+#define MAHF_TLOG_FREQUENCY     0           // MHz
+#define MAHF_TLOG_TEMPERATURE   1           // Celsius
+#define MAHF_TLOG_UTILIZATION   2           // Percent
+#define MAHF_TLOG_STATE         3           // PERFORMANCE_STATE_*
+#define MAHF_TLOG_METRIC_COUNT  4
+
+// One core at one tick
+typedef struct _MAHF_TLOG_SAMPLE {
+    ULONG Value[MAHF_TLOG_METRIC_COUNT];
+} MAHF_TLOG_SAMPLE, *PMAHF_TLOG_SAMPLE;
+
+typedef struct _MAHF_TLOG_HEADER {
+    ULONG Magic;
+    ULONG Version;
+    ULONG CoreCount;
+    ULONG PeriodMs;                 // Nominal; the time column is authoritative
+    ULONG64 StartTime;              // UTC, 100 ns units since 1601
+    ULONG IndexOffset;              // Bytes from the start of the file
+    ULONG IndexCapacity;            // Entries
+    ULONG64 DataOffset;             // First block
+    volatile ULONG64 DataEnd;       // End of the last committed block
+    volatile ULONG BlockCount;      // Committed blocks and index entries
+    ULONG Closed;                   // Set by a clean close
+} MAHF_TLOG_HEADER, *PMAHF_TLOG_HEADER;
+
+typedef struct _MAHF_TLOG_INDEX_ENTRY {
+    ULONG64 FirstTime;              // Of the block, UTC 100 ns
+    ULONG64 Offset;                 // Bytes from the start of the file
+} MAHF_TLOG_INDEX_ENTRY, *PMAHF_TLOG_INDEX_ENTRY;
+
+typedef struct _MAHF_TLOG_BLOCK {
+    ULONG Magic;
+    ULONG Length;                   // Header and columns
+    ULONG64 FirstTime;              // UTC, 100 ns units
+    ULONG64 LastTime;
+    ULONG TickCount;
+    ULONG CoreCount;
+    ULONG TimeOffset;               // Column offsets from the block start
+    ULONG MetricOffset[MAHF_TLOG_METRIC_COUNT];
+    ULONG Checksum;                 // FNV-1a over the column bytes
+} MAHF_TLOG_BLOCK, *PMAHF_TLOG_BLOCK;
+
+// Writer
+// Not thread-safe; the service appends from one thread.
+typedef struct _MAHF_TLOG_CONFIG {
+    const char *Directory;
+    ULONG CoreCount;
+    ULONG PeriodMs;
+    ULONG BlockTicks;               // Ticks per block, at most MAHF_TLOG_MAX_TICKS
+    ULONG64 SegmentBytes;           // Rotate when the next block may not fit
+    ULONG64 SegmentDuration;        // Rotate after this long, 100 ns units
+    ULONG64 RetainDuration;         // Delete older segments, 0 keeps all
+    ULONG Quantum[MAHF_TLOG_METRIC_COUNT];   // Round to a multiple, 0 keeps values exact
+    ULONG Deadband[MAHF_TLOG_METRIC_COUNT];  // Hold a value until it moves by more, 0 for none
+} MAHF_TLOG_CONFIG, *PMAHF_TLOG_CONFIG;
+
+typedef struct _MAHF_TLOG_WRITER {
+    MAHF_TLOG_CONFIG Config;
+    char Directory[260];
+    
+    // Open segment
+#if defined(_WIN32)
+    HANDLE File;
+    HANDLE Mapping;
+#else
+    int File;
+#endif
+    PUCHAR Base;
+    ULONG64 Size;
+    ULONG64 SegmentStart;
+    
+    // Ticks buffered for the next block
+    ULONG Ticks;
+    ULONG64 Times[MAHF_TLOG_MAX_TICKS];
+    PMAHF_TLOG_SAMPLE Samples;      // [tick * CoreCount + core]
+    PMAHF_TLOG_SAMPLE Held;         // Last value written per core, for the deadband
+    BOOLEAN Primed;                 // Held is valid
+    PUCHAR Scratch;                 // Worst-case encoded block
+    ULONG ScratchSize;
+} MAHF_TLOG_WRITER, *PMAHF_TLOG_WRITER;
+
+BOOLEAN MahfTlogOpen(PMAHF_TLOG_WRITER Writer, const MAHF_TLOG_CONFIG *Config);
+BOOLEAN MahfTlogAppend(PMAHF_TLOG_WRITER Writer, ULONG64 Time, const MAHF_TLOG_SAMPLE *Cores);
+BOOLEAN MahfTlogFlush(PMAHF_TLOG_WRITER Writer);
+VOID MahfTlogClose(PMAHF_TLOG_WRITER Writer);
+
+// Reader
+// A segment is mapped read-only; blocks are decoded straight out of the
+// mapping, one metric at a time.
+typedef struct _MAHF_TLOG_FILE {
+#if defined(_WIN32)
+    HANDLE File;
+    HANDLE Mapping;
+#endif
+    const UCHAR *Base;
+    ULONG64 Size;
+    const MAHF_TLOG_HEADER *Header;
+    const MAHF_TLOG_INDEX_ENTRY *Index;
+    ULONG BlockCount;
+} MAHF_TLOG_FILE, *PMAHF_TLOG_FILE;
+
+BOOLEAN MahfTlogMap(const char *Path, PMAHF_TLOG_FILE File);
+VOID MahfTlogUnmap(PMAHF_TLOG_FILE File);
+
+// First block that can hold samples at or after Time
+ULONG MahfTlogSeek(const MAHF_TLOG_FILE *File, ULONG64 Time);
+
+// NULL if the block is truncated or fails its checksum
+const MAHF_TLOG_BLOCK *MahfTlogBlock(const MAHF_TLOG_FILE *File, ULONG Index);
+
+// Times receives TickCount entries; Values receives CoreCount * TickCount,
+// core-major ([core * TickCount + tick])
+BOOLEAN MahfTlogDecodeTimes(const MAHF_TLOG_BLOCK *Block, PULONG64 Times);
+BOOLEAN MahfTlogDecodeMetric(const MAHF_TLOG_BLOCK *Block, ULONG Metric, PULONG Values);
+
+#endif // _MAHF_TLOG_H_
\ No newline at end of file
@@ -0,0 +1,298 @@
+/*
+ * Mahf Firmware CPU Driver - Telemetry Log Reader
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Dumps or summarizes the service's telemetry log segments over a time range
+ *
+ *   mahf_tlogdump [--from T] [--to T] [--core N] [--stats] segment.tlog...
+ *
+ * T is UTC, YYYY-MM-DDTHH:MM:SS. Without --stats every sample is printed as
+ * CSV; with it, each core's minimum, mean and maximum per metric and the
+ * scan rate. Segments may be given in any order.
+ */
+
+#include "mahf_tlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DUMP_UNIX_EPOCH         116444736000000000ULL
+#define DUMP_ALL_CORES          ((ULONG)-1)
+
+static const char *MetricNames[MAHF_TLOG_METRIC_COUNT] = {
+    "frequency", "temperature", "utilization", "state"
+};
+
+typedef struct _DUMP_STATS {
+    ULONG64 Sum[MAHF_TLOG_MAX_CORES][MAHF_TLOG_METRIC_COUNT];
+    ULONG Min[MAHF_TLOG_MAX_CORES][MAHF_TLOG_METRIC_COUNT];
+    ULONG Max[MAHF_TLOG_MAX_CORES][MAHF_TLOG_METRIC_COUNT];
+    ULONG64 Ticks;
+    ULONG CoreCount;
+    ULONG64 Bytes;
+    ULONG64 Values;
+    ULONG64 Blocks;
+    ULONG64 BadBlocks;
+} DUMP_STATS, *PDUMP_STATS;
+
+static DUMP_STATS Stats;
+static ULONG64 Times[MAHF_TLOG_MAX_TICKS];
+static ULONG Values[MAHF_TLOG_METRIC_COUNT][MAHF_TLOG_MAX_CORES * MAHF_TLOG_MAX_TICKS];
+
+static double DumpClock(VOID)
+{
+    struct timespec now;
+    
+    timespec_get(&now, TIME_UTC);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// YYYY-MM-DDTHH:MM:SS, UTC, to 100 ns units since 1601
+static BOOLEAN DumpParseTime(const char *Text, PULONG64 Time)
+{
+    struct tm utc;
+    time_t seconds;
+    
+    memset(&utc, 0, sizeof(utc));
+    
+    if (sscanf(Text, "%d-%d-%dT%d:%d:%d", &utc.tm_year, &utc.tm_mon, &utc.tm_mday,
+               &utc.tm_hour, &utc.tm_min, &utc.tm_sec) != 6) {
+        return FALSE;
+    }
+    
+    utc.tm_year -= 1900;
+    utc.tm_mon -= 1;
+    
+#if defined(_WIN32)
+    seconds = _mkgmtime(&utc);
+#else
+    seconds = timegm(&utc);
+#endif
+    
+    if (seconds < 0) {
+        return FALSE;
+    }
+    
+    *Time = (ULONG64)seconds * 10000000 + DUMP_UNIX_EPOCH;
+    return TRUE;
+}
+
+static VOID DumpFormatTime(ULONG64 Time, char *Text, size_t Length)
+{
+    time_t seconds = (time_t)((Time - DUMP_UNIX_EPOCH) / 10000000);
+    struct tm utc;
+    
+#if defined(_WIN32)
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    
+    snprintf(Text, Length, "%04d-%02d-%02dT%02d:%02d:%02d.%03u",
+             utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+             utc.tm_hour, utc.tm_min, utc.tm_sec,
+             (unsigned)((Time / 10000) % 1000));
+}
+
+// Segment names carry their start time, so a name sort is a time sort
+static int DumpCompareNames(const void *Left, const void *Right)
+{
+    const char *left = *(const char * const *)Left;
+    const char *right = *(const char * const *)Right;
+    const char *leftName = strrchr(left, '/');
+    const char *rightName = strrchr(right, '/');
+    
+#if defined(_WIN32)
+    leftName = strrchr(leftName ? leftName : left, '\\');
+    rightName = strrchr(rightName ? rightName : right, '\\');
+#endif
+    
+    return strcmp(leftName ? leftName + 1 : left, rightName ? rightName + 1 : right);
+}
+
+static VOID DumpBlock(const MAHF_TLOG_BLOCK *Block, ULONG64 From, ULONG64 To, ULONG Core, BOOLEAN Summary)
+{
+    ULONG ticks = Block->TickCount;
+    ULONG first = (Core == DUMP_ALL_CORES) ? 0 : Core;
+    ULONG last = (Core == DUMP_ALL_CORES) ? Block->CoreCount : min(Core + 1, Block->CoreCount);
+    char text[48];
+    
+    for (ULONG t = 0; t < ticks; t++) {
+        if (Times[t] < From || Times[t] > To) {
+            continue;
+        }
+        
+        if (Summary) {
+            for (ULONG c = first; c < last; c++) {
+                for (ULONG m = 0; m < MAHF_TLOG_METRIC_COUNT; m++) {
+                    ULONG value = Values[m][c * ticks + t];
+                    
+                    Stats.Sum[c][m] += value;
+                    Stats.Min[c][m] = min(Stats.Min[c][m], value);
+                    Stats.Max[c][m] = max(Stats.Max[c][m], value);
+                }
+            }
+            
+            Stats.Ticks++;
+            continue;
+        }
+        
+        DumpFormatTime(Times[t], text, sizeof(text));
+        
+        for (ULONG c = first; c < last; c++) {
+            printf("%s,%u,%u,%u,%u,%u\n", text, c,
+                   Values[MAHF_TLOG_FREQUENCY][c * ticks + t],
+                   Values[MAHF_TLOG_TEMPERATURE][c * ticks + t],
+                   Values[MAHF_TLOG_UTILIZATION][c * ticks + t],
+                   Values[MAHF_TLOG_STATE][c * ticks + t]);
+        }
+    }
+}
+
+static VOID DumpSegment(const char *Path, ULONG64 From, ULONG64 To, ULONG Core, BOOLEAN Summary)
+{
+    MAHF_TLOG_FILE file;
+    
+    if (!MahfTlogMap(Path, &file)) {
+        fprintf(stderr, "%s: not a telemetry log\n", Path);
+        return;
+    }
+    
+    if (Stats.CoreCount == 0) {
+        Stats.CoreCount = file.Header->CoreCount;
+    } else if (Stats.CoreCount != file.Header->CoreCount) {
+        fprintf(stderr, "%s: %u cores, expected %u; skipped\n",
+                Path, file.Header->CoreCount, Stats.CoreCount);
+        MahfTlogUnmap(&file);
+        return;
+    }
+    
+    for (ULONG i = MahfTlogSeek(&file, From); i < file.BlockCount; i++) {
+        const MAHF_TLOG_BLOCK *block;
+        
+        if (file.Index[i].FirstTime > To) {
+            break;
+        }
+        
+        block = MahfTlogBlock(&file, i);
+        
+        if (!block || !MahfTlogDecodeTimes(block, Times)) {
+            Stats.BadBlocks++;
+            continue;
+        }
+        
+        if (block->LastTime < From) {
+            continue;
+        }
+        
+        for (ULONG m = 0; m < MAHF_TLOG_METRIC_COUNT; m++) {
+            if (!MahfTlogDecodeMetric(block, m, Values[m])) {
+                Stats.BadBlocks++;
+                block = NULL;
+                break;
+            }
+        }
+        
+        if (block) {
+            DumpBlock(block, From, To, Core, Summary);
+            Stats.Bytes += block->Length;
+            Stats.Values += (ULONG64)block->TickCount * block->CoreCount * MAHF_TLOG_METRIC_COUNT;
+            Stats.Blocks++;
+        }
+    }
+    
+    MahfTlogUnmap(&file);
+}
+
+int main(int argc, char *argv[])
+{
+    ULONG64 from = 0;
+    ULONG64 to = ~0ULL;
+    ULONG core = DUMP_ALL_CORES;
+    BOOLEAN summary = FALSE;
+    char **paths;
+    int pathCount = 0;
+    double start;
+    double elapsed;
+    
+    paths = (char **)calloc(argc, sizeof(char *));
+    if (!paths) {
+        return 1;
+    }
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            if (!DumpParseTime(argv[++i], &from)) {
+                fprintf(stderr, "Bad time: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            if (!DumpParseTime(argv[++i], &to)) {
+                fprintf(stderr, "Bad time: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--core") == 0 && i + 1 < argc) {
+            core = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            summary = TRUE;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [--from T] [--to T] [--core N] [--stats] segment.tlog...\n", argv[0]);
+            return 1;
+        } else {
+            paths[pathCount++] = argv[i];
+        }
+    }
+    
+    if (pathCount == 0) {
+        fprintf(stderr, "Usage: %s [--from T] [--to T] [--core N] [--stats] segment.tlog...\n", argv[0]);
+        return 1;
+    }
+    
+    qsort(paths, pathCount, sizeof(char *), DumpCompareNames);
+    
+    for (ULONG c = 0; c < MAHF_TLOG_MAX_CORES; c++) {
+        for (ULONG m = 0; m < MAHF_TLOG_METRIC_COUNT; m++) {
+            Stats.Min[c][m] = ~0u;
+        }
+    }
+    
+    if (!summary) {
+        printf("time,core,frequency,temperature,utilization,state\n");
+    }
+    
+    start = DumpClock();
+    
+    for (int i = 0; i < pathCount; i++) {
+        DumpSegment(paths[i], from, to, core, summary);
+    }
+    
+    elapsed = DumpClock() - start;
+    
+    if (summary) {
+        ULONG first = (core == DUMP_ALL_CORES) ? 0 : core;
+        ULONG last = (core == DUMP_ALL_CORES) ? Stats.CoreCount : min(core + 1, Stats.CoreCount);
+        
+        printf("core,metric,min,mean,max\n");
+        
+        for (ULONG c = first; c < last && Stats.Ticks != 0; c++) {
+            for (ULONG m = 0; m < MAHF_TLOG_METRIC_COUNT; m++) {
+                printf("%u,%s,%u,%.1f,%u\n", c, MetricNames[m], Stats.Min[c][m],
+                       (double)Stats.Sum[c][m] / (double)Stats.Ticks, Stats.Max[c][m]);
+            }
+        }
+        
+        // Decoded rate counts every value of every block scanned
+        fprintf(stderr, "%llu ticks in %llu blocks (%llu bad), %.1f MB encoded, %.3f s, "
+                "%.0f MB/s decoded\n",
+                (unsigned long long)Stats.Ticks, (unsigned long long)Stats.Blocks,
+                (unsigned long long)Stats.BadBlocks, (double)Stats.Bytes / 1e6, elapsed,
+                elapsed > 0 ? (double)Stats.Values * sizeof(ULONG) / 1e6 / elapsed : 0.0);
+    } else if (Stats.BadBlocks != 0) {
+        fprintf(stderr, "%llu damaged blocks skipped\n", (unsigned long long)Stats.BadBlocks);
+    }
+    
+    free(paths);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,150 @@
+/*
+ * Mahf Firmware CPU Driver - Binary Trace
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Fixed-size trace records the driver writes into per-processor rings and
+ * only mahf_tracedump turns into text
+ */
+
+#ifndef _MAHF_TRACE_H_
+#define _MAHF_TRACE_H_
+
+#if defined(_KERNEL_MODE)
+#include <ntddk.h>
+#elif defined(MAHF_HOST)
+#include "mahf_host.h"
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+// Host builds without the Windows headers
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int32_t LONG;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG, *PULONG;
+typedef uint64_t ULONG64, *PULONG64;
+typedef unsigned char UCHAR, BOOLEAN;
+typedef void VOID, *PVOID;
+
+#define TRUE    1
+#define FALSE   0
+
+#define ANYSIZE_ARRAY 1
+#define FIELD_OFFSET(Type, Field) ((LONG)offsetof(Type, Field))
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#endif
+
+// Levels
+// A record is written when its event's level is at most both the level
+// compiled in (MAHF_TRACE_MAX_LEVEL) and the one set at run time, and its
+// category is selected. Events above the compiled level are constant-false
+// conditions, so their calls and arguments compile away.
+#define MAHF_TRACE_LEVEL_OFF        0
+#define MAHF_TRACE_LEVEL_ERROR      1
+#define MAHF_TRACE_LEVEL_WARNING    2
+#define MAHF_TRACE_LEVEL_INFO       3
+#define MAHF_TRACE_LEVEL_VERBOSE    4
+
+#ifndef MAHF_TRACE_MAX_LEVEL
+#if DBG
+#define MAHF_TRACE_MAX_LEVEL        MAHF_TRACE_LEVEL_VERBOSE
+#else
+#define MAHF_TRACE_MAX_LEVEL        MAHF_TRACE_LEVEL_INFO
+#endif
+#endif
+
+#define MAHF_TRACE_DEFAULT_LEVEL    MAHF_TRACE_LEVEL_WARNING
+
+// Categories
+#define MAHF_TRACE_CATEGORY_IOCTL   0x00000001  // Request dispatch
+#define MAHF_TRACE_CATEGORY_STATE   0x00000002  // Performance states and per-core frequency
+#define MAHF_TRACE_CATEGORY_THERMAL 0x00000004  // Thermal loop
+#define MAHF_TRACE_CATEGORY_POWER   0x00000008  // Power limit loop
+#define MAHF_TRACE_CATEGORY_ALL     0x0000000F
+
+// Events
+// Name, level, category and the decoder's format; every argument is a
+// ULONG, unused ones are 0. Append only: the decoder reads old traces by
+// event number.
+#define MAHF_TRACE_MAX_ARGS         4
+
+#define MAHF_TRACE_EVENTS(X)                                                                    \
+    X(IOCTL, VERBOSE, IOCTL, "IOCTL 0x%08X: 0x%08X, %u bytes")                                 \
+    X(IOCTL_NOT_QUEUED, ERROR, IOCTL, "IOCTL 0x%08X could not be queued: 0x%08X")              \
+    X(STATE_BEGIN, INFO, STATE, "State %u requested, was %u")                                  \
+    X(STATE_END, INFO, STATE, "State %u applied to %u of %u processors at %u MHz")             \
+    X(CORE_FREQUENCY, VERBOSE, STATE, "Core %u at %u MHz, state %u")                           \
+    X(CORE_UPDATE_FAILED, WARNING, STATE, "Core %u not updated: 0x%08X")                       \
+    X(RETARGET, VERBOSE, STATE, "Ratios applied to %u of %u processors")                       \
+    X(THERMAL_CAP, INFO, THERMAL, "%u C (setpoint %u C), cap %u -> %u MHz")                    \
+    X(POWER_CAP, INFO, POWER, "Package %u at %u mW, cap %u -> %u MHz")
+
+#define MAHF_TRACE_EVENT_ID(Name, Level, Category, Format)          MAHF_TRACE_EVENT_##Name,
+#define MAHF_TRACE_EVENT_LEVEL(Name, Level, Category, Format)       MAHF_TRACE_LEVEL_OF_##Name = MAHF_TRACE_LEVEL_##Level,
+#define MAHF_TRACE_EVENT_CATEGORY(Name, Level, Category, Format)    MAHF_TRACE_CATEGORY_OF_##Name = MAHF_TRACE_CATEGORY_##Category,
+
+enum { MAHF_TRACE_EVENTS(MAHF_TRACE_EVENT_ID) MAHF_TRACE_EVENT_COUNT };
+enum { MAHF_TRACE_EVENTS(MAHF_TRACE_EVENT_LEVEL) };
+enum { MAHF_TRACE_EVENTS(MAHF_TRACE_EVENT_CATEGORY) };
+
+// One record, two to a cache line. Records of one processor are in the
+// order they were written; the decoder merges processors by Timestamp.
+typedef struct _MAHF_TRACE_RECORD {
+    ULONG64 Timestamp;          // Performance counter ticks
+    ULONG Stamp;                // Ring slot + 1 once complete
+    USHORT Event;               // MAHF_TRACE_EVENT_*
+    USHORT Processor;
+    ULONG Args[MAHF_TRACE_MAX_ARGS];
+} MAHF_TRACE_RECORD, *PMAHF_TRACE_RECORD;
+
+#define MAHF_TRACE_RING_SIZE        512     // Records per processor, power of two
+
+// IOCTL_MAHF_SET_TRACE input
+typedef struct _MAHF_TRACE_CONFIG {
+    ULONG Level;                // MAHF_TRACE_LEVEL_*
+    ULONG Categories;           // MAHF_TRACE_CATEGORY_* bits
+} MAHF_TRACE_CONFIG, *PMAHF_TRACE_CONFIG;
+
+// IOCTL_MAHF_DRAIN_TRACE output, followed by RecordCount records
+// The driver keeps one read position per ring, so every record is drained
+// once, by whichever client asks first. Records come grouped by processor.
+typedef struct _MAHF_TRACE_DRAIN_RESPONSE {
+    ULONG64 Frequency;          // Timestamp ticks per second
+    ULONG64 LostRecords;        // Overwritten before they could be drained
+    ULONG RecordCount;
+    ULONG Level;                // Current configuration
+    ULONG Categories;
+    ULONG MaxLevel;             // MAHF_TRACE_MAX_LEVEL the driver was built with
+    MAHF_TRACE_RECORD Records[ANYSIZE_ARRAY];
+} MAHF_TRACE_DRAIN_RESPONSE, *PMAHF_TRACE_DRAIN_RESPONSE;
+
+// Trace files, as saved by mahf_tracedump: this header, then records
+#define MAHF_TRACE_FILE_MAGIC       0x4352544D  // 'MTRC'
+#define MAHF_TRACE_FILE_VERSION     1
+
+typedef struct _MAHF_TRACE_FILE_HEADER {
+    ULONG Magic;
+    ULONG Version;
+    ULONG64 Frequency;
+} MAHF_TRACE_FILE_HEADER, *PMAHF_TRACE_FILE_HEADER;
+
+#if defined(_KERNEL_MODE) || defined(MAHF_HOST)
+// Writer side, in the driver
+extern volatile ULONG g_TraceLevel;
+extern volatile ULONG g_TraceCategories;
+
+VOID MahfTraceWrite(ULONG Event, ULONG Arg0, ULONG Arg1, ULONG Arg2, ULONG Arg3);
+
+#define MAHF_TRACE(Event, Arg0, Arg1, Arg2, Arg3)                                       \
+    do {                                                                                \
+        if (MAHF_TRACE_LEVEL_OF_##Event <= MAHF_TRACE_MAX_LEVEL &&                      \
+            (ULONG)MAHF_TRACE_LEVEL_OF_##Event <= g_TraceLevel &&                       \
+            (MAHF_TRACE_CATEGORY_OF_##Event & g_TraceCategories) != 0) {                \
+            MahfTraceWrite(MAHF_TRACE_EVENT_##Event, (ULONG)(Arg0), (ULONG)(Arg1),      \
+                           (ULONG)(Arg2), (ULONG)(Arg3));                               \
+        }                                                                               \
+    } while (0)
+#endif
+
+#endif // _MAHF_TRACE_H_
\ No newline at end of file
@@ -0,0 +1,477 @@
+/*
+ * Mahf Firmware CPU Driver - Trace Decoder
+ * Copyright (c) 2024 Mahf Corporation
+ *
+ * Turns the driver's binary trace records into text, from saved files or
+ * live through the service
+ *
+ *   mahf_tracedump [--level L] [--categories C] trace.mtrc...
+ *   mahf_tracedump --live [--level L] [--categories C] [--interval MS]
+ *                  [--seconds N] [--save trace.mtrc]
+ *
+ * L is error, warning, info or verbose; C is a comma-separated list of
+ * ioctl, state, thermal and power, or a mask. Files are filtered by them;
+ * live, they are set in the driver, so records outside them are never
+ * written. Records from all processors are merged by time, which is in
+ * seconds since the first record shown. Live mode is Windows only and,
+ * like every trace command, needs an administrator.
+ *
+ *   cc -O2 -o mahf_tracedump mahf_tracedump.c
+ */
+
+#if defined(_WIN32)
+#include "mahf_broker.h"
+#endif
+#include "mahf_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DUMP_DEFAULT_INTERVAL_MS    250
+
+typedef struct _DUMP_EVENT {
+    const char *Name;
+    ULONG Level;
+    ULONG Category;
+    const char *Format;
+} DUMP_EVENT, *PDUMP_EVENT;
+
+#define DUMP_EVENT_ENTRY(Name, Level, Category, Format) \
+    { #Name, MAHF_TRACE_LEVEL_##Level, MAHF_TRACE_CATEGORY_##Category, Format },
+
+static const DUMP_EVENT Events[MAHF_TRACE_EVENT_COUNT] = {
+    MAHF_TRACE_EVENTS(DUMP_EVENT_ENTRY)
+};
+
+static const char *LevelNames[] = { "off", "error", "warning", "info", "verbose" };
+static const char *CategoryNames[] = { "ioctl", "state", "thermal", "power" };
+
+typedef struct _DUMP_TRACE {
+    PMAHF_TRACE_RECORD Records;
+    ULONG64 Count;
+    ULONG64 Capacity;
+    ULONG64 Frequency;
+    ULONG64 Origin;             // Timestamp of the first record printed
+    BOOLEAN Started;
+} DUMP_TRACE, *PDUMP_TRACE;
+
+static DUMP_TRACE Trace;
+
+static BOOLEAN DumpParseLevel(const char *Text, PULONG Level)
+{
+    char *end;
+    
+    for (ULONG i = 0; i < sizeof(LevelNames) / sizeof(LevelNames[0]); i++) {
+        if (strcmp(Text, LevelNames[i]) == 0) {
+            *Level = i;
+            return TRUE;
+        }
+    }
+    
+    *Level = (ULONG)strtoul(Text, &end, 0);
+    return *end == '\0' && end != Text && *Level <= MAHF_TRACE_LEVEL_VERBOSE;
+}
+
+static BOOLEAN DumpParseCategories(const char *Text, PULONG Categories)
+{
+    char names[128];
+    char *end;
+    
+    *Categories = (ULONG)strtoul(Text, &end, 0);
+    if (*end == '\0' && end != Text) {
+        return (*Categories & ~MAHF_TRACE_CATEGORY_ALL) == 0;
+    }
+    
+    snprintf(names, sizeof(names), "%s", Text);
+    *Categories = 0;
+    
+    for (char *name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+        ULONG i;
+        
+        for (i = 0; i < sizeof(CategoryNames) / sizeof(CategoryNames[0]); i++) {
+            if (strcmp(name, CategoryNames[i]) == 0) {
+                *Categories |= 1u << i;
+                break;
+            }
+        }
+        
+        if (i == sizeof(CategoryNames) / sizeof(CategoryNames[0])) {
+            return FALSE;
+        }
+    }
+    
+    return *Categories != 0;
+}
+
+static const char *DumpCategoryName(ULONG Category)
+{
+    for (ULONG i = 0; i < sizeof(CategoryNames) / sizeof(CategoryNames[0]); i++) {
+        if (Category == 1u << i) {
+            return CategoryNames[i];
+        }
+    }
+    
+    return "?";
+}
+
+// Timestamp order; a processor's records keep the order it wrote them in
+static int DumpCompareRecords(const void *Left, const void *Right)
+{
+    const MAHF_TRACE_RECORD *left = (const MAHF_TRACE_RECORD *)Left;
+    const MAHF_TRACE_RECORD *right = (const MAHF_TRACE_RECORD *)Right;
+    
+    if (left->Timestamp != right->Timestamp) {
+        return left->Timestamp < right->Timestamp ? -1 : 1;
+    }
+    
+    if (left->Processor != right->Processor) {
+        return left->Processor < right->Processor ? -1 : 1;
+    }
+    
+    return left->Stamp < right->Stamp ? -1 : (left->Stamp > right->Stamp);
+}
+
+static VOID DumpRecord(const MAHF_TRACE_RECORD *Record, ULONG Level, ULONG Categories)
+{
+    const DUMP_EVENT *event = Record->Event < MAHF_TRACE_EVENT_COUNT ? &Events[Record->Event] : NULL;
+    double seconds;
+    
+    // Events newer than this decoder are shown unfiltered, arguments raw
+    if (event && (event->Level > Level || !(event->Category & Categories))) {
+        return;
+    }
+    
+    if (!Trace.Started) {
+        Trace.Origin = Record->Timestamp;
+        Trace.Started = TRUE;
+    }
+    
+    seconds = Record->Timestamp >= Trace.Origin ?
+        (double)(Record->Timestamp - Trace.Origin) / (double)Trace.Frequency :
+        -(double)(Trace.Origin - Record->Timestamp) / (double)Trace.Frequency;
+    
+    printf("%12.6f %4u ", seconds, Record->Processor);
+    
+    if (!event) {
+        printf("%-7s %-7s EVENT_%u 0x%08X 0x%08X 0x%08X 0x%08X\n", "?", "?", Record->Event,
+               Record->Args[0], Record->Args[1], Record->Args[2], Record->Args[3]);
+        return;
+    }
+    
+    printf("%-7s %-7s %-18s ", LevelNames[event->Level], DumpCategoryName(event->Category),
+           event->Name);
+    printf(event->Format, Record->Args[0], Record->Args[1], Record->Args[2], Record->Args[3]);
+    printf("\n");
+}
+
+static VOID DumpRecords(PMAHF_TRACE_RECORD Records, ULONG64 Count, ULONG Level, ULONG Categories)
+{
+    qsort(Records, (size_t)Count, sizeof(MAHF_TRACE_RECORD), DumpCompareRecords);
+    
+    for (ULONG64 i = 0; i < Count; i++) {
+        DumpRecord(&Records[i], Level, Categories);
+    }
+}
+
+static BOOLEAN DumpAppend(const MAHF_TRACE_RECORD *Records, ULONG64 Count)
+{
+    if (Trace.Count + Count > Trace.Capacity) {
+        ULONG64 capacity = Trace.Capacity ? Trace.Capacity : 4096;
+        PMAHF_TRACE_RECORD records;
+        
+        while (capacity < Trace.Count + Count) {
+            capacity *= 2;
+        }
+        
+        records = (PMAHF_TRACE_RECORD)realloc(Trace.Records, (size_t)capacity * sizeof(MAHF_TRACE_RECORD));
+        if (!records) {
+            return FALSE;
+        }
+        
+        Trace.Records = records;
+        Trace.Capacity = capacity;
+    }
+    
+    memcpy(&Trace.Records[Trace.Count], Records, (size_t)Count * sizeof(MAHF_TRACE_RECORD));
+    Trace.Count += Count;
+    return TRUE;
+}
+
+// Files from one machine share a clock and are merged; others are skipped
+static VOID DumpFile(const char *Path)
+{
+    MAHF_TRACE_FILE_HEADER header;
+    MAHF_TRACE_RECORD records[256];
+    size_t count;
+    FILE *file = fopen(Path, "rb");
+    
+    if (!file) {
+        fprintf(stderr, "%s: cannot open\n", Path);
+        return;
+    }
+    
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.Magic != MAHF_TRACE_FILE_MAGIC || header.Version != MAHF_TRACE_FILE_VERSION ||
+        header.Frequency == 0) {
+        fprintf(stderr, "%s: not a trace file\n", Path);
+        fclose(file);
+        return;
+    }
+    
+    if (Trace.Frequency == 0) {
+        Trace.Frequency = header.Frequency;
+    } else if (Trace.Frequency != header.Frequency) {
+        fprintf(stderr, "%s: clock %llu Hz, expected %llu Hz; skipped\n", Path,
+                (unsigned long long)header.Frequency, (unsigned long long)Trace.Frequency);
+        fclose(file);
+        return;
+    }
+    
+    while ((count = fread(records, sizeof(MAHF_TRACE_RECORD), 256, file)) != 0) {
+        if (!DumpAppend(records, count)) {
+            fprintf(stderr, "%s: out of memory\n", Path);
+            break;
+        }
+    }
+    
+    fclose(file);
+}
+
+#if defined(_WIN32)
+static ULONG64 Message[MAHF_BROKER_MAX_MESSAGE / sizeof(ULONG64)];
+
+// One request and its reply; returns the Win32 error
+static DWORD DumpCommand(HANDLE Pipe, ULONG Command, const VOID *Input, ULONG InputLength,
+                         PVOID *Output, PULONG OutputLength)
+{
+    ULONG64 request[(sizeof(MAHF_BROKER_REQUEST) + sizeof(MAHF_TRACE_CONFIG)) / sizeof(ULONG64) + 1];
+    PMAHF_BROKER_REQUEST header = (PMAHF_BROKER_REQUEST)request;
+    PMAHF_BROKER_RESPONSE response = (PMAHF_BROKER_RESPONSE)Message;
+    DWORD bytes = 0;
+    
+    header->Command = Command;
+    header->MaxAgeMs = 0;
+    header->InputLength = InputLength;
+    header->OutputLength = MAHF_BROKER_MAX_MESSAGE - sizeof(MAHF_BROKER_RESPONSE);
+    if (InputLength != 0) {
+        memcpy(header + 1, Input, InputLength);
+    }
+    
+    if (!TransactNamedPipe(Pipe, request, sizeof(MAHF_BROKER_REQUEST) + InputLength,
+                           Message, sizeof(Message), &bytes, NULL)) {
+        return GetLastError();
+    }
+    
+    if (bytes < sizeof(MAHF_BROKER_RESPONSE) ||
+        bytes - sizeof(MAHF_BROKER_RESPONSE) < response->OutputLength) {
+        return ERROR_INVALID_DATA;
+    }
+    
+    if (Output) {
+        *Output = response + 1;
+        *OutputLength = response->OutputLength;
+    }
+    
+    return response->Error;
+}
+
+// Drains every interval, printing each batch merged by time; a batch is
+// what all processors wrote in one interval, so its order is final
+static int DumpLive(ULONG Level, ULONG Categories, BOOLEAN Configure, ULONG IntervalMs,
+                    ULONG Seconds, const char *SavePath)
+{
+    MAHF_TRACE_CONFIG config;
+    MAHF_TRACE_FILE_HEADER header;
+    ULONG64 lost = 0;
+    ULONG64 total = 0;
+    ULONGLONG end = GetTickCount64() + (ULONGLONG)Seconds * 1000;
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    FILE *save = NULL;
+    DWORD error;
+    HANDLE pipe;
+    
+    pipe = CreateFile(MAHF_BROKER_PIPE_NAME, GENERIC_READ | FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES,
+                      0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Cannot connect to the service: %lu\n", GetLastError());
+        return 1;
+    }
+    
+    SetNamedPipeHandleState(pipe, &mode, NULL, NULL);
+    
+    if (Configure) {
+        config.Level = Level;
+        config.Categories = Categories;
+        
+        error = DumpCommand(pipe, IOCTL_MAHF_SET_TRACE, &config, sizeof(config), NULL, NULL);
+        if (error != ERROR_SUCCESS) {
+            fprintf(stderr, "SET_TRACE failed: %lu\n", error);
+            CloseHandle(pipe);
+            return 1;
+        }
+    }
+    
+    if (SavePath) {
+        save = fopen(SavePath, "wb");
+        if (!save) {
+            fprintf(stderr, "%s: cannot create\n", SavePath);
+            CloseHandle(pipe);
+            return 1;
+        }
+    }
+    
+    for (;;) {
+        PMAHF_TRACE_DRAIN_RESPONSE drain;
+        ULONG length;
+        
+        error = DumpCommand(pipe, IOCTL_MAHF_DRAIN_TRACE, NULL, 0, (PVOID *)&drain, &length);
+        if (error != ERROR_SUCCESS || length < FIELD_OFFSET(MAHF_TRACE_DRAIN_RESPONSE, Records) ||
+            (length - FIELD_OFFSET(MAHF_TRACE_DRAIN_RESPONSE, Records)) / sizeof(MAHF_TRACE_RECORD) <
+                drain->RecordCount) {
+            fprintf(stderr, "DRAIN_TRACE failed: %lu\n", error);
+            break;
+        }
+        
+        if (Trace.Frequency == 0) {
+            Trace.Frequency = drain->Frequency;
+            
+            if (drain->Level > drain->MaxLevel) {
+                fprintf(stderr, "Driver traces at most %s, level %s has no further effect\n",
+                        LevelNames[drain->MaxLevel], LevelNames[drain->Level]);
+            }
+            
+            if (save) {
+                header.Magic = MAHF_TRACE_FILE_MAGIC;
+                header.Version = MAHF_TRACE_FILE_VERSION;
+                header.Frequency = drain->Frequency;
+                fwrite(&header, sizeof(header), 1, save);
+            }
+        }
+        
+        if (save) {
+            fwrite(drain->Records, sizeof(MAHF_TRACE_RECORD), drain->RecordCount, save);
+        }
+        
+        // Filtered again in case another client changed the configuration
+        DumpRecords(drain->Records, drain->RecordCount, Configure ? Level : MAHF_TRACE_LEVEL_VERBOSE,
+                    Configure ? Categories : MAHF_TRACE_CATEGORY_ALL);
+        fflush(stdout);
+        
+        lost += drain->LostRecords;
+        total += drain->RecordCount;
+        
+        // A full reply means more is waiting
+        if (drain->RecordCount < (MAHF_BROKER_MAX_MESSAGE - sizeof(MAHF_BROKER_RESPONSE) -
+                                  FIELD_OFFSET(MAHF_TRACE_DRAIN_RESPONSE, Records)) /
+                                 sizeof(MAHF_TRACE_RECORD)) {
+            if (Seconds != 0 && GetTickCount64() >= end) {
+                break;
+            }
+            
+            Sleep(IntervalMs);
+        }
+    }
+    
+    fprintf(stderr, "%llu records, %llu lost\n", (unsigned long long)total, (unsigned long long)lost);
+    
+    if (save) {
+        fclose(save);
+    }
+    
+    CloseHandle(pipe);
+    return 0;
+}
+#else
+static int DumpLive(ULONG Level, ULONG Categories, BOOLEAN Configure, ULONG IntervalMs,
+                    ULONG Seconds, const char *SavePath)
+{
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Categories);
+    UNREFERENCED_PARAMETER(Configure);
+    UNREFERENCED_PARAMETER(IntervalMs);
+    UNREFERENCED_PARAMETER(Seconds);
+    UNREFERENCED_PARAMETER(SavePath);
+    
+    fprintf(stderr, "Live tracing needs the Windows service\n");
+    return 1;
+}
+#endif
+
+static VOID DumpUsage(const char *Program)
+{
+    fprintf(stderr, "Usage: %s [--level L] [--categories C] trace.mtrc...\n", Program);
+#if defined(_WIN32)
+    fprintf(stderr, "       %s --live [--level L] [--categories C] [--interval MS] [--seconds N] "
+            "[--save trace.mtrc]\n", Program);
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    ULONG level = MAHF_TRACE_LEVEL_VERBOSE;
+    ULONG categories = MAHF_TRACE_CATEGORY_ALL;
+    BOOLEAN live = FALSE;
+    BOOLEAN configure = FALSE;
+    ULONG intervalMs = DUMP_DEFAULT_INTERVAL_MS;
+    ULONG seconds = 0;
+    const char *savePath = NULL;
+    int pathCount = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            if (!DumpParseLevel(argv[++i], &level)) {
+                fprintf(stderr, "Bad level: %s\n", argv[i]);
+                return 1;
+            }
+            configure = TRUE;
+        } else if (strcmp(argv[i], "--categories") == 0 && i + 1 < argc) {
+            if (!DumpParseCategories(argv[++i], &categories)) {
+                fprintf(stderr, "Bad categories: %s\n", argv[i]);
+                return 1;
+            }
+            configure = TRUE;
+        } else if (strcmp(argv[i], "--live") == 0) {
+            live = TRUE;
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            intervalMs = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = (ULONG)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (argv[i][0] == '-') {
+            DumpUsage(argv[0]);
+            return 1;
+        } else {
+            pathCount++;
+        }
+    }
+    
+    if (live) {
+        if (pathCount != 0 || intervalMs == 0) {
+            DumpUsage(argv[0]);
+            return 1;
+        }
+        
+        return DumpLive(level, categories, configure, intervalMs, seconds, savePath);
+    }
+    
+    if (pathCount == 0 || savePath) {
+        DumpUsage(argv[0]);
+        return 1;
+    }
+    
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            // Every option but --live takes a value
+            i += strcmp(argv[i], "--live") != 0;
+        } else {
+            DumpFile(argv[i]);
+        }
+    }
+    
+    DumpRecords(Trace.Records, Trace.Count, level, categories);
+    
+    free(Trace.Records);
+    return 0;
+}
\ No newline at end of file
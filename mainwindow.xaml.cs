@@ -1,6 +1,11 @@
 using System;
 using System.ComponentModel;
+using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.IO.Pipes;
 using System.Runtime.InteropServices;
+using System.Security.Principal;
+using System.Threading;
 using System.Windows;
 using System.Windows.Controls;
 using System.Windows.Threading;
@@ -46,8 +51,25 @@ namespace MahfCPUControlPanel
         // IOCTL Codes
         private const uint IOCTL_MAHF_GET_CPU_INFO = 0x88802000;
         private const uint IOCTL_MAHF_GET_PERFORMANCE_DATA = 0x88802004;
-        private const uint IOCTL_MAHF_SET_PERFORMANCE_STATE = 0x88802008;
-        private const uint IOCTL_MAHF_RESET_DRIVER = 0x8880200C;
+        private const uint IOCTL_MAHF_SET_PERFORMANCE_STATE = 0x8880A008;
+        private const uint IOCTL_MAHF_RESET_DRIVER = 0x8880A00C;
+
+        // Shared telemetry section (layout in mahf_core.h)
+        private const string SHARED_SECTION_NAME = "Global\\MahfCPUTelemetry";
+        private const uint SHARED_MAGIC = 0x5348414D;
+        private const long SHARED_MAGIC_OFFSET = 0;
+        private const long SHARED_GENERATION_OFFSET = 8;
+        private const long SHARED_PERFORMANCE_OFFSET = 64;
+
+        // Service broker (protocol in mahf_broker.h); the service holds the
+        // device while it runs, so the panel goes through it when it can
+        private const string BROKER_PIPE_NAME = "MahfCPU";
+        private const string BROKER_SECTION_NAME = "Global\\MahfCPUBroker";
+        private const int BROKER_HEADER_SIZE = 16;
+        private const uint BROKER_MAX_AGE_MS = 500;
+        private const int BROKER_CONNECT_TIMEOUT_MS = 1000;
+        private const int ERROR_BROKEN_PIPE = 109;
+        private const int ERROR_BUSY = 170;
 
         // Performance states
         private enum PerformanceState
@@ -95,7 +117,10 @@ namespace MahfCPUControlPanel
 
         // Member variables
         private IntPtr driverHandle = IntPtr.Zero;
+        private NamedPipeClientStream brokerPipe;
         private DispatcherTimer updateTimer;
+        private MemoryMappedFile sharedTelemetry;
+        private MemoryMappedViewAccessor sharedView;
         private CPU_INFO cpuInfo;
         private PERFORMANCE_DATA perfData;
         private bool isConnected = false;
@@ -114,6 +139,7 @@ namespace MahfCPUControlPanel
             
             // Initialize driver connection
             ConnectToDriver();
+            OpenSharedTelemetry();
             
             // Initialize update timer
             updateTimer = new DispatcherTimer();
@@ -124,6 +150,10 @@ namespace MahfCPUControlPanel
             if (isConnected)
             {
                 LoadCPUInfo();
+            }
+            
+            if (isConnected || sharedView != null)
+            {
                 updateTimer.Start();
             }
             
@@ -133,9 +163,16 @@ namespace MahfCPUControlPanel
 
         private void ConnectToDriver()
         {
+            if (ConnectToBroker())
+            {
+                UpdateStatus("Connected through Mahf CPU Service", true);
+                isConnected = true;
+                return;
+            }
+            
             try
             {
-                // Open device
+                // No service; open the device directly
                 driverHandle = CreateFile(
                     DEVICE_NAME,
                     GENERIC_READ | GENERIC_WRITE,
@@ -164,9 +201,164 @@ namespace MahfCPUControlPanel
             }
         }
 
+        private bool ConnectToBroker()
+        {
+            try
+            {
+                // Only the access the pipe grants non-administrators;
+                // InOut would ask for GENERIC_WRITE, which includes
+                // creating pipe instances, and be refused
+                brokerPipe = new NamedPipeClientStream(".", BROKER_PIPE_NAME,
+                    PipeAccessRights.ReadData | PipeAccessRights.WriteData |
+                    PipeAccessRights.ReadAttributes | PipeAccessRights.WriteAttributes |
+                    PipeAccessRights.Synchronize,
+                    PipeOptions.None, TokenImpersonationLevel.None, HandleInheritability.None);
+                brokerPipe.Connect(BROKER_CONNECT_TIMEOUT_MS);
+                brokerPipe.ReadMode = PipeTransmissionMode.Message;
+                return true;
+            }
+            catch (Exception)
+            {
+                // Service not running
+                brokerPipe?.Dispose();
+                brokerPipe = null;
+                return false;
+            }
+        }
+
+        private void OpenSharedTelemetry()
+        {
+            // The broker's copy is readable without administrator rights
+            foreach (string name in new[] { BROKER_SECTION_NAME, SHARED_SECTION_NAME })
+            {
+                try
+                {
+                    sharedTelemetry = MemoryMappedFile.OpenExisting(
+                        name, MemoryMappedFileRights.Read);
+                    sharedView = sharedTelemetry.CreateViewAccessor(
+                        0, 0, MemoryMappedFileAccess.Read);
+                    return;
+                }
+                catch (Exception)
+                {
+                    // Older driver or no access; fall back to IOCTLs
+                    sharedView?.Dispose();
+                    sharedTelemetry?.Dispose();
+                    sharedView = null;
+                    sharedTelemetry = null;
+                }
+            }
+        }
+
+        // Send a request through the service broker when connected to it,
+        // otherwise straight to the device
+        private bool DriverIoControl(uint ioControlCode, IntPtr inBuffer, int inSize,
+                                     IntPtr outBuffer, int outSize, out int bytesReturned, out int error)
+        {
+            bytesReturned = 0;
+            error = 0;
+            
+            if (brokerPipe == null)
+            {
+                uint returned;
+                bool success = DeviceIoControl(
+                    driverHandle,
+                    ioControlCode,
+                    inBuffer,
+                    (uint)inSize,
+                    outBuffer,
+                    (uint)outSize,
+                    out returned,
+                    IntPtr.Zero);
+                
+                bytesReturned = (int)returned;
+                error = success ? 0 : Marshal.GetLastWin32Error();
+                return success;
+            }
+            
+            byte[] request = new byte[BROKER_HEADER_SIZE + inSize];
+            BitConverter.GetBytes(ioControlCode).CopyTo(request, 0);
+            BitConverter.GetBytes(BROKER_MAX_AGE_MS).CopyTo(request, 4);
+            BitConverter.GetBytes((uint)inSize).CopyTo(request, 8);
+            BitConverter.GetBytes((uint)outSize).CopyTo(request, 12);
+            if (inSize > 0)
+                Marshal.Copy(inBuffer, request, BROKER_HEADER_SIZE, inSize);
+            
+            byte[] response = new byte[BROKER_HEADER_SIZE + outSize];
+            int length = 0;
+            
+            try
+            {
+                brokerPipe.Write(request, 0, request.Length);
+                
+                // One response message per request
+                do
+                {
+                    int read = brokerPipe.Read(response, length, response.Length - length);
+                    if (read == 0)
+                        throw new IOException("Service broker disconnected");
+                    length += read;
+                }
+                while (!brokerPipe.IsMessageComplete && length < response.Length);
+            }
+            catch (IOException)
+            {
+                brokerPipe.Dispose();
+                brokerPipe = null;
+                isConnected = false;
+                error = ERROR_BROKEN_PIPE;
+                return false;
+            }
+            
+            if (length < BROKER_HEADER_SIZE)
+            {
+                error = ERROR_BROKEN_PIPE;
+                return false;
+            }
+            
+            error = BitConverter.ToInt32(response, 0);
+            bytesReturned = Math.Min(BitConverter.ToInt32(response, 4), length - BROKER_HEADER_SIZE);
+            if (bytesReturned > 0)
+                Marshal.Copy(response, BROKER_HEADER_SIZE, outBuffer, bytesReturned);
+            
+            return error == 0;
+        }
+
+        private bool ReadSharedPerformanceData(out PERFORMANCE_DATA data)
+        {
+            data = default;
+            
+            if (sharedView == null)
+                return false;
+            
+            for (int attempt = 0; attempt < 64; attempt++)
+            {
+                int before = sharedView.ReadInt32(SHARED_GENERATION_OFFSET);
+                Thread.MemoryBarrier();
+                
+                // Driver is mid-update
+                if ((before & 1) != 0)
+                {
+                    Thread.SpinWait(20);
+                    continue;
+                }
+                
+                if (sharedView.ReadUInt32(SHARED_MAGIC_OFFSET) != SHARED_MAGIC)
+                    return false;
+                
+                sharedView.Read(SHARED_PERFORMANCE_OFFSET, out data);
+                Thread.MemoryBarrier();
+                
+                if (sharedView.ReadInt32(SHARED_GENERATION_OFFSET) == before)
+                    return true;
+            }
+            
+            return false;
+        }
+
         private void LoadCPUInfo()
         {
-            if (!isConnected || driverHandle == IntPtr.Zero)
+            if (!isConnected)
                 return;
             
             try
@@ -174,16 +366,15 @@ namespace MahfCPUControlPanel
                 int size = Marshal.SizeOf(typeof(CPU_INFO));
                 IntPtr buffer = Marshal.AllocHGlobal(size);
                 
-                uint bytesReturned;
-                bool success = DeviceIoControl(
-                    driverHandle,
+                int bytesReturned;
+                bool success = DriverIoControl(
                     IOCTL_MAHF_GET_CPU_INFO,
                     IntPtr.Zero,
                     0,
                     buffer,
-                    (uint)size,
+                    size,
                     out bytesReturned,
-                    IntPtr.Zero);
+                    out _);
                 
                 if (success && bytesReturned > 0)
                 {
@@ -217,7 +408,18 @@ namespace MahfCPUControlPanel
 
         private void UpdatePerformanceData()
         {
-            if (!isConnected || driverHandle == IntPtr.Zero)
+            // Shared section read needs no driver round trip
+            if (ReadSharedPerformanceData(out PERFORMANCE_DATA sharedData))
+            {
+                perfData = sharedData;
+                Dispatcher.Invoke(() =>
+                {
+                    UpdatePerformanceUI();
+                });
+                return;
+            }
+            
+            if (!isConnected)
                 return;
             
             try
@@ -225,16 +427,15 @@ namespace MahfCPUControlPanel
                 int size = Marshal.SizeOf(typeof(PERFORMANCE_DATA));
                 IntPtr buffer = Marshal.AllocHGlobal(size);
                 
-                uint bytesReturned;
-                bool success = DeviceIoControl(
-                    driverHandle,
+                int bytesReturned;
+                bool success = DriverIoControl(
                     IOCTL_MAHF_GET_PERFORMANCE_DATA,
                     IntPtr.Zero,
                     0,
                     buffer,
-                    (uint)size,
+                    size,
                     out bytesReturned,
-                    IntPtr.Zero);
+                    out _);
                 
                 if (success && bytesReturned > 0)
                 {
@@ -257,26 +458,26 @@ namespace MahfCPUControlPanel
 
         private void SetPerformanceState(PerformanceState state)
         {
-            if (!isConnected || driverHandle == IntPtr.Zero)
+            if (!isConnected)
                 return;
             
             try
             {
-                int size = Marshal.SizeOf(typeof(PerformanceState));
+                int size = Marshal.SizeOf(typeof(int));
                 IntPtr buffer = Marshal.AllocHGlobal(size);
                 
-                Marshal.StructureToPtr(state, buffer, false);
+                Marshal.WriteInt32(buffer, (int)state);
                 
-                uint bytesReturned;
-                bool success = DeviceIoControl(
-                    driverHandle,
+                int bytesReturned;
+                int error;
+                bool success = DriverIoControl(
                     IOCTL_MAHF_SET_PERFORMANCE_STATE,
                     buffer,
-                    (uint)size,
+                    size,
                     IntPtr.Zero,
                     0,
                     out bytesReturned,
-                    IntPtr.Zero);
+                    out error);
                 
                 Marshal.FreeHGlobal(buffer);
                 
@@ -293,9 +494,12 @@ namespace MahfCPUControlPanel
                     
                     UpdateStatus($"Performance state set to: {stateName}", true);
                 }
+                else if (error == ERROR_BUSY)
+                {
+                    UpdateStatus("Another client has control of the CPU settings", false);
+                }
                 else
                 {
-                    int error = Marshal.GetLastWin32Error();
                     UpdateStatus($"Failed to set state (Error: {error})", false);
                 }
             }
@@ -472,7 +676,13 @@ namespace MahfCPUControlPanel
             // Stop timer
             updateTimer?.Stop();
             
-            // Close driver handle
+            // Unmap shared telemetry
+            sharedView?.Dispose();
+            sharedTelemetry?.Dispose();
+            
+            // Close broker connection and driver handle
+            brokerPipe?.Dispose();
+            
             if (driverHandle != IntPtr.Zero && driverHandle.ToInt64() != -1)
             {
                 CloseHandle(driverHandle);